@@ -11,11 +11,13 @@
 #define OP_SHUNTON   0x2
 /** Command code to request version and serial information */
 #define OP_VERSION   0x3
+/** Command code to request data from all modules. They reply one after another in address order */
+#define OP_GETALL    0x4
 /** Command code to enter address mode */
 #define OP_ADDRMODE  0x5
-/** Command code to send a break signal for baud rate calibration */
+/** Command code to change the bit rate of all modules, argument see BAUD_DIVIDER_* */
 #define OP_BREAK     0x6
-/** Command code to jump to bootloader */
+/** Command code to jump to bootloader, addressed to a single module or to 0xAA for all */
 #define OP_BOOT      0x7
 
 /** Number of bits per command */
@@ -46,6 +48,31 @@
 #define CALIB_TEMP_FLAG   0x10
 #define CALIB_LOCK_MAGIC  0x1f
 
+/** Cell modules derive their bit timing from this clock, F_CPU / 8 at 4 MHz. The argument of OP_BREAK
+ * is the number of clock periods per bit, so the bit rate is CMU_BIT_CLOCK / divider.
+ * A new rate is on trial until it is sent again with BAUD_CONFIRM. Modules fall back
+ * to BAUD_DIVIDER_DEFAULT when they see a garbled frame or no confirmation in time */
+#define CMU_BIT_CLOCK         500000
+#define BAUD_DIVIDER_DEFAULT  50 //10 kbit/s, used after power on
+#define BAUD_DIVIDER_MIN      10 //50 kbit/s, the bit timer ISR takes most of the CPU
+#define BAUD_DIVIDER_MASK     0xff
+#define BAUD_CONFIRM          0x100
+
+/** Argument of OP_GETDATA. Without argument (2 byte command) a module replies with
+ * struct BatValues or, once DATA_COMPACT has been requested, with struct BatDeltas
+ * relative to its previous reply. A command with argument always gets a full reply
+ * and thus resynchronizes. Modules also send a full reply when a difference doesn't
+ * fit into 8 bits and after DELTA_KEYFRAME_INTERVAL compact replies */
+#define DATA_COMPACT            0x1
+#define DELTA_KEYFRAME_INTERVAL 16
+/** Set in the address byte of compact replies */
+#define DELTA_ADDR_FLAG         0x80
+
+/** Argument of OP_VERSION. Without argument (2 byte command) a module replies with
+ * struct versionComm, with argument it replies with struct UpdaterVersion. Software
+ * that predates the argument replies with struct versionComm either way */
+#define VERSION_UPDATER         0x0
+
 /** Since we only have 11 bits for the shunt voltage setpoint we add a fixed offset */
 #define SHUNT_VTG_OFFSET  3000
 
@@ -75,6 +102,13 @@ struct BatValues
    uint16_t crc;
 } __attribute__((packed));
 
+struct BatDeltas
+{
+   uint8_t adr;                /**< Module address | DELTA_ADDR_FLAG */
+   int8_t values[NUM_VALUES];  /**< Difference to the values of the previous reply */
+   uint16_t crc;
+} __attribute__((packed));
+
 struct cmd
 {
    uint8_t addr;
@@ -103,4 +137,41 @@ struct PageBuf
    uint16_t crc;             /**< CRC16 xmodem over pageNum and buf */
 } __attribute__((packed));
 
+/** Page numbers beyond the application are commands to the updater. After UPDATE_QUERY
+ * the modules with addresses from buf[0] to buf[1] reply with struct PageMap in address order.
+ * After UPDATE_DONE the next frame starts the application on all modules that have written
+ * every page by then. That frame has passed on to the modules behind them already.
+ * UPDATE_COMPARE + n carries in buf the crc of pages n * PAGE_WORDS on as it would be
+ * in PageBuf. Modules mark the pages that are already in their flash as written.
+ * After UPDATE_SELECT only modules whose address has bit n % 8 of byte n / 8 of buf set
+ * take pages and crcs, the others wait for the image meant for their hardware */
+#define UPDATE_QUERY      0xf0
+#define UPDATE_DONE       0xf1
+#define UPDATE_COMPARE    0xf2
+#define UPDATE_SELECT     0xf8
+#define COMPARE_FRAMES    ((ATTINY_MAX_APPLICATION_PAGES + PAGE_WORDS - 1) / PAGE_WORDS)
+#define PAGE_MAP_BYTES    ((ATTINY_MAX_APPLICATION_PAGES + 7) / 8)
+
+/** Reply to UPDATE_QUERY */
+struct PageMap
+{
+   uint8_t addr;                   /**< Module address */
+   uint8_t pages[PAGE_MAP_BYTES];  /**< Bit n of byte n / 8 is set once page n has been written */
+   uint16_t crc;                   /**< CRC16 xmodem over addr and pages */
+} __attribute__((packed));
+
+/** Updater versions, kept in the last byte of flash. The legacy updater leaves it erased.
+ * It only takes pages in order, pulls the line low for a bit time after a corrupted page
+ * and starts the application after the last page. It ignores all commands above */
+#define UPDATER_LEGACY    0xff
+#define UPDATER_BITMAP    0x1
+
+/** Reply to OP_VERSION with argument */
+struct UpdaterVersion
+{
+   uint8_t addr;     /**< Module address */
+   uint8_t version;  /**< UPDATER_BITMAP or UPDATER_LEGACY */
+   uint16_t crc;     /**< CRC16 xmodem over addr and version */
+} __attribute__((packed));
+
 #endif // BMS_SHARED_H_INCLUDED
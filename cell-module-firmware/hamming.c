@@ -5,6 +5,105 @@
 
 #include "hamming.h"
 
+#if HAMMING_TABLES
+/* The extended Hamming code is linear, so code word, syndrome, parity and data can be
+ * calculated as XOR of per-nibble contributions. The tables are generated by the
+ * preprocessor from the bit placement described by the helper functions below and
+ * are verified against them for all code words by test/test_hamming.
+ * Only the master builds with them, the cell modules have no flash to spare */
+
+#ifdef __AVR__
+#include <avr/pgmspace.h>
+#define TABLE_ATTR   PROGMEM
+#define READ_WORD(t) pgm_read_word(&(t))
+#define READ_BYTE(t) pgm_read_byte(&(t))
+#else
+#define TABLE_ATTR
+#define READ_WORD(t) (t)
+#define READ_BYTE(t) (t)
+#endif
+
+#define NOT_PARITY_BIT_POS(cbit) ((cbit != 0) && (cbit != 1) && (cbit != 3)  && (cbit != 7))
+
+/** Code bit position of data bit d. Data is placed reversed into the non-parity positions */
+#define CODE_POS(d)    ((d) <= 6 ? 14 - (d) : (d) == 10 ? 2 : 13 - (d))
+/** Data bit of non-parity code bit position c */
+#define DATA_POS(c)    ((c) == 2 ? 10 : (c) < 8 ? 13 - (c) : 14 - (c))
+/** Whether code position pos is covered by parity bit p */
+#define COVERED(pos,p) ((((pos) + 1) >> (p)) & 1)
+/** Code word of a single data bit at code position pos including all parity bits */
+#define ENC_COL(pos)   ((1u << (pos)) | (COVERED(pos, 0) << 0) | (COVERED(pos, 1) << 1) | \
+                        (COVERED(pos, 2) << 3) | (COVERED(pos, 3) << 7) | \
+                        ((1u ^ COVERED(pos, 0) ^ COVERED(pos, 1) ^ COVERED(pos, 2) ^ COVERED(pos, 3)) << 15))
+#define ENC_BIT(n,d)   (((n) >> ((d) & 3)) & 1 ? ENC_COL(CODE_POS(d)) : 0)
+#define ENC_NIB(n,s)   (ENC_BIT(n, s) ^ ENC_BIT(n, (s) + 1) ^ ENC_BIT(n, (s) + 2) ^ ((s) < 8 ? ENC_BIT(n, (s) + 3) : 0))
+/** Syndrome in bits 0-3 and extended parity in bit 4 of single code bit c */
+#define SYN_BIT(n,c)   (((n) >> ((c) & 3)) & 1 ? ((c) < 15 ? (c) + 1 : 0) | 0x10 : 0)
+#define SYN_NIB(n,s)   (SYN_BIT(n, s) ^ SYN_BIT(n, (s) + 1) ^ SYN_BIT(n, (s) + 2) ^ SYN_BIT(n, (s) + 3))
+/** Data bits of single code bit c */
+#define DAT_BIT(n,c)   (((n) >> ((c) & 3)) & 1 && (c) < 15 && NOT_PARITY_BIT_POS(c) ? 1u << DATA_POS(c) : 0)
+#define DAT_NIB(n,s)   (DAT_BIT(n, s) ^ DAT_BIT(n, (s) + 1) ^ DAT_BIT(n, (s) + 2) ^ DAT_BIT(n, (s) + 3))
+
+#define NIBBLE_TABLE(f,s) { f(0,s), f(1,s), f(2,s), f(3,s), f(4,s), f(5,s), f(6,s), f(7,s), \
+                            f(8,s), f(9,s), f(10,s), f(11,s), f(12,s), f(13,s), f(14,s), f(15,s) }
+
+static const uint16_t encTable[3][16] TABLE_ATTR =
+{
+   NIBBLE_TABLE(ENC_NIB, 0), NIBBLE_TABLE(ENC_NIB, 4), NIBBLE_TABLE(ENC_NIB, 8)
+};
+
+static const uint8_t synTable[4][16] TABLE_ATTR =
+{
+   NIBBLE_TABLE(SYN_NIB, 0), NIBBLE_TABLE(SYN_NIB, 4), NIBBLE_TABLE(SYN_NIB, 8), NIBBLE_TABLE(SYN_NIB, 12)
+};
+
+static const uint16_t datTable[4][16] TABLE_ATTR =
+{
+   NIBBLE_TABLE(DAT_NIB, 0), NIBBLE_TABLE(DAT_NIB, 4), NIBBLE_TABLE(DAT_NIB, 8), NIBBLE_TABLE(DAT_NIB, 12)
+};
+
+/** Decode an extended Hamming 16/11 code word
+ * @param[in] c received code word
+ * @param[out] d decoded data
+ * @retval DEC_RES_OK data in d is valid
+ * @retval DEC_RES_ERR data in d is invalid
+ */
+int8_t hamming_decode(uint16_t c, uint16_t* d)
+{
+   uint8_t sp = READ_BYTE(synTable[0][c & 0xf]) ^ READ_BYTE(synTable[1][(c >> 4) & 0xf]) ^
+                READ_BYTE(synTable[2][(c >> 8) & 0xf]) ^ READ_BYTE(synTable[3][c >> 12]);
+   uint8_t syndrome = sp & 0xf;
+   int8_t derr = DEC_RES_OK;
+
+   if (sp & 0x10) //parity error
+   {
+      if (syndrome > 0) //Correctable error
+         c ^= 1 << (syndrome - 1);
+      else
+         derr = DEC_RES_ERR;
+   }
+   else if (syndrome > 0) //Uncorrectable error
+   {
+      derr = DEC_RES_ERR;
+   }
+
+   *d = READ_WORD(datTable[0][c & 0xf]) ^ READ_WORD(datTable[1][(c >> 4) & 0xf]) ^
+        READ_WORD(datTable[2][(c >> 8) & 0xf]) ^ READ_WORD(datTable[3][c >> 12]);
+
+   return derr;
+}
+
+/** Encode data with extended Hamming 16/11 code
+ * @param[in] d data to be encoded
+ * @return code word
+ */
+uint16_t hamming_encode(uint16_t d)
+{
+   return READ_WORD(encTable[0][d & 0xf]) ^ READ_WORD(encTable[1][(d >> 4) & 0xf]) ^ READ_WORD(encTable[2][(d >> 8) & 0x7]);
+}
+
+#else
+
 #define EXTENDED_CODE_BITS 16
 #define HAMMING_BITS 15
 #define DATA_BITS 11
@@ -142,3 +241,5 @@ static uint16_t calc_hamming_parity(uint16_t c)
    }
    return c;
 }
+
+#endif // HAMMING_TABLES
@@ -6,6 +6,21 @@
 
 #define USART_BAUD 10000
 
+/* Optional parts of the protocol, the master copes with modules that lack them.
+ * The ATtiny44 build leaves them out to make room for the updater */
+#ifndef CMU_COMPACT_REPLIES
+#define CMU_COMPACT_REPLIES 1 //Deltas after OP_GETDATA with DATA_COMPACT
+#endif
+#ifndef CMU_GETALL
+#define CMU_GETALL          1 //Replies in address order to OP_GETALL
+#endif
+#ifndef CMU_BIT_RATES
+#define CMU_BIT_RATES       1 //Bit rate changes with OP_BREAK
+#endif
+#ifndef CMU_DIFF_UPDATE
+#define CMU_DIFF_UPDATE     1 //The updater skips pages whose crc matches UPDATE_COMPARE
+#endif
+
 #define TX_START() {\
 if (RX_INPUT_STATE) \
    TXRX_PORT &= ~TXRX_PIN; \
@@ -11,6 +11,7 @@
 #include <util/delay.h>
 #include <avr/eeprom.h>
 #include <util/crc16.h>
+#include <avr/pgmspace.h>
 #include "sercom.h"
 #include "hamming.h"
 #include "measure.h"
@@ -19,23 +20,46 @@
 #include "updater.h"
 #include "eeprom.h"
 
+//The master calculates bit rates from CMU_BIT_CLOCK, our bit timer runs at F_CPU / 8
+#if F_CPU / 8 != CMU_BIT_CLOCK
+#error "F_CPU doesn't match CMU_BIT_CLOCK, HWSetup() sets the clock to 4 MHz"
+#endif
+
 #define MIN_ADDR          1
 #define MAX_ADDR          63
 #define MAX_EMPTY_CYCLES  65535
 #define CALIB_CYCLES      40000
 #define UPDATE_DELAY_CYCLES 30000
 #define cycles            emptyCycles
+/** Busy waiting is done in multiples of the bit time at the highest bit rate */
+#define BIT_QUANTUM_US    (1000000 / (CMU_BIT_CLOCK / BAUD_DIVIDER_MIN))
+/** Fallback time slot per module if an upstream module does not reply to OP_GETALL:
+ * duration of one data reply plus 25% */
+#define SLOT_BIT_TIMES    ((sizeof(struct BatValues) * 11 * 5) / 4)
+/** Main loop cycles until a bit rate on trial must be confirmed, about 6s */
+#define BAUD_TRIAL_CYCLES 30000
 
 int __attribute__((OS_main)) main(void);
 static void CmdSetAddr(uint8_t addr);
-static void CmdGetData(void);
+static void CmdGetData(uint8_t allowDelta);
 static void CmdGetVersion(void);
+static void CmdGetUpdaterVersion(void);
 static void CmdShunt(uint16_t arg);
+#if CMU_COMPACT_REPLIES
+static void CmdGetKeyframe(uint16_t arg);
+#endif
+#if CMU_GETALL
+static void CmdGetDataInOrder(void);
+#endif
+#if CMU_BIT_RATES
+static void CmdSetBitRate(uint16_t arg);
+static void SetBitRate(uint8_t divider);
+#endif
 static void HWSetup(void);
 static void CheckCmd(void);
 static void GoToSleep(void);
 
-VERSION(version,2,0,13,'R',1,'A');
+VERSION(version,2,0,16,'R',1,'A');
 
 enum mode_t
 {
@@ -52,6 +76,17 @@ static uint16_t curCmd[2];
 static uint8_t enabledShunts = 0;
 static uint16_t shuntTimeout = 0;
 static uint8_t led = 0;
+#if CMU_GETALL
+static uint8_t bitQuanta = BAUD_DIVIDER_DEFAULT / BAUD_DIVIDER_MIN;
+#endif
+#if CMU_BIT_RATES
+static uint16_t baudTrial = 0;
+#endif
+#if CMU_COMPACT_REPLIES
+static uint16_t sentValues[NUM_VALUES]; //Values of the last reply, base of the next deltas
+static uint8_t compactReplies = 0;
+static uint8_t deltaCount = 0;
+#endif
 
 int main(void)
 {
@@ -92,6 +127,16 @@ int main(void)
             shuntTimeout--;
          }
 
+#if CMU_BIT_RATES
+         if (baudTrial > 0)
+         {
+            baudTrial--;
+
+            if (baudTrial == 0)
+               SetBitRate(BAUD_DIVIDER_DEFAULT);
+         }
+#endif
+
          if (emptyCycles >= MAX_EMPTY_CYCLES)
          {
             GoToSleep();
@@ -124,10 +169,21 @@ static void CheckCmd(void)
             switch (decodedCmd.op)
             {
             case OP_GETDATA:
-               CmdGetData();
+#if CMU_COMPACT_REPLIES
+               if (cnt == sizeof(struct cmd))
+                  CmdGetKeyframe(curCmd[1]);
+               else
+#endif
+                  CmdGetData(1);
                break;
             case OP_VERSION:
-               CmdGetVersion();
+               if (cnt == sizeof(struct cmd))
+                  CmdGetUpdaterVersion();
+               else
+                  CmdGetVersion();
+               break;
+            case OP_BOOT:
+               updater(cmuAddress);
                break;
             case OP_SHUNTON:
                if (cnt == sizeof(struct cmd))
@@ -141,7 +197,7 @@ static void CheckCmd(void)
          {
          case OP_BOOT:
             if (decodedCmd.addr == 0xaa)
-               updater();
+               updater(cmuAddress);
             break;
          case OP_ADDRMODE:
             if (decodedCmd.addr == 0xaa)
@@ -151,12 +207,39 @@ static void CheckCmd(void)
             if (WAIT_ADDR == mode)
                CmdSetAddr(decodedCmd.addr);
             break;
+#if CMU_GETALL
+         case OP_GETALL:
+            if (decodedCmd.addr == 0xaa && RUN == mode)
+               CmdGetDataInOrder();
+            break;
+#endif
+#if CMU_BIT_RATES
+         case OP_BREAK:
+            if (decodedCmd.addr == 0xaa && RUN == mode && cnt == sizeof(struct cmd))
+               CmdSetBitRate(curCmd[1]);
+            break;
+#endif
          }
 
          emptyCycles = 0;
       }
+#if CMU_BIT_RATES
+      else if (baudTrial > 0)
+      {
+         SetBitRate(BAUD_DIVIDER_DEFAULT);
+      }
+#endif
+      set_receive_mode(curCmd, sizeof(curCmd));
+   }
+#if CMU_BIT_RATES
+   else if (baudTrial > 0 && cnt != 0 && cnt != 0xff &&
+            (cnt == 1 || hamming_decode(curCmd[0], (uint16_t*)&decodedCmd) != DEC_RES_OK))
+   {
+      //Garbage instead of a command, we can't keep up with the bit rate on trial
+      SetBitRate(BAUD_DIVIDER_DEFAULT);
       set_receive_mode(curCmd, sizeof(curCmd));
    }
+#endif
    else
    {
       emptyCycles++;
@@ -187,23 +270,104 @@ static uint16_t Crc16XModem(uint8_t* data, uint8_t len)
    return crc;
 }
 
-static void CmdGetData(void)
+/** @param allowDelta 0 to force a full reply. Without CMU_COMPACT_REPLIES it always is */
+static void CmdGetData(uint8_t allowDelta)
 {
+   uint8_t compact = 0;
+#if CMU_COMPACT_REPLIES
+   struct BatDeltas deltas;
+   uint8_t i;
+
+   compact = allowDelta && compactReplies && deltaCount < DELTA_KEYFRAME_INTERVAL;
+#else
+   (void)allowDelta;
+#endif
+
    led = (led + 1) & 0x3;
 
    if (enabledShunts == 0)
    {
       SHUNT_SET(1 << led);
    }
-   vals.crc = Crc16XModem((uint8_t*)&vals, sizeof(vals) - sizeof(vals.crc));
+
+#if CMU_COMPACT_REPLIES
+   for (i = 0; i < NUM_VALUES && compact; i++)
+   {
+      int16_t diff = vals.values[i] - sentValues[i];
+      compact = diff >= INT8_MIN && diff <= INT8_MAX;
+      deltas.values[i] = diff;
+   }
+
+   if (compact)
+   {
+      deltas.adr = cmuAddress | DELTA_ADDR_FLAG;
+      deltas.crc = Crc16XModem((uint8_t*)&deltas, sizeof(deltas) - sizeof(deltas.crc));
+      deltaCount++;
+   }
+   else
+   {
+      deltaCount = 0;
+   }
+
+   for (i = 0; i < NUM_VALUES; i++)
+      sentValues[i] = vals.values[i];
+#endif
+
+   if (!compact)
+      vals.crc = Crc16XModem((uint8_t*)&vals, sizeof(vals) - sizeof(vals.crc));
+
    if (enabledShunts == 0)
    {
       SHUNT_SET(0);
    }
 
-   send_string(&vals, sizeof(vals));
+#if CMU_COMPACT_REPLIES
+   if (compact)
+      send_string(&deltas, sizeof(deltas));
+   else
+#endif
+      send_string(&vals, sizeof(vals));
 }
 
+#if CMU_COMPACT_REPLIES
+static void CmdGetKeyframe(uint16_t arg)
+{
+   uint16_t decodedArg;
+
+   if (DEC_RES_OK == hamming_decode(arg, &decodedArg))
+   {
+      compactReplies = (decodedArg & DATA_COMPACT) != 0;
+   }
+   CmdGetData(0);
+}
+#endif
+
+#if CMU_GETALL
+static void CmdGetDataInOrder(void)
+{
+   uint16_t expectedBytes = sizeof(uint16_t) + (cmuAddress - 1) * sizeof(vals);
+   uint16_t timeout = (cmuAddress - 1) * SLOT_BIT_TIMES * bitQuanta;
+   uint8_t guard;
+
+   //Upstream replies pass through our input, so we reply right after the module
+   //before us. Should one of them be missing, fall back to a time slot derived
+   //from our address. No ADC cycles run meanwhile so vals stays a snapshot taken
+   //at the time of the command.
+   while (num_bytes_since_break() < expectedBytes && timeout > 0)
+   {
+      _delay_us(BIT_QUANTUM_US);
+      timeout--;
+   }
+
+   //let the stop bits of the previous reply pass
+   for (guard = 2 * bitQuanta; guard > 0; guard--)
+      _delay_us(BIT_QUANTUM_US);
+
+   //Replies have fixed slots, so no deltas here
+   CmdGetData(0);
+}
+#endif
+
 static void CmdGetVersion(void)
 {
    struct versionComm ver = { version, 0, 0 };
@@ -214,6 +378,16 @@ static void CmdGetVersion(void)
    send_string(&ver, sizeof(ver));
 }
 
+/** Tell the master which updater we jump to, it is not replaced along with us */
+static void CmdGetUpdaterVersion(void)
+{
+   struct UpdaterVersion ver = { cmuAddress, pgm_read_byte(&updaterVersion), 0 };
+
+   ver.crc = Crc16XModem((uint8_t*)&ver, sizeof(ver) - sizeof(uint16_t));
+
+   send_string(&ver, sizeof(ver));
+}
+
 static void CmdShunt(uint16_t arg)
 {
    uint16_t decodedArg;
@@ -227,6 +401,38 @@ static void CmdShunt(uint16_t arg)
    send_string(&arg, sizeof(arg));
 }
 
+#if CMU_BIT_RATES
+static void CmdSetBitRate(uint16_t arg)
+{
+   uint16_t decodedArg;
+   uint8_t divider;
+
+   if (DEC_RES_OK != hamming_decode(arg, &decodedArg))
+      return;
+
+   divider = decodedArg & BAUD_DIVIDER_MASK;
+
+   if (divider < BAUD_DIVIDER_MIN)
+      return;
+
+   SetBitRate(divider);
+
+   //Only the power-on rate is known to work without trying
+   if ((decodedArg & BAUD_CONFIRM) == 0 && BAUD_DIVIDER_DEFAULT != divider)
+      baudTrial = BAUD_TRIAL_CYCLES;
+}
+
+static void SetBitRate(uint8_t divider)
+{
+   uart_set_divider(divider);
+#if CMU_GETALL
+   //Round up, waiting too long is always safe
+   bitQuanta = (divider + BAUD_DIVIDER_MIN - 1) / BAUD_DIVIDER_MIN;
+#endif
+   baudTrial = 0;
+}
+#endif
+
 static void GoToSleep(void)
 {
    SHUNT_SET(0);
@@ -240,6 +446,10 @@ static void GoToSleep(void)
    sleep_cpu();
    sleep_disable();
    emptyCycles = 0;
+#if CMU_BIT_RATES
+   //The master may have restarted at the power-on rate meanwhile
+   SetBitRate(BAUD_DIVIDER_DEFAULT);
+#endif
    ENABLE_ADC();
    ENABLE_PROPAGATION();
    set_receive_mode(curCmd, sizeof(curCmd));
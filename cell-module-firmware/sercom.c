@@ -21,9 +21,15 @@
 #define SEND 0
 #define RECV 1
 
+//Interrupt response and ISR prologue take about one tick of the bit timer
+#define PCINT_LATENCY_TICKS 1
+
 static volatile uint8_t shiftByte;
 static volatile uint8_t bitCnt;
 static volatile uint8_t idle;
+#if CMU_GETALL
+static volatile uint16_t bytesSinceBreak;
+#endif
 static uint8_t mode;
 static uint8_t *curBuf;
 static uint8_t inverted;
@@ -39,6 +45,14 @@ void uart_initialize()
    SETUP_RX_PINCHANGE_IRQ();
 }
 
+#if CMU_BIT_RATES
+/** Change the bit rate to (F_CPU / 8) / divider. Call only while no frame is on the bus */
+void uart_set_divider(uint8_t divider)
+{
+   OCR0A = divider - 1;
+}
+#endif
+
 void set_receive_mode(void *buf, uint8_t cnt)
 {
    curBuf = (uint8_t*)buf;
@@ -86,21 +100,41 @@ uint8_t num_bytes_received()
    return idle ? currentByte : 0;
 }
 
+#if CMU_GETALL
+/** Counts all bytes seen on the bus since the last break, including
+ * replies of upstream modules that are not stored */
+uint16_t num_bytes_since_break()
+{
+   uint16_t res;
+
+   cli();
+   res = bytesSinceBreak;
+   sei();
+
+   return res;
+}
+#endif
+
 RECV_TIMER_CAPT_ISR
 {
+   //At the highest bit rate there are only 80 CPU cycles between two calls, so
+   //the volatile state is loaded once and stored once
+   uint8_t cnt = bitCnt;
+   uint8_t shift = shiftByte;
+
    if (mode == SEND)
    {
       uint8_t pinval = !inverted; //default to stop bit
 
-      if (bitCnt == 0)
+      if (cnt == 0)
       {
          pinval = inverted;
       }
-      else if (bitCnt < sendBits)
+      else if (cnt < sendBits)
       {
-         pinval = inverted ^ (shiftByte & 1);
+         pinval = inverted ^ (shift & 1);
          //Send LSB first
-         shiftByte >>= 1;
+         shift >>= 1;
       }
 
       if (pinval)
@@ -111,7 +145,7 @@ RECV_TIMER_CAPT_ISR
    else /*if (mode == RECV)*/
    {
       uint8_t bit = SAMPLE();
-      if (bitCnt == 0)
+      if (cnt == 0)
       {
          //Check for spurious start bit
          //Start bit must always be 0
@@ -120,49 +154,60 @@ RECV_TIMER_CAPT_ISR
             DISABLE_CLOCK_IRQ();
             ENABLE_RX_PINCHANGE_IRQ();
          }
-         shiftByte = 0;
+         shift = 0;
       }
-      else if (bitCnt < 9)
+      else if (cnt < 9)
       {
-         shiftByte >>= 1;
+         shift >>= 1;
 
          if (bit)
          {
-            shiftByte |= 1 << 7;
+            shift |= 1 << 7;
          }
       }
-      else if (bitCnt == 9) //stop bit received
+      else if (cnt == 9) //stop bit received
       {
-         if (0 == shiftByte && 0 == bit)
+         if (0 == shift && 0 == bit)
          {
             //break frame - now we actually start receiving
             currentByte = 0;
+#if CMU_GETALL
+            bytesSinceBreak = 0;
+#endif
          }
-         else if (currentByte != 0xff)
+         else
          {
-            if (currentByte < expectedBytes)
+#if CMU_GETALL
+            bytesSinceBreak++;
+#endif
+
+            if (currentByte != 0xff)
             {
-               curBuf[currentByte] = shiftByte;
+               if (currentByte < expectedBytes)
+               {
+                  curBuf[currentByte] = shift;
+               }
+               currentByte++;
             }
-            currentByte++;
          }
       }
-      else if (bitCnt == 10)
+      else if (cnt == 10)
       {
          ENABLE_RX_PINCHANGE_IRQ();
       }
-      else if (bitCnt == 12)
+      else if (cnt == 12)
       {
          DISABLE_CLOCK_IRQ();
          idle = 1;
       }
    }
-   bitCnt++;
+   shiftByte = shift;
+   bitCnt = cnt + 1;
 }
 
 ISR(PCINT0_vect)
 {
-   TCNT0 = OCR0A >> 1; //Fire in the middle of first data bit
+   TCNT0 = (OCR0A >> 1) + PCINT_LATENCY_TICKS; //Fire in the middle of first data bit
    ENABLE_CLOCK_IRQ();
    DISABLE_RX_PINCHANGE_IRQ();
    bitCnt = 0;
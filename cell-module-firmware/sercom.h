@@ -3,9 +3,11 @@
 #include <stdint.h>
 
 void uart_initialize();
+void uart_set_divider(uint8_t divider);
 void set_receive_mode(void *buf, uint8_t cnt);
 void send_string(const void *string, uint8_t cnt);
 void send_break();
 uint8_t num_bytes_received();
+uint16_t num_bytes_since_break();
 
 #endif // SERCOM_H_INCLUDED
@@ -12,13 +12,37 @@
  * It receives data via the custom 1-wire interface or infrared communication using the same
  * logical protocol.
  *
- * The update master transmits all pages multiple times. The updater will not exit until
- * it has received all pages without errors (crc16 check). The data structure for page
- * transmission is described in PageBuf
+ * The update master streams all pages to all modules at once. Every page that passes
+ * the crc16 check is written, in any order and only once. The master then asks for a
+ * bitmap of written pages (UPDATE_QUERY), retransmits what is missing anywhere and
+ * finally sends UPDATE_DONE. The updater exits with the frame that follows it, provided
+ * it has written all pages by then.
+ * For a differential update the master first sends the page crcs of the new image
+ * (UPDATE_COMPARE). Pages whose flash content matches are marked without being written,
+ * so only pages that differ are transmitted and programmed. Without CMU_DIFF_UPDATE the
+ * updater ignores the crcs and so takes every page.
+ * The master holds one image per hardware version. Before it streams an image it
+ * selects the modules it is meant for (UPDATE_SELECT), modules that stay in the
+ * updater from an earlier image ignore it and keep forwarding.
+ * The data structure for page transmission is described in PageBuf
+ *
+ * Modules in the field may still run the legacy updater which only takes pages in order
+ * and exits after the last one. It is never replaced by an update of the application.
+ * The application reports which updater it sits on from updaterVersion, the master
+ * then sends all pages in order, UPDATE_DONE and the last page once more after it.
+ * On the ATtiny84 the legacy updater sat at 0xD00 among the pages it writes, so it could
+ * never update these modules. They need to be programmed over ISP once.
+ *
+ * Applications jump to updater() at the start of .bootloader, the same place as in the
+ * legacy updater. Only updater() and two small helpers fit there, everything else sits
+ * in .bootlow right below, e.g. -Wl,--section-start=.bootlow=0xBC0. Pages from .bootlow on are
+ * marked but never written, the image only holds padding there. updater.ld makes the
+ * linker check the layout.
  */
 
 #include <avr/io.h>
 #include <avr/boot.h>
+#include <avr/pgmspace.h>
 #include <util/crc16.h>
 #include <util/delay.h>
 #include "hwdefs.h"
@@ -28,83 +52,213 @@
 #define PAGE_BYTES (PAGE_WORDS * 2)
 /** number of bytes to be CRC checked */
 #define CRC_BYTES  (sizeof(struct PageBuf) - sizeof(uint16_t))
+/** Pages from here on hold the updater */
+#define UPDATER_PAGE ((uint8_t)(uint16_t)&__updater_page)
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+/** Non-zero for a mark, regardless of the line polarity */
+#define BIT_LEVEL() ((PINA ^ inverted) & TXRX_PIN)
 #define BOOT_SECTION __attribute__ ((section (".bootloader")))
+#define BOOT_LOW     __attribute__ ((section (".bootlow"), noinline))
+/** Helpers that fill up .bootloader behind updater(), define them after it */
+#define BOOT_HIGH    __attribute__ ((section (".bootloader"), noinline))
 
 /** The application programs main entry function */
 extern void __init();
+/** First page of .bootlow, provided by updater.ld */
+extern const uint8_t __updater_page;
 
-static uint16_t calc_crc(uint8_t* buf);
+static uint16_t crc_update(uint16_t crc, uint8_t data);
+static uint16_t calc_crc(uint8_t* buf, uint8_t len);
+#if CMU_DIFF_UPDATE
+static uint16_t flash_crc(uint8_t pageNum);
+#endif
+static uint8_t mark_page(struct PageMap* map, uint8_t pageNum);
 static void write_page(uint16_t* buf, uint8_t pageNum);
 static void receive_page(uint8_t *page);
+static int16_t receive_byte();
+static void send_map(struct PageMap* map, uint8_t address, uint8_t first, uint8_t last);
+/** TXRX_PIN if the line idles low, the bit level is the pin level xor this */
 static uint8_t inverted;
 
+/** Last byte of flash, the legacy updater leaves it erased (UPDATER_LEGACY) */
+const uint8_t updaterVersion __attribute__ ((section (".bootversion"))) = UPDATER_BITMAP;
+
 /** @brief updater entry function
+ * @param address module address, its bitmap is sent in this order
  * @pre LED_PORT must be configured as output
  * @pre MCU must be clocked appropriately for the 1-wire protocol to work
  * @post modifies all registers without saving them
  * @post Disables interrupts
  */
-void __attribute__((OS_main)) BOOT_SECTION updater(void)
+void __attribute__((OS_main)) BOOT_SECTION updater(uint8_t address)
 {
     struct PageBuf pageBuf;
-    uint8_t done = 0;
-    uint8_t expectedPage = 0;
+    struct PageMap map;
+    uint8_t written = 0;
+    uint8_t armed = 0;
+    uint8_t exiting;
+    uint8_t selected = 1;
+
+    //no memset, the application may just be being replaced
+    for (uint8_t i = 0; i < PAGE_MAP_BYTES; i++)
+        ((volatile uint8_t*)map.pages)[i] = 0;
 
     cli();
     PCMSK0 &= ~TXRX_PIN;
     TIMSK0 &= ~(1 << OCIE0A); //disable timer interrupt
     TX_STOP();
-    inverted = (PINA & TXRX_PIN) == 0;
+    inverted = ~PINA & TXRX_PIN;
 
     PORTB |= (1 << PIN2) | (1 << PIN1) | (1 << PIN0);
 
-    while (!done)
+    //Exit with the frame after UPDATE_DONE, it has passed on to the modules behind us
+    //by then. In a chain with legacy updaters it is the last page which they exit with
+    do
     {
+        exiting = armed;
+        armed = 0;
         receive_page((uint8_t*)&pageBuf);
         PORTB ^= (1 << PIN2) | (1 << PIN1) | (1 << PIN0);
 
+        //Corrupted pages are simply not marked, the master resends them
+        if (calc_crc((uint8_t*)&pageBuf, CRC_BYTES) != pageBuf.crc)
+            continue;
+
         if (pageBuf.pageNum < ATTINY_MAX_APPLICATION_PAGES)
         {
-           uint16_t calcCrc = calc_crc((uint8_t*)&pageBuf);
-
-           if (calcCrc == pageBuf.crc && pageBuf.pageNum < ATTINY_MAX_APPLICATION_PAGES)
-           {
-               if (pageBuf.pageNum == expectedPage)
-               {
-                   write_page(pageBuf.buf, pageBuf.pageNum);
-                   expectedPage++;
-               }
-
-               if (pageBuf.pageNum == (ATTINY_MAX_APPLICATION_PAGES - 1))
-                   done = 1;
-           }
-           else
-           {
-               //indicate a CRC error by putting a 0 on the bus
-               TX_START();
-               TCNT0 = 0;
-               TIFR0 |= 1 << OCF0A;
-               while ((TIFR0 & (1 << OCF0A)) == 0);
-               TX_STOP();
-           }
+            if (!selected) continue;
+
+            if (mark_page(&map, pageBuf.pageNum))
+            {
+                if (pageBuf.pageNum < UPDATER_PAGE)
+                    write_page(pageBuf.buf, pageBuf.pageNum);
+                written++;
+            }
         }
-    }
+#if CMU_DIFF_UPDATE
+        else if (pageBuf.pageNum >= UPDATE_COMPARE && pageBuf.pageNum < (UPDATE_COMPARE + COMPARE_FRAMES))
+        {
+            uint8_t page = (pageBuf.pageNum - UPDATE_COMPARE) * PAGE_WORDS;
+
+            if (!selected) continue;
+
+            for (uint16_t* crc = pageBuf.buf; crc < (pageBuf.buf + PAGE_WORDS) && page < ATTINY_MAX_APPLICATION_PAGES; crc++, page++)
+            {
+                if (flash_crc(page) == *crc && mark_page(&map, page))
+                    written++;
+            }
+        }
+#endif
+        else if (pageBuf.pageNum == UPDATE_QUERY)
+        {
+            send_map(&map, address, (uint8_t)pageBuf.buf[0], (uint8_t)pageBuf.buf[1]);
+        }
+        else if (pageBuf.pageNum == UPDATE_SELECT)
+        {
+            selected = (((uint8_t*)pageBuf.buf)[address >> 3] >> (address & 7)) & 1;
+        }
+        else if (pageBuf.pageNum == UPDATE_DONE)
+        {
+            armed = 1;
+        }
+    } while (!exiting || written < ATTINY_MAX_APPLICATION_PAGES);
 
     //Jump to crt entry function. It will reset the stack pointer
     __init();
 }
 
-static uint16_t BOOT_SECTION calc_crc(uint8_t* buf)
+/** The only caller of the inline crc function. Should the compiler not inline it
+ * into several callers, it would put a copy into the application */
+static uint16_t BOOT_LOW crc_update(uint16_t crc, uint8_t data)
+{
+    return _crc_xmodem_update(crc, data);
+}
+
+static uint16_t BOOT_LOW calc_crc(uint8_t* buf, uint8_t len)
 {
     uint16_t crc = 0;
-    for (uint8_t *p = buf; p < (buf + CRC_BYTES); p++)
-        crc = _crc_xmodem_update(crc, *p);
+    for (uint8_t *p = buf; p < (buf + len); p++)
+        crc = crc_update(crc, *p);
+
+    return crc;
+}
+
+#if CMU_DIFF_UPDATE
+/** crc of a flash page as the master calculates it for PageBuf */
+static uint16_t BOOT_LOW flash_crc(uint8_t pageNum)
+{
+    uint16_t crc = crc_update(0, pageNum);
+    uint16_t addr = (uint16_t)pageNum * PAGE_BYTES;
+
+    for (uint16_t end = addr + PAGE_BYTES; addr < end; addr++)
+        crc = crc_update(crc, pgm_read_byte(addr));
 
     return crc;
 }
+#endif
+
+/** @return 1 if the page hadn't been marked before */
+static uint8_t BOOT_HIGH mark_page(struct PageMap* map, uint8_t pageNum)
+{
+    uint8_t* mapByte = &map->pages[pageNum >> 3];
+    uint8_t mask = 1 << (pageNum & 7);
+
+    if (*mapByte & mask) return 0;
+
+    *mapByte |= mask;
+    return 1;
+}
+
+static void BOOT_LOW wait_bit()
+{
+   TIFR0 |= 1 << OCF0A;
+   while ((TIFR0 & (1 << OCF0A)) == 0);
+}
 
-static void BOOT_SECTION write_page(uint16_t* buf, uint8_t pageNum)
+/** Reply with the bitmap of written pages after the replies of all modules
+ * from address first up to ours. They pass through our input, a break in
+ * between means the master has given up on them. Modules beyond last don't
+ * reply, the master asks them separately */
+static void BOOT_LOW send_map(struct PageMap* map, uint8_t address, uint8_t first, uint8_t last)
+{
+   if (address < first || address > last) return;
+
+   //no multiplication, it would call into the application
+   for (uint8_t n = first; n < address; n++)
+   {
+      for (uint8_t i = 0; i < sizeof(struct PageMap); i++)
+      {
+         if (receive_byte() < 0) return;
+      }
+   }
+
+   map->addr = address;
+   map->crc = calc_crc((uint8_t*)map, sizeof(struct PageMap) - sizeof(uint16_t));
+
+   //let the stop bit of the previous reply pass
+   wait_bit();
+   TXRX_DDR |= TXRX_PIN;
+
+   for (uint8_t* p = (uint8_t*)map; p < (uint8_t*)map + sizeof(struct PageMap); p++)
+   {
+      //start bit, 8 data bits LSB first, stop bit
+      uint16_t frame = ((uint16_t)*p << 1) | (1 << 9);
+
+      TCNT0 = 0;
+
+      for (uint8_t bit = 0; bit < 10; bit++, frame >>= 1)
+      {
+         if ((frame & 1) ^ (inverted != 0))
+            TX_HIGH();
+         else
+            TX_LOW();
+         wait_bit();
+      }
+   }
+   TX_STOP();
+}
+
+static void BOOT_LOW write_page(uint16_t* buf, uint8_t pageNum)
 {
     uint16_t* pageAddr = (uint16_t*)((uint16_t)pageNum * PAGE_BYTES);
 
@@ -118,65 +272,35 @@ static void BOOT_SECTION write_page(uint16_t* buf, uint8_t pageNum)
     boot_spm_busy_wait();
 }
 
-static int16_t BOOT_SECTION receive_byte()
+static int16_t BOOT_LOW receive_byte()
 {
-   uint8_t currentBit = 0;
    uint8_t shiftByte = 0;
-   int16_t result = 0;
 
-   while (currentBit < 10)
+   do
    {
-      if (currentBit == 0)
-      {
-         //wait for start bit
-         if (inverted)
-         {
-            while ((PINA & TXRX_PIN) == 0);
-         }
-         else
-         {
-            while ((PINA & TXRX_PIN) != 0);
-         }
-         TCNT0 = OCR0A >> 1; //Fire in the middle of first data bit
-      }
-      TIFR0 |= 1 << OCF0A;
-      while ((TIFR0 & (1 << OCF0A)) == 0);
-      //TCNT0 = 0;
+      //wait for start bit
+      while (BIT_LEVEL());
+      TCNT0 = OCR0A >> 1; //Sample in the middle of each bit
+      wait_bit();
+   } while (BIT_LEVEL()); //not a valid start bit
 
-      uint8_t bit = SAMPLE();
-
-      if (currentBit == 0 && bit)
-      {
-         continue; //not a valid start bit
-      }
-      else if (currentBit > 0 && currentBit < 9)
-      {
-         if (bit)
-         {
-            shiftByte |= 1 << (currentBit - 1);
-         }
-         else
-         {
-            shiftByte &= ~(1 << (currentBit - 1));
-         }
-      }
-      else if (currentBit == 9)
-      {
-         if (0 == shiftByte && !bit)
-         {
-            result = -1; //stop bit is low -> break
-         }
-         else
-         {
-            result = shiftByte;
-         }
-      }
-      currentBit++;
+   //8 data bits LSB first
+   for (uint8_t bit = 0; bit < 8; bit++)
+   {
+      wait_bit();
+      shiftByte >>= 1;
+      if (BIT_LEVEL())
+         shiftByte |= 0x80;
    }
-   return result;
+   wait_bit();
+
+   if (0 == shiftByte && !BIT_LEVEL())
+      return -1; //stop bit is low -> break
+
+   return shiftByte;
 }
 
-static void BOOT_SECTION receive_page(uint8_t *page)
+static void BOOT_HIGH receive_page(uint8_t *page)
 {
    uint8_t bytesReceived = 0;
 
@@ -7,7 +7,13 @@
 #ifndef UPDATER_H_
 #define UPDATER_H_
 
-void updater(void);
+#include <stdint.h>
+
+void updater(uint8_t address);
+
+/** UPDATER_BITMAP, read with pgm_read_byte(). UPDATER_LEGACY if the
+ * application sits on a legacy updater */
+extern const uint8_t updaterVersion;
 
 
 
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef BALANCEPLANNER_H
+#define BALANCEPLANNER_H
+
+#include <stdint.h>
+#include "my_fp.h"
+
+/** @brief Plans how long every cell bleeds through its shunt
+ *
+ * Cells are top balanced: each cell bleeds the charge by which it would reach
+ * full before the emptiest one. Once the cells have been estimated at rest
+ * (see BmsCalculation::EstimateCellSocs()) the charge to full follows from
+ * their SoC and capacity minus what has been bled since. Before that it is
+ * looked up from the present voltages, so the plan corrects itself with
+ * every new reading. Bleeding is counted in whole minutes, once a cell has
+ * bled for bleedTimeLimit minutes it waits for the next estimate at rest.
+ *
+ * Every module may run as many shunts as its thermal budget allows. The budget
+ * is the full shunt count up to deratingSpan below the temperature limit and
+ * drops linearly to none at the limit. Cells with the longest remaining bleed
+ * time get the shunts first.
+ *
+ * Modules are numbered from 1 as in BmsComm.
+ */
+class BalancePlanner
+{
+   public:
+      static void SetBleedCurrent(int current);
+      static void SetTolerance(int charge) { tolerance = charge; }
+      static void SetThermalLimit(int temperature, int shunts);
+      static void Restart();
+      static void Plan(const uint16_t* voltages, const int8_t* temperatures, int numModules, int elapsedMs);
+      static void Stop(int numModules);
+      static bool GetUpdate(int module, uint8_t& shunts);
+      static uint8_t GetShunts(int module) { return shunts[module - 1]; }
+      static int GetBudget(int temperature);
+      static int GetActiveShunts() { return activeShunts; }
+      static int GetTimeToBalance() { return timeToBalance; }
+
+      static const int cellsPerModule = 4;
+      static const int maxModules = 64;
+      static const int deratingSpan = 10; //°C
+      /** Every module gets its shunts sent again after this many plans
+       * so that they don't time out */
+      static const int refreshPlans = 6;
+      static const int bleedTimeLimit = UINT8_MAX; //min
+
+   private:
+      static int32_t ChargeToFull(int cell, uint16_t voltage, int8_t temperature);
+      static int32_t BledCharge(int cell);
+
+      static const int maxCells = maxModules * cellsPerModule;
+      static const int32_t unknown = -1;
+      static int bleedCurrent; //!< mA
+      static int tolerance; //!< mAh
+      static int maxTemperature;
+      static int maxShunts;
+      static uint8_t bleedTime[maxCells]; //!< Minutes of bleeding since the last estimate at rest
+      static uint8_t shunts[maxModules];
+      static uint64_t pendingUpdates;
+      static int pendingMs;
+      static int plans;
+      static int activeShunts;
+      static int timeToBalance; //!< s
+};
+
+#endif // BALANCEPLANNER_H
@@ -28,20 +28,66 @@ class BmsCalculation
       /** Default constructor */
       static void AggregateVoltages(int& min, int& max, int& avg, s32fp& sum);
       static s32fp GetTemperatureAverage();
-      static void SetVoltageSource(const uint16_t* voltages, int numVoltages) { _voltages = voltages; _numVoltages = numVoltages; }
-      static void SetTemperatureSource(const int8_t* temperatures, int numTemperatures) { _temperatures = temperatures, _numTemperatures = numTemperatures; }
-      static void SetVoltageToSoCTable(const uint16_t* table);
+      static int GetMinCell();
+      static int GetMaxCell();
+      static void UpdateModule(int module);
+      static void SetVoltageSource(const uint16_t* voltages, int numVoltages, int voltagesPerModule);
+      static void SetTemperatureSource(const int8_t* temperatures, int numTemperatures);
       static void SetCharge(s32fp chargeIn, s32fp chargeOut) { _chargeIn = chargeIn, _chargeOut = chargeOut; }
       static int EstimateSocFromVoltage(uint16_t vtg);
+      static int32_t GetOpenCircuitVoltage(int32_t soc, int32_t& slope);
+      static void SetCapacity(s32fp capacity) { _capacity = capacity; }
+      static void EstimateCellSocs();
+      static void RestartCharge();
+      static bool HasCellSoc(int cell) { return cell < _numVoltages && cell < maxCells && cellSoc[cell] != unknownSoc; }
+      static s32fp GetCellSoc(int cell);
+      static int32_t GetCellOffset(int cell);
+      static s32fp GetCellCapacity(int cell);
+      static int32_t GetImbalance();
 
    private:
+      /** Statistics of one cell module, only plausible voltages are counted */
+      struct ModuleStats
+      {
+         uint16_t min;
+         uint16_t max;
+         uint16_t sum;
+         uint8_t count;
+         uint8_t minCell;
+         uint8_t maxCell;
+         int8_t temperature;
+      };
+
+      static void UpdateAll();
+      static int32_t CellCharge(int cell);
+      static int FindMinModule();
+      static int FindMaxModule();
+
+      static const int maxModules = 64;
+      static const int maxCells = 256;
+      static const int16_t unknownSoc = INT16_MIN;
+      static const int8_t unknownCapacity = INT8_MIN;
       static s32fp _chargeIn;
       static s32fp _chargeOut;
-      static uint16_t vtgToSoc[11];
+      static s32fp _capacity;
+      static int16_t cellSoc[maxCells]; //!< SoC at the last rest in 0.01%
+      static int8_t cellCapacity[maxCells]; //!< Deviation of the estimated capacity from the nominal one in 1/256, unknownCapacity if not estimated
+      static s32fp restCharge; //!< Net charge counted at the last rest in As
+      static int32_t meanCharge; //!< Mean charge of the cells at the last rest in mAh
+      static int32_t minCharge; //!< Lowest and highest charge of a cell at the last rest in mAh
+      static int32_t maxCharge;
       static const uint16_t* _voltages;
       static int _numVoltages;
+      static int _voltagesPerModule;
       static const int8_t* _temperatures;
       static int _numTemperatures;
+      static ModuleStats modules[maxModules];
+      static int numModules;
+      static int minModule;
+      static int maxModule;
+      static int32_t voltageSum;
+      static int voltageCount;
+      static int32_t temperatureSum;
 };
 
 #endif // BMSCALCULATION_H
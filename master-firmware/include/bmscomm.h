@@ -28,27 +28,131 @@ class BmsComm
       static void ResetAddress();
       static void StartAcquisition(int slave);
       static bool Acquire(int slave);
+      static void StartBroadcastAcquisition();
+      static bool IsBroadcastComplete();
+      static int AcquireAll();
+      static void StartPipelinedAcquisition();
+      static bool StopPipelinedAcquisition();
+      static bool IsPipelineRunning() { return pipelineModule != 0; }
+      static void CheckPipeline();
+      static void ProcessReceived();
+      static uint32_t GetCompletedCycles(bool& allReplied);
       static void StartVersionAcquisition(int slave);
       static bool AcquireVersion(int slave);
       static void SetShunt(int slave, int vtg);
-      static void StartUpdate();
-      static int UpdateNextPage();
+      static void SetShunts(int slave, uint8_t shunts);
+      static void SetBitRate(int divider, bool confirm);
+      static void ApplyBitRate();
+      static bool ResetBitRate();
+      static bool NegotiateBitRate(int maxRate);
+      static int GetBitRate() { return CMU_BIT_CLOCK / divider; }
+      static void ClearErrorCounts();
+      static void SetCompactReplies(bool enable);
+      static int GetErrorCount(int slave) { return errorCounts[slave - 1]; }
+      static void StartUpdate(bool differential);
+      static void RunUpdate();
+      static bool IsUpdating() { return updateStep != UpdateIdle; }
+      static int GetMissingPages(int slave) { return missingPages[slave - 1]; }
+      static int GetUpdateRounds() { return updateRound; }
       static const uint16_t* GetVoltages();
       static const int8_t* GetTemperatures();
       static const struct version* GetVersions();
+      /** Stamp the modules whose values change from now on with seq, see JsonStream */
+      static void SetChangeSequence(uint16_t seq) { changeSequence = seq; }
+      /** @return sequence number of the last change of a module's values, 0 if there was none */
+      static uint16_t GetChangeSequence(int slave) { return moduleChanges[slave]; }
       static const int voltagesPerModule = 4;
       static const int MaxModules = 64;
+      static const int NumBitRates = 4;
+      static const int UpdateNoReply = 0xff; //!< GetMissingPages() of a module that sent no bitmap
+      static const int UpdateNoImage = 0xfe; //!< GetMissingPages() of a module without a valid image for its hardware
+      static const int UpdateCurrent = 0xfd; //!< GetMissingPages() of a module that already runs its image
+      static const int UpdateAgain = 0xfc; //!< GetMissingPages() of a module with a legacy updater that waits for the next update
+      static const int UpdateNoBoot = 0xfb; //!< GetMissingPages() of a module whose application only enters the updater by broadcast
+      static const int MaxUpdateRounds = 4;
+      static const int MaxPageRetries = 3; //!< Resends of a page that a legacy updater reports corrupted
 
    protected:
 
    private:
-      static int Crc16XModem(uint8_t *addr, int num);
+      enum NegotiationSteps
+      {
+         Propose, Try, Evaluate, Confirm, Fallback, Retry
+      };
+
+      enum UpdateSteps
+      {
+         UpdateIdle, UpdateProbe, UpdateBoot, UpdateCompare, UpdateStream, UpdateQuery, UpdateLast, UpdateDone
+      };
+
       static void SendEncodedCmd(struct cmd *cmd);
+      static void MarkChanged(int slave) { moduleChanges[slave - 1] = changeSequence; }
+      static void StoreValues(int slave, const struct BatValues* batValues);
+      static void StoreDeltas(int slave, const struct BatDeltas* batDeltas);
+      static void Resynchronize();
+      static void PipelineFrameReceived();
+      static void NextPipelineModule(bool received);
+      static void ReadPage(int page, uint8_t* buf);
+      static uint16_t PageCrc(int page, const uint8_t* buf);
+      static void NextImage();
+      static void SendProbeCommand(int slave);
+      static bool ParseUpdaterVersion(int slave);
+      static bool IsPageCorrupted();
+      static void SendBootCommand(int slave);
+      static void SendPage(int page);
+      static void ResendPage();
+      static void SendPageCrcs(int frame);
+      static void SendSelectCommand();
+      static void SendUpdateCommand(uint8_t op, uint8_t arg0, uint8_t arg1);
+      static void StartQuery(int first);
+      static int ParsePageMaps();
+      static int NextPendingModule(int first);
       static int numModules;
       static PageBuf pageBuf;
       static uint16_t voltages[MaxModules * voltagesPerModule];
       static int8_t temperatures[MaxModules];
       static struct version versions[MaxModules];
+      static volatile uint16_t moduleChanges[MaxModules]; //!< changeSequence when a value of the module last changed
+      static volatile uint64_t receivedModules; //!< Modules whose values haven't been through ProcessReceived() yet
+      static uint16_t changeSequence;
+      static volatile int pipelineModule;
+      static volatile uint32_t pipelineRequests;
+      static volatile uint32_t completedCycles;
+      static volatile bool pipelineOk;
+      static volatile bool lastCycleOk;
+      static uint32_t checkedRequests;
+      static uint16_t errorCounts[MaxModules];
+      static int divider;
+      static int pendingDivider;
+      static bool compactReplies;
+      static volatile bool synced[MaxModules];
+      static const uint8_t dividers[NumBitRates];
+      static NegotiationSteps negotiationStep;
+      static int negotiationRate;
+      static int negotiationTimeout;
+      static uint32_t negotiationCycles;
+      static UpdateSteps updateStep;
+      static uint8_t resendPages[PAGE_MAP_BYTES];
+      static uint8_t missingPages[MaxModules];
+      static uint64_t pendingModules;
+      static int updatePage;
+      static int updateRound;
+      static int queryFirst;
+      static int updateTimeout;
+      static bool updateLineIdle;
+      static bool queryRepeated;
+      static uint64_t passModules;
+      static uint64_t updaterModules;
+      static uint64_t bitmapModules;
+      static uint64_t bootableModules;
+      static int updateImage;
+      static int bootModule;
+      static int queryLast;
+      static bool updateDifferential;
+      static bool updateBooted;
+      static bool updateSequential;
+      static int updateRetries;
+      static int corruptedPages;
 };
 
 #endif // BMSCOMM_H
@@ -21,6 +21,14 @@
 #include <stdint.h>
 #include "my_fp.h"
 
+/** @brief Battery state that survives a reset
+ *
+ * The state is appended to a journal of BATSTT_PAGES flash pages. Every record
+ * carries a sequence number and a CRC, LoadFromFlash() picks the newest valid
+ * one. A page is only erased when the journal moves on to it, so each page sees
+ * one erase per FLASH_PAGE_SIZE / 24 saves and periodic saves are fine. A save
+ * interrupted by a reset leaves the previous record intact.
+ */
 class BMSState
 {
    public:
@@ -55,7 +63,14 @@ class BMSState
    protected:
 
    private:
-      static bool saved; //!< For every startup battery state can only be saved once to prevent flash death
+      static void FindNewest();
+      static bool IsErased(uint32_t address, int words);
+      static bool LoadLegacy();
+
+      static int newestSlot; //!< Slot of newest valid record, -1 if there is none
+      static int nextSlot; //!< Slot the next record goes to
+      static uint32_t sequence; //!< Sequence number of the newest record
+      static bool scanned; //!< newestSlot, nextSlot and sequence are valid
       static s32fp estimatedSoC; //!< Member variable "estimatedSoC"
       static s32fp chargein; //!< Member variable "chargein"
       static s32fp chargeout; //!< Member variable "chargeout"
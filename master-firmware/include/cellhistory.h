@@ -0,0 +1,141 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CELLHISTORY_H
+#define CELLHISTORY_H
+
+#include <stdint.h>
+#include "bmscomm.h"
+
+#ifndef HISTORY_RAM
+#define HISTORY_RAM      4096 //Bytes for the records of all tiers, see CellHistory
+#endif
+
+#define HISTORY_DATA     'H'
+#define HISTORY_END      'E'
+/** Offset marking a cell without plausible value */
+#define HISTORY_INVALID  0xff
+
+/** A dump is a sequence of COBS frames (see cobs.h). Each data frame carries a
+ * slice of one record, followed by one byte per cell for the cycle tier and a
+ * pair of bytes (minimum, maximum) per cell for the other tiers. A voltage is
+ * base + (offset << shift) mV, minimums are rounded down and maximums up */
+struct HistoryFrameHeader
+{
+   uint8_t type;              /**< HISTORY_DATA */
+   uint8_t tier;              /**< CellHistory::Tier */
+   uint32_t time;             /**< Seconds since power up, start of the interval for minute and hour records */
+   uint16_t base;             /**< Voltage of offset 0 in mV, at most the lowest cell of the record */
+   uint8_t shift;             /**< Resolution is 1 << shift mV, 0 unless the cells spread more than 254 mV */
+   uint8_t firstModule;       /**< Counting from 0 */
+   uint8_t numModules;        /**< Modules in this frame */
+   uint8_t voltagesPerModule;
+} __attribute__((packed));
+
+struct HistoryEndHeader
+{
+   uint8_t type;              /**< HISTORY_END */
+   uint8_t tier;
+   uint16_t records;          /**< Number of records in the dump */
+} __attribute__((packed));
+
+/** @brief Cell voltage history in RAM at three resolutions
+ *
+ * Every acquisition cycle is recorded, as well as the minimum and maximum
+ * of every cell per minute and per hour. Each tier is a ring of fixed size
+ * records that stores the cells as 8 bit offsets from a base voltage at or below
+ * the lowest cell, so a record costs 7 + cells (cycle) or 7 + 2 * cells (minute,
+ * hour) bytes. Minute and hour records are accumulated in the slot they will
+ * take, their rings keep one record less.
+ *
+ * The depth thus depends on the chain length. With the default HISTORY_RAM it
+ * is 11 cycles, 11 minutes and 11 hours with 16 modules, but only 3 cycles,
+ * 2 minutes and 2 hours with 64 modules. Keeping every cycle of 64 modules for
+ * a minute would take about 40 KB, so for long chains the cycle tier only
+ * shows the last second and the minute tier the last minutes. A build with a
+ * larger HISTORY_RAM keeps more. The history is cleared when the number of
+ * modules changes.
+ *
+ * Dumps are sent from the main loop by Run() like JsonStream.
+ */
+class CellHistory
+{
+   public:
+      enum Tier
+      {
+         Cycle, Minute, Hour, NumTiers
+      };
+
+      static void Clear();
+      static void AddCycle(uint32_t time);
+      static int GetRange(int tier, uint32_t& first, uint32_t& last);
+      static bool StartDump(int tier, uint32_t from, uint32_t to);
+      static bool IsDumping() { return dumping; }
+      static void Run();
+
+   private:
+      struct Ring
+      {
+         uint8_t* buf;
+         uint16_t size;
+         uint16_t recordSize;
+         uint16_t slots;
+         uint16_t kept;      /**< Complete records the ring can hold */
+         uint32_t written;   /**< Records written since Clear(), the last kept of them are available */
+      };
+
+      struct RecordHeader
+      {
+         uint32_t time;
+         uint16_t base;
+         uint8_t shift;
+      } __attribute__((packed));
+
+      static void StoreCycle(uint32_t time, const uint16_t* voltages, uint16_t min, uint16_t max);
+      static void Open(int tier, uint32_t time);
+      static void Accumulate(int tier, const uint16_t* voltages, uint16_t min, uint16_t max);
+      static void Rebase(RecordHeader* header, uint8_t* data, uint16_t base, uint8_t shift);
+      static bool GetCellRange(const uint16_t* voltages, uint16_t& min, uint16_t& max);
+      static int NextFrame(uint8_t* buf, int size);
+      static const uint8_t* GetRecord(const Ring& ring, uint32_t record);
+
+      static const int modulesPerFrame = 8;
+      static const int maxFrameData = modulesPerFrame * BmsComm::voltagesPerModule * 2;
+      static const int txBufSize = 1 + sizeof(HistoryFrameHeader) + maxFrameData + 4; //Delimiter and CobsFrame::MaxSize()
+
+      static uint8_t cycleBuf[HISTORY_RAM / 5];
+      static uint8_t minuteBuf[HISTORY_RAM * 2 / 5];
+      static uint8_t hourBuf[HISTORY_RAM * 2 / 5];
+      static Ring rings[NumTiers];
+      static uint32_t minuteStart;
+      static uint32_t hourStart;
+      static bool minuteOpen;
+      static bool hourOpen;
+      static int numModules;
+      static uint8_t txBuf[txBufSize];
+      static bool dumping;
+      static int dumpTier;
+      static uint32_t dumpFrom;
+      static uint32_t dumpTo;
+      static uint32_t dumpRecord;
+      static uint32_t dumpEnd;
+      static int dumpModule;
+      static uint16_t dumpRecords;
+};
+
+#endif // CELLHISTORY_H
@@ -0,0 +1,78 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CELLSTATISTICS_H
+#define CELLSTATISTICS_H
+
+#include <stdint.h>
+#include "my_fp.h"
+#include "bmscomm.h"
+
+/** Long term statistics of every cell. Mean and variance are exponentially
+ * weighted over roughly 2^ewmaShift replies and kept in µV and µV^2 so that
+ * the noise of a steady cell doesn't vanish in rounding. Minimum and maximum
+ * are kept until Reset().
+ *
+ * Time at extreme counts the seconds a cell was the weakest or strongest of
+ * the pack. Only few cells ever are, so the counters live in a table of
+ * MaxExtremeCells entries instead of every record. Counters for every cell
+ * would take another 1 KB, which the RAM of the F103 doesn't have to spare.
+ * When the table is full a newcomer takes over the entry with the least time.
+ * The cell that lost it reads -1 (unknown) until Reset().
+ */
+class CellStatistics
+{
+   public:
+      struct Stats
+      {
+         int32_t mean;         /**< Weighted mean voltage in µV */
+         uint32_t variance;    /**< Weighted variance in µV^2, saturates at about (65 mV)^2 */
+         uint16_t min;         /**< Lowest voltage seen in mV, 0 if no value has been seen */
+         uint16_t max;         /**< Highest voltage seen in mV */
+      };
+
+      static void Reset();
+      static void Update(int cell, uint16_t voltage);
+      static void CountExtremes(int minCell, int maxCell);
+      static const Stats& Get(int cell) { return stats[cell]; }
+      static s32fp GetMean(int cell);
+      static s32fp GetVariance(int cell);
+      static int32_t GetSecondsMin(int cell);
+      static int32_t GetSecondsMax(int cell);
+      static int GetExtremeOverflows() { return extremeOverflows; }
+      static const int MaxCells = BmsComm::MaxModules * BmsComm::voltagesPerModule;
+      static const int MaxExtremeCells = 16;
+
+   private:
+      struct Extreme
+      {
+         uint16_t cell;        /**< Cell index + 1, 0 for an unused entry */
+         uint32_t secondsMin;  /**< Seconds as weakest cell */
+         uint32_t secondsMax;  /**< Seconds as strongest cell */
+      };
+
+      static Extreme* FindExtreme(int cell, bool add);
+
+      static const int ewmaShift = 6;
+      static Stats stats[MaxCells];
+      static Extreme extremes[MaxExtremeCells];
+      static uint8_t evicted[(MaxCells + 7) / 8]; //!< Bit per cell whose counters were taken over
+      static int extremeOverflows;
+};
+
+#endif // CELLSTATISTICS_H
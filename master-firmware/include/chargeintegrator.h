@@ -0,0 +1,62 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CHARGEINTEGRATOR_H
+#define CHARGEINTEGRATOR_H
+
+#include <stdint.h>
+#include "my_fp.h"
+
+/** @brief Counts charge in and out of the battery without drift
+ *
+ * The totals are 64 bit and kept in 2^-16 of 1/64000 As (half a millisecond
+ * times the fixed point resolution of the current), so current samples are
+ * integrated by the trapezoidal rule without rounding and the fraction below
+ * the resolution of the readout is carried over instead of being cut off.
+ * They hold 600 kAh.
+ *
+ * Current samples come from the ADC via AddSample(), the ISA shunt delivers
+ * its own counters via AddCounters(). Totals are read and reset from lower
+ * priority tasks than the sampling, so those accesses mask interrupts.
+ */
+class ChargeIntegrator
+{
+   public:
+      static void SetCharge(s32fp chargeIn, s32fp chargeOut);
+      static void AddSample(s32fp current, uint32_t periodMs);
+      static void AddCounters(uint32_t asIn, uint32_t asOut);
+      static s32fp GetChargeIn();
+      static s32fp GetChargeOut();
+
+      static const int fracBits = 16;
+      /** Units of the totals per As in s32fp */
+      static const int64_t unitsPerAs = (int64_t)(2 * 1000) << fracBits;
+
+   private:
+      static s32fp ToAs(int64_t units);
+
+      static int64_t chargeIn;
+      static int64_t chargeOut;
+      static s32fp lastCurrent;
+      static bool haveSample;
+      static uint32_t lastCounterIn;
+      static uint32_t lastCounterOut;
+      static bool haveCounters;
+};
+
+#endif // CHARGEINTEGRATOR_H
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef COBS_H
+#define COBS_H
+
+#include <stdint.h>
+
+/** @brief Builds a CRC protected frame with consistent overhead byte stuffing
+ *
+ * The payload is followed by its CRC16 (XMODEM, little endian) and the whole
+ * is COBS encoded, so the frame contains no zero byte but the delimiter at its
+ * end. A receiver that starts in the middle of a stream resynchronizes at the
+ * next zero. Encoding happens on the fly, no copy of the payload is needed.
+ */
+class CobsFrame
+{
+   public:
+      CobsFrame(uint8_t* buf, int size);
+      void Add(uint8_t data);
+      void Add(const void* data, int len);
+      int Close();
+      static int Decode(const uint8_t* in, int len, uint8_t* out);
+      /** Worst case size of an encoded frame including CRC and delimiter */
+      static int MaxSize(int payloadLen) { return payloadLen + 2 + (payloadLen + 2) / 254 + 2; }
+
+   private:
+      void Put(uint8_t data);
+      void CloseBlock();
+
+      uint8_t* buf;
+      int size;
+      int pos;
+      int codePos;
+      uint8_t code;
+      uint16_t crc;
+      bool overflow;
+};
+
+#endif // COBS_H
@@ -0,0 +1,43 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef CRC16_H
+#define CRC16_H
+
+#include <stdint.h>
+
+/** @brief Table driven CRC16 XMODEM (polynomial 0x1021, initial value 0)
+ *
+ * The incremental interface allows to checksum a message piece by piece,
+ * e.g. while it is assembled or received:
+ * crc = Crc16::Init(); crc = Crc16::Update(crc, part1, n1); ... Crc16::Final(crc)
+ */
+class Crc16
+{
+   public:
+      static uint16_t Init() { return 0; }
+      static uint16_t Update(uint16_t crc, uint8_t data) { return (crc << 8) ^ table[(crc >> 8) ^ data]; }
+      static uint16_t Update(uint16_t crc, const uint8_t* data, int num);
+      static uint16_t Final(uint16_t crc) { return crc; }
+      static uint16_t Calculate(const uint8_t* data, int num) { return Final(Update(Init(), data, num)); }
+
+   private:
+      static const uint16_t table[256];
+};
+
+#endif // CRC16_H
@@ -27,6 +27,10 @@
 #define PARAM_BLKSIZE FLASH_PAGE_SIZE
 #define CAN_BLKNUM     2
 #define CAN_BLKSIZE    FLASH_PAGE_SIZE
-#define BATSTT_ADDRESS 0x0801E800
+//Battery state journal, the pages below the CAN map. Keep in sync with rom in stm32_bms.ld
+#define BATSTT_PAGES   2
+#define BATSTT_ADDRESS 0x0801E000
+//Open circuit voltage table, the page below the journal. Keep in sync with rom in stm32_bms.ld
+#define OCVTBL_ADDRESS 0x0801D800
 
 #endif // HWDEFS_H_INCLUDED
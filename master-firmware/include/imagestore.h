@@ -0,0 +1,64 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef IMAGESTORE_H
+#define IMAGESTORE_H
+
+#include <stdint.h>
+#include "bms_shared.h"
+#include "lzimage.h"
+
+/** Precedes every image in the store, the compressed image follows directly */
+struct ImageHeader
+{
+   uint16_t magic;           /**< ImageStore::Magic, anything else ends the store */
+   struct version version;   /**< Software version of the image and hardware version it is built for */
+   uint16_t size;            /**< Size of the uncompressed image in bytes */
+   uint16_t packedSize;      /**< Size of the compressed image in bytes, see LzImage */
+   uint16_t crc;             /**< CRC16 xmodem over the uncompressed image */
+} __attribute__((packed));
+
+/** @brief Cell module firmware images for different hardware versions
+ *
+ * The store is built by tools/lzpack and linked in from cmu-images.lz.
+ * A module gets the first image built for its hardware version.
+ */
+class ImageStore
+{
+   public:
+      static int GetNumImages();
+      static const ImageHeader* GetHeader(int index);
+      static const uint8_t* GetData(int index);
+      static int Find(const struct version& moduleVersion);
+      static bool IsCurrent(int index, const struct version& moduleVersion);
+      static bool Verify(int index);
+      /** The only decompressor, its window takes 1 KB of RAM. An update keeps its
+       * position between pages, see BmsComm::ReadPage() */
+      static LzImage& GetDecompressor() { return decompressor; }
+      /** Set while the terminal checks the images, an update waits for it */
+      static void SetBusy(bool b) { busy = b; }
+      static bool IsBusy() { return busy; }
+      static const uint16_t Magic = 0x4d49; //"IM"
+      static const int MaxImages = 8;
+
+   private:
+      static LzImage decompressor;
+      static volatile bool busy;
+};
+
+#endif // IMAGESTORE_H
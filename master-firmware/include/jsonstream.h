@@ -0,0 +1,81 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef JSONSTREAM_H
+#define JSONSTREAM_H
+
+#include <stdint.h>
+#include "params.h"
+
+/** @brief Generates the JSON dump of all parameters and cell values piece by piece
+ *
+ * Run() is called from the main loop. Whenever the terminal TX DMA is idle
+ * it formats the next entry and hands it over straight from the entry buffer,
+ * so the terminal stays responsive and the dump goes out as fast as the UART
+ * allows.
+ *
+ * A delta dump only contains the entries that changed after the delta dump
+ * with the given sequence number, and a "seq" entry with its own sequence
+ * number. Every parameter and every module carries the sequence number of its
+ * last change, so any number of clients can ask for changes since the dump
+ * they saw last and an aborted dump loses nothing. A module reports all its
+ * entries when one of them changed. Sequence number 0, one that hasn't been
+ * given out yet, e.g. from before a reset, or one more than 32767 dumps ago
+ * gets everything.
+ *
+ * The parameter store has no change tracking, so each delta dump compares
+ * the parameters with a 16 bit hash of their value at the previous one.
+ */
+class JsonStream
+{
+   public:
+      static void Start();
+      static void StartDelta(uint16_t since);
+      static bool IsActive() { return active; }
+      static void Run();
+      static int NextChunk(char* buf, int size);
+
+   private:
+      enum Section
+      {
+         Open, Params, Serial, Cells, Close, Done
+      };
+
+      static bool NextEntry();
+      static void ParamEntry();
+      static void CellEntry();
+      static bool Changed(uint16_t seq);
+      static uint16_t NextSequence(uint16_t seq);
+      static uint16_t Hash(s32fp value);
+
+      static char entry[256];
+      static int entryLen;
+      static int entryPos;
+      static Section section;
+      static int index;
+      static int part;
+      static int numSlaves;
+      static bool active;
+      static bool delta;
+      static uint16_t since;
+      static uint16_t sequence; //!< Sequence number of the last delta dump
+      static uint16_t paramHashes[Param::PARAM_LAST];
+      static uint16_t paramChanges[Param::PARAM_LAST]; //!< Sequence number of the last change
+};
+
+#endif // JSONSTREAM_H
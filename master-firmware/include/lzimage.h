@@ -0,0 +1,67 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef LZIMAGE_H
+#define LZIMAGE_H
+
+#include <stdint.h>
+
+/** @brief LZSS compressed firmware image that is decompressed while it is read
+ *
+ * A 4 byte header holds the uncompressed and the compressed size, both uint16
+ * little endian. Then every group of 8 items is preceded by a flag byte. A clear
+ * bit (LSB first) is a literal byte, a set bit a uint16 little endian reference
+ * with distance - 1 in the lower DistanceBits and length - MinMatch in the upper
+ * bits. Only the last WindowSize bytes of output are kept, so reading forward
+ * takes bounded RAM. Seeking backwards starts over from the beginning.
+ */
+class LzImage
+{
+   public:
+      LzImage(const uint8_t* data = 0);
+      void Open(const uint8_t* image);
+      void Rewind();
+      bool Seek(int pos);
+      int Read(uint8_t* out, int len);
+      int GetSize() const { return size; }
+      int GetPackedSize() const { return packedEnd; }
+      static int Compress(const uint8_t* in, int len, uint8_t* out, int outSize);
+      /** Worst case size of the compressed data, all literals */
+      static int MaxSize(int len) { return HeaderSize + len + (len + 7) / 8; }
+      static const int HeaderSize = 4;
+      static const int DistanceBits = 10;
+      static const int WindowSize = 1 << DistanceBits;
+      static const int MinMatch = 3;
+      static const int MaxMatch = MinMatch + (1 << (16 - DistanceBits)) - 1;
+
+   private:
+      int NextByte();
+
+      const uint8_t* data;
+      int size;
+      int packedEnd;
+      int inPos;
+      int outPos;
+      uint8_t flags;
+      int flagBits;
+      int matchDistance;
+      int matchLength;
+      uint8_t window[WindowSize];
+};
+
+#endif // LZIMAGE_H
@@ -0,0 +1,92 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef OCVTABLE_H
+#define OCVTABLE_H
+
+#include <stdint.h>
+#include "my_fp.h"
+
+/** @brief Open circuit voltage over SoC and temperature
+ *
+ * Each temperature column lists the cell voltage at the same SoC points, both
+ * ascending. Lookups pick the two columns around the temperature by binary
+ * search and interpolate bilinearly, so a single column makes the table
+ * independent of temperature.
+ *
+ * The table is loaded from a preset or entered row by row from the terminal
+ * and kept in its own flash page. Entered rows go to a staging table, lookups
+ * keep using the active one until ApplyStaged() has checked the new table and
+ * taken it over. Before any table is loaded lookups use the LFP preset.
+ */
+class OcvTable
+{
+   public:
+      static const int maxTemperatures = 4;
+      static const int maxPoints = 24;
+
+      enum Preset { Lfp, Nmc, NumPresets };
+
+      static void LoadPreset(Preset preset);
+      static bool LoadFromFlash();
+      static bool SaveToFlash();
+      static bool SetTemperatures(const int* temperatures, int count);
+      static bool AddRow(int soc, const int* voltages);
+      static bool ApplyStaged();
+      static int GetStagedTemperatures() { return staging.numTemperatures; }
+      static int GetStagedPoints() { return staging.numPoints; }
+      static bool IsComplete() { return complete; }
+      static int GetNumTemperatures() { return table.numTemperatures; }
+      static int GetNumPoints() { return table.numPoints; }
+      static int GetTemperature(int column) { return table.temperatures[column]; }
+      static int GetPointSoc(int point) { return table.soc[point]; }
+      static int GetPointVoltage(int column, int point) { return table.voltages[column][point]; }
+      static s32fp GetSoc(int voltage, s32fp temperature);
+      static int32_t GetVoltage(int32_t soc, s32fp temperature, int32_t& slope);
+
+   private:
+      struct Data
+      {
+         uint8_t numTemperatures;
+         uint8_t numPoints;
+         uint8_t reserved[2];
+         int8_t temperatures[maxTemperatures]; //!< Column temperatures in °C
+         uint8_t soc[maxPoints]; //!< SoC of each row in %
+         uint16_t voltages[maxTemperatures][maxPoints]; //!< Open circuit voltage in mV
+      };
+
+      /** Flash record */
+      struct Saved
+      {
+         uint32_t version;
+         Data data;
+         uint32_t crc;
+      };
+
+      static bool Check(const Data& data);
+      static const Data& Active() { return complete ? table : presets[Lfp]; }
+      static void FindColumn(const Data& data, s32fp temperature, int& column, int32_t& weight);
+      static int32_t ColumnVoltage(const Data& data, int column, int32_t weight, int point);
+
+      static const Data presets[NumPresets];
+      static Data table;
+      static Data staging;
+      static bool complete;
+};
+
+#endif // OCVTABLE_H
@@ -23,18 +23,64 @@
 
 extern "C" void dma1_channel5_isr();
 
-/** @brief Implements one wire bit length encoded protocol with minimum software interaction */
+/** @brief Implements one wire bit length encoded protocol with minimum software interaction
+ *
+ * Received bytes are written to a ring buffer by circular DMA that is never stopped.
+ * The idle line interrupt and breaks (framing error) cut the stream into frames.
+ * Frames received since the last transmission are read straight from the ring buffer.
+ * The half transfer and transfer complete interrupts count the laps of DMA around the
+ * ring buffer, so a frame whose bytes have been overwritten is noticed and dropped.
+ */
 class OneWire
 {
    public:
+      static void Init();
       static void StartReceiveMode();
-      static int GetReceivedData(uint8_t* data, int numBytes);
-      static void SendData(const uint8_t* data, int numBytes);
+      static int GetNumFrames();
+      static int GetFrameLength(int index);
+      static int ReadFrame(int index, int offset, void* data, int numBytes);
+      static int GetLastFrameLength() { return GetFrameLength(numFrames - 1); }
+      static int ReadLastFrame(int offset, void* data, int numBytes) { return ReadFrame(numFrames - 1, offset, data, numBytes); }
+      static int GetNumBytesReceived();
+      static uint32_t GetOverruns() { return overruns; }
+      static bool SendData(const uint8_t* data, int numBytes);
       static bool IsReceiving();
+      static void SetBaudrate(int baud);
+      static void SetFrameReceivedCallback(void (*callback)());
+      static void IdleLineDetected();
+      static void BreakDetected();
+      static void HalfTransferComplete() { halfTransfers++; }
 
    private:
-      static const int bufferSize = 512; //large buffer because there will be many break frames in address mode
+      struct Frame
+      {
+         uint32_t start; //!< Counted from Init(), see GetWriteCount()
+         uint16_t length;
+         bool brk;
+         bool lost; //!< DMA has overwritten the frame
+      };
+
+      static int GetWritePosition();
+      static uint32_t GetWriteCount();
+      static bool IsOverwritten(Frame& frame);
+      static bool CloseFrame(uint32_t end);
+
+      //large buffer because all modules reply into it on OP_GETALL, 64 * 13 bytes
+      static const int bufferSize = 1024;
+      //many break frames arrive in address mode, only the last ones are kept
+      static const int maxFrames = 16;
+      //the largest frame we send is a PageBuf
+      static const int txBufferSize = 80;
       static uint8_t buffer[bufferSize];
+      static uint8_t txBuffer[txBufferSize];
+      static Frame frames[maxFrames];
+      static volatile int firstFrame;
+      static volatile int numFrames;
+      static volatile uint32_t frameStart;
+      static volatile bool frameBrk;
+      static volatile uint32_t halfTransfers;
+      static volatile uint32_t overruns;
+      static void (*frameReceived)();
 };
 
 #endif // ONEWIRE_H
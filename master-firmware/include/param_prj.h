@@ -29,16 +29,26 @@ extern const char* errorListString;
    2. Temporary parameters (id = 0)
    3. Display values
  */
-//Next param id (increase when adding new parameter!): 19
+//Next param id (increase when adding new parameter!): 32
 /*              category     name         unit       min     max     default id */
 #define PARAM_LIST \
     PARAM_ENTRY(CAT_BMS,     cellmodop,   MODOPS,    0,      3,      0,      0   ) \
+    PARAM_ENTRY(CAT_BMS,     updmode,     UPDMODES,  0,      1,      0,      31  ) \
     PARAM_ENTRY(CAT_BMS,     shuntvtg,    "mV",      3000,   4200,   4200,   0   ) \
     PARAM_ENTRY(CAT_BMS,     chargestop,  "mV",      3000,   4200,   4200,   4   ) \
     PARAM_ENTRY(CAT_BMS,     chargestart, "mV",      3000,   4200,   3300,   6   ) \
     PARAM_ENTRY(CAT_BMS,     loadstop,    "mV",      2500,   4200,   2600,   14  ) \
     PARAM_ENTRY(CAT_BMS,     loadstart,   "mV",      2500,   4200,   3300,   15  ) \
     PARAM_ENTRY(CAT_BMS,     capacity,    "Ah",      1,      2000,   100,    8   ) \
+    PARAM_ENTRY(CAT_BMS,     socmode,     SOCMODES,  0,      1,      0,      22  ) \
+    PARAM_ENTRY(CAT_BMS,     cellr0,      "mOhm",    0,      100,    1,      23  ) \
+    PARAM_ENTRY(CAT_BMS,     cellr1,      "mOhm",    0,      100,    1,      24  ) \
+    PARAM_ENTRY(CAT_BMS,     celltau,     "s",       10,     10000,  60,     25  ) \
+    PARAM_ENTRY(CAT_BAL,     balmode,     BALMODES,  0,      1,      0,      26  ) \
+    PARAM_ENTRY(CAT_BAL,     balcur,      "mA",      10,     1000,   100,    27  ) \
+    PARAM_ENTRY(CAT_BAL,     baltol,      "mAh",     0,      10000,  300,    28  ) \
+    PARAM_ENTRY(CAT_BAL,     balmaxtmp,   "°C",      20,     100,    60,     29  ) \
+    PARAM_ENTRY(CAT_BAL,     balshunts,   "",        1,      4,      4,      30  ) \
     PARAM_ENTRY(CAT_CUR,     idcgain,     "dig/A",   -1000,  1000,   10,     3   ) \
     PARAM_ENTRY(CAT_CUR,     idcofs,      "dig",    -4095,   4095,   0,      5   ) \
     PARAM_ENTRY(CAT_CUR,     idcmode,     IDCMODES,  0,      3,      0,      7   ) \
@@ -53,14 +63,25 @@ extern const char* errorListString;
     PARAM_ENTRY(CAT_COMM,    canspeed,    CANSPEEDS, 0,      4,      2,      83  ) \
     PARAM_ENTRY(CAT_COMM,    canperiod,   CANPERIODS,0,      1,      0,      88  ) \
     PARAM_ENTRY(CAT_COMM,    modcount,    "",        0,      63,     0,      16  ) \
+    PARAM_ENTRY(CAT_COMM,    acqmode,     ACQMODES,  0,      1,      0,      19  ) \
+    PARAM_ENTRY(CAT_COMM,    maxbaud,     BAUDRATES, 0,      3,      0,      20  ) \
+    PARAM_ENTRY(CAT_COMM,    replyfmt,    REPLYFMTS, 0,      1,      0,      21  ) \
     PARAM_ENTRY(CAT_TEST,    soctest,     "%",       0,      100,    0,      0   ) \
     PARAM_ENTRY(CAT_TEST,    relaytest,   ONOFF,     0,      2,      2,      0   ) \
     PARAM_ENTRY(CAT_TEST,    testcmd,     TESTS,     0,      5,      0,      0   ) \
     VALUE_ENTRY(opmode,      OPMODES, 2000 ) \
     VALUE_ENTRY(commquality, "%",     2029 ) \
+    VALUE_ENTRY(refreshrate, "Hz",    2031 ) \
+    VALUE_ENTRY(baudrate,    "baud",  2032 ) \
+    VALUE_ENTRY(rxoverruns,  "",      2052 ) \
     VALUE_ENTRY(curmodule,   "",      2025 ) \
     VALUE_ENTRY(soc,         "%",     2001 ) \
     VALUE_ENTRY(socest,      "%",     2019 ) \
+    VALUE_ENTRY(socekf,      "%",     2035 ) \
+    VALUE_ENTRY(capekf,      "Ah",    2036 ) \
+    VALUE_ENTRY(imbalance,   "Ah",    2037 ) \
+    VALUE_ENTRY(balcells,    "",      2038 ) \
+    VALUE_ENTRY(baltime,     "h",     2039 ) \
     VALUE_ENTRY(idc,         "A",     2002 ) \
     VALUE_ENTRY(idcavg,      "A",     2022 ) \
     VALUE_ENTRY(udc,         "V",     2003 ) \
@@ -73,6 +94,8 @@ extern const char* errorListString;
     VALUE_ENTRY(batmin,      "mV",    2008 ) \
     VALUE_ENTRY(batmax,      "mV",    2009 ) \
     VALUE_ENTRY(batavg,      "mV",    2010 ) \
+    VALUE_ENTRY(mincell,     "",      2033 ) \
+    VALUE_ENTRY(maxcell,     "",      2034 ) \
     VALUE_ENTRY(tmpavg,      "°C",    2023 ) \
     VALUE_ENTRY(batmin2,     "mV",    2011 ) \
     VALUE_ENTRY(batmax2,     "mV",    2012 ) \
@@ -84,24 +107,43 @@ extern const char* errorListString;
     VALUE_ENTRY(uaux,        "V",     2014 ) \
     VALUE_ENTRY(version,     VERSTR,  2015 ) \
     VALUE_ENTRY(cpuload,     "%",     2017 ) \
+    VALUE_ENTRY(t1msavg,     "us",    2040 ) \
+    VALUE_ENTRY(t1msmax,     "us",    2041 ) \
+    VALUE_ENTRY(t1msmiss,    "",      2042 ) \
+    VALUE_ENTRY(t10msavg,    "us",    2043 ) \
+    VALUE_ENTRY(t10msmax,    "us",    2044 ) \
+    VALUE_ENTRY(t10msmiss,   "",      2045 ) \
+    VALUE_ENTRY(t40msavg,    "us",    2046 ) \
+    VALUE_ENTRY(t40msmax,    "us",    2047 ) \
+    VALUE_ENTRY(t40msmiss,   "",      2048 ) \
+    VALUE_ENTRY(t100msavg,   "us",    2049 ) \
+    VALUE_ENTRY(t100msmax,   "us",    2050 ) \
+    VALUE_ENTRY(t100msmiss,  "",      2051 ) \
 
-//Next value Id: 2031
+//Next value Id: 2053
 
 #define CAT_TEST     "Testing"
 #define CAT_GAUGE    "Fuel Gauge"
 #define CAT_COMM     "Communication"
 #define CAT_BMS      "Bms"
+#define CAT_BAL      "Balancing"
 #define CAT_CUR      "Current Sensing"
 #define CAT_IO       "IO settings"
 #define CAT_CHARGER  "Charger and Load Control"
 #define CANSPEEDS    "0=125k, 1=250k, 2=500k, 3=800k, 4=1M"
 #define CANPERIODS   "0=100ms, 1=10ms"
-#define OPMODES      "0=Start, 1=ResetAddr, 2=SetAddr, 3=WaitAddr, 4=WaitRdy, 5=GetVersion, 6=Run, 7=Standby, 8=SetShunt, 9=SWUpgrade, 10=TestExpired"
+#define OPMODES      "0=Start, 1=ResetAddr, 2=SetAddr, 3=WaitAddr, 4=WaitRdy, 5=GetVersion, 6=Run, 7=Standby, 8=SetShunt, 9=SWUpgrade, 10=TestExpired, 11=BitRate"
 #define MODOPS       "0=none, 1=AssignAddress, 2=StopAcq, 3=FWUpgrade"
 #define IDCMODES     "0=AdcSingle, 1=AdcDifferential, 2=IsaCan1, 3=IsaCan2"
 #define ONOFF        "0=Off, 1=On, 2=na"
 #define TESTS        "0=AllOn, 1=WifiOff, 2=CursensOff, 3=AllOff, 4=BoardOff, 5=EstSoC"
 #define RELAYMODS    "0=CellVtg, 1=CurThresh"
+#define ACQMODES     "0=Sequential, 1=Broadcast"
+#define BAUDRATES    "0=10k, 1=20k, 2=25k, 3=50k"
+#define REPLYFMTS    "0=Full, 1=Delta"
+#define SOCMODES     "0=Counting, 1=Ekf"
+#define BALMODES     "0=Threshold, 1=Predictive"
+#define UPDMODES     "0=Full, 1=Differential"
 
 enum
 {
@@ -125,10 +167,35 @@ enum Power
 
 enum States
 {
-   Start, ResetAddress, SetAddress, WaitAddress, WaitReady, GetVersion, Run, Standby, Shunt, SWUpgrade
+   Start, ResetAddress, SetAddress, WaitAddress, WaitReady, GetVersion, Run, Standby, Shunt, SWUpgrade, TestExpired, BitRate
 };
 
 enum RelayModes
 {
    CellVoltage, CurThresh
 };
+
+enum AcqModes
+{
+   AcqSequential, AcqBroadcast
+};
+
+enum ReplyFormats
+{
+   ReplyFull, ReplyDelta
+};
+
+enum SocModes
+{
+   SocCounting, SocEkf
+};
+
+enum BalanceModes
+{
+   BalThreshold, BalPredictive
+};
+
+enum UpdateModes
+{
+   UpdateFull, UpdateDifferential
+};
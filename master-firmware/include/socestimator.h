@@ -0,0 +1,74 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SOCESTIMATOR_H
+#define SOCESTIMATOR_H
+
+#include <stdint.h>
+#include "my_fp.h"
+
+/** @brief Extended Kalman filter for state of charge and capacity
+ *
+ * The cell is modelled as open circuit voltage from the voltage to SoC table
+ * in series with R0 and one RC element (R1, tau). The state is SoC, the
+ * voltage across the RC element and the ratio of nominal to actual capacity.
+ * Current predicts the state, the average cell voltage corrects it whenever a
+ * new one is available, so the estimate follows the counted charge while
+ * driving and converges to the open circuit voltage without waiting for
+ * the pack to rest.
+ *
+ * State and covariance are Q30 fixed point (1 << 30 is 100%, 1 V or a
+ * ratio of 1) with 64 bit intermediates. Current samples are summed every
+ * millisecond, a filter step runs every stepMs and takes three 64 bit
+ * divisions, so it fits into the 1 ms current measurement task.
+ */
+class SocEstimator
+{
+   public:
+      static void SetModel(s32fp capacity, s32fp r0, s32fp r1, s32fp tau);
+      static void Reset(s32fp soc);
+      static void SetVoltage(int cellVoltage);
+      static void AddSample(s32fp current);
+      static void Step(int32_t currentSum);
+      static s32fp GetSoc();
+      static s32fp GetCapacity();
+
+      /** Current samples per filter step, one per millisecond */
+      static const int stepMs = 100;
+
+   private:
+      static int32_t MulQ30(int32_t a, int32_t b) { return ((int64_t)a * b) >> 30; }
+      static void Predict(int32_t currentSum, int32_t current);
+      static void Correct(int32_t current);
+
+      static s32fp nominalCapacity;
+      static s32fp r0;
+      static int64_t chargeScale;
+      static int32_t decay;
+      static int64_t rcGain;
+      static int32_t soc;
+      static int32_t rcVoltage;
+      static int32_t capacityRatio;
+      static int32_t p00, p01, p02, p11, p12, p22;
+      static int32_t sampleSum;
+      static int samples;
+      static volatile int measuredVoltage;
+      static volatile bool haveVoltage;
+};
+
+#endif // SOCESTIMATOR_H
@@ -0,0 +1,95 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TASKPROFILER_H
+#define TASKPROFILER_H
+
+#include <stdint.h>
+#include <libopencm3/cm3/dwt.h>
+
+#ifndef TASK_PROFILING
+#define TASK_PROFILING 1
+#endif
+
+/** @brief Execution time of every scheduler task from the DWT cycle counter
+ *
+ * A task is measured by adding TaskProfiler::Run<task, index> to the scheduler
+ * in its place, see ADD_PROFILED_TASK. Per task the shortest, average and
+ * longest execution since the last Reset() are kept, along with the number of
+ * runs that took longer than the task period. All tasks run from the
+ * scheduler interrupt, so only the readout from the main loop may see a task
+ * half way through updating its figures.
+ */
+class TaskProfiler
+{
+   public:
+      static void Init(uint32_t cyclesPerUs);
+      static void SetTask(int index, const char* name, int periodMs);
+      static void Reset();
+      static int GetNumTasks() { return numTasks; }
+      static const char* GetName(int index) { return tasks[index].name; }
+      static int GetPeriod(int index) { return tasks[index].periodMs; }
+      static uint32_t GetMin(int index);
+      static uint32_t GetAvg(int index);
+      static uint32_t GetMax(int index);
+      static uint32_t GetRuns(int index) { return tasks[index].runs; }
+      static uint32_t GetMisses(int index) { return tasks[index].misses; }
+
+      template <void (*task)(void), int index>
+      static void Run()
+      {
+         uint32_t start = dwt_read_cycle_counter();
+         task();
+         Record(index, dwt_read_cycle_counter() - start);
+      }
+
+      static const int MaxTasks = 8;
+
+   private:
+      struct Task
+      {
+         const char* name;
+         int periodMs;
+         uint32_t periodCycles;
+         uint32_t minCycles;
+         uint32_t maxCycles;
+         uint64_t totalCycles;
+         uint32_t runs;
+         uint32_t misses;
+      };
+
+      static void Record(int index, uint32_t cycles);
+
+      static Task tasks[MaxTasks];
+      static int numTasks;
+      static uint32_t cyclesPerUs;
+      static volatile uint32_t resetRequests;
+};
+
+/** Add a task to the scheduler. With TASK_PROFILING it is measured in slot
+ * index of TaskProfiler, otherwise it is added as is */
+#if TASK_PROFILING
+#define ADD_PROFILED_TASK(scheduler, task, periodMs, index) \
+   (scheduler).AddTask(TaskProfiler::Run<task, index>, periodMs); \
+   TaskProfiler::SetTask(index, #task, periodMs)
+#else
+#define ADD_PROFILED_TASK(scheduler, task, periodMs, index) \
+   (scheduler).AddTask(task, periodMs)
+#endif
+
+#endif // TASKPROFILER_H
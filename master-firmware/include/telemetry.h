@@ -0,0 +1,83 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdint.h>
+
+class CobsFrame;
+
+/** Frame types, see struct TelemetryHeader */
+#define TELEMETRY_LAYOUT  'L'
+#define TELEMETRY_DATA    'D'
+/** Maximum number of parameters and values per data frame */
+#define TELEMETRY_MAX_PARAMS 10
+/** A layout frame precedes every this many data frames so a late receiver can sync */
+#define TELEMETRY_LAYOUT_INTERVAL 32
+/** Fractional bits of parameter values, same as s32fp */
+#define TELEMETRY_FRAC_BITS 5
+
+/** Every frame is encoded with CobsFrame, all fields are little endian.
+ * A layout frame is followed by the names of the selected parameters, each
+ * terminated by a zero byte. A data frame is followed by
+ * - int32_t value[numParams], fixed point with TELEMETRY_FRAC_BITS
+ * - uint16_t voltage[numModules * voltagesPerModule] in mV
+ * - int8_t temperature[numModules] in °C
+ */
+struct TelemetryHeader
+{
+   uint8_t type;
+   uint8_t numParams;
+   uint8_t numModules;
+   uint8_t voltagesPerModule;
+   uint16_t sequence; /**< Counts data frames, a layout frame carries the number of the next data frame */
+} __attribute__((packed));
+
+/** @brief Streams selected values and all cell voltages as binary frames on the terminal UART
+ *
+ * One data frame is sent per acquisition cycle. The frame is handed to the
+ * terminal TX DMA channel and the call returns immediately. When the previous
+ * frame is still being sent the new one is dropped. Every transfer starts
+ * with a delimiter so text sent by the terminal before doesn't corrupt the
+ * first frame.
+ */
+class Telemetry
+{
+   public:
+      static void Start(const int* params, int num);
+      static void Stop();
+      static bool IsActive() { return active; }
+      static void SendCycle();
+      static uint32_t GetDroppedFrames() { return droppedFrames; }
+
+   private:
+      static void AddLayout(uint8_t* buf, int& len);
+      static void AddData(uint8_t* buf, int& len);
+      static void AddHeader(CobsFrame& frame, uint8_t type);
+
+      static const int bufSize = 832;
+      static uint8_t txBuf[bufSize];
+      static int params[TELEMETRY_MAX_PARAMS];
+      static int numParams;
+      static uint16_t sequence;
+      static bool active;
+      static uint32_t droppedFrames;
+};
+
+#endif // TELEMETRY_H
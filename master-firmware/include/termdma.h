@@ -0,0 +1,36 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef TERMDMA_H
+#define TERMDMA_H
+
+#include <stdint.h>
+
+/** @brief Shares the terminal TX DMA channel with the terminal's own output
+ *
+ * The terminal waits for the transfer complete flag before it starts a
+ * transfer and clears it. We do the same, so whoever comes second waits.
+ */
+class TermDma
+{
+   public:
+      static bool IsBusy();
+      static bool Send(const uint8_t* data, int len);
+};
+
+#endif // TERMDMA_H
@@ -0,0 +1,212 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "balanceplanner.h"
+#include "bmscalculation.h"
+#include "ocvtable.h"
+#include "my_math.h"
+
+int BalancePlanner::bleedCurrent = 100;
+int BalancePlanner::tolerance = 300;
+int BalancePlanner::maxTemperature = 60;
+int BalancePlanner::maxShunts = cellsPerModule;
+uint8_t BalancePlanner::bleedTime[maxCells];
+uint8_t BalancePlanner::shunts[maxModules];
+uint64_t BalancePlanner::pendingUpdates;
+int BalancePlanner::pendingMs;
+int BalancePlanner::plans;
+int BalancePlanner::activeShunts;
+int BalancePlanner::timeToBalance;
+
+/** @param current current through one shunt in mA */
+void BalancePlanner::SetBleedCurrent(int current)
+{
+   bleedCurrent = MAX(current, 1);
+}
+
+/** @param temperature module temperature in °C at which no shunt may be on
+ * @param shunts number of shunts a cool module may run at the same time */
+void BalancePlanner::SetThermalLimit(int temperature, int shunts)
+{
+   maxTemperature = temperature;
+   maxShunts = MAX(0, MIN(shunts, cellsPerModule));
+}
+
+/** The cells have been estimated at rest, that includes what has been bled so far */
+void BalancePlanner::Restart()
+{
+   for (int cell = 0; cell < maxCells; cell++)
+      bleedTime[cell] = 0;
+}
+
+/** Work out the shunts of all modules, called periodically while balancing is allowed
+ * @param voltages cell voltages in mV, cellsPerModule per module
+ * @param temperatures module temperatures in °C
+ * @param numModules number of modules
+ * @param elapsedMs time since the last plan */
+void BalancePlanner::Plan(const uint16_t* voltages, const int8_t* temperatures, int numModules, int elapsedMs)
+{
+   int32_t maxToFull = unknown;
+   int minutes;
+
+   numModules = MIN(numModules, maxModules);
+   pendingMs += elapsedMs;
+   minutes = pendingMs / 60000;
+   pendingMs %= 60000;
+
+   for (int cell = 0; cell < numModules * cellsPerModule; cell++)
+   {
+      int module = cell / cellsPerModule;
+
+      if (shunts[module] & (1 << (cell % cellsPerModule)))
+         bleedTime[cell] = MIN(bleedTime[cell] + minutes, bleedTimeLimit);
+
+      maxToFull = MAX(maxToFull, ChargeToFull(cell, voltages[cell], temperatures[module]));
+   }
+
+   plans++;
+
+   if (plans >= refreshPlans)
+   {
+      plans = 0;
+      pendingUpdates = ~0ULL;
+   }
+
+   activeShunts = 0;
+   timeToBalance = 0;
+
+   for (int module = 0; module < numModules; module++)
+   {
+      int32_t remaining[cellsPerModule]; //s
+      int32_t sum = 0, longest = 0;
+      int budget = GetBudget(temperatures[module]);
+      uint8_t selected = 0;
+
+      for (int i = 0; i < cellsPerModule; i++)
+      {
+         int cell = module * cellsPerModule + i;
+         int32_t toFull = ChargeToFull(cell, voltages[cell], temperatures[module]);
+         int32_t excess = toFull != unknown ? maxToFull - toFull : 0;
+         bool bleeding = (shunts[module] >> i) & 1;
+         //Beyond the limit the estimate at rest no longer accounts for all that was bled
+         bool counted = bleedTime[cell] < bleedTimeLimit || !BmsCalculation::HasCellSoc(cell);
+
+         remaining[i] = 0;
+
+         //Start beyond the tolerance, then bleed down to the emptiest cell
+         if (counted && (excess > tolerance || (bleeding && excess > 0)))
+            remaining[i] = ((int64_t)excess * 3600) / bleedCurrent;
+
+         sum += remaining[i];
+         longest = MAX(longest, remaining[i]);
+      }
+
+      for (int n = 0; n < budget; n++)
+      {
+         int best = -1;
+
+         for (int i = 0; i < cellsPerModule; i++)
+         {
+            if ((selected & (1 << i)) == 0 && remaining[i] > 0 && (best < 0 || remaining[i] > remaining[best]))
+               best = i;
+         }
+
+         if (best < 0) break;
+
+         selected |= 1 << best;
+         activeShunts++;
+      }
+
+      if (selected != shunts[module])
+      {
+         shunts[module] = selected;
+         pendingUpdates |= 1ULL << module;
+      }
+
+      timeToBalance = MAX(timeToBalance, MAX(longest, sum / MAX(budget, 1)));
+   }
+}
+
+/** Turn off all shunts, e.g. while discharging */
+void BalancePlanner::Stop(int numModules)
+{
+   numModules = MIN(numModules, maxModules);
+
+   for (int module = 0; module < numModules; module++)
+   {
+      if (shunts[module] != 0)
+      {
+         shunts[module] = 0;
+         pendingUpdates |= 1ULL << module;
+      }
+   }
+
+   activeShunts = 0;
+}
+
+/** Check whether a module needs to be sent its shunts
+ * @param module module number starting at 1
+ * @param[out] shunts bit mask of shunts to turn on
+ * @return true once after the shunts changed or are due for refresh */
+bool BalancePlanner::GetUpdate(int module, uint8_t& shunts)
+{
+   uint64_t bit = 1ULL << (module - 1);
+
+   if ((pendingUpdates & bit) == 0) return false;
+
+   pendingUpdates &= ~bit;
+   shunts = BalancePlanner::shunts[module - 1];
+   return true;
+}
+
+/** @return number of shunts a module may run at the given temperature in °C */
+int BalancePlanner::GetBudget(int temperature)
+{
+   int budget = maxShunts * (maxTemperature - temperature) / deratingSpan;
+
+   return MAX(0, MIN(budget, maxShunts));
+}
+
+/** @return charge that fills the cell in mAh or unknown */
+int32_t BalancePlanner::ChargeToFull(int cell, uint16_t voltage, int8_t temperature)
+{
+   s32fp soc;
+   int32_t bled = 0;
+
+   if (voltage >= 5000 || voltage <= 50) return unknown;
+
+   //A voltage reading already shows the bled charge, the estimate at rest doesn't
+   if (BmsCalculation::HasCellSoc(cell))
+   {
+      soc = BmsCalculation::GetCellSoc(cell);
+      bled = BledCharge(cell);
+   }
+   else
+   {
+      soc = OcvTable::GetSoc(voltage, FP_FROMINT(temperature));
+   }
+
+   //% times Ah to mAh
+   return FP_TOINT(FP_MUL(FP_FROMINT(100) - soc, BmsCalculation::GetCellCapacity(cell)) * 10) + bled;
+}
+
+/** @return charge bled since the last estimate at rest in mAh */
+int32_t BalancePlanner::BledCharge(int cell)
+{
+   return (int32_t)bleedTime[cell] * bleedCurrent / 60;
+}
@@ -17,79 +17,323 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "bmscalculation.h"
+#include "ocvtable.h"
 #include "my_math.h"
 
-uint16_t BmsCalculation::vtgToSoc[11];
+#include <libopencm3/cm3/cortex.h>
+
 s32fp BmsCalculation::_chargeIn;
 s32fp BmsCalculation::_chargeOut;
+s32fp BmsCalculation::_capacity = FP_FROMINT(100);
+int16_t BmsCalculation::cellSoc[];
+int8_t BmsCalculation::cellCapacity[];
+s32fp BmsCalculation::restCharge;
+int32_t BmsCalculation::meanCharge;
+int32_t BmsCalculation::minCharge;
+int32_t BmsCalculation::maxCharge;
 const uint16_t* BmsCalculation::_voltages;
 int BmsCalculation::_numVoltages;
+int BmsCalculation::_voltagesPerModule = 1;
 const int8_t* BmsCalculation::_temperatures;
 int BmsCalculation::_numTemperatures;
+BmsCalculation::ModuleStats BmsCalculation::modules[];
+int BmsCalculation::numModules = 0;
+int BmsCalculation::minModule = 0;
+int BmsCalculation::maxModule = 0;
+int32_t BmsCalculation::voltageSum = 0;
+int BmsCalculation::voltageCount = 0;
+int32_t BmsCalculation::temperatureSum = 0;
 
+/** Pack statistics as of the last UpdateModule() call, no need to wait for a full cycle */
 void BmsCalculation::AggregateVoltages(int& min, int& max, int& avg, s32fp& sum)
 {
-   int cnt = 0;
-   min = 5000;
-   max = 0;
-   avg = 0;
+   cm_disable_interrupts();
+   min = modules[minModule].min;
+   max = modules[maxModule].max;
+   avg = voltageCount > 0 ? voltageSum / voltageCount : 0;
+   sum = FP_FROMINT(voltageSum) / 1000;
+   cm_enable_interrupts();
+}
+
+s32fp BmsCalculation::GetTemperatureAverage()
+{
+   s32fp tmpavg;
+
+   cm_disable_interrupts();
+   tmpavg = FP_FROMINT(temperatureSum);
+   cm_enable_interrupts();
+
+   if (_numTemperatures > 0)
+      tmpavg /= _numTemperatures;
+
+   return tmpavg;
+}
+
+/** @return index of the cell with the lowest voltage, counting from 0 */
+int BmsCalculation::GetMinCell()
+{
+   cm_disable_interrupts();
+   int cell = minModule * _voltagesPerModule + modules[minModule].minCell;
+   cm_enable_interrupts();
+
+   return cell;
+}
+
+/** @return index of the cell with the highest voltage, counting from 0 */
+int BmsCalculation::GetMaxCell()
+{
+   cm_disable_interrupts();
+   int cell = maxModule * _voltagesPerModule + modules[maxModule].maxCell;
+   cm_enable_interrupts();
+
+   return cell;
+}
+
+/** Fold new values of one module into the pack statistics. Call whenever
+ * a reply has been stored, also from interrupt context.
+ * @param module module index counting from 0 */
+void BmsCalculation::UpdateModule(int module)
+{
+   if (module >= numModules) return;
+
+   const uint16_t* voltages = &_voltages[module * _voltagesPerModule];
+   ModuleStats& stats = modules[module];
+   ModuleStats old = stats;
+
+   stats.min = 5000;
+   stats.max = 0;
+   stats.sum = 0;
+   stats.count = 0;
+   stats.minCell = 0;
+   stats.maxCell = 0;
 
-   for (int i = 0; i < _numVoltages; i++)
+   for (int i = 0; i < _voltagesPerModule; i++)
    {
       //ignore implausible voltages from unused channels
-      if (_voltages[i] < 5000 && _voltages[i] > 50)
+      if (voltages[i] < 5000 && voltages[i] > 50)
       {
-         min = MIN(min, _voltages[i]);
-         max = MAX(max, _voltages[i]);
-         avg += _voltages[i];
-         cnt++;
+         if (voltages[i] < stats.min)
+         {
+            stats.min = voltages[i];
+            stats.minCell = i;
+         }
+         if (voltages[i] > stats.max)
+         {
+            stats.max = voltages[i];
+            stats.maxCell = i;
+         }
+         stats.sum += voltages[i];
+         stats.count++;
       }
    }
 
-   sum = FP_FROMINT(avg) / 1000;
-   avg /= cnt;
+   stats.temperature = module < _numTemperatures ? _temperatures[module] : 0;
+
+   voltageSum += stats.sum - old.sum;
+   voltageCount += stats.count - old.count;
+   temperatureSum += stats.temperature - old.temperature;
+
+   //Only when the extreme module moves away from the extreme we have to look at all modules
+   if (module == minModule && stats.min > old.min)
+      minModule = FindMinModule();
+   else if (stats.min < modules[minModule].min)
+      minModule = module;
+
+   if (module == maxModule && stats.max < old.max)
+      maxModule = FindMaxModule();
+   else if (stats.max > modules[maxModule].max)
+      maxModule = module;
 }
 
-s32fp BmsCalculation::GetTemperatureAverage()
+void BmsCalculation::SetVoltageSource(const uint16_t* voltages, int numVoltages, int voltagesPerModule)
+{
+   _voltages = voltages;
+   _numVoltages = numVoltages;
+   _voltagesPerModule = voltagesPerModule;
+   UpdateAll();
+
+   //Cells may have been renumbered
+   for (int i = 0; i < maxCells; i++)
+   {
+      cellSoc[i] = unknownSoc;
+      cellCapacity[i] = unknownCapacity;
+   }
+   meanCharge = minCharge = maxCharge = 0;
+}
+
+void BmsCalculation::SetTemperatureSource(const int8_t* temperatures, int numTemperatures)
+{
+   _temperatures = temperatures;
+   _numTemperatures = numTemperatures;
+   UpdateAll();
+}
+
+void BmsCalculation::UpdateAll()
 {
-   s32fp tmpavg = 0;
+   cm_disable_interrupts();
 
-   for (int i = 0; i < _numTemperatures; i++)
+   numModules = _voltages != 0 ? MIN(_numVoltages / _voltagesPerModule, maxModules) : 0;
+   minModule = 0;
+   maxModule = 0;
+   voltageSum = 0;
+   voltageCount = 0;
+   temperatureSum = 0;
+
+   for (int i = 0; i < maxModules; i++)
    {
-      tmpavg += _temperatures[i];
+      modules[i] = ModuleStats();
+      modules[i].min = 5000;
    }
 
-   tmpavg = FP_FROMINT(tmpavg);
-   tmpavg /= _numTemperatures;
+   for (int i = 0; i < numModules; i++)
+      UpdateModule(i);
 
-   return tmpavg;
+   cm_enable_interrupts();
 }
 
-void BmsCalculation::SetVoltageToSoCTable(const uint16_t* table)
+int BmsCalculation::FindMinModule()
 {
-   for (uint32_t i = 0; i < sizeof(vtgToSoc) / sizeof(vtgToSoc[0]); i++)
+   int min = 0;
+
+   for (int i = 1; i < numModules; i++)
    {
-      vtgToSoc[i] = table[i];
+      if (modules[i].min < modules[min].min)
+         min = i;
    }
+   return min;
 }
 
+int BmsCalculation::FindMaxModule()
+{
+   int max = 0;
+
+   for (int i = 1; i < numModules; i++)
+   {
+      if (modules[i].max > modules[max].max)
+         max = i;
+   }
+   return max;
+}
+
+/** SoC of a rested cell at the average temperature
+ * @param vtg cell voltage in mV
+ * @return SoC in % */
 int BmsCalculation::EstimateSocFromVoltage(uint16_t vtg)
 {
-   int soc = 100;
-   for (uint32_t i = 0; i < sizeof(vtgToSoc) / sizeof(vtgToSoc[0]); i++)
+   return FP_TOINT(OcvTable::GetSoc(vtg, GetTemperatureAverage()));
+}
+
+/** Open circuit voltage at the average temperature
+ * @param soc state of charge, 1 << 30 is 100%
+ * @param[out] slope change of the open circuit voltage in uV per 100% at soc
+ * @return open circuit voltage in uV */
+int32_t BmsCalculation::GetOpenCircuitVoltage(int32_t soc, int32_t& slope)
+{
+   return OcvTable::GetVoltage(soc, GetTemperatureAverage(), slope);
+}
+
+/** Estimate the SoC of every cell from its open circuit voltage at its module
+ * temperature. Call when the pack has been resting. Since all cells carry the
+ * same current the estimates are moved along with the charge counted since.
+ * If the counted charge since the previous rest changed a cell's SoC by more
+ * than 50%, that cell's capacity is updated */
+void BmsCalculation::EstimateCellSocs()
+{
+   s32fp netCharge = _chargeIn - _chargeOut;
+   //Counted Ah in 0.1 Ah
+   int32_t deltaCharge = (netCharge - restCharge) / (360 << CST_DIGITS);
+   int numCells = MIN(_numVoltages, maxCells);
+   int64_t sum = 0;
+   int count = 0;
+
+   minCharge = INT32_MAX;
+   maxCharge = INT32_MIN;
+
+   for (int cell = 0; cell < numCells; cell++)
    {
-      if (vtg <= vtgToSoc[i])
+      uint16_t vtg = _voltages[cell];
+      int module = cell / _voltagesPerModule;
+      s32fp temperature = module < _numTemperatures ? FP_FROMINT(_temperatures[module]) : GetTemperatureAverage();
+
+      if (vtg >= 5000 || vtg <= 50)
       {
-         if (i == 0)
-         {
-            soc = 0;
-            break;
-         }
-         soc = (i - 1) * 10;
-         soc += (10 * (vtg - vtgToSoc[i - 1])) / (vtgToSoc[i] - vtgToSoc[i - 1]);
-         break;
+         cellSoc[cell] = unknownSoc;
+         continue;
       }
+
+      int soc = (OcvTable::GetSoc(vtg, temperature) * 100) >> CST_DIGITS;
+
+      if (cellSoc[cell] != unknownSoc && ABS(soc - cellSoc[cell]) > 5000)
+      {
+         int capacity = deltaCharge * 10000 / (soc - cellSoc[cell]);
+         int nominal = FP_TOINT(_capacity * 10);
+         //In 1/256 of nominal, rounded
+         int deviation = ((capacity - nominal) * 512 / nominal + (capacity > nominal ? 1 : -1)) / 2;
+
+         //Drop implausible results, e.g. when the cell was balanced meanwhile
+         if (deviation > unknownCapacity && deviation <= INT8_MAX)
+            cellCapacity[cell] = deviation;
+      }
+
+      cellSoc[cell] = soc;
+
+      int32_t charge = CellCharge(cell);
+      sum += charge;
+      count++;
+      minCharge = MIN(minCharge, charge);
+      maxCharge = MAX(maxCharge, charge);
    }
-   return soc;
+
+   meanCharge = count > 0 ? sum / count : 0;
+   restCharge = netCharge;
+
+   if (count == 0)
+      minCharge = maxCharge = 0;
+}
+
+/** The charge counters start over from 0, cell estimates stay where they are */
+void BmsCalculation::RestartCharge()
+{
+   restCharge -= _chargeIn - _chargeOut;
+   _chargeIn = 0;
+   _chargeOut = 0;
 }
 
+/** @return SoC of a cell in %, see HasCellSoc() */
+s32fp BmsCalculation::GetCellSoc(int cell)
+{
+   s32fp soc = FP_FROMINT(cellSoc[cell]) / 100;
+   s32fp counted = _chargeIn - _chargeOut - restCharge;
+
+   //As to % of the cell capacity
+   soc += FP_DIV(counted / 36, GetCellCapacity(cell));
+
+   return MAX(0, MIN(soc, FP_FROMINT(100)));
+}
+
+/** @return charge of a cell relative to the mean of all cells in mAh, positive
+ * if the cell is ahead. It only changes at rest, all cells see the same current */
+int32_t BmsCalculation::GetCellOffset(int cell)
+{
+   return CellCharge(cell) - meanCharge;
+}
+
+/** @return estimated capacity of a cell in Ah, the nominal capacity until estimated */
+s32fp BmsCalculation::GetCellCapacity(int cell)
+{
+   if (cell < maxCells && cellCapacity[cell] != unknownCapacity)
+      return _capacity + (_capacity * cellCapacity[cell]) / 256;
+   return _capacity;
+}
+
+/** @return charge difference between the fullest and the emptiest cell in mAh */
+int32_t BmsCalculation::GetImbalance()
+{
+   return maxCharge - minCharge;
+}
+
+/** @return charge of a cell at the last rest in mAh */
+int32_t BmsCalculation::CellCharge(int cell)
+{
+   return ((int64_t)cellSoc[cell] * GetCellCapacity(cell) / 10) >> CST_DIGITS;
+}
@@ -17,22 +17,70 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <libopencm3/cm3/cortex.h>
 #include "bmscomm.h"
 #include "bms_shared.h"
 #include "onewire.h"
 #include "hamming.h"
+#include "crc16.h"
 #include "params.h"
+#include "bmscalculation.h"
+#include "cellstatistics.h"
+#include "my_math.h"
+#include "imagestore.h"
 
-#define poly 0x1021
 #define NUM_DATA_BYTES (NUM_DATA_BITS / 8)
 #define NUM_CMD_BYTES  (NUM_CMD_BITS / 8)
 #define NUM_PARAM_BYTES  (NUM_PARAM_BITS / 8)
+#define TRIAL_CYCLES     2 //Full pack cycles without any error to accept a bit rate
 
 uint16_t BmsComm::voltages[];
 int8_t BmsComm::temperatures[];
 struct version BmsComm::versions[];
+volatile uint16_t BmsComm::moduleChanges[];
+volatile uint64_t BmsComm::receivedModules = 0;
+uint16_t BmsComm::changeSequence = 1;
 int BmsComm::numModules = -1;
 PageBuf BmsComm::pageBuf;
+volatile int BmsComm::pipelineModule = 0;
+volatile uint32_t BmsComm::pipelineRequests = 0;
+volatile uint32_t BmsComm::completedCycles = 0;
+volatile bool BmsComm::pipelineOk = true;
+volatile bool BmsComm::lastCycleOk = true;
+uint32_t BmsComm::checkedRequests = 0;
+uint16_t BmsComm::errorCounts[];
+int BmsComm::divider = BAUD_DIVIDER_DEFAULT;
+int BmsComm::pendingDivider = BAUD_DIVIDER_DEFAULT;
+bool BmsComm::compactReplies = false;
+volatile bool BmsComm::synced[];
+//10k, 20k, 25k and 50k, all of them divide the bit clock of the modules
+const uint8_t BmsComm::dividers[] = { BAUD_DIVIDER_DEFAULT, 25, 20, BAUD_DIVIDER_MIN };
+BmsComm::NegotiationSteps BmsComm::negotiationStep = BmsComm::Propose;
+int BmsComm::negotiationRate = 0;
+int BmsComm::negotiationTimeout = 0;
+uint32_t BmsComm::negotiationCycles = 0;
+BmsComm::UpdateSteps BmsComm::updateStep = BmsComm::UpdateIdle;
+uint8_t BmsComm::resendPages[];
+uint8_t BmsComm::missingPages[];
+uint64_t BmsComm::pendingModules = 0;
+int BmsComm::updatePage = 0;
+int BmsComm::updateRound = 0;
+int BmsComm::queryFirst = 1;
+int BmsComm::updateTimeout = 0;
+bool BmsComm::updateLineIdle = false;
+bool BmsComm::queryRepeated = false;
+uint64_t BmsComm::passModules = 0;
+uint64_t BmsComm::updaterModules = 0;
+uint64_t BmsComm::bitmapModules = 0;
+uint64_t BmsComm::bootableModules = 0;
+int BmsComm::updateImage = -1;
+int BmsComm::bootModule = 0;
+int BmsComm::queryLast = 1;
+bool BmsComm::updateDifferential = false;
+bool BmsComm::updateBooted = false;
+bool BmsComm::updateSequential = false;
+int BmsComm::updateRetries = 0;
+int BmsComm::corruptedPages = 0;
 
 void BmsComm::SetAddress()
 {
@@ -46,6 +94,7 @@ void BmsComm::ResetAddress()
    struct cmd cmd = { 0xaa, OP_ADDRMODE, 0 };
 
    numModules = -1;
+   Resynchronize();
    SendEncodedCmd(&cmd);
 }
 
@@ -54,10 +103,13 @@ int BmsComm::GetNumberOfCellModules()
    if (numModules < 0)
    {
       struct cmd cmd;
-      uint16_t encodedCmd;
-      int numbytes = OneWire::GetReceivedData((uint8_t*)&encodedCmd, sizeof(encodedCmd));
+      uint8_t data[sizeof(uint16_t)];
+      int length = OneWire::GetLastFrameLength();
 
-      if (numbytes != sizeof(encodedCmd)) return -1;
+      //the command of the last module is at the end of the frame
+      if (OneWire::ReadLastFrame(length - sizeof(data), data, sizeof(data)) < (int)sizeof(data)) return -1;
+
+      uint16_t encodedCmd = data[0] | (data[1] << 8);
 
       if (hamming_decode(encodedCmd, (uint16_t*)&cmd) == DEC_RES_OK)
       {
@@ -69,35 +121,224 @@ int BmsComm::GetNumberOfCellModules()
    return numModules;
 }
 
+/** Request data from one module. Unless we hold the values of its previous
+ * reply the request carries an argument that asks for a full reply */
 void BmsComm::StartAcquisition(int slave)
 {
-   struct cmd cmd = { (uint8_t)slave, OP_GETDATA, 0 };
+   struct cmd cmd = { (uint8_t)slave, OP_GETDATA, (uint16_t)(compactReplies ? DATA_COMPACT : 0) };
 
-   SendEncodedCmd(&cmd);
+   if (synced[slave - 1])
+   {
+      SendEncodedCmd(&cmd);
+   }
+   else
+   {
+      uint16_t encodedCmd[2] = { hamming_encode(*((uint16_t*)&cmd)), hamming_encode(cmd.arg) };
+      OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(encodedCmd));
+   }
 }
 
 bool BmsComm::Acquire(int slave)
 {
+   int length = OneWire::GetLastFrameLength();
+   bool plainRequest = synced[slave - 1];
    struct BatValues batValues;
-   int numbytes = OneWire::GetReceivedData((uint8_t*)&batValues, sizeof(batValues));
-   int offset = 4 * (slave - 1);
 
-   if (numbytes != sizeof(batValues)) return false;
+   //Compact replies are only sent to plain requests, i.e. when we are in sync
+   if (plainRequest && length >= (int)sizeof(struct BatDeltas))
+   {
+      struct BatDeltas batDeltas;
 
-   int crc = Crc16XModem((uint8_t*)&batValues, sizeof(batValues) - sizeof(uint16_t));
+      OneWire::ReadLastFrame(length - sizeof(batDeltas), &batDeltas, sizeof(batDeltas));
 
-   if (crc != batValues.crc) return false;
+      if (batDeltas.adr == (slave | DELTA_ADDR_FLAG) &&
+          Crc16::Calculate((uint8_t*)&batDeltas, sizeof(batDeltas) - sizeof(uint16_t)) == batDeltas.crc)
+      {
+         StoreDeltas(slave, &batDeltas);
+         return true;
+      }
+   }
 
-   for (int i = 0; i < voltagesPerModule; i++)
+   //From here on the module's idea of our values is unknown until the next full reply
+   synced[slave - 1] = false;
+
+   if (length < (int)sizeof(struct BatValues))
+   {
+      errorCounts[slave - 1]++;
+      return false;
+   }
+
+   //The reply is at the end of the frame
+   OneWire::ReadLastFrame(length - sizeof(batValues), &batValues, sizeof(batValues));
+   int crc = Crc16::Calculate((uint8_t*)&batValues, sizeof(batValues) - sizeof(uint16_t));
+
+   if (crc != batValues.crc)
    {
-      voltages[i + offset] = batValues.values[i];
+      errorCounts[slave - 1]++;
+      return false;
    }
 
-   temperatures[slave - 1] = (int8_t)(batValues.values[4] & 0xFF);
+   StoreValues(slave, &batValues);
+   //A full reply to a plain request may be a keyframe, but the module may
+   //also have been reset or missed DATA_COMPACT. The next request carries
+   //the argument again, that costs one more full reply at worst
+   synced[slave - 1] = !(compactReplies && plainRequest);
 
    return true;
 }
 
+/** Poll all modules one after another without waiting for the scheduler.
+ * The next request is sent from the idle line interrupt as soon as the
+ * previous reply is complete. Runs until StopPipelinedAcquisition() is called
+ */
+void BmsComm::StartPipelinedAcquisition()
+{
+   OneWire::SetFrameReceivedCallback(PipelineFrameReceived);
+   pipelineOk = true;
+   checkedRequests = pipelineRequests;
+   pipelineModule = 1;
+   StartAcquisition(1);
+}
+
+/** Stop pipelined acquisition
+ * @return true if it was running. A reply may still be on its way then
+ */
+bool BmsComm::StopPipelinedAcquisition()
+{
+   bool running = pipelineModule != 0;
+
+   pipelineModule = 0;
+
+   return running;
+}
+
+/** Skip a module that didn't reply since the last call.
+ * Call periodically with a period longer than one request/reply round trip
+ */
+void BmsComm::CheckPipeline()
+{
+   cm_disable_interrupts();
+
+   if (pipelineModule != 0 && pipelineRequests == checkedRequests)
+   {
+      errorCounts[pipelineModule - 1]++;
+      NextPipelineModule(false);
+   }
+
+   checkedRequests = pipelineRequests;
+
+   cm_enable_interrupts();
+}
+
+/** Update the cell statistics and pack calculation with the values of the
+ * modules that replied since the last call. Replies are stored from the idle
+ * line interrupt, this does the rest from the task. A module that replied
+ * more than once in between contributes its latest values only
+ */
+void BmsComm::ProcessReceived()
+{
+   uint64_t pending = receivedModules;
+
+   for (int slave = 1; slave <= numModules && pending != 0; slave++)
+   {
+      uint64_t bit = 1ULL << (slave - 1);
+      int offset = voltagesPerModule * (slave - 1);
+      uint16_t values[voltagesPerModule];
+
+      if ((pending & bit) == 0) continue;
+
+      pending &= ~bit;
+
+      //The next reply of this module must not change its values half way
+      cm_disable_interrupts();
+      receivedModules &= ~bit;
+      for (int i = 0; i < voltagesPerModule; i++)
+         values[i] = voltages[i + offset];
+      BmsCalculation::UpdateModule(slave - 1);
+      cm_enable_interrupts();
+
+      for (int i = 0; i < voltagesPerModule; i++)
+         CellStatistics::Update(i + offset, values[i]);
+   }
+}
+
+/** @param[out] allReplied true if all modules replied in the last completed cycle
+ * @return number of full pack cycles completed since start-up */
+uint32_t BmsComm::GetCompletedCycles(bool& allReplied)
+{
+   cm_disable_interrupts();
+   uint32_t cycles = completedCycles;
+   allReplied = lastCycleOk;
+   cm_enable_interrupts();
+
+   return cycles;
+}
+
+/** Request data from all modules at once. They reply one after another in address order */
+void BmsComm::StartBroadcastAcquisition()
+{
+   struct cmd cmd = { 0xAA, OP_GETALL, 0 };
+
+   SendEncodedCmd(&cmd);
+}
+
+bool BmsComm::IsBroadcastComplete()
+{
+   return OneWire::IsReceiving() && OneWire::GetNumBytesReceived() >= numModules * (int)sizeof(struct BatValues);
+}
+
+/** Parse all replies to StartBroadcastAcquisition()
+ * @return number of modules that replied with a valid frame
+ */
+int BmsComm::AcquireAll()
+{
+   uint64_t replied = 0;
+   int received = 0;
+
+   if (!OneWire::IsReceiving()) return 0;
+
+   //Replies are expected back to back, so usually there is only one frame.
+   //A missing module leaves a gap which may split it up
+   for (int frame = 0; frame < OneWire::GetNumFrames(); frame++)
+   {
+      int numBytes = OneWire::GetFrameLength(frame);
+
+      //We still look for valid replies at every position so a garbled
+      //reply only costs the module that sent it
+      for (int pos = 0; pos + (int)sizeof(struct BatValues) <= numBytes;)
+      {
+         struct BatValues batValues;
+
+         OneWire::ReadFrame(frame, pos, &batValues, sizeof(batValues));
+
+         if (batValues.adr > 0 && batValues.adr <= numModules &&
+             Crc16::Calculate((uint8_t*)&batValues, sizeof(batValues) - sizeof(uint16_t)) == batValues.crc)
+         {
+            StoreValues(batValues.adr, &batValues);
+            synced[batValues.adr - 1] = true;
+            replied |= 1ULL << (batValues.adr - 1);
+            received++;
+            pos += sizeof(struct BatValues);
+         }
+         else
+         {
+            pos++;
+         }
+      }
+   }
+
+   for (int slave = 1; slave <= numModules; slave++)
+   {
+      if ((replied & (1ULL << (slave - 1))) == 0)
+      {
+         errorCounts[slave - 1]++;
+         synced[slave - 1] = false;
+      }
+   }
+
+   return received;
+}
+
 void BmsComm::StartVersionAcquisition(int slave)
 {
    struct cmd cmd = { (uint8_t)slave, OP_VERSION, 0 };
@@ -107,41 +348,186 @@ void BmsComm::StartVersionAcquisition(int slave)
 
 bool BmsComm::AcquireVersion(int slave)
 {
+   int length = OneWire::GetLastFrameLength();
    struct versionComm version;
-   int numbytes = OneWire::GetReceivedData((uint8_t*)&version, sizeof(version));
 
-   if (numbytes != sizeof(version)) return false;
+   if (length < (int)sizeof(version)) return false;
 
-   int crc = Crc16XModem((uint8_t*)&version, sizeof(version) - sizeof(uint16_t));
+   OneWire::ReadLastFrame(length - sizeof(version), &version, sizeof(version));
+   int crc = Crc16::Calculate((uint8_t*)&version, sizeof(version) - sizeof(uint16_t));
 
    if (crc != version.crc) return false;
 
    versions[slave - 1] = version.version;
+   MarkChanged(slave);
 
    return true;
 }
 
+/** Turn on the shunts of all cells of a module above a threshold
+ * @param slave module address
+ * @param vtg threshold in mV */
 void BmsComm::SetShunt(int slave, int vtg)
 {
-   struct cmd cmd;
-   uint16_t encodedCmd[2];
    int offset = 4 * (slave - 1);
-
-   cmd.op = OP_SHUNTON;
-   cmd.addr = slave;
-   cmd.arg = 0;
+   uint8_t shunts = 0;
 
    for (int i = 0; i < voltagesPerModule; i++)
    {
-      cmd.arg |= (voltages[i + offset] > vtg && voltages[i + offset] < 5000) << i;
+      shunts |= (voltages[i + offset] > vtg && voltages[i + offset] < 5000) << i;
    }
 
+   SetShunts(slave, shunts);
+}
+
+/** Turn on the shunts of a module, all others off
+ * @param slave module address
+ * @param shunts bit mask, bit 0 is the first cell */
+void BmsComm::SetShunts(int slave, uint8_t shunts)
+{
+   struct cmd cmd;
+   uint16_t encodedCmd[2];
+
+   cmd.op = OP_SHUNTON;
+   cmd.addr = slave;
+   cmd.arg = shunts;
+
    encodedCmd[0] = hamming_encode(*((uint16_t*)&cmd));
    encodedCmd[1] = hamming_encode(cmd.arg);
 
    OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(encodedCmd));
 }
 
+/** Change the bit rate of all modules. The master follows with ApplyBitRate()
+ * once the command is out, i.e. on the next task tick.
+ * @param divider Bit time in periods of CMU_BIT_CLOCK
+ * @param confirm false to put the rate on trial, modules return to the
+ *                power-on rate unless it is sent again with confirm=true */
+void BmsComm::SetBitRate(int divider, bool confirm)
+{
+   struct cmd cmd = { 0xAA, OP_BREAK, (uint16_t)(divider | (confirm ? BAUD_CONFIRM : 0)) };
+   uint16_t encodedCmd[2] = { hamming_encode(*((uint16_t*)&cmd)), hamming_encode(cmd.arg) };
+
+   pendingDivider = divider;
+   OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(encodedCmd));
+}
+
+void BmsComm::ApplyBitRate()
+{
+   divider = pendingDivider;
+   OneWire::SetBaudrate(CMU_BIT_CLOCK / divider);
+}
+
+/** Bring all modules and the master back to the power-on rate.
+ * @return true while a command is on its way, call again on the next tick */
+bool BmsComm::ResetBitRate()
+{
+   if (divider == BAUD_DIVIDER_DEFAULT) return false;
+
+   if (pendingDivider != BAUD_DIVIDER_DEFAULT)
+   {
+      SetBitRate(BAUD_DIVIDER_DEFAULT, false);
+      return true;
+   }
+
+   ApplyBitRate();
+   return false;
+}
+
+/** Find the highest bit rate all modules sustain. Rates are tried from maxRate
+ * downwards, each one by pipelined polling of the whole pack. The first rate
+ * without a single error is confirmed. Call once per task tick after the
+ * modules have been addressed, with the bus otherwise idle.
+ * @param maxRate index of the highest rate to try, 0..NumBitRates-1
+ * @return true when done, the master and all modules then use the same rate */
+bool BmsComm::NegotiateBitRate(int maxRate)
+{
+   bool allReplied;
+   uint32_t cycles = GetCompletedCycles(allReplied);
+   bool errors = false;
+
+   switch (negotiationStep)
+   {
+   case Propose:
+      negotiationRate = maxRate < NumBitRates ? maxRate : NumBitRates - 1;
+
+      if (negotiationRate <= 0)
+         return true;
+
+      SetBitRate(dividers[negotiationRate], false);
+      negotiationStep = Try;
+      break;
+   case Try:
+      ApplyBitRate();
+      ClearErrorCounts();
+      StartPipelinedAcquisition();
+      negotiationCycles = cycles;
+      negotiationTimeout = numModules / 2 + 10;
+      negotiationStep = Evaluate;
+      break;
+   case Evaluate:
+      CheckPipeline();
+
+      for (int slave = 1; slave <= numModules; slave++)
+         errors |= errorCounts[slave - 1] > 0;
+
+      negotiationTimeout--;
+
+      if (errors || negotiationTimeout <= 0)
+         negotiationStep = Fallback;
+      else if ((cycles - negotiationCycles) >= TRIAL_CYCLES)
+         negotiationStep = Confirm;
+      else
+         break;
+
+      //Let the current request finish before anything else goes on the bus
+      StopPipelinedAcquisition();
+      break;
+   case Confirm:
+      SetBitRate(dividers[negotiationRate], true);
+      negotiationStep = Propose;
+      return true;
+   case Fallback:
+      //Modules that already gave up are back at the power-on rate anyway
+      SetBitRate(BAUD_DIVIDER_DEFAULT, false);
+      negotiationStep = Retry;
+      break;
+   case Retry:
+      ApplyBitRate();
+      negotiationRate--;
+
+      if (negotiationRate <= 0)
+      {
+         negotiationStep = Propose;
+         return true;
+      }
+
+      SetBitRate(dividers[negotiationRate], false);
+      negotiationStep = Try;
+      break;
+   }
+
+   return false;
+}
+
+void BmsComm::ClearErrorCounts()
+{
+   for (int i = 0; i < MaxModules; i++)
+      errorCounts[i] = 0;
+}
+
+/** Let modules reply with differences to their previous reply. Takes effect
+ * with the next request to each module. Modules that don't support it keep
+ * sending full replies */
+void BmsComm::SetCompactReplies(bool enable)
+{
+   if (enable != compactReplies)
+   {
+      compactReplies = enable;
+      Resynchronize();
+   }
+}
+
 const uint16_t* BmsComm::GetVoltages()
 {
    return voltages;
@@ -157,68 +543,704 @@ const struct version* BmsComm::GetVersions()
    return versions;
 }
 
-void BmsComm::StartUpdate()
+/** Update every module whose hardware has an image in the store and that
+ * doesn't run its software yet. Call RunUpdate() every 10 ms until
+ * IsUpdating() returns false. It first asks every module which updater
+ * it runs, modules that don't know the question run a legacy updater.
+ * @param differential only send the pages that differ from the flash content
+ * of any module. Otherwise the whole image is sent in the first round */
+void BmsComm::StartUpdate(bool differential)
 {
-   struct cmd cmd = { 0xAA, OP_BOOT, 0x1234 };
+   for (int i = 0; i < MaxModules; i++)
+      missingPages[i] = UpdateNoImage;
 
-   uint16_t encodedCmd[2] = { hamming_encode(*((uint16_t*)&cmd)), cmd.arg };
-   pageBuf.pageNum = 0;
-   OneWire::SendData((uint8_t*)&encodedCmd, sizeof(encodedCmd));
+   for (int i = 0; i < numModules; i++)
+   {
+      int index = ImageStore::Find(versions[i]);
+
+      if (index >= 0 && ImageStore::IsCurrent(index, versions[i]))
+         missingPages[i] = UpdateCurrent;
+   }
+
+   updateDifferential = differential;
+   updaterModules = 0;
+   bitmapModules = 0;
+   bootableModules = 0;
+   updateBooted = false;
+   updateSequential = false;
+   updateImage = -1;
+   updateLineIdle = false;
+   bootModule = 0;
+   updateTimeout = 0;
+   updateStep = UpdateProbe;
+}
+
+/** Every image is a pass of its own: put the modules that need it into their
+ * updater, stream the image and collect a bitmap of written pages from every
+ * module. Pages missing anywhere are sent again to all modules, at most
+ * MaxUpdateRounds times. A differential update starts with sending the page
+ * crcs of the image and collecting the bitmaps of matching pages. Modules of
+ * earlier passes stay in the updater until the last pass is done, so they
+ * keep forwarding frames. A frame only goes out once the line has been idle
+ * since the previous call, so the modules have at least 10 ms to write the
+ * last page.
+ * A pass with legacy updaters is sequential: its pages go out in order and
+ * a page is sent again right away when a legacy updater reports it corrupted.
+ * Only the modules with bitmap updaters are queried. The last page is held
+ * back until the very end, legacy updaters exit with it.
+ */
+void BmsComm::RunUpdate()
+{
+   bool wasIdle = updateLineIdle;
+
+   updateLineIdle = OneWire::IsReceiving();
+
+   if (!wasIdle || !updateLineIdle) return;
+
+   switch (updateStep)
+   {
+      case UpdateProbe:
+         //Wait a few calls for the reply of the module asked last
+         if (bootModule > 0 && !ParseUpdaterVersion(bootModule))
+         {
+            updateTimeout--;
+            if (updateTimeout > 0) return;
+         }
+
+         while (bootModule < numModules && missingPages[bootModule] == UpdateCurrent)
+            bootModule++;
+
+         if (bootModule < numModules)
+         {
+            SendProbeCommand(bootModule + 1);
+            bootModule++;
+            updateTimeout = 3;
+            return;
+         }
+
+         NextImage();
+         return;
+      case UpdateBoot:
+         if (bootModule < 0)
+         {
+            bootModule = 0;
+
+            //All modules take part, that also reaches modules without address
+            if (numModules <= 0 || passModules == (1ULL << numModules) - 1)
+            {
+               SendBootCommand(0xAA);
+               bootModule = numModules + 1;
+               return;
+            }
+         }
+
+         while (bootModule < numModules && (passModules & (1ULL << bootModule)) == 0)
+            bootModule++;
+
+         if (bootModule < numModules)
+         {
+            SendBootCommand(bootModule + 1);
+            bootModule++;
+            return;
+         }
+
+         //Bitmap updaters still in the updater from an earlier image or update
+         //must not take this one. Legacy updaters don't know the selection
+         if (bootModule == numModules && ((updaterModules | passModules) & bitmapModules) != 0)
+         {
+            SendSelectCommand();
+            bootModule++;
+            return;
+         }
+
+         updateBooted = true;
+         //Legacy updaters can't be asked for their bitmap
+         updaterModules |= passModules & bitmapModules;
+         updateStep = updateDifferential && !updateSequential ? UpdateCompare : UpdateStream;
+         return;
+      case UpdateCompare:
+         //Modules checksum up to PAGE_WORDS pages of flash per frame, that takes
+         //about 12 ms. Give them another call
+         if (updateTimeout > 0)
+         {
+            updateTimeout--;
+            return;
+         }
+
+         if (updatePage < COMPARE_FRAMES)
+         {
+            SendPageCrcs(updatePage);
+            updatePage++;
+            updateTimeout = 1;
+         }
+         else
+         {
+            updatePage = 0;
+            StartQuery(NextPendingModule(1));
+         }
+         return;
+      case UpdateStream:
+      {
+         //The last page ends a sequential pass
+         int numPages = updateSequential ? ATTINY_MAX_APPLICATION_PAGES - 1 : ATTINY_MAX_APPLICATION_PAGES;
+
+         if (updateSequential && updatePage > 0 && IsPageCorrupted())
+         {
+            if (updateRetries < MaxPageRetries)
+            {
+               updateRetries++;
+               ResendPage();
+               return;
+            }
+            corruptedPages++;
+         }
+
+         updateRetries = 0;
+
+         while (updatePage < numPages && (resendPages[updatePage / 8] & (1 << (updatePage % 8))) == 0)
+            updatePage++;
+
+         if (updatePage < numPages)
+         {
+            SendPage(updatePage);
+            updatePage++;
+         }
+         else
+         {
+            for (int i = 0; i < PAGE_MAP_BYTES; i++)
+               resendPages[i] = 0;
+
+            //Modules without address can't be asked, they only get the pages once
+            if (pendingModules != 0)
+               StartQuery(NextPendingModule(1));
+            else
+               NextImage();
+         }
+         return;
+      }
+      case UpdateQuery:
+      {
+         int expected = (queryLast - queryFirst + 1) * sizeof(struct PageMap);
+
+         updateTimeout--;
+         if (OneWire::GetNumBytesReceived() < expected && updateTimeout > 0) return;
+
+         int last = ParsePageMaps();
+
+         //Modules behind a silent one wait for its reply. It may just have
+         //missed the query so ask once more, then carry on behind it
+         if (last < queryLast && updateTimeout <= 0)
+         {
+            int silent = MAX(last, queryFirst - 1) + 1;
+
+            if (silent > queryFirst || !queryRepeated)
+            {
+               queryRepeated = true;
+               StartQuery(silent);
+               return;
+            }
+
+            queryRepeated = false;
+
+            if (passModules & (1ULL << (silent - 1)))
+               missingPages[silent - 1] = UpdateNoReply;
+
+            if (silent < queryLast)
+            {
+               StartQuery(silent + 1);
+               return;
+            }
+         }
+
+         queryRepeated = false;
+
+         //Modules that aren't in the updater end a query, ask those behind them
+         if (NextPendingModule(queryLast + 1) <= numModules)
+         {
+            StartQuery(NextPendingModule(queryLast + 1));
+            return;
+         }
+
+         if (pendingModules == 0 || updateRound >= (MaxUpdateRounds - 1))
+         {
+            NextImage();
+         }
+         else
+         {
+            //Nothing has been streamed yet after comparing
+            if (updatePage > 0)
+               updateRound++;
+
+            updatePage = 0;
+            updateStep = UpdateStream;
+         }
+         return;
+      }
+      case UpdateLast:
+         //UPDATE_DONE right before the last page, so bitmap updaters exit with
+         //it as well. All modules pass it on before they start the application.
+         //That cuts off the chain, so a corrupted last page can't be sent again
+         if (updateTimeout == 0)
+         {
+            SendUpdateCommand(UPDATE_DONE, 0, 0);
+         }
+         else if (updateTimeout == 1)
+         {
+            SendPage(ATTINY_MAX_APPLICATION_PAGES - 1);
+         }
+         else
+         {
+            if (IsPageCorrupted())
+               corruptedPages++;
+
+            //Legacy updaters don't tell what they have written, only what they lost
+            for (int i = 0; i < numModules; i++)
+            {
+               if (passModules & ~bitmapModules & (1ULL << i))
+                  missingPages[i] = corruptedPages;
+            }
+            updateStep = UpdateIdle;
+            return;
+         }
+
+         updateTimeout++;
+         return;
+      case UpdateDone:
+         //Bitmap updaters exit with the frame after UPDATE_DONE. Modules that
+         //miss one stay in the updater, so say it three times
+         SendUpdateCommand(UPDATE_DONE, 0, 0);
+         updateTimeout--;
+
+         if (updateTimeout == 0)
+            updateStep = UpdateIdle;
+         break;
+      default:
+         break;
+   }
+   updateLineIdle = false;
 }
 
-int BmsComm::UpdateNextPage()
+/** Start the pass of the next image that any module needs. Without known
+ * modules the first image is sent once to whatever is on the chain. Images
+ * that don't match their header are skipped. After the last pass all modules
+ * are started.
+ * A module with a legacy updater starts the application after the last page
+ * of its image, which cuts off the chain behind it. So the passes with legacy
+ * updaters go last and only one of them runs per update */
+void BmsComm::NextImage()
 {
-   extern uint16_t _binary_bms_tiny_elf_bin_start[2048];
+   int numImages = ImageStore::GetNumImages();
 
-   if (OneWire::IsReceiving() && pageBuf.pageNum > 0)
+   //Bitmap passes first, then sequential passes
+   while (!updateSequential && ++updateImage < 2 * numImages)
    {
-      uint8_t slaveReply = 0;
+      int index = updateImage % numImages;
+      bool sequential = updateImage >= numImages;
+
+      passModules = 0;
+
+      for (int i = 0; i < numModules; i++)
+      {
+         if (missingPages[i] == UpdateNoImage && ImageStore::Find(versions[i]) == index)
+            passModules |= 1ULL << i;
+      }
+
+      //Applications that don't know the probe only enter the updater by broadcast
+      if (passModules != (1ULL << numModules) - 1)
+      {
+         for (int i = 0; i < numModules; i++)
+         {
+            if (passModules & ~bootableModules & (1ULL << i))
+               missingPages[i] = UpdateNoBoot;
+         }
+         passModules &= bootableModules;
+      }
 
-      OneWire::GetReceivedData(&slaveReply, 1);
+      if (passModules == 0 && (numModules > 0 || index > 0)) continue;
+      if (((passModules & ~bitmapModules) != 0 || numModules <= 0) != sequential) continue;
+      if (!ImageStore::Verify(index)) continue;
 
-      if (slaveReply != 0)
+      for (int i = 0; i < numModules; i++)
       {
-         //resend last page
-         pageBuf.pageNum--;
+         if (passModules & (1ULL << i))
+            missingPages[i] = UpdateNoReply;
       }
+
+      for (int i = 0; i < PAGE_MAP_BYTES; i++)
+         resendPages[i] = updateDifferential && !sequential ? 0 : 0xff;
+
+      //Only bitmap updaters can be asked for missing pages
+      pendingModules = passModules & bitmapModules;
+      bootModule = -1;
+      updatePage = 0;
+      updateRound = 0;
+      updateTimeout = 0;
+      updateRetries = 0;
+      corruptedPages = 0;
+      queryRepeated = false;
+      updateSequential = sequential;
+      updateStep = UpdateBoot;
+      return;
    }
 
-   if (pageBuf.pageNum < (ATTINY_MAX_APPLICATION_PAGES + 4) && OneWire::IsReceiving())
+   if (updateSequential)
    {
-      uint16_t* const page = &_binary_bms_tiny_elf_bin_start[PAGE_WORDS * pageBuf.pageNum];
-      for (int i = 0; i < PAGE_WORDS; i++)
-         pageBuf.buf[i] = page[i];
-      pageBuf.crc = Crc16XModem((uint8_t*)&pageBuf, PAGE_WORDS * sizeof(uint16_t) + sizeof(uint8_t));
+      for (int i = 0; i < numModules; i++)
+      {
+         if (missingPages[i] == UpdateNoImage && ImageStore::Find(versions[i]) >= 0)
+            missingPages[i] = UpdateAgain;
+      }
+      updateStep = UpdateLast;
+      updateTimeout = 0;
+      return;
+   }
+
+   updateStep = updateBooted ? UpdateDone : UpdateIdle;
+   updateTimeout = 3;
+}
+
+/** Decompress a page of the image that NextImage() has verified. The
+ * decompressor stays where the page ends, so reading pages in ascending order
+ * decompresses the image once per round. A page before the last one starts
+ * over from the beginning.
+ * Whatever lies beyond the end of the image reads as erased flash */
+void BmsComm::ReadPage(int page, uint8_t* buf)
+{
+   const int pageBytes = PAGE_WORDS * sizeof(uint16_t);
+   LzImage& image = ImageStore::GetDecompressor();
+   int len = 0;
+
+   if (image.Seek(page * pageBytes))
+      len = image.Read(buf, pageBytes);
+
+   for (; len < pageBytes; len++)
+      buf[len] = 0xff;
+}
+
+/** @return crc of an image page as it is sent in PageBuf */
+uint16_t BmsComm::PageCrc(int page, const uint8_t* buf)
+{
+   uint16_t crc = Crc16::Update(Crc16::Init(), page);
+
+   crc = Crc16::Update(crc, buf, PAGE_WORDS * sizeof(uint16_t));
+   return Crc16::Final(crc);
+}
+
+/** Ask a module which updater it jumps to, see struct UpdaterVersion */
+void BmsComm::SendProbeCommand(int slave)
+{
+   struct cmd cmd = { (uint8_t)slave, OP_VERSION, VERSION_UPDATER };
+   uint16_t encodedCmd[2] = { hamming_encode(*((uint16_t*)&cmd)), hamming_encode(cmd.arg) };
+
+   OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(encodedCmd));
+   updateLineIdle = false;
+}
 
-      OneWire::SendData((uint8_t*)&pageBuf, sizeof(pageBuf));
-      pageBuf.pageNum++;
+/** Evaluate the reply to SendProbeCommand(). Software that predates the
+ * question replies with its version, it runs on a legacy updater and only
+ * enters it by broadcast. Newer software also takes an addressed OP_BOOT.
+ * @return true if the module replied */
+bool BmsComm::ParseUpdaterVersion(int slave)
+{
+   int length = OneWire::GetLastFrameLength();
+   struct versionComm version;
+   struct UpdaterVersion updater;
+
+   if (length >= (int)sizeof(version))
+   {
+      OneWire::ReadLastFrame(length - sizeof(version), &version, sizeof(version));
+
+      if (Crc16::Calculate((uint8_t*)&version, sizeof(version) - sizeof(uint16_t)) == version.crc)
+         return true;
+   }
+
+   //Our own command ends in 0, so it doesn't pass as a reply
+   if (length >= (int)sizeof(updater))
+   {
+      OneWire::ReadLastFrame(length - sizeof(updater), &updater, sizeof(updater));
+
+      if (updater.addr == slave &&
+          Crc16::Calculate((uint8_t*)&updater, sizeof(updater) - sizeof(uint16_t)) == updater.crc)
+      {
+         if (updater.version != UPDATER_LEGACY)
+            bitmapModules |= 1ULL << (slave - 1);
+         bootableModules |= 1ULL << (slave - 1);
+         return true;
+      }
    }
-   return pageBuf.pageNum;
+
+   return false;
 }
 
-void BmsComm::SendEncodedCmd(struct cmd *cmd)
+/** A legacy updater that receives a corrupted page pulls the line low for a
+ * bit time after it. That arrives as an extra byte behind the page.
+ * @return true if the last page came back with extra bytes */
+bool BmsComm::IsPageCorrupted()
 {
-   uint16_t encodedCmd = hamming_encode(*((uint16_t*)cmd));
-   OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(uint16_t));
+   return (OneWire::GetNumBytesReceived() % sizeof(struct PageBuf)) != 0;
+}
+
+/** Jump to the updater
+ * @param slave module address, 0xAA for all modules */
+void BmsComm::SendBootCommand(int slave)
+{
+   struct cmd cmd = { (uint8_t)slave, OP_BOOT, 0x1234 };
+
+   uint16_t encodedCmd[2] = { hamming_encode(*((uint16_t*)&cmd)), cmd.arg };
+   OneWire::SendData((uint8_t*)&encodedCmd, sizeof(encodedCmd));
+   updateLineIdle = false;
 }
 
-/* On entry, addr=>start of data
-             num = length of data
-             crc = incoming CRC     */
-int BmsComm::Crc16XModem(uint8_t *addr, int num)
+/** Send a page of the image, see ReadPage() */
+void BmsComm::SendPage(int page)
 {
-   int i, crc = 0;
+   pageBuf.pageNum = page;
+   ReadPage(page, (uint8_t*)pageBuf.buf);
+   pageBuf.crc = PageCrc(page, (uint8_t*)pageBuf.buf);
 
-   for (; num>0; num--)               /* Step through bytes in memory */
+   ResendPage();
+}
+
+/** Send the last page again, it is still in pageBuf */
+void BmsComm::ResendPage()
+{
+   OneWire::SendData((uint8_t*)&pageBuf, sizeof(pageBuf));
+   updateLineIdle = false;
+}
+
+/** Send the crcs of the image pages from frame * PAGE_WORDS on */
+void BmsComm::SendPageCrcs(int frame)
+{
+   uint8_t buf[PAGE_WORDS * sizeof(uint16_t)];
+
+   pageBuf.pageNum = UPDATE_COMPARE + frame;
+
+   for (int i = 0, page = frame * PAGE_WORDS; i < PAGE_WORDS; i++, page++)
    {
-      crc = crc ^ (*addr++ << 8);      /* Fetch byte from memory, XOR into CRC top byte*/
-      for (i=0; i<8; i++)              /* Prepare to rotate 8 bits */
+      if (page < ATTINY_MAX_APPLICATION_PAGES)
+      {
+         ReadPage(page, buf);
+         pageBuf.buf[i] = PageCrc(page, buf);
+      }
+      else
       {
-         crc = crc << 1;                /* rotate */
-         if (crc & 0x10000)             /* bit 15 was set (now bit 16)... */
-            crc = (crc ^ poly) & 0xFFFF; /* XOR with XMODEM polynomic */
-                                   /* and ensure CRC remains 16-bit value */
-    }                              /* Loop for 8 bits */
-  }                                /* Loop until num=0 */
-  return(crc);                     /* Return updated CRC */
+         pageBuf.buf[i] = 0;
+      }
+   }
+
+   pageBuf.crc = Crc16::Calculate((uint8_t*)&pageBuf, sizeof(pageBuf) - sizeof(uint16_t));
+
+   OneWire::SendData((uint8_t*)&pageBuf, sizeof(pageBuf));
+   updateLineIdle = false;
+}
+
+/** Select the modules of the current image, the others ignore its pages */
+void BmsComm::SendSelectCommand()
+{
+   uint8_t* selection = (uint8_t*)pageBuf.buf;
+
+   pageBuf.pageNum = UPDATE_SELECT;
+
+   for (int i = 0; i < PAGE_WORDS; i++)
+      pageBuf.buf[i] = 0;
+
+   for (int i = 0; i < numModules; i++)
+   {
+      if (passModules & (1ULL << i))
+         selection[(i + 1) / 8] |= 1 << ((i + 1) % 8);
+   }
+
+   pageBuf.crc = Crc16::Calculate((uint8_t*)&pageBuf, sizeof(pageBuf) - sizeof(uint16_t));
+
+   OneWire::SendData((uint8_t*)&pageBuf, sizeof(pageBuf));
+   updateLineIdle = false;
+}
+
+/** Send a command to the updater, it travels in a page frame */
+void BmsComm::SendUpdateCommand(uint8_t op, uint8_t arg0, uint8_t arg1)
+{
+   pageBuf.pageNum = op;
+
+   for (int i = 0; i < PAGE_WORDS; i++)
+      pageBuf.buf[i] = 0;
+
+   pageBuf.buf[0] = arg0;
+   pageBuf.buf[1] = arg1;
+   pageBuf.crc = Crc16::Calculate((uint8_t*)&pageBuf, sizeof(pageBuf) - sizeof(uint16_t));
+
+   OneWire::SendData((uint8_t*)&pageBuf, sizeof(pageBuf));
+   updateLineIdle = false;
+}
+
+/** Ask the modules from first on for their bitmap, up to the first one that
+ * isn't in the updater. Legacy updaters take the replies for the start of a
+ * page, so with them around the replies to one query stay below a page */
+void BmsComm::StartQuery(int first)
+{
+   const int maxLegacyReplies = (sizeof(struct PageBuf) - 1) / sizeof(struct PageMap);
+   int last = first;
+
+   while (last < numModules && (updaterModules & (1ULL << last)) &&
+          (!updateSequential || last - first + 1 < maxLegacyReplies))
+      last++;
+
+   //Replies have 10 bit times per byte, count 10 ms calls
+   int replyTicks = (last - first + 1) * sizeof(struct PageMap) * 10 * 100 / GetBitRate();
+
+   queryFirst = first;
+   queryLast = last;
+   updateTimeout = replyTicks + 3;
+   updateStep = UpdateQuery;
+   SendUpdateCommand(UPDATE_QUERY, first, last);
+}
+
+/** Evaluate the replies to UPDATE_QUERY. Only bitmaps of modules in the
+ * current pass count, modules of earlier passes have another image
+ * @return highest address that replied */
+int BmsComm::ParsePageMaps()
+{
+   int last = 0;
+
+   for (int frame = 0; frame < OneWire::GetNumFrames(); frame++)
+   {
+      int numBytes = OneWire::GetFrameLength(frame);
+
+      for (int pos = 0; pos + (int)sizeof(struct PageMap) <= numBytes;)
+      {
+         struct PageMap pageMap;
+         const struct PageMap* map = &pageMap;
+
+         OneWire::ReadFrame(frame, pos, &pageMap, sizeof(pageMap));
+
+         if (map->addr >= queryFirst && map->addr <= queryLast &&
+             Crc16::Calculate((uint8_t*)map, sizeof(struct PageMap) - sizeof(uint16_t)) == map->crc)
+         {
+            if (passModules & (1ULL << (map->addr - 1)))
+            {
+               //A sequential pass sends the last page at the very end
+               int numPages = updateSequential ? ATTINY_MAX_APPLICATION_PAGES - 1 : ATTINY_MAX_APPLICATION_PAGES;
+               int missing = 0;
+
+               for (int page = 0; page < numPages; page++)
+               {
+                  if ((map->pages[page / 8] & (1 << (page % 8))) == 0)
+                  {
+                     resendPages[page / 8] |= 1 << (page % 8);
+                     missing++;
+                  }
+               }
+
+               missingPages[map->addr - 1] = missing;
+
+               if (missing == 0)
+                  pendingModules &= ~(1ULL << (map->addr - 1));
+            }
+
+            last = MAX(last, map->addr);
+            pos += sizeof(struct PageMap);
+         }
+         else
+         {
+            pos++;
+         }
+      }
+   }
+
+   return last;
+}
+
+/** @return lowest module from first on that misses pages, numModules + 1 if there is none */
+int BmsComm::NextPendingModule(int first)
+{
+   int module = first;
+
+   while (module <= numModules && (pendingModules & (1ULL << (module - 1))) == 0)
+      module++;
+
+   return module;
+}
+
+void BmsComm::PipelineFrameReceived()
+{
+   if (pipelineModule == 0) return;
+
+   int numBytes = OneWire::GetLastFrameLength();
+
+   //Not a complete reply, maybe a glitch. Wait for the next frame
+   if (numBytes < (int)sizeof(struct BatDeltas)) return;
+
+   NextPipelineModule(Acquire(pipelineModule));
+}
+
+void BmsComm::NextPipelineModule(bool received)
+{
+   pipelineOk = pipelineOk && received;
+   pipelineRequests++;
+
+   if (pipelineModule < numModules)
+   {
+      pipelineModule++;
+   }
+   else
+   {
+      pipelineModule = 1;
+      lastCycleOk = pipelineOk;
+      pipelineOk = true;
+      completedCycles++;
+   }
+
+   StartAcquisition(pipelineModule);
+}
+
+void BmsComm::StoreValues(int slave, const struct BatValues* batValues)
+{
+   int offset = voltagesPerModule * (slave - 1);
+
+   int8_t temperature = (int8_t)(batValues->values[TEMP_IDX] & 0xFF);
+
+   for (int i = 0; i < voltagesPerModule; i++)
+   {
+      if (voltages[i + offset] != batValues->values[i])
+         MarkChanged(slave);
+
+      voltages[i + offset] = batValues->values[i];
+   }
+
+   if (temperatures[slave - 1] != temperature)
+      MarkChanged(slave);
+
+   temperatures[slave - 1] = temperature;
+   receivedModules |= 1ULL << (slave - 1);
+}
+
+void BmsComm::StoreDeltas(int slave, const struct BatDeltas* batDeltas)
+{
+   int offset = voltagesPerModule * (slave - 1);
+
+   for (int i = 0; i < voltagesPerModule; i++)
+   {
+      if (batDeltas->values[i] != 0)
+         MarkChanged(slave);
+
+      voltages[i + offset] += batDeltas->values[i];
+   }
+
+   if (batDeltas->values[TEMP_IDX] != 0)
+      MarkChanged(slave);
+
+   //Only the low byte of the temperature is kept, it wraps around like the module's value
+   temperatures[slave - 1] += batDeltas->values[TEMP_IDX];
+   receivedModules |= 1ULL << (slave - 1);
+}
+
+void BmsComm::Resynchronize()
+{
+   for (int i = 0; i < MaxModules; i++)
+      synced[i] = false;
+}
+
+void BmsComm::SendEncodedCmd(struct cmd *cmd)
+{
+   uint16_t encodedCmd = hamming_encode(*((uint16_t*)cmd));
+   OneWire::SendData((const uint8_t*)&encodedCmd, sizeof(uint16_t));
 }
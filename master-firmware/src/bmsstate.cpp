@@ -22,10 +22,28 @@
 #include "bmsstate.h"
 
 #define STT_WORDS        (sizeof(struct savedstate) / sizeof(uint32_t))
-#define STT_WORDS_NO_CRC (STT_WORDS - sizeof(uint32_t))
-#define CURRENT_VERSION  1
+#define STT_WORDS_NO_CRC (STT_WORDS - 1)
+#define CURRENT_VERSION  2
+#define SLOTS_PER_PAGE   (int)(FLASH_PAGE_SIZE / sizeof(struct savedstate))
+#define NUM_SLOTS        (SLOTS_PER_PAGE * BATSTT_PAGES)
+#define SLOT_ADDRESS(s)  (BATSTT_ADDRESS + ((s) / SLOTS_PER_PAGE) * FLASH_PAGE_SIZE + ((s) % SLOTS_PER_PAGE) * sizeof(struct savedstate))
+#define PAGE_ADDRESS(s)  (BATSTT_ADDRESS + ((s) / SLOTS_PER_PAGE) * FLASH_PAGE_SIZE)
+
+//Single record written by firmware before the journal, it lives in the second journal page
+#define LEGACY_ADDRESS   (BATSTT_ADDRESS + FLASH_PAGE_SIZE)
+#define LEGACY_VERSION   1
 
 struct savedstate
+{
+   uint32_t version;
+   uint32_t sequence;
+   s32fp estimatedSoC;
+   s32fp chargein;
+   s32fp chargeout;
+   uint32_t crc;
+};
+
+struct legacystate
 {
    uint32_t version;
    s32fp estimatedSoC;
@@ -37,49 +55,149 @@ struct savedstate
 s32fp BMSState::estimatedSoC; //!< Member variable "estimatedSoC"
 s32fp BMSState::chargein; //!< Member variable "chargein"
 s32fp BMSState::chargeout; //!< Member variable "chargeout"
-bool BMSState::saved = false;
+int BMSState::newestSlot;
+int BMSState::nextSlot;
+uint32_t BMSState::sequence;
+bool BMSState::scanned = false;
+
+static bool IsValid(const struct savedstate* stt)
+{
+   crc_reset();
+   uint32_t crc = crc_calculate_block((uint32_t*)stt, STT_WORDS_NO_CRC);
 
+   return crc == stt->crc && stt->version == CURRENT_VERSION;
+}
+
+/** Append the current state to the journal unless it equals the newest record.
+ * Erasing a page stalls the CPU for about 20 ms, this happens every
+ * FLASH_PAGE_SIZE / 24 saves */
 void BMSState::SaveToFlash()
 {
    struct savedstate stt;
 
-   if (saved) return; //Only allow saving once per session
+   if (!scanned) FindNewest();
 
-   crc_reset();
+   if (newestSlot >= 0)
+   {
+      const struct savedstate* newest = (const struct savedstate*)SLOT_ADDRESS(newestSlot);
+
+      if (newest->estimatedSoC == estimatedSoC && newest->chargein == chargein && newest->chargeout == chargeout)
+         return;
+   }
 
    stt.version = CURRENT_VERSION;
+   stt.sequence = sequence + 1;
    stt.estimatedSoC = estimatedSoC;
    stt.chargein = chargein;
    stt.chargeout = chargeout;
+   crc_reset();
    stt.crc = crc_calculate_block((uint32_t*)&stt, STT_WORDS_NO_CRC);
 
    flash_unlock();
-   flash_erase_page(BATSTT_ADDRESS);
 
-   for (uint32_t idx = 0; idx < STT_WORDS; idx++)
+   //Skip slots that a reset left half written
+   for (int tries = 0; tries < NUM_SLOTS; tries++)
    {
-      uint32_t* pData = ((uint32_t*)&stt) + idx;
-      flash_program_word(BATSTT_ADDRESS + idx * sizeof(uint32_t), *pData);
+      int slot = nextSlot;
+      nextSlot = (nextSlot + 1) % NUM_SLOTS;
+
+      if ((slot % SLOTS_PER_PAGE) == 0 && !IsErased(PAGE_ADDRESS(slot), FLASH_PAGE_SIZE / sizeof(uint32_t)))
+      {
+         //Never give up the newest record, only happens if the other pages are worn out
+         if (newestSlot >= 0 && (newestSlot / SLOTS_PER_PAGE) == (slot / SLOTS_PER_PAGE))
+            break;
+
+         flash_erase_page(PAGE_ADDRESS(slot));
+      }
+
+      if (!IsErased(SLOT_ADDRESS(slot), STT_WORDS))
+         continue;
+
+      for (uint32_t idx = 0; idx < STT_WORDS; idx++)
+      {
+         uint32_t* pData = ((uint32_t*)&stt) + idx;
+         flash_program_word(SLOT_ADDRESS(slot) + idx * sizeof(uint32_t), *pData);
+      }
+
+      if (IsValid((const struct savedstate*)SLOT_ADDRESS(slot)))
+      {
+         newestSlot = slot;
+         sequence = stt.sequence;
+         break;
+      }
    }
    flash_lock();
-   saved = true;
 }
 
+/** Restore the state from the newest valid journal record
+ * @return true if a record was found */
 bool BMSState::LoadFromFlash()
 {
-   bool res = false;
-   struct savedstate *stt = (struct savedstate *)BATSTT_ADDRESS;
+   FindNewest();
+
+   if (newestSlot >= 0)
+   {
+      const struct savedstate* stt = (const struct savedstate*)SLOT_ADDRESS(newestSlot);
+
+      estimatedSoC = stt->estimatedSoC;
+      chargein = stt->chargein;
+      chargeout = stt->chargeout;
+      return true;
+   }
+
+   return LoadLegacy();
+}
+
+void BMSState::FindNewest()
+{
+   newestSlot = -1;
+   nextSlot = 0;
+   sequence = 0;
+
+   for (int slot = 0; slot < NUM_SLOTS; slot++)
+   {
+      const struct savedstate* stt = (const struct savedstate*)SLOT_ADDRESS(slot);
+
+      if (IsValid(stt) && (newestSlot < 0 || (int32_t)(stt->sequence - sequence) > 0))
+      {
+         newestSlot = slot;
+         sequence = stt->sequence;
+      }
+   }
+
+   if (newestSlot >= 0)
+      nextSlot = (newestSlot + 1) % NUM_SLOTS;
+
+   scanned = true;
+}
+
+bool BMSState::IsErased(uint32_t address, int words)
+{
+   const uint32_t* data = (const uint32_t*)(uintptr_t)address;
+
+   for (int i = 0; i < words; i++)
+   {
+      if (data[i] != 0xffffffff)
+         return false;
+   }
+   return true;
+}
+
+/** Read the record of firmware before the journal. Its CRC only covered the version word */
+bool BMSState::LoadLegacy()
+{
+   const struct legacystate *stt = (const struct legacystate *)LEGACY_ADDRESS;
 
    crc_reset();
-   uint32_t crc = crc_calculate_block((uint32_t*)stt, STT_WORDS_NO_CRC);
+   uint32_t crc = crc_calculate_block((uint32_t*)stt, 1);
 
-   if (crc == stt->crc && stt->version == CURRENT_VERSION)
+   if (crc == stt->crc && stt->version == LEGACY_VERSION)
    {
       estimatedSoC = stt->estimatedSoC;
       chargein = stt->chargein;
       chargeout = stt->chargeout;
-      res = true;
+      return true;
    }
 
-   return res;
+   return false;
 }
@@ -0,0 +1,420 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libopencm3/cm3/cortex.h>
+#include "my_math.h"
+#include "cobs.h"
+#include "termdma.h"
+#include "cellhistory.h"
+
+#define VALID(vtg) ((vtg) > 50 && (vtg) < 5000)
+
+uint8_t CellHistory::cycleBuf[];
+uint8_t CellHistory::minuteBuf[];
+uint8_t CellHistory::hourBuf[];
+CellHistory::Ring CellHistory::rings[NumTiers] =
+{
+   { cycleBuf, sizeof(cycleBuf), 0, 0, 0, 0 },
+   { minuteBuf, sizeof(minuteBuf), 0, 0, 0, 0 },
+   { hourBuf, sizeof(hourBuf), 0, 0, 0, 0 }
+};
+uint32_t CellHistory::minuteStart;
+uint32_t CellHistory::hourStart;
+bool CellHistory::minuteOpen = false;
+bool CellHistory::hourOpen = false;
+int CellHistory::numModules = 0;
+uint8_t CellHistory::txBuf[];
+bool CellHistory::dumping = false;
+int CellHistory::dumpTier;
+uint32_t CellHistory::dumpFrom;
+uint32_t CellHistory::dumpTo;
+uint32_t CellHistory::dumpRecord;
+uint32_t CellHistory::dumpEnd;
+int CellHistory::dumpModule;
+uint16_t CellHistory::dumpRecords;
+
+/** Drop all records and size them for the current number of modules */
+void CellHistory::Clear()
+{
+   int numCells = numModules * BmsComm::voltagesPerModule;
+
+   for (int tier = 0; tier < NumTiers; tier++)
+   {
+      Ring& ring = rings[tier];
+      ring.recordSize = sizeof(RecordHeader) + numCells * (tier == Cycle ? 1 : 2);
+      ring.slots = ring.size / ring.recordSize;
+      //The open minute or hour takes a slot
+      ring.kept = tier == Cycle || ring.slots == 0 ? ring.slots : ring.slots - 1;
+      ring.written = 0;
+   }
+
+   minuteOpen = false;
+   hourOpen = false;
+   dumping = false;
+}
+
+/** Record the voltages of the acquisition cycle that just completed, call
+ * once per cycle. O(number of cells)
+ * @param time seconds since power up */
+void CellHistory::AddCycle(uint32_t time)
+{
+   const uint16_t* voltages = BmsComm::GetVoltages();
+   int modules = BmsComm::GetNumberOfCellModules();
+   uint16_t min, max;
+
+   if (modules != numModules)
+   {
+      numModules = modules;
+      Clear();
+   }
+
+   if (numModules == 0) return;
+
+   if (minuteOpen && (time / 60) != (minuteStart / 60))
+   {
+      rings[Minute].written++;
+      minuteOpen = false;
+   }
+
+   if (hourOpen && (time / 3600) != (hourStart / 3600))
+   {
+      rings[Hour].written++;
+      hourOpen = false;
+   }
+
+   if (!minuteOpen)
+   {
+      Open(Minute, time - time % 60);
+      minuteStart = time;
+      minuteOpen = true;
+   }
+
+   if (!hourOpen)
+   {
+      Open(Hour, time - time % 3600);
+      hourStart = time;
+      hourOpen = true;
+   }
+
+   if (GetCellRange(voltages, min, max))
+   {
+      Accumulate(Minute, voltages, min, max);
+      Accumulate(Hour, voltages, min, max);
+   }
+   else
+   {
+      min = max = 0;
+   }
+
+   StoreCycle(time, voltages, min, max);
+}
+
+/** Get the number of records and their time span
+ * @param tier Cycle, Minute or Hour
+ * @param[out] first time of oldest record
+ * @param[out] last time of newest record
+ * @return number of records */
+int CellHistory::GetRange(int tier, uint32_t& first, uint32_t& last)
+{
+   const Ring& ring = rings[tier];
+   RecordHeader header;
+   int count;
+
+   first = last = 0;
+
+   cm_disable_interrupts();
+   count = MIN(ring.written, ring.kept);
+
+   if (count > 0)
+   {
+      header = *(const RecordHeader*)GetRecord(ring, ring.written - count);
+      first = header.time;
+      header = *(const RecordHeader*)GetRecord(ring, ring.written - 1);
+      last = header.time;
+   }
+   cm_enable_interrupts();
+
+   return count;
+}
+
+/** Start sending all records of a tier with from <= time <= to
+ * @return false if the tier doesn't exist */
+bool CellHistory::StartDump(int tier, uint32_t from, uint32_t to)
+{
+   if (tier < 0 || tier >= NumTiers) return false;
+
+   const Ring& ring = rings[tier];
+
+   cm_disable_interrupts();
+   dumpTier = tier;
+   dumpFrom = from;
+   dumpTo = to;
+   dumpEnd = ring.written;
+   dumpRecord = ring.written > ring.kept ? ring.written - ring.kept : 0;
+   dumpModule = 0;
+   dumpRecords = 0;
+   dumping = true;
+   cm_enable_interrupts();
+
+   return true;
+}
+
+/** Send the next frame of a dump if the terminal is idle */
+void CellHistory::Run()
+{
+   if (!dumping || TermDma::IsBusy()) return;
+
+   int len = NextFrame(txBuf, txBufSize);
+
+   if (len > 0)
+      TermDma::Send(txBuf, len);
+}
+
+/** Store the cells of a cycle as offsets from the lowest one
+ * @param min lowest plausible cell
+ * @param max highest plausible cell */
+void CellHistory::StoreCycle(uint32_t time, const uint16_t* voltages, uint16_t min, uint16_t max)
+{
+   Ring& ring = rings[Cycle];
+   int numCells = numModules * BmsComm::voltagesPerModule;
+   uint8_t shift = 0;
+
+   if (ring.slots == 0) return;
+
+   while (((max - min + (1 << shift) - 1) >> shift) >= HISTORY_INVALID)
+      shift++;
+
+   uint8_t* rec = ring.buf + (ring.written % ring.slots) * ring.recordSize;
+   RecordHeader* header = (RecordHeader*)rec;
+   uint8_t* data = rec + sizeof(RecordHeader);
+
+   header->time = time;
+   header->base = min;
+   header->shift = shift;
+
+   for (int i = 0; i < numCells; i++)
+      *data++ = VALID(voltages[i]) ? (voltages[i] - min) >> shift : HISTORY_INVALID;
+
+   ring.written++;
+}
+
+/** Start the record of a minute or hour in the slot after the newest record */
+void CellHistory::Open(int tier, uint32_t time)
+{
+   Ring& ring = rings[tier];
+   int numCells = numModules * BmsComm::voltagesPerModule;
+
+   if (ring.slots == 0) return;
+
+   uint8_t* rec = ring.buf + (ring.written % ring.slots) * ring.recordSize;
+   RecordHeader* header = (RecordHeader*)rec;
+   uint8_t* data = rec + sizeof(RecordHeader);
+
+   header->time = time;
+   header->base = 0xffff;
+   header->shift = 0;
+
+   for (int i = 0; i < numCells * 2; i++)
+      data[i] = HISTORY_INVALID;
+}
+
+/** Merge the cells of a cycle into the open record of a minute or hour. The
+ * record is re-encoded when they don't fit its base and resolution. Bases
+ * are multiples of the resolution, so that only rounds the cells to the new
+ * resolution.
+ * @param min lowest plausible cell of the cycle
+ * @param max highest plausible cell of the cycle */
+void CellHistory::Accumulate(int tier, const uint16_t* voltages, uint16_t min, uint16_t max)
+{
+   Ring& ring = rings[tier];
+   int numCells = numModules * BmsComm::voltagesPerModule;
+
+   if (ring.slots == 0) return;
+
+   uint8_t* rec = ring.buf + (ring.written % ring.slots) * ring.recordSize;
+   RecordHeader* header = (RecordHeader*)rec;
+   uint8_t* data = rec + sizeof(RecordHeader);
+   uint16_t base = header->base;
+   uint8_t shift = header->shift;
+
+   //0xffff for an empty record, then everything is out of range
+   if (min < base || ((max - base + (1 << shift) - 1) >> shift) >= HISTORY_INVALID)
+   {
+      uint16_t top = max;
+
+      for (int i = 0; i < numCells; i++)
+      {
+         if (data[2 * i + 1] != HISTORY_INVALID)
+            top = MAX(top, base + (data[2 * i + 1] << shift));
+      }
+
+      base = MIN(base, min) & ~((1 << shift) - 1);
+
+      while (((top - base + (1 << shift) - 1) >> shift) >= HISTORY_INVALID)
+      {
+         shift++;
+         base &= ~((1 << shift) - 1);
+      }
+
+      Rebase(header, data, base, shift);
+   }
+
+   for (int i = 0; i < numCells; i++, data += 2)
+   {
+      uint16_t vtg = voltages[i];
+
+      if (!VALID(vtg)) continue;
+
+      uint8_t lo = (vtg - base) >> shift;
+      uint8_t hi = (vtg - base + (1 << shift) - 1) >> shift;
+
+      if (data[0] == HISTORY_INVALID || lo < data[0])
+         data[0] = lo;
+      if (data[1] == HISTORY_INVALID || hi > data[1])
+         data[1] = hi;
+   }
+}
+
+void CellHistory::Rebase(RecordHeader* header, uint8_t* data, uint16_t base, uint8_t shift)
+{
+   int numCells = numModules * BmsComm::voltagesPerModule;
+
+   for (int i = 0; i < numCells; i++, data += 2)
+   {
+      if (data[0] == HISTORY_INVALID) continue;
+
+      uint16_t lo = header->base + (data[0] << header->shift);
+      uint16_t hi = header->base + (data[1] << header->shift);
+
+      data[0] = (lo - base) >> shift;
+      data[1] = (hi - base + (1 << shift) - 1) >> shift;
+   }
+
+   header->base = base;
+   header->shift = shift;
+}
+
+/** Lowest and highest plausible cell, min > max if there is none
+ * @return true if there is a plausible cell */
+bool CellHistory::GetCellRange(const uint16_t* voltages, uint16_t& min, uint16_t& max)
+{
+   int numCells = numModules * BmsComm::voltagesPerModule;
+
+   min = 0xffff;
+   max = 0;
+
+   for (int i = 0; i < numCells; i++)
+   {
+      if (VALID(voltages[i]))
+      {
+         min = MIN(min, voltages[i]);
+         max = MAX(max, voltages[i]);
+      }
+   }
+
+   return min <= max;
+}
+
+const uint8_t* CellHistory::GetRecord(const Ring& ring, uint32_t record)
+{
+   return ring.buf + (record % ring.slots) * ring.recordSize;
+}
+
+/** Encode the next slice of the dump, i.e. up to modulesPerFrame modules of one record
+ * @return length including the leading delimiter, 0 when the dump is complete */
+int CellHistory::NextFrame(uint8_t* buf, int size)
+{
+   const Ring& ring = rings[dumpTier];
+   int bytesPerModule = BmsComm::voltagesPerModule * (dumpTier == Cycle ? 1 : 2);
+   uint8_t data[maxFrameData];
+   struct HistoryFrameHeader header;
+   bool found = false;
+
+   //Records are written from the acquisition task, take a consistent copy
+   cm_disable_interrupts();
+   while (!found && dumping && dumpRecord < dumpEnd)
+   {
+      //Overwritten while we were sending
+      if (ring.written - dumpRecord > ring.kept)
+      {
+         dumpRecord = ring.written - ring.kept;
+         dumpModule = 0;
+         continue;
+      }
+
+      const uint8_t* rec = GetRecord(ring, dumpRecord);
+      const RecordHeader* recHeader = (const RecordHeader*)rec;
+
+      if (recHeader->time >= dumpFrom && recHeader->time <= dumpTo)
+      {
+         const uint8_t* src = rec + sizeof(RecordHeader) + dumpModule * bytesPerModule;
+
+         header.type = HISTORY_DATA;
+         header.tier = dumpTier;
+         header.time = recHeader->time;
+         header.base = recHeader->base;
+         header.shift = recHeader->shift;
+         header.firstModule = dumpModule;
+         header.numModules = MIN(modulesPerFrame, numModules - dumpModule);
+         header.voltagesPerModule = BmsComm::voltagesPerModule;
+
+         for (int i = 0; i < header.numModules * bytesPerModule; i++)
+            data[i] = src[i];
+
+         found = true;
+      }
+      else
+      {
+         dumpRecord++;
+      }
+   }
+   cm_enable_interrupts();
+
+   if (!dumping) return 0;
+
+   //Leading delimiter ends whatever text the terminal sent before
+   buf[0] = 0;
+   CobsFrame frame(buf + 1, size - 1);
+
+   if (found)
+   {
+      frame.Add(&header, sizeof(header));
+      frame.Add(data, header.numModules * bytesPerModule);
+
+      dumpModule += header.numModules;
+
+      if (dumpModule >= numModules)
+      {
+         dumpModule = 0;
+         dumpRecord++;
+         dumpRecords++;
+      }
+   }
+   else
+   {
+      struct HistoryEndHeader end;
+
+      end.type = HISTORY_END;
+      end.tier = dumpTier;
+      end.records = dumpRecords;
+      frame.Add(&end, sizeof(end));
+      dumping = false;
+   }
+
+   return 1 + frame.Close();
+}
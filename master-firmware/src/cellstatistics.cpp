@@ -0,0 +1,137 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cellstatistics.h"
+
+CellStatistics::Stats CellStatistics::stats[];
+CellStatistics::Extreme CellStatistics::extremes[];
+uint8_t CellStatistics::evicted[];
+int CellStatistics::extremeOverflows = 0;
+
+void CellStatistics::Reset()
+{
+   for (int i = 0; i < MaxCells; i++)
+      stats[i] = Stats();
+
+   for (int i = 0; i < MaxExtremeCells; i++)
+      extremes[i] = Extreme();
+
+   for (int i = 0; i < (int)sizeof(evicted); i++)
+      evicted[i] = 0;
+
+   extremeOverflows = 0;
+}
+
+/** Add a new voltage reading of one cell, O(1) so it can be called per reply
+ * @param cell cell index counting from 0
+ * @param voltage cell voltage in mV, implausible values are ignored */
+void CellStatistics::Update(int cell, uint16_t voltage)
+{
+   Stats& s = stats[cell];
+
+   if (voltage >= 5000 || voltage <= 50) return;
+
+   int32_t microVolts = (int32_t)voltage * 1000;
+
+   if (s.min == 0)
+   {
+      s.mean = microVolts;
+      s.variance = 0;
+      s.min = voltage;
+      s.max = voltage;
+      return;
+   }
+
+   //Incremental weighted variance, see Finch "Incremental calculation of
+   //weighted mean and variance". The square of the difference needs 64 bits
+   int32_t diff = microVolts - s.mean;
+   uint64_t var = s.variance + (((int64_t)diff * diff) >> ewmaShift);
+
+   s.mean += diff >> ewmaShift;
+   var -= var >> ewmaShift;
+   s.variance = var < UINT32_MAX ? var : UINT32_MAX;
+
+   if (voltage < s.min)
+      s.min = voltage;
+   if (voltage > s.max)
+      s.max = voltage;
+}
+
+/** Call once per second with the current weakest and strongest cell */
+void CellStatistics::CountExtremes(int minCell, int maxCell)
+{
+   FindExtreme(minCell, true)->secondsMin++;
+   FindExtreme(maxCell, true)->secondsMax++;
+}
+
+/** @return weighted mean voltage in mV */
+s32fp CellStatistics::GetMean(int cell)
+{
+   return FP_FROMINT(stats[cell].mean) / 1000;
+}
+
+/** @return weighted variance in mV^2 */
+s32fp CellStatistics::GetVariance(int cell)
+{
+   return ((uint64_t)stats[cell].variance << CST_DIGITS) / 1000000;
+}
+
+/** @return seconds as weakest cell, -1 if the counters of the cell were taken over */
+int32_t CellStatistics::GetSecondsMin(int cell)
+{
+   Extreme* extreme = FindExtreme(cell, false);
+
+   if ((evicted[cell / 8] >> (cell % 8)) & 1) return -1;
+   return extreme != 0 ? extreme->secondsMin : 0;
+}
+
+/** @return seconds as strongest cell, -1 if the counters of the cell were taken over */
+int32_t CellStatistics::GetSecondsMax(int cell)
+{
+   Extreme* extreme = FindExtreme(cell, false);
+
+   if ((evicted[cell / 8] >> (cell % 8)) & 1) return -1;
+   return extreme != 0 ? extreme->secondsMax : 0;
+}
+
+/** @param add take over a free entry or the one with the least time if the cell has none
+ * @return table entry of a cell, 0 if it has none and add is false */
+CellStatistics::Extreme* CellStatistics::FindExtreme(int cell, bool add)
+{
+   Extreme* least = &extremes[0];
+
+   for (Extreme* e = extremes; e < extremes + MaxExtremeCells; e++)
+   {
+      if (e->cell == cell + 1)
+         return e;
+      if (e->cell == 0 || (least->cell != 0 && e->secondsMin + e->secondsMax < least->secondsMin + least->secondsMax))
+         least = e;
+   }
+
+   if (!add) return 0;
+
+   if (least->cell != 0)
+   {
+      int lost = least->cell - 1;
+      evicted[lost / 8] |= 1 << (lost % 8);
+      extremeOverflows++;
+   }
+
+   *least = { (uint16_t)(cell + 1), 0, 0 };
+   return least;
+}
@@ -0,0 +1,124 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libopencm3/cm3/cortex.h>
+#include "chargeintegrator.h"
+
+int64_t ChargeIntegrator::chargeIn;
+int64_t ChargeIntegrator::chargeOut;
+s32fp ChargeIntegrator::lastCurrent;
+bool ChargeIntegrator::haveSample = false;
+uint32_t ChargeIntegrator::lastCounterIn;
+uint32_t ChargeIntegrator::lastCounterOut;
+bool ChargeIntegrator::haveCounters = false;
+
+/** Set totals, e.g. restored from flash or 0 after a SoC estimate */
+void ChargeIntegrator::SetCharge(s32fp chargeIn, s32fp chargeOut)
+{
+   cm_disable_interrupts();
+   ChargeIntegrator::chargeIn = chargeIn * unitsPerAs;
+   ChargeIntegrator::chargeOut = chargeOut * unitsPerAs;
+   cm_enable_interrupts();
+}
+
+/** Integrate the current from the previous sample to this one as a straight line
+ * @param current positive when charging
+ * @param periodMs time since the previous sample */
+void ChargeIntegrator::AddSample(s32fp current, uint32_t periodMs)
+{
+   int64_t first = haveSample ? lastCurrent : current;
+   int64_t last = current;
+
+   lastCurrent = current;
+   haveSample = true;
+
+   if (first >= 0 && last >= 0)
+   {
+      chargeIn += ((first + last) * periodMs) << fracBits;
+   }
+   else if (first <= 0 && last <= 0)
+   {
+      chargeOut -= ((first + last) * periodMs) << fracBits;
+   }
+   else
+   {
+      //The line crosses zero, the two triangles go to different totals.
+      //Their difference is exact so rounding can't make in and out drift
+      //apart. The fractional bits keep the rounding of either of them from
+      //adding up when the same crossing repeats, e.g. with pulsed loads
+      int64_t pos = first > 0 ? first : last;
+      int64_t neg = first > 0 ? last : first;
+      int64_t areaIn = ((pos * pos * periodMs << fracBits) + (pos - neg) / 2) / (pos - neg);
+
+      chargeIn += areaIn;
+      chargeOut += areaIn - (((pos + neg) * periodMs) << fracBits);
+   }
+}
+
+/** Add what an external meter counted since its previous reading.
+ * A counter that goes backwards has been reset by the meter, its new
+ * value is what it counted since.
+ * @param asIn charge counter in As
+ * @param asOut discharge counter in As */
+void ChargeIntegrator::AddCounters(uint32_t asIn, uint32_t asOut)
+{
+   if (haveCounters)
+   {
+      uint32_t deltaIn = asIn >= lastCounterIn ? asIn - lastCounterIn : asIn;
+      uint32_t deltaOut = asOut >= lastCounterOut ? asOut - lastCounterOut : asOut;
+
+      cm_disable_interrupts();
+      chargeIn += ((int64_t)deltaIn << CST_DIGITS) * unitsPerAs;
+      chargeOut += ((int64_t)deltaOut << CST_DIGITS) * unitsPerAs;
+      cm_enable_interrupts();
+   }
+
+   lastCounterIn = asIn;
+   lastCounterOut = asOut;
+   haveCounters = true;
+}
+
+/** @return charge since SetCharge() in As */
+s32fp ChargeIntegrator::GetChargeIn()
+{
+   cm_disable_interrupts();
+   int64_t units = chargeIn;
+   cm_enable_interrupts();
+
+   return ToAs(units);
+}
+
+/** @return discharge since SetCharge() in As */
+s32fp ChargeIntegrator::GetChargeOut()
+{
+   cm_disable_interrupts();
+   int64_t units = chargeOut;
+   cm_enable_interrupts();
+
+   return ToAs(units);
+}
+
+/** Convert to As, saturating rather than wrapping if s32fp can't hold it */
+s32fp ChargeIntegrator::ToAs(int64_t units)
+{
+   int64_t as = units / unitsPerAs;
+
+   if (as > INT32_MAX) return INT32_MAX;
+   if (as < INT32_MIN) return INT32_MIN;
+   return as;
+}
@@ -0,0 +1,123 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cobs.h"
+#include "crc16.h"
+
+CobsFrame::CobsFrame(uint8_t* buf, int size)
+   : buf(buf), size(size), pos(1), codePos(0), code(1), crc(Crc16::Init()), overflow(size < 2)
+{
+}
+
+void CobsFrame::Add(uint8_t data)
+{
+   crc = Crc16::Update(crc, data);
+   Put(data);
+}
+
+void CobsFrame::Add(const void* data, int len)
+{
+   const uint8_t* bytes = (const uint8_t*)data;
+
+   for (int i = 0; i < len; i++)
+      Add(bytes[i]);
+}
+
+/** Append CRC and delimiter
+ * @return length of the frame in bytes, 0 if it didn't fit into the buffer */
+int CobsFrame::Close()
+{
+   uint16_t final = Crc16::Final(crc);
+
+   Put(final & 0xff);
+   Put(final >> 8);
+
+   if (overflow || pos >= size)
+      return 0;
+
+   buf[codePos] = code;
+   buf[pos++] = 0;
+   return pos;
+}
+
+/** Decode one frame and check its CRC
+ * @param in encoded frame without the delimiter
+ * @param len length of encoded frame
+ * @param[out] out decoded payload, must hold len bytes
+ * @return length of payload without CRC, -1 if the frame is corrupt */
+int CobsFrame::Decode(const uint8_t* in, int len, uint8_t* out)
+{
+   int i = 0, o = 0;
+
+   while (i < len)
+   {
+      uint8_t blockCode = in[i++];
+
+      if (blockCode == 0) return -1;
+
+      for (int j = 1; j < blockCode; j++)
+      {
+         if (i >= len || in[i] == 0) return -1;
+         out[o++] = in[i++];
+      }
+
+      //A block shorter than the maximum ends in a zero, except the last one
+      if (blockCode < 0xff && i < len)
+         out[o++] = 0;
+   }
+
+   if (o < 2) return -1;
+
+   o -= 2;
+   uint16_t received = out[o] | (out[o + 1] << 8);
+
+   return Crc16::Calculate(out, o) == received ? o : -1;
+}
+
+void CobsFrame::Put(uint8_t data)
+{
+   if (data == 0)
+   {
+      CloseBlock();
+   }
+   else
+   {
+      if (pos < size)
+         buf[pos] = data;
+      else
+         overflow = true;
+
+      pos++;
+      code++;
+
+      if (code == 0xff)
+         CloseBlock();
+   }
+}
+
+void CobsFrame::CloseBlock()
+{
+   if (codePos < size)
+      buf[codePos] = code;
+   else
+      overflow = true;
+
+   codePos = pos;
+   pos++;
+   code = 1;
+}
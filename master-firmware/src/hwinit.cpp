@@ -106,6 +106,8 @@ void usart_setup(void)
    usart_set_parity(BMS_USART, USART_PARITY_NONE);
    usart_set_flow_control(BMS_USART, USART_FLOWCONTROL_NONE);
    USART_CR1(BMS_USART) |= USART_CR1_TCIE; //on transmission complete we enable receiver
+   USART_CR1(BMS_USART) |= USART_CR1_IDLEIE; //on idle line after receiving a reply is complete
+   USART_CR3(BMS_USART) |= USART_CR3_EIE; //framing error with DMA enabled, marks a break
 
    usart_enable_rx_dma(BMS_USART);
    usart_enable_tx_dma(BMS_USART);
@@ -115,6 +117,7 @@ void usart_setup(void)
    dma_set_peripheral_size(DMA1, BMS_USART_DMARX, DMA_CCR_PSIZE_8BIT);
    dma_set_memory_size(DMA1, BMS_USART_DMARX, DMA_CCR_MSIZE_8BIT);
    dma_enable_memory_increment_mode(DMA1, BMS_USART_DMARX);
+   dma_enable_circular_mode(DMA1, BMS_USART_DMARX);
 
    dma_channel_reset(DMA1, BMS_USART_DMATX);
    dma_set_read_from_memory(DMA1, BMS_USART_DMATX);
@@ -159,8 +162,7 @@ void nvic_setup(void)
    nvic_enable_irq(NVIC_TIM1_CC_IRQ); //One Wire Comm
    nvic_set_priority(NVIC_TIM4_IRQ, 0x1 << 4); //highest priority
 
-   //nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ);
-	//nvic_set_priority(NVIC_DMA1_CHANNEL5_IRQ, 0xd << 4); //third lowest priority
+   nvic_enable_irq(NVIC_DMA1_CHANNEL5_IRQ); //Laps of the one wire ring buffer, same priority as USART1
 	nvic_enable_irq(NVIC_USART1_IRQ);
 
    nvic_enable_irq(NVIC_TIM4_IRQ); //Scheduler
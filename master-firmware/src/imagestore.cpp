@@ -0,0 +1,114 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "imagestore.h"
+#include "crc16.h"
+
+/** Image store, linked in from cmu-images.lz */
+extern const uint8_t _binary_cmu_images_lz_start[];
+
+LzImage ImageStore::decompressor;
+volatile bool ImageStore::busy = false;
+
+int ImageStore::GetNumImages()
+{
+   int index = 0;
+
+   while (index < MaxImages && GetHeader(index) != 0)
+      index++;
+
+   return index;
+}
+
+/** @return header of an image, 0 if the store has fewer images */
+const ImageHeader* ImageStore::GetHeader(int index)
+{
+   const uint8_t* entry = _binary_cmu_images_lz_start;
+
+   for (int i = 0; i < MaxImages; i++)
+   {
+      const ImageHeader* header = (const ImageHeader*)entry;
+
+      if (header->magic != Magic) return 0;
+      if (i == index) return header;
+
+      entry += sizeof(ImageHeader) + header->packedSize;
+   }
+
+   return 0;
+}
+
+/** @return compressed image for LzImage::Open() */
+const uint8_t* ImageStore::GetData(int index)
+{
+   return (const uint8_t*)(GetHeader(index) + 1);
+}
+
+/** @return index of the image for the hardware of a module, -1 if there is none */
+int ImageStore::Find(const struct version& moduleVersion)
+{
+   for (int index = 0; index < MaxImages; index++)
+   {
+      const ImageHeader* header = GetHeader(index);
+
+      if (header == 0) break;
+
+      if (header->version.hwVersion[0] == moduleVersion.hwVersion[0] &&
+          header->version.hwVersion[1] == moduleVersion.hwVersion[1])
+         return index;
+   }
+
+   return -1;
+}
+
+/** @return true if the module already runs the software of the image */
+bool ImageStore::IsCurrent(int index, const struct version& moduleVersion)
+{
+   const ImageHeader* header = GetHeader(index);
+
+   for (unsigned i = 0; i < sizeof(header->version.swVersion); i++)
+   {
+      if (header->version.swVersion[i] != moduleVersion.swVersion[i])
+         return false;
+   }
+
+   return true;
+}
+
+/** Decompress a whole image and check it against size and crc in its header.
+ * The decompressor is left open on the image, positioned at the end */
+bool ImageStore::Verify(int index)
+{
+   const ImageHeader* header = GetHeader(index);
+   uint8_t buf[64];
+   uint16_t crc = Crc16::Init();
+   int size = 0, len;
+
+   decompressor.Open(GetData(index));
+
+   if (decompressor.GetSize() != header->size || decompressor.GetPackedSize() != header->packedSize)
+      return false;
+
+   while ((len = decompressor.Read(buf, sizeof(buf))) > 0)
+   {
+      crc = Crc16::Update(crc, buf, len);
+      size += len;
+   }
+
+   return size == header->size && Crc16::Final(crc) == header->crc;
+}
@@ -0,0 +1,279 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libopencm3/stm32/desig.h>
+#include "params.h"
+#include "my_fp.h"
+#include "printf.h"
+#include "stm32_can.h"
+#include "bmscomm.h"
+#include "cellstatistics.h"
+#include "termdma.h"
+#include "jsonstream.h"
+
+char JsonStream::entry[];
+int JsonStream::entryLen;
+int JsonStream::entryPos;
+JsonStream::Section JsonStream::section = Done;
+int JsonStream::index;
+int JsonStream::part;
+int JsonStream::numSlaves;
+bool JsonStream::active = false;
+bool JsonStream::delta = false;
+uint16_t JsonStream::since;
+uint16_t JsonStream::sequence = 0;
+uint16_t JsonStream::paramHashes[];
+uint16_t JsonStream::paramChanges[];
+
+/** Restart the dump from the beginning */
+void JsonStream::Start()
+{
+   section = Open;
+   index = 0;
+   part = 0;
+   entryLen = 0;
+   entryPos = 0;
+   numSlaves = BmsComm::GetNumberOfCellModules();
+   delta = false;
+   active = true;
+}
+
+/** Start a dump of the entries that changed since an earlier delta dump
+ * @param since sequence number of that dump, 0 gets all entries */
+void JsonStream::StartDelta(uint16_t since)
+{
+   //Changes since the previous delta dump carry the number of this one
+   uint16_t current = NextSequence(sequence);
+
+   //Sequence numbers that weren't given out yet, e.g. from before a reset, get everything
+   if ((uint16_t)(sequence - since) >= 0x8000)
+      since = 0;
+
+   for (int i = 0; i < Param::PARAM_LAST; i++)
+   {
+      uint16_t hash = Hash(Param::Get((Param::PARAM_NUM)i));
+
+      if (hash != paramHashes[i])
+         paramChanges[i] = current;
+
+      paramHashes[i] = hash;
+   }
+
+   sequence = current;
+   //Values stored from now on are newer than this dump
+   BmsComm::SetChangeSequence(NextSequence(current));
+
+   Start();
+   delta = true;
+   JsonStream::since = since;
+}
+
+/** Send the next entry if the terminal is idle. The entry buffer is only
+ * reused once DMA has sent it, formatting takes far less than sending */
+void JsonStream::Run()
+{
+   if (!active || TermDma::IsBusy()) return;
+
+   while (entryPos == entryLen)
+   {
+      entryPos = 0;
+      entryLen = 0;
+
+      if (!NextEntry())
+      {
+         active = false;
+         return;
+      }
+   }
+
+   if (TermDma::Send((uint8_t*)&entry[entryPos], entryLen - entryPos))
+      entryPos = entryLen;
+}
+
+/** Fill a buffer with the next part of the document
+ * @return number of bytes written, 0 at the end of the document */
+int JsonStream::NextChunk(char* buf, int size)
+{
+   int len = 0;
+
+   while (len < size)
+   {
+      if (entryPos == entryLen)
+      {
+         entryPos = 0;
+         entryLen = 0;
+
+         if (!NextEntry())
+            break;
+      }
+
+      while (entryPos < entryLen && len < size)
+         buf[len++] = entry[entryPos++];
+   }
+
+   return len;
+}
+
+/** Format the next entry into the entry buffer, it may be empty
+ * @return false when the document is complete */
+bool JsonStream::NextEntry()
+{
+   switch (section)
+   {
+   case Open:
+      entryLen = sprintf(entry, "{");
+      section = Params;
+      break;
+   case Params:
+      while (index < Param::PARAM_LAST &&
+             ((Param::GetFlag((Param::PARAM_NUM)index) & Param::FLAG_HIDDEN) || !Changed(paramChanges[index])))
+         index++;
+
+      if (index < Param::PARAM_LAST)
+      {
+         ParamEntry();
+      }
+      else
+      {
+         section = Serial;
+      }
+      break;
+   case Serial:
+      if (!delta || since == 0)
+         entryLen = sprintf(entry, "\r\n   \"serial\": {\"unit\":\"\",\"value\":\"%X:%X:%X\",\"isparam\":false}", DESIG_UNIQUE_ID2, DESIG_UNIQUE_ID1, DESIG_UNIQUE_ID0);
+      if (delta)
+         entryLen += sprintf(entry + entryLen, "%s\r\n   \"seq\": {\"unit\":\"\",\"value\":%d,\"isparam\":false}", since == 0 ? "," : "", sequence);
+      section = Cells;
+      index = 0;
+      part = 0;
+      break;
+   case Cells:
+      if (index < numSlaves)
+      {
+         CellEntry();
+      }
+      else
+      {
+         section = Close;
+      }
+      break;
+   case Close:
+      entryLen = sprintf(entry, "\r\n}\r\n");
+      section = Done;
+      break;
+   case Done:
+      return false;
+   }
+
+   return true;
+}
+
+/** One parameter is split into three entries so a long unit string fits */
+void JsonStream::ParamEntry()
+{
+   Param::PARAM_NUM idx = (Param::PARAM_NUM)index;
+   const Param::Attributes* pAtr = Param::GetAttrib(idx);
+   int canId, canOffset, canLength;
+   bool isRx;
+   s32fp canGain;
+
+   switch (part)
+   {
+   case 0:
+      entryLen = sprintf(entry, "\r\n   \"%s\": {\"unit\":\"%s\",\"value\":%f,", pAtr->name, pAtr->unit, Param::Get(idx));
+      part++;
+      break;
+   case 1:
+      if (Can::GetInterface(0)->FindMap(idx, canId, canOffset, canLength, canGain, isRx))
+      {
+         entryLen = sprintf(entry, "\"canid\":%d,\"canoffset\":%d,\"canlength\":%d,\"cangain\":%d,\"isrx\":%s,",
+                            canId, canOffset, canLength, canGain, isRx ? "true" : "false");
+      }
+      part++;
+      break;
+   default:
+      if (Param::IsParam(idx))
+      {
+         entryLen = sprintf(entry, "\"isparam\":true,\"minimum\":%f,\"maximum\":%f,\"default\":%f,\"category\":\"%s\"},", pAtr->min, pAtr->max, pAtr->def, pAtr->category);
+      }
+      else
+      {
+         entryLen = sprintf(entry, "\"isparam\":false},");
+      }
+      part = 0;
+      index++;
+      break;
+   }
+}
+
+/** Voltages of each channel, then temperature and version of one module */
+void JsonStream::CellEntry()
+{
+   int slave = index;
+
+   if (part < BmsComm::voltagesPerModule)
+   {
+      int cell = BmsComm::voltagesPerModule * slave + part;
+      uint16_t vtg = BmsComm::GetVoltages()[cell];
+      const CellStatistics::Stats& stats = CellStatistics::Get(cell);
+
+      if (vtg < 5000 && Changed(BmsComm::GetChangeSequence(slave)))
+      {
+         entryLen = sprintf(entry, ",\r\n   \"u.%02d.%d\": {\"unit\":\"mV\",\"value\":%d,\"mean\":%f,\"variance\":%f,\"min\":%d,\"max\":%d,\"tmin\":%d,\"tmax\":%d,\"isparam\":false}",
+                            slave + 1, part + 1, vtg, CellStatistics::GetMean(cell), CellStatistics::GetVariance(cell), stats.min, stats.max,
+                            CellStatistics::GetSecondsMin(cell), CellStatistics::GetSecondsMax(cell));
+      }
+      part++;
+   }
+   else if (part == BmsComm::voltagesPerModule)
+   {
+      if (Changed(BmsComm::GetChangeSequence(slave)))
+         entryLen = sprintf(entry, ",\r\n   \"t.%02d\": {\"unit\":\"°C\",\"value\":%d,\"isparam\":false}", slave + 1, BmsComm::GetTemperatures()[slave]);
+      part++;
+   }
+   else
+   {
+      const uint8_t* ver = BmsComm::GetVersions()[slave].swVersion;
+
+      if (Changed(BmsComm::GetChangeSequence(slave)))
+         entryLen = sprintf(entry, ",\r\n   \"swver.%02d\": {\"unit\":\"\",\"value\":\"%d.%d.%d.%c\",\"isparam\":false}", slave + 1, ver[0], ver[1], ver[2], ver[3]);
+      part = 0;
+      index++;
+   }
+}
+
+/** @param seq sequence number of the last change of an entry
+ * @return true if the entry belongs into the current dump */
+bool JsonStream::Changed(uint16_t seq)
+{
+   return !delta || since == 0 || (int16_t)(seq - since) > 0;
+}
+
+/** @return sequence number after seq, 0 is never used */
+uint16_t JsonStream::NextSequence(uint16_t seq)
+{
+   seq++;
+   return seq == 0 ? 1 : seq;
+}
+
+/** Multiplicative hash, a change goes unnoticed about once in 65536 changes.
+ * It is reported with the next change of that parameter or a full dump */
+uint16_t JsonStream::Hash(s32fp value)
+{
+   return ((uint32_t)value * 2654435761u) >> 16;
+}
@@ -0,0 +1,190 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "lzimage.h"
+
+/** @param data compressed image, it isn't read before Rewind() */
+LzImage::LzImage(const uint8_t* data)
+   : data(data), size(0), packedEnd(0), inPos(0), outPos(0), flags(0), flagBits(0), matchDistance(1), matchLength(0)
+{
+}
+
+/** Start decompressing another image */
+void LzImage::Open(const uint8_t* image)
+{
+   data = image;
+   Rewind();
+}
+
+/** Read the header and start decompressing from the beginning */
+void LzImage::Rewind()
+{
+   size = data[0] | (data[1] << 8);
+   packedEnd = HeaderSize + (data[2] | (data[3] << 8));
+   inPos = HeaderSize;
+   outPos = 0;
+   flagBits = 0;
+   matchLength = 0;
+
+   //References to before the start of a corrupt image read zeros
+   for (int i = 0; i < WindowSize; i++)
+      window[i] = 0;
+}
+
+/** Position the image so the next Read() starts at byte pos
+ * @return false if the image is shorter */
+bool LzImage::Seek(int pos)
+{
+   if (pos < outPos)
+      Rewind();
+
+   while (outPos < pos)
+   {
+      if (NextByte() < 0) return false;
+   }
+
+   return true;
+}
+
+/** @return number of bytes read, less than len at the end of the image */
+int LzImage::Read(uint8_t* out, int len)
+{
+   int i;
+
+   for (i = 0; i < len; i++)
+   {
+      int byte = NextByte();
+
+      if (byte < 0) break;
+
+      out[i] = byte;
+   }
+
+   return i;
+}
+
+/** Greedy compression with the longest match in the window
+ * @param[out] out compressed image, must hold MaxSize(len) bytes
+ * @return compressed size including the header, -1 if it doesn't fit */
+int LzImage::Compress(const uint8_t* in, int len, uint8_t* out, int outSize)
+{
+   int pos = 0, o = HeaderSize, flagPos = 0, numFlags = 8;
+
+   if (len > 0xffff || outSize < MaxSize(len)) return -1;
+
+   while (pos < len)
+   {
+      int bestLength = 0, bestDistance = 0;
+
+      if (numFlags == 8)
+      {
+         flagPos = o++;
+         out[flagPos] = 0;
+         numFlags = 0;
+      }
+
+      for (int distance = 1; distance <= WindowSize && distance <= pos && bestLength < MaxMatch; distance++)
+      {
+         int length = 0;
+
+         //A match may overlap the data it produces
+         while (length < MaxMatch && (pos + length) < len && in[pos + length] == in[pos + length - distance])
+            length++;
+
+         if (length > bestLength)
+         {
+            bestLength = length;
+            bestDistance = distance;
+         }
+      }
+
+      if (bestLength >= MinMatch)
+      {
+         uint16_t ref = (bestDistance - 1) | ((bestLength - MinMatch) << DistanceBits);
+
+         out[flagPos] |= 1 << numFlags;
+         out[o++] = ref & 0xff;
+         out[o++] = ref >> 8;
+         pos += bestLength;
+      }
+      else
+      {
+         out[o++] = in[pos++];
+      }
+      numFlags++;
+   }
+
+   if ((o - HeaderSize) > 0xffff) return -1;
+
+   out[0] = len & 0xff;
+   out[1] = len >> 8;
+   out[2] = (o - HeaderSize) & 0xff;
+   out[3] = (o - HeaderSize) >> 8;
+
+   return o;
+}
+
+/** @return next byte of output, -1 at the end or if the compressed data ends early */
+int LzImage::NextByte()
+{
+   uint8_t byte;
+
+   if (outPos >= size) return -1;
+
+   if (matchLength > 0)
+   {
+      byte = window[(outPos - matchDistance) & (WindowSize - 1)];
+      matchLength--;
+   }
+   else
+   {
+      if (flagBits == 0)
+      {
+         if (inPos >= packedEnd) return -1;
+
+         flags = data[inPos++];
+         flagBits = 8;
+      }
+
+      bool reference = flags & 1;
+      flags >>= 1;
+      flagBits--;
+
+      if (reference)
+      {
+         if ((inPos + 2) > packedEnd) return -1;
+
+         uint16_t ref = data[inPos] | (data[inPos + 1] << 8);
+         inPos += 2;
+         matchDistance = (ref & (WindowSize - 1)) + 1;
+         matchLength = (ref >> DistanceBits) + MinMatch - 1;
+         byte = window[(outPos - matchDistance) & (WindowSize - 1)];
+      }
+      else
+      {
+         if (inPos >= packedEnd) return -1;
+
+         byte = data[inPos++];
+      }
+   }
+
+   window[outPos & (WindowSize - 1)] = byte;
+   outPos++;
+
+   return byte;
+}
@@ -0,0 +1,294 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include "hwdefs.h"
+#include "ocvtable.h"
+
+#define CURRENT_VERSION 1
+#define TBL_WORDS       (sizeof(Saved) / sizeof(uint32_t))
+
+const OcvTable::Data OcvTable::presets[] =
+{
+   //LFP, the former fixed table
+   { 1, 11, { 0 }, { 25 }, { 0, 10, 20, 30, 40, 50, 60, 70, 80, 90, 100 },
+     { { 2700, 3223, 3257, 3283, 3292, 3295, 3302, 3323, 3331, 3334, 3357 } } },
+   //NMC, typical values at room temperature
+   { 1, 13, { 0 }, { 25 }, { 0, 5, 10, 20, 30, 40, 50, 60, 70, 80, 90, 95, 100 },
+     { { 3000, 3450, 3550, 3620, 3670, 3720, 3770, 3840, 3920, 4000, 4080, 4130, 4180 } } }
+};
+
+OcvTable::Data OcvTable::table;
+OcvTable::Data OcvTable::staging;
+bool OcvTable::complete = false;
+
+void OcvTable::LoadPreset(Preset preset)
+{
+   table = presets[preset];
+   complete = true;
+}
+
+/** Load the table saved by SaveToFlash()
+ * @return true if a valid table was found */
+bool OcvTable::LoadFromFlash()
+{
+   const Saved* tbl = (const Saved*)OCVTBL_ADDRESS;
+
+   crc_reset();
+   uint32_t crc = crc_calculate_block((uint32_t*)tbl, TBL_WORDS - 1);
+
+   if (crc != tbl->crc || tbl->version != CURRENT_VERSION || !Check(tbl->data))
+      return false;
+
+   table = tbl->data;
+   complete = true;
+   return true;
+}
+
+/** Take over a staged table, then write the active table to its flash page.
+ * Erasing stalls the CPU for about 20 ms
+ * @return true if the table is complete and has been written */
+bool OcvTable::SaveToFlash()
+{
+   Saved tbl;
+
+   if (staging.numTemperatures > 0 && !ApplyStaged()) return false;
+   if (!complete) return false;
+
+   tbl.version = CURRENT_VERSION;
+   tbl.data = table;
+   crc_reset();
+   tbl.crc = crc_calculate_block((uint32_t*)&tbl, TBL_WORDS - 1);
+
+   flash_unlock();
+   flash_erase_page(OCVTBL_ADDRESS);
+
+   for (uint32_t idx = 0; idx < TBL_WORDS; idx++)
+   {
+      uint32_t* pData = ((uint32_t*)&tbl) + idx;
+      flash_program_word(OCVTBL_ADDRESS + idx * sizeof(uint32_t), *pData);
+   }
+   flash_lock();
+
+   return LoadFromFlash();
+}
+
+/** Start entering a new table into the staging table
+ * @param temperatures column temperatures in °C, ascending
+ * @param count number of columns */
+bool OcvTable::SetTemperatures(const int* temperatures, int count)
+{
+   if (count < 1 || count > maxTemperatures) return false;
+
+   for (int i = 0; i < count; i++)
+   {
+      if (temperatures[i] < -40 || temperatures[i] > 100 || (i > 0 && temperatures[i] <= temperatures[i - 1]))
+         return false;
+   }
+
+   staging = Data();
+   staging.numTemperatures = count;
+
+   for (int i = 0; i < count; i++)
+      staging.temperatures[i] = temperatures[i];
+
+   return true;
+}
+
+/** Append a row to the staging table, SoC and voltages must keep ascending
+ * @param soc in %
+ * @param voltages one open circuit voltage in mV per temperature */
+bool OcvTable::AddRow(int soc, const int* voltages)
+{
+   int point = staging.numPoints;
+
+   if (staging.numTemperatures == 0 || point >= maxPoints || soc < 0 || soc > 100) return false;
+   if (point > 0 && soc <= staging.soc[point - 1]) return false;
+
+   for (int i = 0; i < staging.numTemperatures; i++)
+   {
+      if (voltages[i] <= 0 || voltages[i] > 5000) return false;
+      if (point > 0 && voltages[i] <= staging.voltages[i][point - 1]) return false;
+   }
+
+   staging.soc[point] = soc;
+
+   for (int i = 0; i < staging.numTemperatures; i++)
+      staging.voltages[i][point] = voltages[i];
+
+   staging.numPoints++;
+   return true;
+}
+
+/** Make the staging table the active one if it is complete, i.e. has at
+ * least two rows. Otherwise it stays staged so more rows can be added
+ * @return true if the table was taken over */
+bool OcvTable::ApplyStaged()
+{
+   if (!Check(staging)) return false;
+
+   table = staging;
+   staging = Data();
+   complete = true;
+   return true;
+}
+
+/** SoC at rest
+ * @param voltage cell voltage in mV
+ * @param temperature cell temperature in °C
+ * @return SoC in % */
+s32fp OcvTable::GetSoc(int voltage, s32fp temperature)
+{
+   const Data& data = Active();
+   int column;
+   int32_t weight;
+   int32_t vtg = voltage << 8;
+
+   FindColumn(data, temperature, column, weight);
+
+   int lo = 0, hi = data.numPoints - 1;
+   int32_t vlo = ColumnVoltage(data, column, weight, lo);
+   int32_t vhi = ColumnVoltage(data, column, weight, hi);
+
+   if (vtg <= vlo) return FP_FROMINT(data.soc[lo]);
+   if (vtg >= vhi) return FP_FROMINT(data.soc[hi]);
+
+   while (hi - lo > 1)
+   {
+      int mid = (lo + hi) / 2;
+      int32_t vmid = ColumnVoltage(data, column, weight, mid);
+
+      if (vmid <= vtg)
+      {
+         lo = mid;
+         vlo = vmid;
+      }
+      else
+      {
+         hi = mid;
+         vhi = vmid;
+      }
+   }
+
+   int64_t socDiff = FP_FROMINT(data.soc[hi] - data.soc[lo]);
+   return FP_FROMINT(data.soc[lo]) + (socDiff * (vtg - vlo)) / (vhi - vlo);
+}
+
+/** Open circuit voltage, the inverse of GetSoc() with finer resolution
+ * @param soc state of charge, 1 << 30 is 100%
+ * @param temperature cell temperature in °C
+ * @param[out] slope change of the voltage in uV per 100% at soc
+ * @return open circuit voltage in uV */
+int32_t OcvTable::GetVoltage(int32_t soc, s32fp temperature, int32_t& slope)
+{
+   const Data& data = Active();
+   int column;
+   int32_t weight;
+   //SoC in % with 30 fractional bits
+   int64_t pos = (int64_t)soc * 100;
+   int lo = 0, hi = data.numPoints - 1;
+
+   FindColumn(data, temperature, column, weight);
+
+   while (hi - lo > 1)
+   {
+      int mid = (lo + hi) / 2;
+
+      if (((int64_t)data.soc[mid] << 30) <= pos)
+         lo = mid;
+      else
+         hi = mid;
+   }
+
+   int64_t vlo = ((int64_t)ColumnVoltage(data, column, weight, lo) * 1000) >> 8;
+   int64_t vhi = ((int64_t)ColumnVoltage(data, column, weight, hi) * 1000) >> 8;
+   int64_t width = (int64_t)(data.soc[hi] - data.soc[lo]) << 30;
+
+   //Beyond the first or last row extend the outer segment
+   pos -= (int64_t)data.soc[lo] << 30;
+   pos = pos < 0 ? 0 : (pos > width ? width : pos);
+   slope = (vhi - vlo) * 100 / (data.soc[hi] - data.soc[lo]);
+
+   return vlo + (vhi - vlo) * pos / width;
+}
+
+bool OcvTable::Check(const Data& data)
+{
+   if (data.numTemperatures < 1 || data.numTemperatures > maxTemperatures) return false;
+   if (data.numPoints < 2 || data.numPoints > maxPoints) return false;
+
+   for (int i = 1; i < data.numTemperatures; i++)
+   {
+      if (data.temperatures[i] <= data.temperatures[i - 1]) return false;
+   }
+
+   for (int p = 1; p < data.numPoints; p++)
+   {
+      if (data.soc[p] <= data.soc[p - 1] || data.soc[p] > 100) return false;
+
+      for (int i = 0; i < data.numTemperatures; i++)
+      {
+         if (data.voltages[i][p] <= data.voltages[i][p - 1]) return false;
+      }
+   }
+   return true;
+}
+
+/** Find the columns around the temperature
+ * @param[out] column lower column
+ * @param[out] weight of the upper column, 16 fractional bits. 0 beyond the outer columns */
+void OcvTable::FindColumn(const Data& data, s32fp temperature, int& column, int32_t& weight)
+{
+   int lo = 0, hi = data.numTemperatures - 1;
+
+   column = 0;
+   weight = 0;
+
+   if (temperature <= FP_FROMINT(data.temperatures[lo])) return;
+
+   if (temperature >= FP_FROMINT(data.temperatures[hi]))
+   {
+      column = hi;
+      return;
+   }
+
+   while (hi - lo > 1)
+   {
+      int mid = (lo + hi) / 2;
+
+      if (FP_FROMINT(data.temperatures[mid]) <= temperature)
+         lo = mid;
+      else
+         hi = mid;
+   }
+
+   column = lo;
+   weight = ((temperature - FP_FROMINT(data.temperatures[lo])) << 16) / FP_FROMINT(data.temperatures[hi] - data.temperatures[lo]);
+}
+
+/** @return voltage of a row interpolated between two columns in mV with 8 fractional bits */
+int32_t OcvTable::ColumnVoltage(const Data& data, int column, int32_t weight, int point)
+{
+   int32_t vtg = data.voltages[column][point] << 8;
+
+   if (weight > 0)
+      vtg += ((data.voltages[column + 1][point] - data.voltages[column][point]) * weight) >> 8;
+
+   return vtg;
+}
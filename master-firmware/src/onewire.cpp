@@ -19,6 +19,7 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/dma.h>
 #include <libopencm3/stm32/usart.h>
+#include <libopencm3/cm3/cortex.h>
 
 #include "onewire.h"
 #include "hwdefs.h"
@@ -26,53 +27,118 @@
 #include "digio.h"
 
 uint8_t OneWire::buffer[];
+uint8_t OneWire::txBuffer[];
+OneWire::Frame OneWire::frames[];
+volatile int OneWire::firstFrame = 0;
+volatile int OneWire::numFrames = 0;
+volatile uint32_t OneWire::frameStart = 0;
+volatile bool OneWire::frameBrk = false;
+volatile uint32_t OneWire::halfTransfers = 0;
+volatile uint32_t OneWire::overruns = 0;
+void (*OneWire::frameReceived)() = 0;
 
-void OneWire::StartReceiveMode()
+/** Start circular reception, the DMA channel keeps running from here on */
+void OneWire::Init()
 {
-   usart_set_mode(USART1, USART_MODE_TX_RX);
    dma_disable_channel(DMA1, BMS_USART_DMARX);
-   dma_disable_channel(DMA1, BMS_USART_DMATX);
-   dma_set_memory_address(DMA1, BMS_USART_DMARX, (uint32_t)buffer);
+   dma_set_memory_address(DMA1, BMS_USART_DMARX, (uintptr_t)buffer);
    dma_set_number_of_data(DMA1, BMS_USART_DMARX, sizeof(buffer));
+   dma_enable_half_transfer_interrupt(DMA1, BMS_USART_DMARX);
+   dma_enable_transfer_complete_interrupt(DMA1, BMS_USART_DMARX);
+   halfTransfers = 0;
+   numFrames = 0;
+   frameStart = 0;
+   frameBrk = false;
    dma_enable_channel(DMA1, BMS_USART_DMARX);
+}
+
+/** Enable receiver and forget all frames received before */
+void OneWire::StartReceiveMode()
+{
+   numFrames = 0;
+   frameStart = GetWriteCount();
+   frameBrk = false;
+   usart_set_mode(USART1, USART_MODE_TX_RX);
    gpio_toggle(GPIOB, GPIO9);
 }
 
-int OneWire::GetReceivedData(uint8_t* data, int numBytes)
+int OneWire::GetNumFrames()
 {
-   uint16_t availableBytes = sizeof(buffer) - dma_get_number_of_data(DMA1, BMS_USART_DMARX);
-   int res = numBytes < availableBytes ? numBytes : availableBytes;
+   return numFrames;
+}
 
-   //Always copy the last received bytes. Especially in set address commands
-   //the buffer is polluted with break frames
-   while (numBytes > 0 && availableBytes > 0)
-   {
-      numBytes--;
-      availableBytes--;
-      data[numBytes] = buffer[availableBytes];
-   }
+/** @param index frame number, 0 is the oldest frame since the last transmission
+ * @return number of bytes in frame, not counting the break. 0 if DMA has overwritten it */
+int OneWire::GetFrameLength(int index)
+{
+   if (index < 0 || index >= numFrames) return 0;
+
+   Frame& frame = frames[(firstFrame + index) % maxFrames];
+
+   return IsOverwritten(frame) ? 0 : frame.length;
+}
+
+/** Copy part of a frame out of the ring buffer. Callers only take the
+ * reply structures they parse, so frames that wrap around the end of the
+ * ring buffer need no linear copy
+ * @param index frame number, 0 is the oldest frame since the last transmission
+ * @param offset first byte to copy, counted from the start of the frame
+ * @param[out] data destination
+ * @param numBytes number of bytes to copy
+ * @return number of bytes copied, fewer if the frame ends before. 0 if DMA has overwritten
+ * the frame, also while copying
+ */
+int OneWire::ReadFrame(int index, int offset, void* data, int numBytes)
+{
+   int length = GetFrameLength(index);
+   uint8_t* dest = (uint8_t*)data;
+
+   if (offset < 0 || offset >= length) return 0;
+   if (numBytes > length - offset) numBytes = length - offset;
+
+   Frame& frame = frames[(firstFrame + index) % maxFrames];
+   int pos = (frame.start + offset) % bufferSize;
+
+   for (int i = 0; i < numBytes; i++, pos = (pos + 1) % bufferSize)
+      dest[i] = buffer[pos];
 
-   return res;
+   return IsOverwritten(frame) ? 0 : numBytes;
 }
 
-void OneWire::SendData(const uint8_t* data, int numBytes)
+/** @return number of bytes in all complete frames since the last transmission */
+int OneWire::GetNumBytesReceived()
 {
+   int numBytes = 0;
+
+   for (int i = 0; i < numFrames; i++)
+      numBytes += frames[(firstFrame + i) % maxFrames].length;
+
+   return numBytes;
+}
+
+/** Send a frame preceded by a break
+ * @return false if the frame doesn't fit into the transmit buffer, nothing is sent then */
+bool OneWire::SendData(const uint8_t* data, int numBytes)
+{
+   if (numBytes > txBufferSize) return false;
+
    usart_set_mode(USART1, USART_MODE_TX);
 
-   dma_disable_channel(DMA1, BMS_USART_DMARX);
    dma_disable_channel(DMA1, BMS_USART_DMATX);
    dma_set_number_of_data(DMA1, BMS_USART_DMATX, numBytes);
-   dma_set_memory_address(DMA1, BMS_USART_DMATX, (uint32_t)buffer);
+   dma_set_memory_address(DMA1, BMS_USART_DMATX, (uintptr_t)txBuffer);
    dma_clear_interrupt_flags(DMA1, BMS_USART_DMATX, DMA_TCIF);
 
    while (numBytes > 0)
    {
-      buffer[numBytes - 1] = data[numBytes - 1];
+      txBuffer[numBytes - 1] = data[numBytes - 1];
       numBytes--;
    }
 
    USART1_CR1 |= USART_CR1_SBK;
    dma_enable_channel(DMA1, BMS_USART_DMATX);
+
+   return true;
 }
 
 bool OneWire::IsReceiving()
@@ -80,9 +146,143 @@ bool OneWire::IsReceiving()
    return (USART_CR1(BMS_USART) & USART_CR1_RE) != 0;
 }
 
-extern "C" void usart1_isr()
+/** Change bit rate, only call when no frame is being sent or received */
+void OneWire::SetBaudrate(int baud)
 {
-   USART1_SR &= ~USART_SR_TC;
-   OneWire::StartReceiveMode();
+   usart_set_baudrate(BMS_USART, baud);
+}
+
+/** Set function to be called from interrupt context when the line
+ * becomes idle after receiving data, i.e. a reply is complete */
+void OneWire::SetFrameReceivedCallback(void (*callback)())
+{
+   frameReceived = callback;
+}
+
+void OneWire::IdleLineDetected()
+{
+   if (!IsReceiving()) return;
+
+   if (CloseFrame(GetWriteCount()) && frameReceived != 0)
+      frameReceived();
+}
+
+/** A break is received as 0 with framing error, it ends the current
+ * frame and starts a new one */
+void OneWire::BreakDetected()
+{
+   if (!IsReceiving()) return;
+
+   uint32_t end = GetWriteCount();
+
+   //The break character itself has already been written by DMA
+   CloseFrame(end - 1);
+   frameStart = end;
+   frameBrk = true;
 }
 
+int OneWire::GetWritePosition()
+{
+   return (bufferSize - dma_get_number_of_data(DMA1, BMS_USART_DMARX)) % bufferSize;
+}
+
+/** @return number of bytes DMA has written since Init(), it counts on where
+ * the write position wraps around */
+uint32_t OneWire::GetWriteCount()
+{
+   const int halfSize = bufferSize / 2;
+   uint32_t halves;
+   int pos;
+
+   do
+   {
+      halves = halfTransfers;
+      pos = GetWritePosition();
+   } while (halves != halfTransfers);
+
+   //The interrupt of the half that has just been filled may still be pending
+   if ((int)(halves % 2) != pos / halfSize)
+      halves++;
+
+   return halves * halfSize + pos % halfSize;
+}
+
+/** A frame is lost once DMA has written more than the ring buffer holds since
+ * its start. The first time we notice counts as an overrun */
+bool OneWire::IsOverwritten(Frame& frame)
+{
+   uint32_t masked = cm_mask_interrupts(1);
+
+   if (!frame.lost && GetWriteCount() - frame.start > (uint32_t)bufferSize)
+   {
+      frame.lost = true;
+      overruns++;
+   }
+
+   cm_mask_interrupts(masked);
+
+   return frame.lost;
+}
+
+/** Put bytes from frameStart to end into the frame queue. If the queue
+ * is full the oldest frame is dropped. So is a frame longer than the ring
+ * buffer, it has overwritten its own start
+ * @return true if a frame was added */
+bool OneWire::CloseFrame(uint32_t end)
+{
+   int32_t length = end - frameStart;
+   bool added = length > 0 || frameBrk;
+
+   if (length > bufferSize)
+   {
+      overruns++;
+      added = false;
+   }
+   else if (added)
+   {
+      if (numFrames == maxFrames)
+      {
+         firstFrame = (firstFrame + 1) % maxFrames;
+         numFrames--;
+      }
+
+      Frame& frame = frames[(firstFrame + numFrames) % maxFrames];
+      frame.start = frameStart;
+      frame.length = length > 0 ? length : 0;
+      frame.brk = frameBrk;
+      frame.lost = false;
+      numFrames++;
+   }
+
+   frameStart = end;
+   frameBrk = false;
+
+   return added;
+}
+
+extern "C" void dma1_channel5_isr()
+{
+   dma_clear_interrupt_flags(DMA1, BMS_USART_DMARX, DMA_HTIF | DMA_TCIF);
+   OneWire::HalfTransferComplete();
+}
+
+extern "C" void usart1_isr()
+{
+   uint32_t sr = USART1_SR;
+
+   if (sr & (USART_SR_IDLE | USART_SR_FE))
+   {
+      (void)USART1_DR; //Reading DR after SR clears the idle and error flags
+
+      if (sr & USART_SR_FE)
+         OneWire::BreakDetected();
+      if (sr & USART_SR_IDLE)
+         OneWire::IdleLineDetected();
+   }
+
+   if (sr & USART_SR_TC)
+   {
+      USART1_SR &= ~USART_SR_TC;
+      OneWire::StartReceiveMode();
+   }
+}
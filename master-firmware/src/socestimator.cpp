@@ -0,0 +1,199 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "socestimator.h"
+#include "bmscalculation.h"
+#include "my_math.h"
+
+#define ONE             (1 << 30)
+//Process noise per step and measurement noise, all Q30
+#define Q_SOC           4        //random walk of about 1% SoC per hour
+#define Q_RC            43       //(0.2 mV)^2
+#define Q_RATIO         1
+#define R_VOLTAGE       26844    //(5 mV)^2, mostly model error
+#define R_UNCERTAINTY   500      //uV per A, error of the modelled resistance
+//Initial uncertainty
+#define P_SOC_INIT      2684355  //(5%)^2
+#define P_RC_INIT       107374   //(10 mV)^2
+#define P_RATIO_INIT    2684355  //(5%)^2
+
+s32fp SocEstimator::nominalCapacity = FP_FROMINT(100);
+s32fp SocEstimator::r0;
+int64_t SocEstimator::chargeScale;
+int32_t SocEstimator::decay = ONE;
+int64_t SocEstimator::rcGain;
+int32_t SocEstimator::soc = ONE / 2;
+int32_t SocEstimator::rcVoltage;
+int32_t SocEstimator::capacityRatio = ONE;
+int32_t SocEstimator::p00 = P_SOC_INIT;
+int32_t SocEstimator::p01;
+int32_t SocEstimator::p02;
+int32_t SocEstimator::p11 = P_RC_INIT;
+int32_t SocEstimator::p12;
+int32_t SocEstimator::p22 = P_RATIO_INIT;
+int32_t SocEstimator::sampleSum;
+int SocEstimator::samples;
+volatile int SocEstimator::measuredVoltage;
+volatile bool SocEstimator::haveVoltage = false;
+
+/** Set cell model parameters, e.g. after the user changed them
+ * @param capacity nominal capacity in Ah
+ * @param r0 series resistance in mOhm
+ * @param r1 resistance of the RC element in mOhm
+ * @param tau time constant of the RC element in s, at least 10 */
+void SocEstimator::SetModel(s32fp capacity, s32fp r0, s32fp r1, s32fp tau)
+{
+   //Q30 per 1/32 As with 24 more bits so that small currents aren't lost
+   int64_t scale = ((int64_t)1 << 54) / (3600000LL * MAX(capacity, 1));
+   //Q30 step time over time constant, the series is exact enough for up to 0.01
+   int32_t x = ((int64_t)stepMs << (30 + CST_DIGITS)) / (1000 * MAX(tau, FP_FROMINT(10)));
+   int32_t a = ONE - x + MulQ30(x, x) / 2;
+   //Q30 V per s32fp A
+   int64_t r1Scale = ((int64_t)r1 << 20) / 1000;
+
+   nominalCapacity = capacity;
+   SocEstimator::r0 = r0;
+   chargeScale = scale;
+   decay = a;
+   rcGain = (ONE - a) * r1Scale;
+}
+
+/** Restart from a known SoC, the learned capacity is kept
+ * @param soc state of charge in % */
+void SocEstimator::Reset(s32fp soc)
+{
+   SocEstimator::soc = ((int64_t)soc << 30) / FP_FROMINT(100);
+   rcVoltage = 0;
+   p00 = P_SOC_INIT;
+   p01 = 0;
+   p02 = 0;
+   p11 = P_RC_INIT;
+   p12 = 0;
+}
+
+/** Hand over a new average cell voltage, it is used by the next step
+ * @param cellVoltage in mV */
+void SocEstimator::SetVoltage(int cellVoltage)
+{
+   if (cellVoltage <= 0) return;
+
+   measuredVoltage = cellVoltage;
+   haveVoltage = true;
+}
+
+/** Call every millisecond
+ * @param current positive when charging */
+void SocEstimator::AddSample(s32fp current)
+{
+   sampleSum += current;
+   samples++;
+
+   if (samples == stepMs)
+   {
+      Step(sampleSum);
+      sampleSum = 0;
+      samples = 0;
+   }
+}
+
+/** One filter step, AddSample() calls this every stepMs
+ * @param currentSum sum of the current samples since the previous step */
+void SocEstimator::Step(int32_t currentSum)
+{
+   int32_t current = currentSum / stepMs;
+
+   Predict(currentSum, current);
+
+   if (haveVoltage)
+   {
+      haveVoltage = false;
+      Correct(current);
+   }
+}
+
+/** @return state of charge in % */
+s32fp SocEstimator::GetSoc()
+{
+   return ((int64_t)soc * FP_FROMINT(100)) >> 30;
+}
+
+/** @return estimated actual capacity in Ah */
+s32fp SocEstimator::GetCapacity()
+{
+   return ((int64_t)nominalCapacity << 30) / capacityRatio;
+}
+
+/** Propagate state and covariance with F = [1 0 delta; 0 decay 0; 0 0 1] */
+void SocEstimator::Predict(int32_t currentSum, int32_t current)
+{
+   //SoC change if the capacity were nominal
+   int32_t delta = (currentSum * chargeScale) >> 24;
+
+   soc += MulQ30(delta, capacityRatio);
+   soc = MAX(0, MIN(soc, ONE));
+   rcVoltage = MulQ30(decay, rcVoltage) + ((rcGain * current) >> 30);
+
+   p00 += 2 * MulQ30(delta, p02) + MulQ30(delta, MulQ30(delta, p22)) + Q_SOC;
+   p01 = MulQ30(decay, p01 + MulQ30(delta, p12));
+   p02 += MulQ30(delta, p22);
+   p11 = MulQ30(decay, MulQ30(decay, p11)) + Q_RC;
+   p12 = MulQ30(decay, p12);
+   p22 += Q_RATIO;
+}
+
+/** Correct the state with the measured voltage, H = [dOCV/dSoC 1 0] */
+void SocEstimator::Correct(int32_t current)
+{
+   int32_t slope;
+   int32_t ocv = BmsCalculation::GetOpenCircuitVoltage(soc, slope);
+   int32_t predicted = ocv + (((int64_t)rcVoltage * 1000000) >> 30) + (((int64_t)current * r0 * 1000) >> (2 * CST_DIGITS));
+   int32_t error = measuredVoltage * 1000 - predicted;
+   //Under load an error in the modelled resistance shows as voltage error, Q15 V
+   int32_t loadError = ((ABS(current) * R_UNCERTAINTY >> CST_DIGITS) * 34360) >> 20;
+
+   //Don't let a bogus reading throw off the estimate, convert uV to Q30 V
+   error = MAX(-1000000, MIN(error, 1000000));
+   error = ((int64_t)error * 1125899907) >> 20;
+
+   //Q24 V per 100% SoC
+   int64_t h = ((int64_t)slope * 17592186) >> 20;
+   //g = H * P, innovation variance s = H * P * H' + R
+   int64_t g0 = ((h * p00) >> 24) + p01;
+   int64_t g1 = ((h * p01) >> 24) + p11;
+   int64_t g2 = ((h * p02) >> 24) + p12;
+   int64_t s = ((h * g0) >> 24) + g1 + R_VOLTAGE + loadError * loadError;
+   //Kalman gain K = g' / s
+   int64_t k0 = (g0 << 30) / s;
+   int64_t k1 = (g1 << 30) / s;
+   int64_t k2 = (g2 << 30) / s;
+
+   soc += (k0 * (error >> 8)) >> 22;
+   soc = MAX(0, MIN(soc, ONE));
+   rcVoltage += (k1 * (error >> 8)) >> 22;
+   capacityRatio += (k2 * (error >> 8)) >> 22;
+   //Capacity between 2/3 and twice the nominal value
+   capacityRatio = MAX(ONE / 2, MIN(capacityRatio, 3 * (ONE / 2)));
+
+   //P = P - K * H * P
+   p00 = MAX(1, p00 - ((k0 * g0) >> 30));
+   p01 -= (k0 * g1) >> 30;
+   p02 -= (k0 * g2) >> 30;
+   p11 = MAX(1, p11 - ((k1 * g1) >> 30));
+   p12 -= (k1 * g2) >> 30;
+   p22 = MAX(1, p22 - ((k2 * g2) >> 30));
+}
@@ -25,6 +25,7 @@
 #include <libopencm3/stm32/iwdg.h>
 #include <libopencm3/stm32/can.h>
 #include <libopencm3/stm32/crc.h>
+#include <libopencm3/stm32/rcc.h>
 #include "stm32_can.h"
 #include "terminal.h"
 #include "params.h"
@@ -40,23 +41,62 @@
 #include "onewire.h"
 #include "bmscomm.h"
 #include "bmscalculation.h"
+#include "cellstatistics.h"
+#include "telemetry.h"
+#include "jsonstream.h"
+#include "cellhistory.h"
 #include "bmsstate.h"
+#include "chargeintegrator.h"
+#include "socestimator.h"
+#include "ocvtable.h"
+#include "balanceplanner.h"
 #include "isashunt.h"
+#include "taskprofiler.h"
+#include "imagestore.h"
 
 #define CAN_TIMEOUT       50  //500ms
+#define STATE_SAVE_PERIOD 3000 //5 min
 
 static Stm32Scheduler* scheduler;
 static Can* can1;
 static Can* can2;
 static uint32_t noCurrentMillis = 0;
 static uint32_t ignOffTime = 0;
-static const uint16_t lfpVtgToSoc[] = { 2700, 3223, 3257, 3283, 3292, 3295, 3302, 3323, 3331, 3334, 3357 };
+
+/** Copy charge counters to the battery state and append it to the flash journal */
+static void SaveBatteryState()
+{
+   BMSState::SetChargein(Param::Get(Param::chargein));
+   BMSState::SetChargeout(Param::Get(Param::chargeout));
+   BMSState::SaveToFlash();
+}
+
+/** Execution times of the tasks in the order they are added in main() */
+static void PublishTaskProfile()
+{
+   static const Param::PARAM_NUM values[][3] =
+   {
+      { Param::t1msavg, Param::t1msmax, Param::t1msmiss },
+      { Param::t10msavg, Param::t10msmax, Param::t10msmiss },
+      { Param::t40msavg, Param::t40msmax, Param::t40msmiss },
+      { Param::t100msavg, Param::t100msmax, Param::t100msmiss }
+   };
+
+   for (int i = 0; i < TaskProfiler::GetNumTasks() && i < (int)(sizeof(values) / sizeof(values[0])); i++)
+   {
+      Param::SetInt(values[i][0], TaskProfiler::GetAvg(i));
+      Param::SetInt(values[i][1], TaskProfiler::GetMax(i));
+      Param::SetInt(values[i][2], TaskProfiler::GetMisses(i));
+   }
+}
 
 static void Ms100Task(void)
 {
    static int relayStopCnt = 0;
+   static int saveTimer = 0;
    static bool lastIgnState = true;
    static s32fp batmaxFiltered = 0, batminFiltered = 0;
+   static uint32_t lastSecond = 0;
    States state = (States)Param::GetInt(Param::opmode);
 
    iwdg_reset();
@@ -64,14 +104,19 @@ static void Ms100Task(void)
 
    s32fp cpuLoad = FP_FROMINT(scheduler->GetCpuLoad());
    Param::SetFlt(Param::cpuload, cpuLoad / 10);
+   PublishTaskProfile();
 
    if (IsaShunt::IsReady())
    {
       IsaShunt::RequestCharge();
 
-      Param::SetInt(Param::chargein, IsaShunt::GetChargeIn());
-      Param::SetInt(Param::chargeout, IsaShunt::GetChargeOut());
-      BmsCalculation::SetCharge(FP_FROMINT(IsaShunt::GetChargeIn()), FP_FROMINT(IsaShunt::GetChargeOut()));
+      ChargeIntegrator::AddCounters(IsaShunt::GetChargeIn(), IsaShunt::GetChargeOut());
+
+      s32fp chargein = ChargeIntegrator::GetChargeIn();
+      s32fp chargeout = ChargeIntegrator::GetChargeOut();
+      Param::SetFlt(Param::chargein, chargein);
+      Param::SetFlt(Param::chargeout, chargeout);
+      BmsCalculation::SetCharge(chargein, chargeout);
    }
 
    Param::SetInt(Param::ignition, DigIo::IgnIn.Get());
@@ -94,7 +139,7 @@ static void Ms100Task(void)
 
       if (ttostandby == 0)
       {
-         BMSState::SaveToFlash();
+         SaveBatteryState();
          DigIo::BoardPower.Clear();
       }
    }
@@ -114,6 +159,12 @@ static void Ms100Task(void)
       curLim = MIN(Param::Get(Param::dismaxcur), curLim);
       curLim = MAX(0, curLim);
       Param::SetFlt(Param::dislim, curLim);
+
+      if (rtc_get_counter_val() != lastSecond)
+      {
+         CellStatistics::CountExtremes(BmsCalculation::GetMinCell(), BmsCalculation::GetMaxCell());
+         lastSecond = rtc_get_counter_val();
+      }
    }
    else
    {
@@ -123,6 +174,14 @@ static void Ms100Task(void)
 
    lastIgnState = DigIo::IgnIn.Get();
 
+   //The journal keeps the state across crashes and resets, unchanged state isn't written
+   saveTimer++;
+   if (saveTimer >= STATE_SAVE_PERIOD)
+   {
+      SaveBatteryState();
+      saveTimer = 0;
+   }
+
    switch (Param::GetInt(Param::testcmd))
    {
    case AllOn:
@@ -148,8 +207,9 @@ static void Ms100Task(void)
       int soc = BmsCalculation::EstimateSocFromVoltage(Param::GetInt(Param::batavg));
       Param::SetInt(Param::socest, soc);
       Param::SetInt(Param::soc, soc);
+      SocEstimator::Reset(FP_FROMINT(soc));
       BMSState::SetEstimatedSoC(FP_FROMINT(soc));
-      BMSState::SaveToFlash();
+      SaveBatteryState();
       break;
    }
 
@@ -204,115 +264,238 @@ static void Ms100Task(void)
       can1->SendAll();
 }
 
-static void CellModuleCommunication()
+/** Publish pack statistics. They are updated with every module reply,
+ * so this may be called at any time, not only after a complete cycle
+ * @param[out] avg average cell voltage including the second BMS
+ * @param[out] voltageSum sum of all cell voltages of this BMS
+ */
+static void PublishPackStats(int& avg, s32fp& voltageSum)
 {
-   static int numCellMods;
-   static int timeout = 10, commTimeout = 10;
-   static int currentCellMod = 1;
-   static int lastSocEst = -1;
-   static bool inverted = false;
-   static bool commRunning = true;
-   static States state = Start;
+   int min, max;
 
-   Param::SetInt(Param::curmodule, currentCellMod);
+   BmsCalculation::AggregateVoltages(min, max, avg, voltageSum);
 
-   if (state == Run)
+   if (Param::Get(Param::batavg2) > 0)
    {
-      commRunning &= BmsComm::Acquire(currentCellMod);
+      avg += Param::GetInt(Param::batavg2);
+      avg /= 2;
+      min = MIN(min, Param::GetInt(Param::batmin2));
+      max = MAX(max, Param::GetInt(Param::batmax2));
+   }
+
+   Param::SetInt(Param::batmin, min);
+   Param::SetInt(Param::batmax, max);
+   Param::SetInt(Param::batavg, avg);
+   Param::SetInt(Param::mincell, BmsCalculation::GetMinCell() + 1);
+   Param::SetInt(Param::maxcell, BmsCalculation::GetMaxCell() + 1);
+   Param::SetFlt(Param::tmpavg, BmsCalculation::GetTemperatureAverage());
+}
+
+/** Evaluate the values of all cell modules after a complete acquisition cycle
+ * @param commRunning true if all modules responded in this cycle
+ */
+static void ProcessCellValues(bool commRunning)
+{
+   static int commTimeout = 10;
+   static int lastSocEst = -1;
+   static bool estimatorStarted = false;
+   static bool cellsEstimated = false;
+   int avg;
+   s32fp voltageSum;
+
+   PublishPackStats(avg, voltageSum);
 
-      if (currentCellMod < numCellMods)
+   if (!commRunning)
+   {
+      if (commTimeout > 0)
       {
-         currentCellMod++;
+         commTimeout--;
       }
-      else
-      {
-         currentCellMod = 1;
-         int min, max, avg;
-         s32fp voltageSum;
+   }
+   else
+   {
+      commTimeout = 10;
+   }
 
-         BmsCalculation::AggregateVoltages(min, max, avg, voltageSum);
+   Param::SetInt(Param::commquality, commTimeout * 10);
 
-         if (!commRunning)
-         {
-            if (commTimeout > 0)
-            {
-               commTimeout--;
-            }
-            commRunning = true; //will be reset if one module does not respond
-         }
-         else
-         {
-            commTimeout = 10;
-         }
+   s32fp udc = voltageSum;
+   udc += Param::Get(Param::udc2);
+   Param::SetFlt(Param::udc, udc);
 
-         Param::SetInt(Param::commquality, commTimeout * 10);
+   if (noCurrentMillis > 3600000)
+   {
+      static int numEstimates = 0;
 
-         s32fp udc = voltageSum;
-         udc += Param::Get(Param::udc2);
-         Param::SetFlt(Param::udc, udc);
+      int soc = BmsCalculation::EstimateSocFromVoltage(avg);
+      s32fp chargein = Param::Get(Param::chargein);
+      s32fp chargeout = Param::Get(Param::chargeout);
+      Param::SetInt(Param::socest, soc);
+      Param::SetInt(Param::soc, soc);
 
-         if (Param::Get(Param::batavg2) > 0)
+      //Once per rest period, the bleed time counts on until current flows again
+      if (commRunning && !cellsEstimated)
+      {
+         BmsCalculation::EstimateCellSocs();
+         BalancePlanner::Restart();
+         cellsEstimated = true;
+      }
+
+      ChargeIntegrator::SetCharge(0, 0);
+      BmsCalculation::RestartCharge();
+      Param::SetFlt(Param::chargein, 0);
+      Param::SetFlt(Param::chargeout, 0);
+      BMSState::SetEstimatedSoC(FP_FROMINT(soc));
+      numEstimates++;
+
+      if (numEstimates > 10)
+      {
+         if (lastSocEst < 0)
          {
-            avg += Param::GetInt(Param::batavg2);
-            avg /= 2;
-            min = MIN(min, Param::GetInt(Param::batmin2));
-            max = MAX(max, Param::GetInt(Param::batmax2));
+            lastSocEst = soc;
          }
-
-         if (noCurrentMillis > 3600000)
+         //The battery has been charged more than 50% since last estimate
+         else if (lastSocEst < soc && (soc - lastSocEst) > 50)
          {
-            static int numEstimates = 0;
-
-            int soc = BmsCalculation::EstimateSocFromVoltage(avg);
-            s32fp chargein = Param::Get(Param::chargein);
-            s32fp chargeout = Param::Get(Param::chargeout);
-            Param::SetInt(Param::socest, soc);
-            Param::SetInt(Param::soc, soc);
-            Param::SetFlt(Param::chargein, 0);
-            Param::SetFlt(Param::chargeout, 0);
-            BMSState::SetEstimatedSoC(FP_FROMINT(soc));
-            numEstimates++;
-
-            if (numEstimates > 10)
-            {
-               if (lastSocEst < 0)
-               {
-                  lastSocEst = soc;
-               }
-               //The battery has been charged more than 50% since last estimate
-               else if (lastSocEst < soc && (soc - lastSocEst) > 50)
-               {
-                  s32fp chargeDelta = chargein - chargeout;
-                  lastSocEst = soc; //Now we don't come here again
-                  s32fp capacity = chargeDelta * 100 / (soc - lastSocEst);
-                  capacity /= 3600; //As to Ah
-                  Param::SetFlt(Param::capacity, capacity);
-               }
-               //The battery has been discharged more than 50% since last estimate
-               else if (lastSocEst > soc && (lastSocEst - soc) > 50)
-               {
-                  s32fp chargeDelta = chargeout - chargein;
-                  lastSocEst = soc; //Now we don't come here again
-                  s32fp capacity = chargeDelta * 100 / (lastSocEst - soc);
-                  capacity /= 3600; //As to Ah
-                  Param::SetFlt(Param::capacity, capacity);
-               }
-            }
+            s32fp chargeDelta = chargein - chargeout;
+            lastSocEst = soc; //Now we don't come here again
+            s32fp capacity = chargeDelta * 100 / (soc - lastSocEst);
+            capacity /= 3600; //As to Ah
+            Param::SetFlt(Param::capacity, capacity);
          }
-         else
+         //The battery has been discharged more than 50% since last estimate
+         else if (lastSocEst > soc && (lastSocEst - soc) > 50)
          {
-            s32fp soc = Param::Get(Param::socest);
-            s32fp chargeDiff = Param::Get(Param::chargein) - Param::Get(Param::chargeout);
-            chargeDiff /= 36; //From As to Ah times 100%
-            soc += FP_DIV(chargeDiff, Param::Get(Param::capacity));
-            Param::SetFlt(Param::soc, soc);
+            s32fp chargeDelta = chargeout - chargein;
+            lastSocEst = soc; //Now we don't come here again
+            s32fp capacity = chargeDelta * 100 / (lastSocEst - soc);
+            capacity /= 3600; //As to Ah
+            Param::SetFlt(Param::capacity, capacity);
          }
-         Param::SetInt(Param::batmin, min);
-         Param::SetInt(Param::batmax, max);
-         Param::SetInt(Param::batavg, avg);
-         Param::SetFlt(Param::tmpavg, BmsCalculation::GetTemperatureAverage());
       }
    }
+   else
+   {
+      s32fp soc = Param::Get(Param::socest);
+      s32fp chargeDiff = Param::Get(Param::chargein) - Param::Get(Param::chargeout);
+      chargeDiff /= 36; //From As to Ah times 100%
+      soc += FP_DIV(chargeDiff, Param::Get(Param::capacity));
+      Param::SetFlt(Param::soc, soc);
+      cellsEstimated = false;
+   }
+
+   //The filter starts from the counted SoC and corrects it with every complete cycle
+   if (commRunning)
+   {
+      if (!estimatorStarted)
+      {
+         SocEstimator::Reset(Param::Get(Param::soc));
+         estimatorStarted = true;
+      }
+      SocEstimator::SetVoltage(avg);
+   }
+
+   Param::SetFlt(Param::socekf, SocEstimator::GetSoc());
+   Param::SetFlt(Param::capekf, SocEstimator::GetCapacity());
+   Param::SetFlt(Param::imbalance, FP_FROMINT(BmsCalculation::GetImbalance()) / 1000);
+   Param::SetInt(Param::balcells, BalancePlanner::GetActiveShunts());
+   Param::SetFlt(Param::baltime, FP_FROMINT(BalancePlanner::GetTimeToBalance() / 36) / 100);
+
+   if (estimatorStarted && Param::GetInt(Param::socmode) == SocEkf)
+      Param::SetFlt(Param::soc, SocEstimator::GetSoc());
+
+   CellHistory::AddCycle(rtc_get_counter_val());
+   Telemetry::SendCycle();
+}
+
+/** Calculate the full pack refresh rate over at least one second
+ * @param newCycles number of acquisition cycles completed since last call
+ */
+static void MeasureRefreshRate(int newCycles)
+{
+   const int ticksPerSecond = 1000 / 40;
+   static int ticks = 0, cycles = 0;
+
+   ticks++;
+   cycles += newCycles;
+
+   if ((ticks >= ticksPerSecond && cycles > 0) || ticks >= (10 * ticksPerSecond))
+   {
+      Param::SetFlt(Param::refreshrate, FP_FROMINT(cycles * ticksPerSecond) / ticks);
+      ticks = 0;
+      cycles = 0;
+   }
+}
+
+/** Plan the shunts for the next balancing period
+ * @param numCellMods number of cell modules
+ * @param elapsedMs time since the last call
+ */
+static void PlanBalancing(int numCellMods, int elapsedMs)
+{
+   //Balance while charging and at rest, not while discharging
+   if (Param::Get(Param::idc) < -FP_FROMFLT(0.8))
+      BalancePlanner::Stop(numCellMods);
+   else
+      BalancePlanner::Plan(BmsComm::GetVoltages(), BmsComm::GetTemperatures(), numCellMods, elapsedMs);
+}
+
+static void CellModuleCommunication()
+{
+   static int numCellMods;
+   static int timeout = 10;
+   static int planTicks = 0;
+   static int broadcastTimeout = 0;
+   static int currentCellMod = 1;
+   static uint32_t lastCycles = 0;
+   static bool inverted = false;
+   static States state = Start;
+
+   Param::SetInt(Param::curmodule, currentCellMod);
+   Param::SetInt(Param::baudrate, BmsComm::GetBitRate());
+   Param::SetInt(Param::rxoverruns, OneWire::GetOverruns());
+   planTicks++;
+
+   if (state == Run && broadcastTimeout > 0)
+   {
+      broadcastTimeout--;
+
+      if (BmsComm::IsBroadcastComplete() || broadcastTimeout == 0)
+      {
+         bool allReplied = BmsComm::AcquireAll() == numCellMods;
+
+         BmsComm::ProcessReceived();
+         ProcessCellValues(allReplied);
+         MeasureRefreshRate(1);
+         broadcastTimeout = 0;
+      }
+      else
+      {
+         MeasureRefreshRate(0);
+      }
+   }
+   else if (state == Run)
+   {
+      bool allReplied;
+      uint32_t cycles = BmsComm::GetCompletedCycles(allReplied);
+
+      //Modules are polled from interrupt context, here we only look after the results
+      BmsComm::CheckPipeline();
+      BmsComm::ProcessReceived();
+
+      if (cycles != lastCycles)
+      {
+         ProcessCellValues(allReplied);
+      }
+      else
+      {
+         int avg;
+         s32fp voltageSum;
+         PublishPackStats(avg, voltageSum);
+      }
+      MeasureRefreshRate(cycles - lastCycles);
+      lastCycles = cycles;
+   }
    else if (state == GetVersion)
    {
       if (BmsComm::AcquireVersion(currentCellMod))
@@ -366,7 +549,7 @@ static void CellModuleCommunication()
          timeout--;
          if (timeout == 0)
          {
-            BmsCalculation::SetVoltageSource(BmsComm::GetVoltages(), BmsComm::GetNumberOfCellModules() * BmsComm::voltagesPerModule);
+            BmsCalculation::SetVoltageSource(BmsComm::GetVoltages(), BmsComm::GetNumberOfCellModules() * BmsComm::voltagesPerModule, BmsComm::voltagesPerModule);
             BmsCalculation::SetTemperatureSource(BmsComm::GetTemperatures(), BmsComm::GetNumberOfCellModules());
             state = GetVersion;
             timeout = 20;
@@ -381,7 +564,7 @@ static void CellModuleCommunication()
          }
          if (currentCellMod > numCellMods)
          {
-            state = Run;
+            state = BitRate;
          }
          else
          {
@@ -391,9 +574,30 @@ static void CellModuleCommunication()
       case Run:
          timeout--;
 
+         if (Param::GetInt(Param::cellmodop) != None ||
+             Param::GetInt(Param::acqmode) != AcqSequential ||
+             (timeout <= 0 && broadcastTimeout == 0))
+         {
+            //Let the current request finish before anything else goes on the bus
+            if (BmsComm::StopPipelinedAcquisition())
+               break;
+         }
+
+         if (Param::GetInt(Param::cellmodop) == FWUpgrade ||
+             Param::GetInt(Param::cellmodop) == AssignAddress)
+         {
+            //Updater and address mode start over at the power-on rate
+            if (BmsComm::ResetBitRate())
+               break;
+         }
+
          if (Param::GetInt(Param::cellmodop) == FWUpgrade)
          {
-            BmsComm::StartUpdate();
+            //The terminal is checking the images with the decompressor
+            if (ImageStore::IsBusy())
+               break;
+
+            BmsComm::StartUpdate(Param::GetInt(Param::updmode) == UpdateDifferential);
             state = SWUpgrade;
             timeout = 0;
             Param::SetInt(Param::cellmodop, None);
@@ -407,41 +611,68 @@ static void CellModuleCommunication()
          {
             state = Standby;
          }
-         else if (timeout <= 0)
+         else if (timeout <= 0 && broadcastTimeout == 0)
          {
             state = Shunt;
             currentCellMod = 1;
+
+            if (Param::GetInt(Param::balmode) == BalPredictive)
+               PlanBalancing(numCellMods, planTicks * 40);
+            planTicks = 0;
          }
-         else
+         else if (Param::GetInt(Param::acqmode) == AcqBroadcast)
+         {
+            if (broadcastTimeout == 0)
+            {
+               BmsComm::StartBroadcastAcquisition();
+               //Module replies take 11 bit times per byte, add a third for the
+               //gaps between them and some margin. Counts calls every 40 ms
+               int replyMs = numCellMods * sizeof(struct BatValues) * 11 * 1000 / BmsComm::GetBitRate();
+               broadcastTimeout = replyMs * 4 / 3 / 40 + 3;
+               currentCellMod = 1;
+            }
+         }
+         else if (!BmsComm::IsPipelineRunning())
          {
-            BmsComm::StartAcquisition(currentCellMod);
+            BmsComm::StartPipelinedAcquisition();
          }
          break;
+      case BitRate:
+         if (BmsComm::NegotiateBitRate(Param::GetInt(Param::maxbaud)))
+            state = Run;
+         break;
       case Standby:
          if (Param::GetInt(Param::cellmodop) != StopAcq)
             state = Run;
          break;
       case Shunt:
-         BmsComm::SetShunt(currentCellMod, Param::GetInt(Param::shuntvtg));
+         if (Param::GetInt(Param::balmode) == BalPredictive)
+         {
+            uint8_t shunts;
+
+            //Only modules with changed or expiring shunts take up the bus
+            while (currentCellMod <= numCellMods && !BalancePlanner::GetUpdate(currentCellMod, shunts))
+               currentCellMod++;
+
+            if (currentCellMod <= numCellMods)
+               BmsComm::SetShunts(currentCellMod, shunts);
+         }
+         else
+         {
+            BmsComm::SetShunt(currentCellMod, Param::GetInt(Param::shuntvtg));
+         }
          currentCellMod++;
          if (currentCellMod > numCellMods)
          {
             state = Run;
-            timeout = 300;
+            //The planner runs every 2s, threshold shunting every 12s
+            timeout = Param::GetInt(Param::balmode) == BalPredictive ? 50 : 300;
          }
          break;
       case SWUpgrade:
-         if (timeout == 0)
-         {
-            int page = BmsComm::UpdateNextPage();
-
-            if (page == (ATTINY_MAX_APPLICATION_PAGES + 4))
-            {
-               state = ResetAddress;
-            }
-            timeout = 4;
-         }
-         timeout--;
+         //Ms10Task streams the pages, updated modules restart at the power-on rate
+         if (!BmsComm::IsUpdating())
+            state = ResetAddress;
          break;
    }
 
@@ -460,6 +691,9 @@ static void Ms10Task(void)
 
    Param::SetFlt(Param::uaux, uaux);
 
+   if (BmsComm::IsUpdating())
+      BmsComm::RunUpdate();
+
    timer_set_oc_value(GAUGE_TIMER, TIM_OC1, dc1);
    timer_set_oc_value(GAUGE_TIMER, TIM_OC2, dc2);
 
@@ -480,7 +714,6 @@ static void MeasureCurrent()
    if (idcmode == IDC_DIFFERENTIAL || idcmode == IDC_SINGLE)
    {
       static int samples = 0;
-      static u32fp amsIn = 0, amsOut = 0;
       static s32fp idcavg = 0;
       int curpos = AnaIn::curpos.Get();
       int curneg = AnaIn::curneg.Get();
@@ -490,18 +723,15 @@ static void MeasureCurrent()
 
       current = FP_DIV(FP_FROMINT(rawCurrent - idcofs), idcgain);
 
-      if (current < -FP_FROMFLT(0.8))
+      //Offset noise around 0 isn't counted
+      if (current < -FP_FROMFLT(0.8) || current > FP_FROMFLT(0.8))
       {
-         amsOut += -current;
-         noCurrentMillis = 0;
-      }
-      else if (current > FP_FROMFLT(0.8))
-      {
-         amsIn += current;
+         ChargeIntegrator::AddSample(current, 1);
          noCurrentMillis = 0;
       }
       else
       {
+         ChargeIntegrator::AddSample(0, 1);
          noCurrentMillis++;
       }
 
@@ -510,11 +740,9 @@ static void MeasureCurrent()
 
       if (samples == 1000)
       {
-         s32fp chargein = Param::Get(Param::chargein);
-         s32fp chargeout = Param::Get(Param::chargeout);
+         s32fp chargein = ChargeIntegrator::GetChargeIn();
+         s32fp chargeout = ChargeIntegrator::GetChargeOut();
 
-         chargein += amsIn / 1000;
-         chargeout += amsOut / 1000;
          idcavg /= 1000;
 
          s32fp power = FP_MUL(voltage, idcavg);
@@ -522,8 +750,6 @@ static void MeasureCurrent()
          Param::SetFlt(Param::idcavg, idcavg);
          Param::SetFlt(Param::power, power);
 
-         amsIn = 0;
-         amsOut = 0;
          samples = 0;
          idcavg = 0;
 
@@ -539,9 +765,24 @@ static void MeasureCurrent()
       Param::SetFlt(Param::power, power);
    }
 
+   SocEstimator::AddSample(current);
    Param::SetFlt(Param::idc, current);
 }
 
+static void SetBalanceLimits()
+{
+   BalancePlanner::SetBleedCurrent(Param::GetInt(Param::balcur));
+   BalancePlanner::SetTolerance(Param::GetInt(Param::baltol));
+   BalancePlanner::SetThermalLimit(Param::GetInt(Param::balmaxtmp), Param::GetInt(Param::balshunts));
+}
+
+static void SetSocModel()
+{
+   BmsCalculation::SetCapacity(Param::Get(Param::capacity));
+   SocEstimator::SetModel(Param::Get(Param::capacity), Param::Get(Param::cellr0),
+                          Param::Get(Param::cellr1), Param::Get(Param::celltau));
+}
+
 /** This function is called when the user changes a parameter */
 extern void parm_Change(Param::PARAM_NUM paramNum)
 {
@@ -561,6 +802,22 @@ extern void parm_Change(Param::PARAM_NUM paramNum)
             IsaShunt::SetInterface(can2);
             IsaShunt::Initialize();
          }
+         break;
+      case Param::replyfmt:
+         BmsComm::SetCompactReplies(Param::GetInt(Param::replyfmt) == ReplyDelta);
+         break;
+      case Param::capacity:
+      case Param::cellr0:
+      case Param::cellr1:
+      case Param::celltau:
+         SetSocModel();
+         break;
+      case Param::balcur:
+      case Param::baltol:
+      case Param::balmaxtmp:
+      case Param::balshunts:
+         SetBalanceLimits();
+         break;
       default:
          break;
    }
@@ -583,6 +840,7 @@ extern "C" int main(void)
    clock_setup();
    rtc_setup();
    usart_setup();
+   OneWire::Init();
    tim_setup();
    nvic_setup();
    parm_load();
@@ -607,27 +865,39 @@ extern "C" int main(void)
    c2.RegisterUserMessage(IsaShunt::CAN_ID_VOLTAGE);
    c2.RegisterUserMessage(IsaShunt::CAN_ID_POWER);
 
-   BmsCalculation::SetVoltageToSoCTable(lfpVtgToSoc);
+   if (!OcvTable::LoadFromFlash())
+      OcvTable::LoadPreset(OcvTable::Lfp);
 
    if (BMSState::LoadFromFlash())
    {
       Param::SetFlt(Param::socest, BMSState::GetEstimatedSoC());
+      Param::SetFlt(Param::chargein, BMSState::GetChargein());
+      Param::SetFlt(Param::chargeout, BMSState::GetChargeout());
+      ChargeIntegrator::SetCharge(BMSState::GetChargein(), BMSState::GetChargeout());
    }
 
    Stm32Scheduler s(TIM4); //We never exit main so it's ok to put it on stack
    scheduler = &s;
 
-   s.AddTask(MeasureCurrent, 1);
-   s.AddTask(Ms10Task, 10);
-   s.AddTask(CellModuleCommunication, 40);
-   s.AddTask(Ms100Task, 100);
+   TaskProfiler::Init(rcc_ahb_frequency / 1000000);
+   ADD_PROFILED_TASK(s, MeasureCurrent, 1, 0);
+   ADD_PROFILED_TASK(s, Ms10Task, 10, 1);
+   ADD_PROFILED_TASK(s, CellModuleCommunication, 40, 2);
+   ADD_PROFILED_TASK(s, Ms100Task, 100, 3);
 
    parm_Change(Param::idcmode);
+   parm_Change(Param::replyfmt);
+   SetSocModel();
+   SetBalanceLimits();
    Param::SetInt(Param::version, 4); //backward compatibility
    Terminal t(USART3, TermCmds);
 
    while(true)
+   {
       t.Run();
+      JsonStream::Run();
+      CellHistory::Run();
+   }
 
    return 0;
 }
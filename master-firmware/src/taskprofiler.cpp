@@ -0,0 +1,99 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "taskprofiler.h"
+
+TaskProfiler::Task TaskProfiler::tasks[];
+int TaskProfiler::numTasks = 0;
+uint32_t TaskProfiler::cyclesPerUs = 1;
+volatile uint32_t TaskProfiler::resetRequests = 0;
+
+/** Start the cycle counter
+ * @param cyclesPerUs core clock in MHz */
+void TaskProfiler::Init(uint32_t cyclesPerUs)
+{
+   TaskProfiler::cyclesPerUs = cyclesPerUs;
+   dwt_enable_cycle_counter();
+}
+
+/** Name a slot, call before the task is first run */
+void TaskProfiler::SetTask(int index, const char* name, int periodMs)
+{
+   if (index < 0 || index >= MaxTasks) return;
+
+   tasks[index] = Task();
+   tasks[index].name = name;
+   tasks[index].periodMs = periodMs;
+   tasks[index].periodCycles = periodMs * 1000 * cyclesPerUs;
+   tasks[index].minCycles = UINT32_MAX;
+
+   if (index >= numTasks)
+      numTasks = index + 1;
+}
+
+/** Start over with all figures. The tasks clear their own slot on their
+ * next run, so nothing is lost to a task running meanwhile */
+void TaskProfiler::Reset()
+{
+   resetRequests = (1 << MaxTasks) - 1;
+}
+
+/** @return shortest execution in us, 0 if the task hasn't run */
+uint32_t TaskProfiler::GetMin(int index)
+{
+   return tasks[index].runs > 0 ? tasks[index].minCycles / cyclesPerUs : 0;
+}
+
+/** @return average execution in us */
+uint32_t TaskProfiler::GetAvg(int index)
+{
+   return tasks[index].runs > 0 ? tasks[index].totalCycles / tasks[index].runs / cyclesPerUs : 0;
+}
+
+/** @return longest execution in us */
+uint32_t TaskProfiler::GetMax(int index)
+{
+   return tasks[index].maxCycles / cyclesPerUs;
+}
+
+void TaskProfiler::Record(int index, uint32_t cycles)
+{
+   Task& task = tasks[index];
+
+   if (resetRequests & (1 << index))
+   {
+      resetRequests &= ~(1 << index);
+      task.minCycles = UINT32_MAX;
+      task.maxCycles = 0;
+      task.totalCycles = 0;
+      task.runs = 0;
+      task.misses = 0;
+   }
+
+   if (cycles < task.minCycles)
+      task.minCycles = cycles;
+   if (cycles > task.maxCycles)
+      task.maxCycles = cycles;
+
+   //The next run was due before this one ended
+   if (cycles > task.periodCycles)
+      task.misses++;
+
+   task.totalCycles += cycles;
+   task.runs++;
+}
@@ -0,0 +1,128 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "params.h"
+#include "bmscomm.h"
+#include "cobs.h"
+#include "termdma.h"
+#include "telemetry.h"
+
+uint8_t Telemetry::txBuf[];
+int Telemetry::params[];
+int Telemetry::numParams;
+uint16_t Telemetry::sequence;
+bool Telemetry::active = false;
+uint32_t Telemetry::droppedFrames;
+
+/** Start streaming
+ * @param params indexes of the parameters to send with every frame
+ * @param num number of parameters, at most TELEMETRY_MAX_PARAMS */
+void Telemetry::Start(const int* params, int num)
+{
+   numParams = num < TELEMETRY_MAX_PARAMS ? num : TELEMETRY_MAX_PARAMS;
+
+   for (int i = 0; i < numParams; i++)
+      Telemetry::params[i] = params[i];
+
+   sequence = 0;
+   droppedFrames = 0;
+   active = true;
+}
+
+void Telemetry::Stop()
+{
+   active = false;
+}
+
+/** Send the values of the last acquisition cycle, call once per cycle */
+void Telemetry::SendCycle()
+{
+   int len = 1;
+
+   if (!active) return;
+
+   //Terminal output or our last frame is still being sent
+   if (TermDma::IsBusy())
+   {
+      droppedFrames++;
+      sequence++;
+      return;
+   }
+
+   //Leading delimiter ends whatever text the terminal sent before
+   txBuf[0] = 0;
+
+   if ((sequence % TELEMETRY_LAYOUT_INTERVAL) == 0)
+      AddLayout(txBuf, len);
+
+   AddData(txBuf, len);
+   sequence++;
+
+   TermDma::Send(txBuf, len);
+}
+
+void Telemetry::AddHeader(CobsFrame& frame, uint8_t type)
+{
+   struct TelemetryHeader header;
+
+   header.type = type;
+   header.numParams = numParams;
+   header.numModules = BmsComm::GetNumberOfCellModules();
+   header.voltagesPerModule = BmsComm::voltagesPerModule;
+   header.sequence = sequence;
+   frame.Add(&header, sizeof(header));
+}
+
+void Telemetry::AddLayout(uint8_t* buf, int& len)
+{
+   CobsFrame frame(buf + len, bufSize - len);
+
+   AddHeader(frame, TELEMETRY_LAYOUT);
+
+   for (int i = 0; i < numParams; i++)
+   {
+      const char* name = Param::GetAttrib((Param::PARAM_NUM)params[i])->name;
+
+      do
+      {
+         frame.Add(*name);
+      } while (*name++ != 0);
+   }
+
+   len += frame.Close();
+}
+
+void Telemetry::AddData(uint8_t* buf, int& len)
+{
+   CobsFrame frame(buf + len, bufSize - len);
+   int numModules = BmsComm::GetNumberOfCellModules();
+
+   AddHeader(frame, TELEMETRY_DATA);
+
+   for (int i = 0; i < numParams; i++)
+   {
+      int32_t value = Param::Get((Param::PARAM_NUM)params[i]);
+      frame.Add(&value, sizeof(value));
+   }
+
+   //Cortex-M is little endian like the frame format
+   frame.Add(BmsComm::GetVoltages(), numModules * BmsComm::voltagesPerModule * sizeof(uint16_t));
+   frame.Add(BmsComm::GetTemperatures(), numModules);
+
+   len += frame.Close();
+}
@@ -0,0 +1,52 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/cortex.h>
+#include "hwdefs.h"
+#include "termdma.h"
+
+/** @return true while a transfer is in progress */
+bool TermDma::IsBusy()
+{
+   return dma_get_number_of_data(DMA1, TERM_USART_DMATX) > 0;
+}
+
+/** Start sending a buffer that must stay valid until IsBusy() returns false.
+ * Callers run in the main loop as well as in timer interrupts, so checking
+ * and claiming the channel must not be interrupted
+ * @return false if the channel was busy and nothing has been sent */
+bool TermDma::Send(const uint8_t* data, int len)
+{
+   uint32_t masked = cm_mask_interrupts(1);
+
+   if (IsBusy())
+   {
+      cm_mask_interrupts(masked);
+      return false;
+   }
+
+   dma_disable_channel(DMA1, TERM_USART_DMATX);
+   dma_set_memory_address(DMA1, TERM_USART_DMATX, (uintptr_t)data);
+   dma_set_number_of_data(DMA1, TERM_USART_DMATX, len);
+   dma_clear_interrupt_flags(DMA1, TERM_USART_DMATX, DMA_TCIF);
+   dma_enable_channel(DMA1, TERM_USART_DMATX);
+
+   cm_mask_interrupts(masked);
+   return true;
+}
@@ -17,6 +17,7 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <libopencm3/cm3/cortex.h>
 #include <libopencm3/stm32/usart.h>
 #include "hwdefs.h"
 #include "terminal.h"
@@ -28,6 +29,14 @@
 #include "errormessage.h"
 #include "stm32_can.h"
 #include "bmscomm.h"
+#include "cellstatistics.h"
+#include "telemetry.h"
+#include "jsonstream.h"
+#include "cellhistory.h"
+#include "bmscalculation.h"
+#include "ocvtable.h"
+#include "imagestore.h"
+#include "taskprofiler.h"
 #include "terminalcommands.h"
 
 static void PrintVoltages(Terminal* t, char* arg);
@@ -39,6 +48,14 @@ static void Help(Terminal* t, char *arg);
 static void PrintParamsJson(Terminal* t, char *arg);
 static void PrintSerial(Terminal* t, char *arg);
 static void PrintErrors(Terminal* t, char *arg);
+static void PrintCellStatistics(Terminal* t, char *arg);
+static void BinaryStream(Terminal* t, char *arg);
+static void DumpHistory(Terminal* t, char *arg);
+static void OcvCommand(Terminal* t, char *arg);
+static void PrintCellSoc(Terminal* t, char *arg);
+static void PrintUpdateResult(Terminal* t, char *arg);
+static void PrintImages(Terminal* t, char *arg);
+static void PrintProfile(Terminal* t, char *arg);
 
 extern "C" const TERM_CMD TermCmds[] =
 {
@@ -55,6 +72,14 @@ extern "C" const TERM_CMD TermCmds[] =
   { "can", TerminalCommands::MapCan },
   { "serial", PrintSerial },
   { "errors", PrintErrors },
+  { "cellstats", PrintCellStatistics },
+  { "binstream", BinaryStream },
+  { "history", DumpHistory },
+  { "ocv", OcvCommand },
+  { "cellsoc", PrintCellSoc },
+  { "updateresult", PrintUpdateResult },
+  { "cmuimages", PrintImages },
+  { "profile", PrintProfile },
   { "reset", TerminalCommands::Reset },
   { NULL, NULL }
 };
@@ -65,60 +90,18 @@ static void PrintVoltages(Terminal* t, char* arg)
    arg = arg;
 }
 
+/** The dump is sent from the main loop by JsonStream::Run().
+ * "json n" only sends what changed since the delta dump with sequence number n,
+ * "json 0" everything */
 static void PrintParamsJson(Terminal* t, char *arg)
 {
-   const Param::Attributes *pAtr;
-   int numSlaves = BmsComm::GetNumberOfCellModules();
-   const uint16_t* voltages = BmsComm::GetVoltages();
-   const int8_t* temperatures = BmsComm::GetTemperatures();
-   const struct version* versions = BmsComm::GetVersions();
-
    t = t;
-   arg = arg;
-   printf("{");
-   for (uint32_t idx = 0; idx < Param::PARAM_LAST; idx++)
-   {
-      int canId, canOffset, canLength;
-      bool isRx;
-      s32fp canGain;
-      pAtr = Param::GetAttrib((Param::PARAM_NUM)idx);
-
-      if ((Param::GetFlag((Param::PARAM_NUM)idx) & Param::FLAG_HIDDEN) == 0)
-      {
-         printf("\r\n   \"%s\": {\"unit\":\"%s\",\"value\":%f,", pAtr->name, pAtr->unit, Param::Get((Param::PARAM_NUM)idx));
-
-         if (Can::GetInterface(0)->FindMap((Param::PARAM_NUM)idx, canId, canOffset, canLength, canGain, isRx))
-         {
-            printf("\"canid\":%d,\"canoffset\":%d,\"canlength\":%d,\"cangain\":%d,\"isrx\":%s,",
-                   canId, canOffset, canLength, canGain, isRx ? "true" : "false");
-         }
-
-         if (Param::IsParam((Param::PARAM_NUM)idx))
-         {
-            printf("\"isparam\":true,\"minimum\":%f,\"maximum\":%f,\"default\":%f,\"category\":\"%s\"},", pAtr->min, pAtr->max, pAtr->def, pAtr->category);
-         }
-         else
-         {
-            printf("\"isparam\":false},");
-         }
-      }
-   }
-   printf("\r\n   \"serial\": {\"unit\":\"\",\"value\":\"%X:%X:%X\",\"isparam\":false}", DESIG_UNIQUE_ID2, DESIG_UNIQUE_ID1, DESIG_UNIQUE_ID0);
-
-   for (int slave = 0; slave < numSlaves; slave++)
-   {
-      const uint8_t* ver = versions[slave].swVersion;
-      for (int channel = 0; channel < BmsComm::voltagesPerModule; channel++)
-      {
-         uint16_t vtg = voltages[4 * slave + channel];
-         if (vtg < 5000)
-            printf(",\r\n   \"u.%02d.%d\": {\"unit\":\"mV\",\"value\":%d,\"isparam\":false}", slave + 1, channel + 1, vtg);
-      }
-      printf(",\r\n   \"t.%02d\": {\"unit\":\"°C\",\"value\":%d,\"isparam\":false}", slave + 1, temperatures[slave]);
-      printf(",\r\n   \"swver.%02d\": {\"unit\":\"\",\"value\":\"%d.%d.%d.%c\",\"isparam\":false}", slave + 1, ver[0], ver[1], ver[2], ver[3]);
-   }
+   arg = my_trim(arg);
 
-   printf("\r\n}\r\n");
+   if (0 == *arg)
+      JsonStream::Start();
+   else
+      JsonStream::StartDelta(my_atoi(arg));
 }
 
 static int GetBatVoltageIdx(char* arg)
@@ -198,6 +181,46 @@ static void ParamStream(Terminal* t, char *arg)
    }
 }
 
+/** "binstream val1,val2..." sends the given values and all cell voltages as
+ * binary frames once per acquisition cycle, "binstream" stops. See telemetry.h */
+static void BinaryStream(Terminal* t, char *arg)
+{
+   int params[TELEMETRY_MAX_PARAMS];
+   int numParams = 0;
+   char* comma;
+   char orig;
+
+   t = t;
+   arg = my_trim(arg);
+
+   if (0 == *arg)
+   {
+      Telemetry::Stop();
+      printf("Stream stopped, %d frames dropped\r\n", Telemetry::GetDroppedFrames());
+      return;
+   }
+
+   do
+   {
+      comma = (char*)my_strchr(arg, ',');
+      orig = *comma;
+      *comma = 0;
+
+      Param::PARAM_NUM idx = Param::NumFromString(arg);
+
+      *comma = orig;
+      arg = comma + 1;
+
+      if (idx != Param::PARAM_INVALID)
+      {
+         params[numParams] = idx;
+         numParams++;
+      }
+   } while (',' == *comma && numParams < TELEMETRY_MAX_PARAMS);
+
+   Telemetry::Start(params, numParams);
+}
+
 static void LoadDefaults(Terminal* t, char *arg)
 {
    t = t;
@@ -239,6 +262,278 @@ static void PrintErrors(Terminal* t, char *arg)
    ErrorMessage::PrintAllErrors();
 }
 
+/** Print long term statistics of all cells, "cellstats reset" clears them */
+static void PrintCellStatistics(Terminal* t, char *arg)
+{
+   int numCells = BmsComm::GetNumberOfCellModules() * BmsComm::voltagesPerModule;
+
+   t = t;
+   arg = my_trim(arg);
+
+   if (my_strcmp(arg, "reset") == 0)
+   {
+      CellStatistics::Reset();
+      printf("Cell statistics cleared\r\n");
+      return;
+   }
+
+   printf("cell,mean[mV],variance[mV^2],min[mV],max[mV],tmin[s],tmax[s]\r\n");
+
+   for (int cell = 0; cell < numCells; cell++)
+   {
+      const CellStatistics::Stats& stats = CellStatistics::Get(cell);
+
+      printf("u.%02d.%d,%f,%f,%d,%d,%d,%d\r\n", cell / BmsComm::voltagesPerModule + 1, cell % BmsComm::voltagesPerModule + 1,
+             CellStatistics::GetMean(cell), CellStatistics::GetVariance(cell), stats.min, stats.max,
+             CellStatistics::GetSecondsMin(cell), CellStatistics::GetSecondsMax(cell));
+   }
+
+   if (CellStatistics::GetExtremeOverflows() > 0)
+      printf("Time at extreme table overflowed %d times, -1 is unknown\r\n", CellStatistics::GetExtremeOverflows());
+}
+
+/** "history tier [from [to]]" dumps the records of a tier (0 cycles, 1 minutes,
+ * 2 hours) between the given seconds of uptime as binary frames, see cellhistory.h.
+ * "history" prints what is available */
+static void DumpHistory(Terminal* t, char *arg)
+{
+   static const char* tierNames[] = { "cycle", "minute", "hour" };
+   uint32_t from = 0, to = 0xffffffff;
+
+   t = t;
+   arg = my_trim(arg);
+
+   if (0 == *arg)
+   {
+      for (int tier = 0; tier < CellHistory::NumTiers; tier++)
+      {
+         uint32_t first, last;
+         int records = CellHistory::GetRange(tier, first, last);
+
+         printf("%d %s: %d records, %d-%ds\r\n", tier, tierNames[tier], records, first, last);
+      }
+      return;
+   }
+
+   int tier = my_atoi(arg);
+   arg = (char*)my_strchr(arg, ' ');
+
+   if (0 != *arg)
+   {
+      arg = my_trim(arg + 1);
+      from = my_atoi(arg);
+      arg = (char*)my_strchr(arg, ' ');
+
+      if (0 != *arg)
+         to = my_atoi(my_trim(arg + 1));
+   }
+
+   if (!CellHistory::StartDump(tier, from, to))
+      printf("Usage: history [0|1|2 [from [to]]]\r\n");
+}
+
+/** Print SoC, charge relative to the mean of all cells and capacity of every
+ * cell that has been estimated at rest */
+static void PrintCellSoc(Terminal* t, char *arg)
+{
+   int numCells = BmsComm::GetNumberOfCellModules() * BmsComm::voltagesPerModule;
+
+   t = t;
+   arg = arg;
+
+   printf("%s\r\n", "cell,soc[%],offset[mAh],capacity[Ah]");
+
+   for (int cell = 0; cell < numCells; cell++)
+   {
+      if (!BmsCalculation::HasCellSoc(cell)) continue;
+
+      printf("u.%02d.%d,%f,%d,%f\r\n", cell / BmsComm::voltagesPerModule + 1, cell % BmsComm::voltagesPerModule + 1,
+             BmsCalculation::GetCellSoc(cell), BmsCalculation::GetCellOffset(cell), BmsCalculation::GetCellCapacity(cell));
+   }
+}
+
+/** Pages each module was missing at the end of the last cell module update */
+static void PrintUpdateResult(Terminal* t, char *arg)
+{
+   t = t;
+   arg = arg;
+
+   printf("%s\r\n", "module,missing pages");
+
+   for (int module = 1; module <= BmsComm::GetNumberOfCellModules(); module++)
+   {
+      int missing = BmsComm::GetMissingPages(module);
+
+      if (missing == BmsComm::UpdateNoReply)
+         printf("%d,%s\r\n", module, "no reply");
+      else if (missing == BmsComm::UpdateNoImage)
+         printf("%d,%s\r\n", module, "no image");
+      else if (missing == BmsComm::UpdateCurrent)
+         printf("%d,%s\r\n", module, "up to date");
+      else if (missing == BmsComm::UpdateAgain)
+         printf("%d,%s\r\n", module, "update again");
+      else if (missing == BmsComm::UpdateNoBoot)
+         printf("%d,%s\r\n", module, "no boot");
+      else
+         printf("%d,%d\r\n", module, missing);
+   }
+}
+
+/** Cell module firmware images linked into the master */
+static void PrintImages(Terminal* t, char *arg)
+{
+   t = t;
+   arg = arg;
+
+   //An update keeps its position in the only decompressor between pages
+   cm_disable_interrupts();
+   bool updating = BmsComm::IsUpdating();
+   ImageStore::SetBusy(!updating);
+   cm_enable_interrupts();
+
+   if (updating)
+   {
+      printf("%s\r\n", "Update running, try again later");
+      return;
+   }
+
+   printf("%s\r\n", "image,software,hardware,size,packed,valid");
+
+   for (int index = 0; index < ImageStore::GetNumImages(); index++)
+   {
+      const ImageHeader* header = ImageStore::GetHeader(index);
+      struct version ver = header->version;
+
+      printf("%d,%d.%d.%d.%c,%d.%c,%d,%d,%d\r\n", index, ver.swVersion[0], ver.swVersion[1], ver.swVersion[2], ver.swVersion[3],
+             ver.hwVersion[0], ver.hwVersion[1], header->size, header->packedSize, ImageStore::Verify(index));
+   }
+
+   ImageStore::SetBusy(false);
+}
+
+/** Execution time of the scheduler tasks, "profile reset" starts over */
+static void PrintProfile(Terminal* t, char *arg)
+{
+   t = t;
+   arg = my_trim(arg);
+
+   if (my_strcmp(arg, "reset") == 0)
+   {
+      TaskProfiler::Reset();
+      printf("%s\r\n", "OK");
+      return;
+   }
+
+   if (TaskProfiler::GetNumTasks() == 0)
+   {
+      printf("%s\r\n", "Task profiling disabled");
+      return;
+   }
+
+   printf("%s\r\n", "task,period[ms],min[us],avg[us],max[us],runs,misses");
+
+   for (int i = 0; i < TaskProfiler::GetNumTasks(); i++)
+   {
+      printf("%s,%d,%d,%d,%d,%d,%d\r\n", TaskProfiler::GetName(i), TaskProfiler::GetPeriod(i), (int)TaskProfiler::GetMin(i),
+             (int)TaskProfiler::GetAvg(i), (int)TaskProfiler::GetMax(i), (int)TaskProfiler::GetRuns(i), (int)TaskProfiler::GetMisses(i));
+   }
+}
+
+/** Parse space separated integers
+ * @return number of integers found, at most max */
+static int ParseIntegers(char* arg, int* values, int max)
+{
+   int count = 0;
+
+   arg = my_trim(arg);
+
+   while (0 != *arg && count < max)
+   {
+      values[count++] = '-' == *arg ? -my_atoi(arg + 1) : my_atoi(arg);
+      arg = (char*)my_strchr(arg, ' ');
+
+      if (0 != *arg)
+         arg = my_trim(arg + 1);
+   }
+   return count;
+}
+
+/** "ocv" prints the open circuit voltage table, "ocv lfp" and "ocv nmc" load
+ * a preset. "ocv temp t1 [t2 ...]" starts a new staged table with the column
+ * temperatures in °C, "ocv row soc v1 [v2 ...]" appends a row with one voltage
+ * in mV per column. "ocv save" makes the staged table active and stores the
+ * active table in flash */
+static void OcvCommand(Terminal* t, char *arg)
+{
+   int values[OcvTable::maxTemperatures + 1];
+   char* cmd = my_trim(arg);
+   bool ok = true;
+
+   t = t;
+   arg = (char*)my_strchr(cmd, ' ');
+
+   if (0 != *arg)
+   {
+      *arg = 0;
+      arg++;
+   }
+
+   if (0 == *cmd)
+   {
+      printf("soc");
+
+      for (int i = 0; i < OcvTable::GetNumTemperatures(); i++)
+         printf(",%d°C", OcvTable::GetTemperature(i));
+
+      printf("\r\n");
+
+      for (int p = 0; p < OcvTable::GetNumPoints(); p++)
+      {
+         printf("%d", OcvTable::GetPointSoc(p));
+
+         for (int i = 0; i < OcvTable::GetNumTemperatures(); i++)
+            printf(",%d", OcvTable::GetPointVoltage(i, p));
+
+         printf("\r\n");
+      }
+
+      if (!OcvTable::IsComplete())
+         printf("No table loaded, using LFP preset\r\n");
+      if (OcvTable::GetStagedTemperatures() > 0)
+         printf("%d rows staged, not active until ocv save\r\n", OcvTable::GetStagedPoints());
+      return;
+   }
+   else if (my_strcmp(cmd, "lfp") == 0)
+   {
+      OcvTable::LoadPreset(OcvTable::Lfp);
+   }
+   else if (my_strcmp(cmd, "nmc") == 0)
+   {
+      OcvTable::LoadPreset(OcvTable::Nmc);
+   }
+   else if (my_strcmp(cmd, "temp") == 0)
+   {
+      int count = ParseIntegers(arg, values, OcvTable::maxTemperatures);
+      ok = OcvTable::SetTemperatures(values, count);
+   }
+   else if (my_strcmp(cmd, "row") == 0)
+   {
+      int count = ParseIntegers(arg, values, OcvTable::maxTemperatures + 1);
+      ok = count == OcvTable::GetStagedTemperatures() + 1 && OcvTable::AddRow(values[0], &values[1]);
+   }
+   else if (my_strcmp(cmd, "save") == 0)
+   {
+      ok = OcvTable::SaveToFlash();
+   }
+   else
+   {
+      printf("Usage: ocv [lfp|nmc|save|temp t1 [t2 ...]|row soc v1 [v2 ...]]\r\n");
+      return;
+   }
+
+   printf(ok ? "OK\r\n" : "Invalid\r\n");
+}
+
 static void PrintSerial(Terminal* t, char *arg)
 {
    arg = arg;
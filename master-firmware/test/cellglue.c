@@ -0,0 +1,81 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Pieces of cell-module-firmware/main.c main() that the simulator needs to run
+ * outside of the endless loop. Compiled against the cell module headers so the
+ * real hwdefs.h macros are used. */
+#include "hwdefs.h"
+#include "bms_shared.h"
+#include "sercom.h"
+#include "measure.h"
+
+/* main.c is compiled with static removed, so its state is reachable from here */
+extern uint8_t led;
+extern uint8_t enabledShunts;
+extern struct BatValues vals;
+extern uint16_t curCmd[2];
+void HWSetup(void);
+
+/** Same as the preamble of main() */
+void sim_cell_power_on(void)
+{
+   HWSetup();
+   adc_initialize(vals.values);
+   uart_initialize();
+   DISABLE_ADC_INPUT_BUFFERS();
+
+   set_receive_mode(curCmd, sizeof(curCmd));
+}
+
+/** Same as the head of the WAIT_ADDR case in main() */
+void sim_cell_wait_addr(void)
+{
+   led = (led + 1) & 0x3;
+   SHUNT_SET(1 << led);
+   DISABLE_PROPAGATION();
+}
+
+uint8_t sim_cell_propagates(void)
+{
+   return (INHIBIT_DDR & INHIBIT_PIN) == 0;
+}
+
+uint8_t sim_cell_shunts(void)
+{
+   return enabledShunts;
+}
+
+/* Mode constants as enumerated in main.c */
+enum { WAIT_ADDR, RUN };
+
+extern uint8_t mode;
+void CheckCmd(void);
+
+/** One pass of the main loop as far as command handling is concerned */
+void sim_cell_main_loop(void)
+{
+   uint8_t lastMode = mode;
+
+   if (RUN == mode)
+      adc_cycle();
+
+   CheckCmd();
+
+   if (WAIT_ADDR == mode && WAIT_ADDR != lastMode)
+      sim_cell_wait_addr();
+}
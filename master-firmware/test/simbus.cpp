@@ -0,0 +1,333 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <algorithm>
+#include <map>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
+#include "simbus.h"
+#include "simcell.h"
+#include "hwdefs.h"
+
+#define MASTER_BITS_PER_BYTE 11 //start, 8 data, 2 stop
+#define BREAK_BITS           13
+
+struct DmaChannel
+{
+   bool enabled;
+   uint8_t* mem;
+   uint16_t size;
+   uint16_t count;
+   uint32_t interrupts; //!< DMA_HTIF and DMA_TCIF if enabled
+};
+
+extern "C" void dma1_channel5_isr();
+
+static void DmaWrite(DmaChannel& rx, uint8_t data)
+{
+   if (rx.count == 0) return;
+
+   rx.mem[rx.size - rx.count] = data;
+   rx.count--;
+
+   if (rx.count == rx.size / 2 && (rx.interrupts & DMA_HTIF))
+      dma1_channel5_isr();
+
+   //The receive channel runs in circular mode
+   if (rx.count == 0)
+   {
+      rx.count = rx.size;
+
+      if (rx.interrupts & DMA_TCIF)
+         dma1_channel5_isr();
+   }
+}
+
+typedef std::multimap<std::pair<uint64_t, uint64_t>, SimBus::Event> EventQueue;
+
+static EventQueue events;
+static std::vector<SimCell*> cells;
+static DmaChannel dmaChannels[8];
+
+volatile uint32_t sim_usart1_cr1;
+volatile uint32_t sim_usart1_sr;
+volatile uint32_t sim_usart1_dr;
+
+int SimBus::baudrate = CMU_BIT_CLOCK / BAUD_DIVIDER_DEFAULT;
+uint64_t SimBus::now;
+uint64_t SimBus::seq;
+uint64_t SimBus::busyUntil;
+int SimBus::numCells;
+SimBus::Stats SimBus::stats;
+std::string SimBus::terminalOutput;
+
+extern "C" void usart1_isr();
+
+void SimBus::Reset(int numModules)
+{
+   for (SimCell* cell: cells)
+      delete cell;
+
+   cells.clear();
+   events.clear();
+   now = 0;
+   seq = 0;
+   busyUntil = 0;
+   numCells = numModules;
+   baudrate = CMU_BIT_CLOCK / BAUD_DIVIDER_DEFAULT;
+
+   for (int i = 1; i <= numModules; i++)
+      cells.push_back(new SimCell(i));
+
+   for (DmaChannel& ch: dmaChannels)
+      ch = DmaChannel();
+
+   //as set up by usart_setup()
+   sim_usart1_cr1 = USART_MODE_TX | USART_CR1_TCIE | USART_CR1_IDLEIE;
+   sim_usart1_sr = 0;
+   ClearStats();
+}
+
+SimCell* SimBus::GetCell(int position)
+{
+   return cells[position - 1];
+}
+
+void SimBus::Schedule(uint64_t delayUs, Event ev)
+{
+   events.insert(std::make_pair(std::make_pair(now + delayUs, seq++), ev));
+}
+
+uint64_t SimBus::NextEventTime()
+{
+   return events.empty() ? UINT64_MAX : events.begin()->first.first;
+}
+
+void SimBus::RunFor(uint64_t us)
+{
+   uint64_t end = now + us;
+
+   while (!events.empty() && events.begin()->first.first <= end)
+   {
+      EventQueue::iterator it = events.begin();
+      Event ev = it->second;
+      now = it->first.first;
+      events.erase(it);
+      ev();
+   }
+   now = end;
+}
+
+bool SimBus::RunUntil(std::function<bool()> done, uint64_t timeoutUs)
+{
+   uint64_t end = now + timeoutUs;
+
+   while (!done())
+   {
+      if (events.empty() || events.begin()->first.first > end)
+      {
+         now = end;
+         return false;
+      }
+      RunFor(events.begin()->first.first - now);
+   }
+   return true;
+}
+
+uint64_t SimBus::FrameTime(int len, bool brk, int bitsPerByte, int baud)
+{
+   uint64_t bits = len * bitsPerByte + (brk ? BREAK_BITS : 0);
+   return (bits * 1000000 + baud - 1) / baud;
+}
+
+/** What a receiver with a different bit rate makes of a frame: edges at the
+ * wrong times read as runs of ones and zeros. The pattern neither decodes as
+ * a command nor passes a CRC check */
+std::vector<uint8_t> SimBus::Misread(const uint8_t*, int len)
+{
+   std::vector<uint8_t> garbage(len);
+
+   for (int i = 0; i < len; i++)
+      garbage[i] = (i & 1) ? 0x0f : 0xf0;
+
+   return garbage;
+}
+
+/** Puts a frame on the wire.
+ * @return time at which the frame has been sent completely */
+uint64_t SimBus::Transmit(int source, uint64_t startUs, const uint8_t* data, int len, bool brk, int bitsPerByte, int baud)
+{
+   uint64_t duration = FrameTime(len, brk, bitsPerByte, baud);
+   uint64_t end = startUs + duration;
+   std::vector<uint8_t> frame(data, data + len);
+
+   if (source == 0)
+      stats.masterBytes += len + brk;
+   else
+      stats.moduleBytes += len + brk;
+
+   stats.frames++;
+   stats.busyUs += duration;
+   busyUntil = std::max(busyUntil, end);
+
+   Schedule(end - now, [=]() { Deliver(source, frame.data(), frame.size(), brk, baud); });
+
+   return end;
+}
+
+void SimBus::ClearStats()
+{
+   stats = Stats();
+}
+
+void SimBus::TerminalTransmit(const uint8_t* data, int len)
+{
+   terminalOutput.append((const char*)data, len);
+}
+
+void SimBus::Deliver(int source, const uint8_t* data, int len, bool brk, int baud)
+{
+   int last = source + 1;
+
+   //Find the reach first, receiving may change propagation of a module
+   while (last <= numCells && GetCell(last)->Propagates())
+      last++;
+
+   for (int pos = source + 1; pos <= last && pos <= numCells; pos++)
+      GetCell(pos)->Receive(data, len, brk, baud);
+
+   if (last > numCells)
+      MasterReceive(data, len, brk, baud);
+}
+
+void SimBus::MasterReceive(const uint8_t* data, int len, bool brk, int baud)
+{
+   DmaChannel& rx = dmaChannels[DMA_CHANNEL5];
+   std::vector<uint8_t> garbage;
+
+   if ((sim_usart1_cr1 & USART_CR1_RE) == 0 || !rx.enabled)
+      return;
+
+   if (baud != baudrate)
+   {
+      garbage = Misread(data, len);
+      data = garbage.data();
+   }
+
+   //A break is received as 0 with framing error and written by DMA
+   if (brk)
+   {
+      DmaWrite(rx, 0);
+      sim_usart1_sr |= USART_SR_FE;
+      usart1_isr();
+      sim_usart1_sr &= ~USART_SR_FE;
+   }
+
+   for (int i = 0; i < len; i++)
+      DmaWrite(rx, data[i]);
+
+   //Idle line is detected after one character time without a start bit
+   uint64_t idleTime = FrameTime(1, false, MASTER_BITS_PER_BYTE, baudrate);
+
+   Schedule(idleTime, [idleTime]()
+   {
+      bool idle = now >= busyUntil + idleTime;
+
+      if (idle && (sim_usart1_cr1 & USART_CR1_RE) && (sim_usart1_cr1 & USART_CR1_IDLEIE))
+      {
+         sim_usart1_sr |= USART_SR_IDLE;
+         usart1_isr();
+         sim_usart1_sr &= ~USART_SR_IDLE; //cleared by reading SR and DR in the ISR
+      }
+   });
+}
+
+/********* libopencm3 stand-ins used by onewire.cpp *********/
+
+void usart_set_mode(uint32_t, uint32_t mode)
+{
+   sim_usart1_cr1 = (sim_usart1_cr1 & ~USART_MODE_TX_RX) | mode;
+}
+
+void usart_set_baudrate(uint32_t, uint32_t baud)
+{
+   SimBus::baudrate = baud;
+}
+
+void dma_enable_channel(uint32_t, uint8_t channel)
+{
+   DmaChannel& ch = dmaChannels[channel];
+
+   ch.enabled = true;
+
+   if (channel == TERM_USART_DMATX)
+   {
+      SimBus::TerminalTransmit(ch.mem, ch.count);
+      ch.count = 0;
+   }
+
+   if (channel == DMA_CHANNEL4 && ch.count > 0)
+   {
+      bool brk = (sim_usart1_cr1 & USART_CR1_SBK) != 0;
+      sim_usart1_cr1 &= ~USART_CR1_SBK;
+      uint64_t end = SimBus::Transmit(0, SimBus::Now(), ch.mem, ch.count, brk, MASTER_BITS_PER_BYTE, SimBus::baudrate);
+      ch.count = 0;
+
+      SimBus::Schedule(end - SimBus::Now(), []()
+      {
+         sim_usart1_sr |= USART_SR_TC;
+         if (sim_usart1_cr1 & USART_CR1_TCIE)
+            usart1_isr();
+      });
+   }
+}
+
+void dma_disable_channel(uint32_t, uint8_t channel)
+{
+   dmaChannels[channel].enabled = false;
+}
+
+void dma_set_memory_address(uint32_t, uint8_t channel, uintptr_t address)
+{
+   dmaChannels[channel].mem = (uint8_t*)address;
+}
+
+void dma_set_number_of_data(uint32_t, uint8_t channel, uint16_t number)
+{
+   dmaChannels[channel].size = number;
+   dmaChannels[channel].count = number;
+}
+
+uint16_t dma_get_number_of_data(uint32_t, uint8_t channel)
+{
+   return dmaChannels[channel].count;
+}
+
+void dma_enable_half_transfer_interrupt(uint32_t, uint8_t channel)
+{
+   dmaChannels[channel].interrupts |= DMA_HTIF;
+}
+
+void dma_enable_transfer_complete_interrupt(uint32_t, uint8_t channel)
+{
+   dmaChannels[channel].interrupts |= DMA_TCIF;
+}
+
+void dma_clear_interrupt_flags(uint32_t, uint8_t, uint32_t)
+{
+}
@@ -0,0 +1,84 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIMBUS_H
+#define SIMBUS_H
+
+#include <stdint.h>
+#include <functional>
+#include <string>
+#include <vector>
+
+class SimCell;
+
+/** @brief Discrete event model of the daisy chain, the master USART and its DMA channels
+ *
+ * Position 0 is the master output, positions 1..N are the cell modules. A frame sent
+ * from position p is seen by every module behind p up to and including the first one
+ * that does not propagate. If all modules propagate, the frame loops back to the master.
+ * The terminal USART is modelled as far as its TX DMA channel, it sends instantly.
+ */
+class SimBus
+{
+   public:
+      typedef std::function<void()> Event;
+
+      struct Stats
+      {
+         uint32_t masterBytes;  //!< Bytes sent by the master including break frames
+         uint32_t moduleBytes;  //!< Bytes sent by cell modules including break frames
+         uint32_t frames;       //!< Number of frames put on the wire
+         uint64_t busyUs;       //!< Sum of all frame durations
+      };
+
+      static void Reset(int numModules);
+      static SimCell* GetCell(int position);
+      static int GetNumberOfCells() { return numCells; }
+
+      static uint64_t Now() { return now; }
+      static void Schedule(uint64_t delayUs, Event ev);
+      static uint64_t NextEventTime();
+      static void RunFor(uint64_t us);
+      static bool RunUntil(std::function<bool()> done, uint64_t timeoutUs);
+
+      static uint64_t Transmit(int source, uint64_t startUs, const uint8_t* data, int len, bool brk, int bitsPerByte, int baud);
+      static uint64_t FrameTime(int len, bool brk, int bitsPerByte, int baud);
+      static std::vector<uint8_t> Misread(const uint8_t* data, int len);
+
+      static const Stats& GetStats() { return stats; }
+      static void ClearStats();
+
+      static const std::string& GetTerminalOutput() { return terminalOutput; }
+      static void ClearTerminalOutput() { terminalOutput.clear(); }
+      static void TerminalTransmit(const uint8_t* data, int len);
+
+      static int baudrate; //!< Bit rate of the master USART
+
+   private:
+      static void Deliver(int source, const uint8_t* data, int len, bool brk, int baud);
+      static void MasterReceive(const uint8_t* data, int len, bool brk, int baud);
+
+      static uint64_t now;
+      static uint64_t seq;
+      static uint64_t busyUntil; //!< End of the last frame on any segment of the chain
+      static int numCells;
+      static Stats stats;
+      static std::string terminalOutput;
+};
+
+#endif // SIMBUS_H
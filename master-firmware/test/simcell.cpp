@@ -0,0 +1,660 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include <algorithm>
+#include <ucontext.h>
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <util/crc16.h>
+#include "simcell.h"
+#include "simbus.h"
+#include "hamming.h"
+
+#define MODULE_BITS_PER_BYTE 11 //send() waits for 11 timer ticks per byte
+#define UPDATER_BITS_PER_BYTE 10 //send_map() sends one stop bit
+#define PAGE_WRITE_US        9000 //page erase and write, 4.5 ms each
+#define PAGE_CRC_US          360  //flash_crc() of one page at 4 MHz
+
+extern "C"
+{
+   /* State of main.c which is compiled with static removed */
+   extern uint8_t mode;
+   extern uint8_t cmuAddress;
+   extern uint16_t emptyCycles;
+   extern struct BatValues vals;
+   extern uint16_t curCmd[2];
+   extern uint8_t enabledShunts;
+   extern uint16_t shuntTimeout;
+   extern uint8_t led;
+   extern uint8_t bitQuanta;
+   extern uint16_t baudTrial;
+   extern uint16_t sentValues[NUM_VALUES];
+   extern uint8_t compactReplies;
+   extern uint8_t deltaCount;
+   extern const struct version version;
+   extern const uint8_t updaterVersion;
+
+   void CmdGetVersion(void);
+
+   /* cellglue.c */
+   void sim_cell_power_on(void);
+   void sim_cell_wait_addr(void);
+   void sim_cell_main_loop(void);
+   uint8_t sim_cell_propagates(void);
+   uint8_t sim_cell_shunts(void);
+}
+
+/* The updater of updater.c, SimCell::legacyUpdater reads it as erased */
+const uint8_t updaterVersion = UPDATER_BITMAP;
+
+volatile uint8_t PORTA, DDRA, PINA, PORTB, DDRB;
+volatile uint8_t CLKPR, OSCCAL, MCUCR, ADCSRA, DIDR0;
+volatile uint8_t GIMSK, PCMSK0, TIFR0, TIMSK0, TCCR0A, TCCR0B, TCNT0, OCR0A;
+
+#define CELL_STATE_LIST \
+   CELL_STATE_ENTRY(mode) \
+   CELL_STATE_ENTRY(cmuAddress) \
+   CELL_STATE_ENTRY(emptyCycles) \
+   CELL_STATE_ENTRY(vals) \
+   CELL_STATE_ENTRY(curCmd) \
+   CELL_STATE_ENTRY(enabledShunts) \
+   CELL_STATE_ENTRY(shuntTimeout) \
+   CELL_STATE_ENTRY(led) \
+   CELL_STATE_ENTRY(bitQuanta) \
+   CELL_STATE_ENTRY(baudTrial) \
+   CELL_STATE_ENTRY(sentValues) \
+   CELL_STATE_ENTRY(compactReplies) \
+   CELL_STATE_ENTRY(deltaCount) \
+   CELL_STATE_ENTRY(PORTA) \
+   CELL_STATE_ENTRY(DDRA) \
+   CELL_STATE_ENTRY(PINA) \
+   CELL_STATE_ENTRY(PORTB) \
+   CELL_STATE_ENTRY(DDRB) \
+   CELL_STATE_ENTRY(MCUCR) \
+   CELL_STATE_ENTRY(ADCSRA) \
+   CELL_STATE_ENTRY(PCMSK0) \
+   CELL_STATE_ENTRY(TIMSK0)
+
+#define CELL_STATE_ENTRY(v) uint8_t v##_[sizeof(v)];
+struct Context
+{
+   CELL_STATE_LIST
+};
+#undef CELL_STATE_ENTRY
+
+static Context powerOnContext;
+static bool powerOnCaptured = false;
+static uint16_t* adcValues;
+
+int SimCell::commandLatencyUs = 1000;
+SimCell* SimCell::active = 0;
+SimCell* SimCell::starting = 0;
+
+SimCell::SimCell(int position)
+ : ctx(new Context), position(position), cursor(0), processPending(false), busy(false), stack(0),
+   rxBuf(0), rxExpected(0), rxCurrent(0xff), rxIdle(0), rxSinceBreak(0), baudrate(CMU_BIT_CLOCK / BAUD_DIVIDER_DEFAULT), boot(false), selected(true), armed(false), pageBytes(0), updaterAddress(0), pagesWritten(0), replyBytes(-1), writeEnd(0)
+{
+   if (!powerOnCaptured)
+   {
+      //Nothing has run yet, so the globals still hold their initializers
+      #define CELL_STATE_ENTRY(v) memcpy(powerOnContext.v##_, (const void*)&v, sizeof(v));
+      CELL_STATE_LIST
+      #undef CELL_STATE_ENTRY
+      powerOnCaptured = true;
+   }
+
+   for (int i = 0; i < NUM_INPUTS; i++)
+      voltages[i] = 3300 + 4 * position + i;
+
+   temperature = 20 + position % 10;
+   maxBaudrate = CMU_BIT_CLOCK / BAUD_DIVIDER_MIN;
+   dropPages = 0;
+   dropQueries = 0;
+   flashWrites = 0;
+   reportedVersion = version;
+   legacyUpdater = false;
+   oldApplication = false;
+   memset(flash, 0xff, sizeof(flash));
+   PowerOn();
+}
+
+SimCell::~SimCell()
+{
+   delete ctx;
+   delete[] stack;
+}
+
+void SimCell::PowerOn()
+{
+   *ctx = powerOnContext;
+   boot = false;
+   Activate();
+   sim_cell_power_on();
+   sim_cell_wait_addr();
+   Deactivate();
+}
+
+void SimCell::Activate()
+{
+   #define CELL_STATE_ENTRY(v) memcpy((void*)&v, ctx->v##_, sizeof(v));
+   CELL_STATE_LIST
+   #undef CELL_STATE_ENTRY
+   active = this;
+}
+
+void SimCell::Deactivate()
+{
+   #define CELL_STATE_ENTRY(v) memcpy(ctx->v##_, (const void*)&v, sizeof(v));
+   CELL_STATE_LIST
+   #undef CELL_STATE_ENTRY
+   active = 0;
+}
+
+bool SimCell::Propagates()
+{
+   Activate();
+   bool res = sim_cell_propagates();
+   Deactivate();
+   return res;
+}
+
+uint8_t SimCell::GetShunts()
+{
+   Activate();
+   uint8_t res = sim_cell_shunts();
+   Deactivate();
+   return res;
+}
+
+/** Fall back to full replies, as after an OP_GETDATA argument that failed to decode */
+void SimCell::DropCompactReplies()
+{
+   Activate();
+   compactReplies = 0;
+   Deactivate();
+}
+
+/** Mirrors the receiver state machine in sercom.c on frame level */
+void SimCell::Receive(const uint8_t* data, int len, bool brk, int baud)
+{
+   std::vector<uint8_t> garbage;
+
+   if (boot)
+   {
+      ReceivePage(data, len, brk, baud);
+      return;
+   }
+
+   if (baud != baudrate || baudrate > maxBaudrate)
+   {
+      garbage = SimBus::Misread(data, len);
+      data = garbage.data();
+   }
+
+   Activate();
+
+   if (brk)
+   {
+      rxCurrent = 0;
+      rxSinceBreak = 0;
+   }
+
+   for (int i = 0; i < len; i++)
+   {
+      rxSinceBreak++;
+
+      if (rxCurrent != 0xff)
+      {
+         if (rxCurrent < rxExpected)
+            rxBuf[rxCurrent] = data[i];
+         rxCurrent++;
+      }
+   }
+   rxIdle = 1;
+
+   Deactivate();
+
+   if (!processPending)
+   {
+      processPending = true;
+      SimBus::Schedule(commandLatencyUs, [this]() { Process(); });
+   }
+}
+
+void SimCell::Process()
+{
+   if (busy)
+   {
+      //Still busy waiting inside the previous command, try again later
+      SimBus::Schedule(commandLatencyUs, [this]() { Process(); });
+      return;
+   }
+
+   processPending = false;
+
+   if (boot) return;
+
+   if (!stack)
+      stack = new uint8_t[STACK_SIZE];
+
+   //Run the main loop pass on its own stack so busy waiting can yield to the bus
+   getcontext(&cellContext);
+   cellContext.uc_stack.ss_sp = stack;
+   cellContext.uc_stack.ss_size = STACK_SIZE;
+   cellContext.uc_link = &callerContext;
+   makecontext(&cellContext, (void (*)())MainLoopEntry, 0);
+
+   cursor = SimBus::Now();
+   busy = true;
+   Resume();
+}
+
+void SimCell::MainLoopEntry()
+{
+   SimCell* cell = starting;
+
+   cell->Activate();
+   sim_cell_main_loop();
+   cell->Deactivate();
+   cell->busy = false;
+}
+
+void SimCell::Resume()
+{
+   starting = this;
+   swapcontext(&callerContext, &cellContext);
+}
+
+/** Busy waiting lets the rest of the bus carry on, e.g. upstream modules
+ * replying to OP_GETALL while this module waits for its turn */
+void SimCell::Delay(uint32_t us)
+{
+   cursor = std::max(cursor, SimBus::Now()) + us;
+
+   if (!busy) return; //not called from the main loop
+   if (SimBus::NextEventTime() > cursor) return; //nothing can change meanwhile
+
+   Deactivate();
+   SimBus::Schedule(cursor - SimBus::Now(), [this]() { Resume(); });
+   swapcontext(&cellContext, &callerContext);
+   Activate();
+}
+
+void SimCell::EnterUpdater(uint8_t address)
+{
+   struct cmd cmd;
+
+   //Old software only takes the broadcast
+   if (oldApplication && (hamming_decode(curCmd[0], (uint16_t*)&cmd) != DEC_RES_OK || cmd.addr != 0xaa))
+      return;
+
+   boot = true;
+   selected = true;
+   armed = false;
+   pageBytes = 0;
+   updaterAddress = address;
+   pagesWritten = 0;
+   replyBytes = -1;
+   writeEnd = 0;
+   memset(&pageMap, 0, sizeof(pageMap));
+}
+
+/** Mirrors receive_page(), send_map() and the main loop of updater.c */
+void SimCell::ReceivePage(const uint8_t* data, int len, bool brk, int baud)
+{
+   uint8_t* buf = (uint8_t*)&page;
+   uint64_t frameStart = SimBus::Now() - SimBus::FrameTime(len, brk, MODULE_BITS_PER_BYTE, baud);
+
+   if (frameStart < writeEnd)
+   {
+      //The break went by while writing, the rest is garbage until the next one
+      pageBytes = 0;
+      return;
+   }
+
+   if (brk)
+   {
+      pageBytes = 0;
+      replyBytes = -1;
+   }
+   else if (replyBytes >= 0)
+   {
+      //Counting upstream replies
+      replyBytes -= len;
+
+      if (replyBytes <= 0)
+         SendPageMap();
+      return;
+   }
+
+   for (int i = 0; i < len; i++)
+   {
+      buf[pageBytes++] = data[i];
+
+      if (pageBytes < sizeof(struct PageBuf))
+         continue;
+
+      pageBytes = 0;
+
+      if (legacyUpdater ? ProcessLegacyPage() : ProcessPage())
+      {
+         //Jump to the application which restarts from scratch
+         PowerOn();
+         return;
+      }
+   }
+}
+
+/** @return true if the page passes the crc check and isn't in dropPages */
+bool SimCell::IsPageValid()
+{
+   uint8_t* buf = (uint8_t*)&page;
+   uint16_t crc = 0;
+
+   for (uint8_t* p = buf; p < (buf + sizeof(struct PageBuf) - sizeof(uint16_t)); p++)
+      crc = _crc_xmodem_update(crc, *p);
+
+   if (crc != page.crc)
+      return false;
+
+   if (page.pageNum < ATTINY_MAX_APPLICATION_PAGES && (dropPages & (1ULL << page.pageNum)))
+   {
+      dropPages &= ~(1ULL << page.pageNum);
+      return false;
+   }
+
+   return true;
+}
+
+/** Mirrors the main loop of updater.c for one frame
+ * @return true if the updater exits */
+bool SimCell::ProcessPage()
+{
+   bool exiting = armed;
+
+   armed = false;
+
+   if (!IsPageValid())
+   {
+      //Corrupted pages are simply not marked
+   }
+   else if (page.pageNum < ATTINY_MAX_APPLICATION_PAGES)
+   {
+      uint8_t mask = 1 << (page.pageNum & 7);
+
+      if (selected && (pageMap.pages[page.pageNum >> 3] & mask) == 0)
+      {
+         if (page.pageNum < UpdaterPage)
+         {
+            memcpy(&flash[page.pageNum * PAGE_WORDS], page.buf, sizeof(page.buf));
+            flashWrites++;
+            writeEnd = SimBus::Now() + PAGE_WRITE_US;
+         }
+         pageMap.pages[page.pageNum >> 3] |= mask;
+         pagesWritten++;
+      }
+   }
+   else if (page.pageNum >= UPDATE_COMPARE && page.pageNum < (UPDATE_COMPARE + COMPARE_FRAMES))
+   {
+      int first = (page.pageNum - UPDATE_COMPARE) * PAGE_WORDS;
+
+      for (int i = 0, p = first; selected && i < PAGE_WORDS && p < ATTINY_MAX_APPLICATION_PAGES; i++, p++)
+      {
+         uint8_t mask = 1 << (p & 7);
+
+         if (FlashCrc(p) == page.buf[i] && (pageMap.pages[p >> 3] & mask) == 0)
+         {
+            pageMap.pages[p >> 3] |= mask;
+            pagesWritten++;
+         }
+         writeEnd = SimBus::Now() + (i + 1) * PAGE_CRC_US;
+      }
+   }
+   else if (page.pageNum == UPDATE_QUERY)
+   {
+      uint8_t first = page.buf[0];
+      uint8_t last = page.buf[1];
+
+      if (dropQueries > 0)
+      {
+         dropQueries--;
+      }
+      else if (updaterAddress >= first && updaterAddress <= last)
+      {
+         replyBytes = (updaterAddress - first) * sizeof(struct PageMap);
+
+         if (replyBytes == 0)
+            SendPageMap();
+      }
+   }
+   else if (page.pageNum == UPDATE_SELECT)
+   {
+      const uint8_t* selection = (const uint8_t*)page.buf;
+
+      selected = (selection[updaterAddress >> 3] >> (updaterAddress & 7)) & 1;
+   }
+   else if (page.pageNum == UPDATE_DONE)
+   {
+      armed = true;
+   }
+
+   return exiting && pagesWritten == ATTINY_MAX_APPLICATION_PAGES;
+}
+
+/** Mirrors the legacy updater: pages in order, a bit time low after a
+ * corrupted one and exit after the last page
+ * @return true if the updater exits */
+bool SimCell::ProcessLegacyPage()
+{
+   static const uint8_t nack = 0xff;
+
+   if (page.pageNum >= ATTINY_MAX_APPLICATION_PAGES)
+      return false;
+
+   if (!IsPageValid())
+   {
+      SimBus::Transmit(position, SimBus::Now(), &nack, 1, false, UPDATER_BITS_PER_BYTE, baudrate);
+      return false;
+   }
+
+   if (page.pageNum == pagesWritten)
+   {
+      memcpy(&flash[page.pageNum * PAGE_WORDS], page.buf, sizeof(page.buf));
+      pagesWritten++;
+      flashWrites++;
+      writeEnd = SimBus::Now() + PAGE_WRITE_US;
+   }
+
+   return page.pageNum == (ATTINY_MAX_APPLICATION_PAGES - 1);
+}
+
+uint16_t SimCell::FlashCrc(int pageNum)
+{
+   const uint8_t* data = (const uint8_t*)&flash[pageNum * PAGE_WORDS];
+   uint16_t crc = _crc_xmodem_update(0, pageNum);
+
+   for (int i = 0; i < PAGE_WORDS * 2; i++)
+      crc = _crc_xmodem_update(crc, data[i]);
+
+   return crc;
+}
+
+void SimCell::SendPageMap()
+{
+   uint16_t crc = 0;
+   uint64_t bitTime = (1000000 + baudrate - 1) / baudrate;
+
+   replyBytes = -1;
+   pageMap.addr = updaterAddress;
+
+   for (uint8_t* p = (uint8_t*)&pageMap; p < (uint8_t*)&pageMap + sizeof(pageMap) - sizeof(uint16_t); p++)
+      crc = _crc_xmodem_update(crc, *p);
+
+   pageMap.crc = crc;
+   //one bit time for the stop bit of the previous reply
+   SimBus::Transmit(position, SimBus::Now() + bitTime, (const uint8_t*)&pageMap, sizeof(pageMap), false, UPDATER_BITS_PER_BYTE, baudrate);
+}
+
+void SimCell::SetReceiveMode(void* buf, uint8_t cnt)
+{
+   rxBuf = (uint8_t*)buf;
+   rxCurrent = 0xff;
+   rxExpected = cnt;
+}
+
+uint8_t SimCell::GetNumBytesReceived() const
+{
+   return rxIdle ? rxCurrent : 0;
+}
+
+void SimCell::Send(const void* data, uint8_t len, bool brk)
+{
+   struct versionComm ver;
+
+   //Old software replies with its version when asked for the updater
+   if (oldApplication && len == sizeof(struct UpdaterVersion))
+   {
+      CmdGetVersion();
+      return;
+   }
+
+   //Only CmdGetVersion() sends this many bytes
+   if (len == sizeof(ver))
+   {
+      memcpy(&ver, data, sizeof(ver));
+      ver.version = reportedVersion;
+      ver.crc = 0;
+
+      for (uint8_t* p = (uint8_t*)&ver; p < (uint8_t*)&ver.crc; p++)
+         ver.crc = _crc_xmodem_update(ver.crc, *p);
+
+      data = &ver;
+   }
+
+   cursor = SimBus::Transmit(position, std::max(cursor, SimBus::Now()), (const uint8_t*)data, len, brk, MODULE_BITS_PER_BYTE, baudrate);
+}
+
+void SimCell::Measure(uint16_t* values)
+{
+   for (int i = 0; i < NUM_INPUTS; i++)
+      values[i] = voltages[i];
+
+   values[TEMP_IDX] = (uint8_t)temperature;
+}
+
+/********* Cell module driver stand-ins called from main.c *********/
+
+extern "C" void uart_initialize()
+{
+   SimCell::active->SetDivider(BAUD_DIVIDER_DEFAULT);
+}
+
+extern "C" void uart_set_divider(uint8_t divider)
+{
+   SimCell::active->SetDivider(divider);
+}
+
+extern "C" void set_receive_mode(void *buf, uint8_t cnt)
+{
+   SimCell::active->SetReceiveMode(buf, cnt);
+}
+
+extern "C" uint8_t num_bytes_received()
+{
+   return SimCell::active->GetNumBytesReceived();
+}
+
+extern "C" void send_string(const void *string, uint8_t cnt)
+{
+   SimCell::active->Send(string, cnt, false);
+}
+
+extern "C" void send_break()
+{
+   SimCell::active->Send(0, 0, true);
+}
+
+extern "C" void adc_initialize(uint16_t* values)
+{
+   adcValues = values;
+}
+
+extern "C" void adc_cycle()
+{
+   SimCell::active->Measure(adcValues);
+}
+
+extern "C" void updater(uint8_t address)
+{
+   SimCell::active->EnterUpdater(address);
+}
+
+extern "C" void sim_cell_delay_us(uint32_t us)
+{
+   SimCell::active->Delay(us);
+}
+
+extern "C" uint16_t num_bytes_since_break()
+{
+   return SimCell::active->GetNumBytesSinceBreak();
+}
+
+extern "C" uint8_t sim_pgm_read_byte(const void* addr)
+{
+   //Legacy updaters leave the last byte of flash erased
+   if (addr == &updaterVersion && SimCell::active->legacyUpdater)
+      return UPDATER_LEGACY;
+
+   return *(const uint8_t*)addr;
+}
+
+extern "C" uint8_t eeprom_read_byte(const uint8_t* addr)
+{
+   return *addr;
+}
+
+extern "C" uint16_t eeprom_read_word(const uint16_t* addr)
+{
+   return *addr;
+}
+
+extern "C" uint32_t eeprom_read_dword(const uint32_t* addr)
+{
+   return *addr;
+}
+
+extern "C" void eeprom_read_block(void* dst, const void* src, size_t n)
+{
+   memcpy(dst, src, n);
+}
+
+extern "C" uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data)
+{
+   crc = crc ^ ((uint16_t)data << 8);
+
+   for (int i = 0; i < 8; i++)
+   {
+      if (crc & 0x8000)
+         crc = (crc << 1) ^ 0x1021;
+      else
+         crc <<= 1;
+   }
+
+   return crc;
+}
@@ -0,0 +1,113 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIMCELL_H
+#define SIMCELL_H
+
+#include <stdint.h>
+#include <ucontext.h>
+#include "bms_shared.h"
+
+/** @brief Virtual cell module running the command handling of cell-module-firmware/main.c
+ *
+ * main.c is linked only once, so its global state and the AVR registers are swapped
+ * in before and out after every call into it. Every main loop pass runs as a coroutine
+ * so busy waiting inside a command yields to the rest of the bus.
+ */
+class SimCell
+{
+   public:
+      SimCell(int position);
+      ~SimCell();
+      void PowerOn();
+      void Receive(const uint8_t* data, int len, bool brk, int baud);
+      bool Propagates();
+      uint8_t GetShunts();
+      void DropCompactReplies();
+      bool IsUpdating() const { return boot; }
+      const uint16_t* GetFlash() const { return flash; }
+
+      void SetReceiveMode(void* buf, uint8_t cnt);
+      uint8_t GetNumBytesReceived() const;
+      uint16_t GetNumBytesSinceBreak() const { return rxSinceBreak; }
+      void Send(const void* data, uint8_t len, bool brk);
+      void Delay(uint32_t us);
+      void Measure(uint16_t* values);
+      void EnterUpdater(uint8_t address);
+      void SetDivider(uint8_t divider) { baudrate = CMU_BIT_CLOCK / divider; }
+      int GetBaudrate() const { return baudrate; }
+
+      uint16_t voltages[NUM_INPUTS];
+      int8_t temperature;
+      int maxBaudrate;             //!< Frames at higher bit rates are misread
+      uint64_t dropPages;          //!< The updater sees these pages corrupted the first time
+      int dropQueries;             //!< Number of UPDATE_QUERY frames the updater misses
+      int flashWrites;             //!< Pages programmed since power on of the simulation
+      struct version reportedVersion; //!< Replaces the version main.c reports, to simulate other hardware
+      bool legacyUpdater;          //!< Jumps to the updater that predates UPDATER_BITMAP
+      bool oldApplication;         //!< Runs software that predates VERSION_UPDATER, see Send() and EnterUpdater()
+
+      static int commandLatencyUs; //!< Time between end of a command and start of processing
+      static const int UpdaterPage = 47; //!< First page of .bootlow in the Tiny44 build, the updater doesn't write it
+      static SimCell* active;      //!< Module whose state is currently swapped in
+
+   private:
+      void Activate();
+      void Deactivate();
+      void Process();
+      void Resume();
+      static void MainLoopEntry();
+      void ReceivePage(const uint8_t* data, int len, bool brk, int baud);
+      bool IsPageValid();
+      bool ProcessPage();
+      bool ProcessLegacyPage();
+      void SendPageMap();
+      uint16_t FlashCrc(int pageNum);
+
+      struct Context* ctx;
+      int position;
+      uint64_t cursor;
+      bool processPending;
+      bool busy;                  //!< inside a main loop pass, possibly busy waiting
+      uint8_t* stack;
+      ucontext_t cellContext;
+      ucontext_t callerContext;
+      static SimCell* starting;   //!< Module whose main loop pass is being entered
+      static const int STACK_SIZE = 65536;
+
+      uint8_t* rxBuf;
+      uint8_t rxExpected;
+      uint8_t rxCurrent;
+      uint8_t rxIdle;
+      uint16_t rxSinceBreak;
+      int baudrate;
+
+      bool boot;
+      bool selected;
+      bool armed;                 //!< UPDATE_DONE was the last frame
+      struct PageBuf page;
+      struct PageMap pageMap;
+      uint8_t pageBytes;
+      uint8_t updaterAddress;
+      int pagesWritten;
+      int replyBytes;             //!< Upstream reply bytes to wait for before sending the bitmap, -1 if none
+      uint64_t writeEnd;          //!< The updater is deaf while it writes flash
+      uint16_t flash[ATTINY_MAX_APPLICATION_PAGES * PAGE_WORDS];
+};
+
+#endif // SIMCELL_H
@@ -0,0 +1,141 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include "hwdefs.h"
+#include "simflash.h"
+
+uint32_t SimFlash::base;
+int SimFlash::size;
+int SimFlash::remaining = -1;
+bool SimFlash::locked = true;
+int SimFlash::eraseCounts[];
+
+static uint32_t crc;
+
+/** The test binary is linked with -no-pie so the STM32 flash addresses are free */
+bool SimFlash::Map(uint32_t address, int size)
+{
+   void* mem = mmap((void*)(uintptr_t)address, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+
+   if (mem != (void*)(uintptr_t)address)
+   {
+      perror("mmap");
+      return false;
+   }
+
+   base = address;
+   SimFlash::size = size;
+   EraseAll();
+   return true;
+}
+
+void SimFlash::EraseAll()
+{
+   memset((void*)(uintptr_t)base, 0xff, size);
+   memset(eraseCounts, 0, sizeof(eraseCounts));
+}
+
+SimFlash::Outcome SimFlash::Operate()
+{
+   if (remaining < 0) return Done;
+   if (remaining == 0) return NoPower;
+   remaining--;
+   return remaining == 0 ? Interrupted : Done;
+}
+
+int SimFlash::GetEraseCount(uint32_t address)
+{
+   return eraseCounts[(address - base) / FLASH_PAGE_SIZE];
+}
+
+void SimFlash::CountErase(uint32_t address)
+{
+   eraseCounts[(address - base) / FLASH_PAGE_SIZE]++;
+}
+
+void flash_unlock()
+{
+   SimFlash::SetLocked(false);
+}
+
+void flash_lock()
+{
+   SimFlash::SetLocked(true);
+}
+
+/** An erase cut short by a power loss leaves the first half of the page erased,
+ * a word cut short only has its upper half programmed */
+void flash_erase_page(uint32_t page_address)
+{
+   if (SimFlash::IsLocked()) return;
+
+   page_address &= ~(FLASH_PAGE_SIZE - 1);
+
+   switch (SimFlash::Operate())
+   {
+   case SimFlash::Done:
+      memset((void*)(uintptr_t)page_address, 0xff, FLASH_PAGE_SIZE);
+      SimFlash::CountErase(page_address);
+      break;
+   case SimFlash::Interrupted:
+      memset((void*)(uintptr_t)page_address, 0xff, FLASH_PAGE_SIZE / 2);
+      break;
+   case SimFlash::NoPower:
+      break;
+   }
+}
+
+void flash_program_word(uint32_t address, uint32_t data)
+{
+   if (SimFlash::IsLocked()) return;
+
+   switch (SimFlash::Operate())
+   {
+   case SimFlash::Done:
+      *(volatile uint32_t*)(uintptr_t)address &= data;
+      break;
+   case SimFlash::Interrupted:
+      *(volatile uint32_t*)(uintptr_t)address &= data | 0xffff;
+      break;
+   case SimFlash::NoPower:
+      break;
+   }
+}
+
+void crc_reset()
+{
+   crc = 0xffffffff;
+}
+
+/** CRC-32 as calculated by the STM32 CRC unit: word wise, MSB first, no reflection */
+uint32_t crc_calculate_block(uint32_t *datap, int size)
+{
+   for (int i = 0; i < size; i++)
+   {
+      crc ^= datap[i];
+
+      for (int bit = 0; bit < 32; bit++)
+         crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04C11DB7 : crc << 1;
+   }
+   return crc;
+}
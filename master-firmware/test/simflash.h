@@ -0,0 +1,49 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef SIMFLASH_H
+#define SIMFLASH_H
+#include <stdint.h>
+
+/** Flash pages mapped at their STM32 address. Programming can only clear bits,
+ * erasing sets a page to 0xff. A simulated power loss cuts one operation short
+ * and makes all further operations fail until Restore() */
+class SimFlash
+{
+   public:
+      static bool Map(uint32_t address, int size);
+      static void EraseAll();
+      static void PowerLossAfter(int operations) { remaining = operations; }
+      static void Restore() { remaining = -1; }
+      enum Outcome { Done, Interrupted, NoPower };
+
+      static Outcome Operate();
+      static bool IsLocked() { return locked; }
+      static void SetLocked(bool lock) { locked = lock; }
+      static int GetEraseCount(uint32_t address);
+      static void CountErase(uint32_t address);
+
+   private:
+      static uint32_t base;
+      static int size;
+      static int remaining;
+      static bool locked;
+      static int eraseCounts[64];
+};
+
+#endif // SIMFLASH_H
@@ -0,0 +1,112 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <string.h>
+#include "params.h"
+#include "stm32_can.h"
+
+#define PARAM_ENTRY(category, name, unit, min, max, def, id) { category, #name, unit, (s32fp)((min) * 32), (s32fp)((max) * 32), (s32fp)((def) * 32), id },
+#define VALUE_ENTRY(name, unit, id) { 0, #name, unit, 0, 0, 0, id },
+static const Param::Attributes attribs[] = { PARAM_LIST };
+#undef PARAM_ENTRY
+#undef VALUE_ENTRY
+
+#define PARAM_ENTRY(category, name, unit, min, max, def, id) 1,
+#define VALUE_ENTRY(name, unit, id) 0,
+static const bool isParam[] = { PARAM_LIST };
+#undef PARAM_ENTRY
+#undef VALUE_ENTRY
+
+static s32fp values[Param::PARAM_LAST];
+static Param::PARAM_FLAG flags[Param::PARAM_LAST];
+
+int Param::Set(PARAM_NUM ParamNum, s32fp ParamVal)
+{
+   values[ParamNum] = ParamVal;
+   return 0;
+}
+
+s32fp Param::Get(PARAM_NUM ParamNum)
+{
+   return values[ParamNum];
+}
+
+int Param::GetInt(PARAM_NUM ParamNum)
+{
+   return FP_TOINT(values[ParamNum]);
+}
+
+void Param::SetInt(PARAM_NUM ParamNum, int ParamVal)
+{
+   values[ParamNum] = FP_FROMINT(ParamVal);
+}
+
+void Param::SetFlt(PARAM_NUM ParamNum, s32fp ParamVal)
+{
+   values[ParamNum] = ParamVal;
+}
+
+Param::PARAM_NUM Param::NumFromString(const char *name)
+{
+   for (int i = 0; i < PARAM_LAST; i++)
+   {
+      if (strcmp(attribs[i].name, name) == 0)
+         return (PARAM_NUM)i;
+   }
+   return PARAM_INVALID;
+}
+
+const Param::Attributes* Param::GetAttrib(PARAM_NUM ParamNum)
+{
+   return &attribs[ParamNum];
+}
+
+int Param::IsParam(PARAM_NUM ParamNum)
+{
+   return isParam[ParamNum];
+}
+
+void Param::SetFlag(PARAM_NUM param, PARAM_FLAG flag)
+{
+   flags[param] = flag;
+}
+
+Param::PARAM_FLAG Param::GetFlag(PARAM_NUM param)
+{
+   return flags[param];
+}
+
+/** One interface with udc and soc mapped */
+Can* Can::GetInterface(int)
+{
+   static Can can;
+   return &can;
+}
+
+bool Can::FindMap(Param::PARAM_NUM param, int& canId, int& offset, int& length, s32fp& gain, bool& rx)
+{
+   if (param != Param::udc && param != Param::soc)
+      return false;
+
+   canId = 0x100 + param;
+   offset = param == Param::udc ? 0 : 16;
+   length = 16;
+   gain = FP_FROMINT(10);
+   rx = param == Param::soc;
+   return true;
+}
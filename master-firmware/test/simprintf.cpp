@@ -0,0 +1,90 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include "my_fp.h"
+#include "simbus.h"
+
+#undef printf
+#undef sprintf
+
+/** Like the target printf, %f takes an s32fp and prints two decimals */
+static int Format(char* out, const char* format, va_list args)
+{
+   char* start = out;
+
+   while (*format)
+   {
+      if (*format != '%')
+      {
+         *out++ = *format++;
+         continue;
+      }
+
+      char spec[16];
+      int len = strspn(format + 1, "0123456789-.") + 2;
+
+      snprintf(spec, sizeof(spec), "%.*s", len, format);
+      format += len;
+
+      switch (spec[len - 1])
+      {
+      case 'f':
+         spec[len - 1] = 0;
+         strcat(spec, ".2f");
+         out += sprintf(out, spec, va_arg(args, int) / (double)(1 << CST_DIGITS));
+         break;
+      case 's':
+         out += sprintf(out, spec, va_arg(args, const char*));
+         break;
+      case '%':
+         *out++ = '%';
+         break;
+      default:
+         out += sprintf(out, spec, va_arg(args, int));
+         break;
+      }
+   }
+
+   *out = 0;
+   return out - start;
+}
+
+int sim_sprintf(char* out, const char* format, ...)
+{
+   va_list args;
+   va_start(args, format);
+   int len = Format(out, format, args);
+   va_end(args);
+
+   return len;
+}
+
+int sim_printf(const char* format, ...)
+{
+   char buf[1024];
+   va_list args;
+   va_start(args, format);
+   int len = Format(buf, format, args);
+   va_end(args);
+
+   SimBus::TerminalTransmit((const uint8_t*)buf, len);
+   return len;
+}
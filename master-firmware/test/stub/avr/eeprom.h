@@ -0,0 +1,23 @@
+/* Host stand-in for avr/eeprom.h. EEPROM variables live in normal RAM */
+#ifndef SIM_AVR_EEPROM_H
+#define SIM_AVR_EEPROM_H
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+#define EEMEM
+
+uint8_t eeprom_read_byte(const uint8_t* addr);
+uint16_t eeprom_read_word(const uint16_t* addr);
+uint32_t eeprom_read_dword(const uint32_t* addr);
+void eeprom_read_block(void* dst, const void* src, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_AVR_EEPROM_H
@@ -0,0 +1,9 @@
+/* Host stand-in for avr/interrupt.h */
+#ifndef SIM_AVR_INTERRUPT_H
+#define SIM_AVR_INTERRUPT_H
+
+#define sei()
+#define cli()
+#define ISR(vector) void vector(void)
+
+#endif // SIM_AVR_INTERRUPT_H
@@ -0,0 +1,41 @@
+/* Host stand-in for avr/io.h. Registers are plain variables owned by simcell.cpp
+ * and swapped along with the rest of the cell module context */
+#ifndef SIM_AVR_IO_H
+#define SIM_AVR_IO_H
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+extern volatile uint8_t PORTA, DDRA, PINA, PORTB, DDRB;
+extern volatile uint8_t CLKPR, OSCCAL, MCUCR, ADCSRA, DIDR0;
+extern volatile uint8_t GIMSK, PCMSK0, TIFR0, TIMSK0, TCCR0A, TCCR0B, TCNT0, OCR0A;
+
+#define PIN0     0
+#define PIN1     1
+#define PIN2     2
+#define PIN3     3
+#define PIN4     4
+#define PIN5     5
+#define PIN6     6
+#define PIN7     7
+
+#define CLKPCE   7
+#define CLKPS0   0
+#define BODS     7
+#define BODSE    2
+#define ADEN     7
+#define PCIE0    4
+#define PCINT7   7
+#define OCF0A    1
+#define OCIE0A   1
+#define WGM01    1
+#define CS01     1
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_AVR_IO_H
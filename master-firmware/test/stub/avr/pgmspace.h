@@ -0,0 +1,20 @@
+/* Host stand-in for avr/pgmspace.h. Flash reads go through simcell.cpp, which
+ * knows which updater the active module runs */
+#ifndef SIM_AVR_PGMSPACE_H
+#define SIM_AVR_PGMSPACE_H
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+uint8_t sim_pgm_read_byte(const void* addr);
+
+#define pgm_read_byte(addr) sim_pgm_read_byte(addr)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_AVR_PGMSPACE_H
@@ -0,0 +1,11 @@
+/* Host stand-in for avr/sleep.h. Virtual modules never sleep */
+#ifndef SIM_AVR_SLEEP_H
+#define SIM_AVR_SLEEP_H
+
+#define SLEEP_MODE_PWR_DOWN 0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_cpu()
+#define sleep_disable()
+
+#endif // SIM_AVR_SLEEP_H
@@ -0,0 +1,4 @@
+/* Host stand-in for libopeninv digio.h */
+#ifndef SIM_DIGIO_H
+#define SIM_DIGIO_H
+#endif // SIM_DIGIO_H
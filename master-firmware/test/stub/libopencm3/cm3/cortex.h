@@ -0,0 +1,30 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host stand-in for libopencm3 interrupt masking. Interrupt handlers are
+ * events of the simulator and never preempt, so there is nothing to mask. */
+#ifndef SIM_CORTEX_H
+#define SIM_CORTEX_H
+
+#include <stdint.h>
+
+static inline void cm_disable_interrupts(void) {}
+static inline void cm_enable_interrupts(void) {}
+static inline uint32_t cm_mask_interrupts(uint32_t mask) { (void)mask; return 0; }
+
+#endif // SIM_CORTEX_H
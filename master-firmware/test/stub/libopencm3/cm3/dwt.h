@@ -0,0 +1,31 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host stand-in for the libopencm3 DWT cycle counter. Tests advance
+ * sim_cycle_counter themselves to simulate the execution time of a task. */
+#ifndef SIM_DWT_H
+#define SIM_DWT_H
+
+#include <stdint.h>
+
+extern uint32_t sim_cycle_counter;
+
+static inline bool dwt_enable_cycle_counter(void) { return true; }
+static inline uint32_t dwt_read_cycle_counter(void) { return sim_cycle_counter; }
+
+#endif // SIM_DWT_H
@@ -0,0 +1,9 @@
+/* Host stand-in for the libopencm3 unique device id */
+#ifndef SIM_DESIG_H
+#define SIM_DESIG_H
+
+#define DESIG_UNIQUE_ID0 0x12345678
+#define DESIG_UNIQUE_ID1 0x9abcdef0
+#define DESIG_UNIQUE_ID2 0x0badcafe
+
+#endif // SIM_DESIG_H
@@ -0,0 +1,42 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host stand-in for the libopencm3 DMA API, backed by simbus.cpp */
+#ifndef SIM_DMA_H
+#define SIM_DMA_H
+#include <stdint.h>
+
+#define DMA1            1
+#define DMA_CHANNEL2    2
+#define DMA_CHANNEL4    4
+#define DMA_CHANNEL5    5
+#define DMA_TCIF        (1 << 1)
+#define DMA_HTIF        (1 << 2)
+
+void dma_enable_channel(uint32_t dma, uint8_t channel);
+void dma_disable_channel(uint32_t dma, uint8_t channel);
+/* Takes the address as uintptr_t, the firmware casts buffers to that.
+ * It is uint32_t on the STM32 and holds a whole pointer on the host */
+void dma_set_memory_address(uint32_t dma, uint8_t channel, uintptr_t address);
+void dma_set_number_of_data(uint32_t dma, uint8_t channel, uint16_t number);
+uint16_t dma_get_number_of_data(uint32_t dma, uint8_t channel);
+void dma_enable_half_transfer_interrupt(uint32_t dma, uint8_t channel);
+void dma_enable_transfer_complete_interrupt(uint32_t dma, uint8_t channel);
+void dma_clear_interrupt_flags(uint32_t dma, uint8_t channel, uint32_t interrupts);
+
+#endif // SIM_DMA_H
@@ -0,0 +1,29 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host stand-in for the libopencm3 flash API, backed by simflash.cpp */
+#ifndef SIM_FLASH_H
+#define SIM_FLASH_H
+#include <stdint.h>
+
+void flash_unlock(void);
+void flash_lock(void);
+void flash_erase_page(uint32_t page_address);
+void flash_program_word(uint32_t address, uint32_t data);
+
+#endif // SIM_FLASH_H
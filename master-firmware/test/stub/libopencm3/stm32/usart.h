@@ -0,0 +1,53 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host stand-in for the libopencm3 USART API, backed by simbus.cpp */
+#ifndef SIM_USART_H
+#define SIM_USART_H
+#include <stdint.h>
+
+#define USART1             1
+#define USART3             3
+
+#define USART_CR1_SBK      (1 << 0)
+#define USART_CR1_RE       (1 << 2)
+#define USART_CR1_TE       (1 << 3)
+#define USART_CR1_IDLEIE   (1 << 4)
+#define USART_CR1_TCIE     (1 << 6)
+#define USART_SR_TC        (1 << 6)
+#define USART_SR_RXNE      (1 << 5)
+#define USART_SR_IDLE      (1 << 4)
+#define USART_SR_FE        (1 << 1)
+
+#define USART_MODE_RX      USART_CR1_RE
+#define USART_MODE_TX      USART_CR1_TE
+#define USART_MODE_TX_RX   (USART_CR1_RE | USART_CR1_TE)
+
+extern volatile uint32_t sim_usart1_cr1;
+extern volatile uint32_t sim_usart1_sr;
+extern volatile uint32_t sim_usart1_dr;
+
+#define USART1_CR1         sim_usart1_cr1
+#define USART1_SR          sim_usart1_sr
+#define USART1_DR          sim_usart1_dr
+#define USART_CR1(usart)   sim_usart1_cr1
+
+void usart_set_mode(uint32_t usart, uint32_t mode);
+void usart_set_baudrate(uint32_t usart, uint32_t baud);
+
+#endif // SIM_USART_H
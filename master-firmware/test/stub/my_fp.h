@@ -0,0 +1,18 @@
+/* Host stand-in for libopeninv my_fp.h, only what the BMS code uses */
+#ifndef SIM_MY_FP_H
+#define SIM_MY_FP_H
+
+#include <stdint.h>
+
+#define CST_DIGITS 5
+#define FRAC_DIGITS CST_DIGITS
+#define FP_FROMINT(a) ((s32fp)((a) << CST_DIGITS))
+#define FP_FROMFLT(a) ((s32fp)((a) * (1 << CST_DIGITS)))
+#define FP_TOINT(a) ((a) >> CST_DIGITS)
+#define FP_MUL(a, b) (((a) * (b)) >> CST_DIGITS)
+#define FP_DIV(a, b) (((a) << CST_DIGITS) / (b))
+
+typedef int32_t s32fp;
+typedef uint32_t u32fp;
+
+#endif // SIM_MY_FP_H
@@ -0,0 +1,9 @@
+/* Host stand-in for libopeninv my_math.h */
+#ifndef SIM_MY_MATH_H
+#define SIM_MY_MATH_H
+
+#define MIN(a, b) (((a) < (b)) ? (a) : (b))
+#define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define ABS(a) ((a) < 0 ? (-(a)) : (a))
+
+#endif // SIM_MY_MATH_H
@@ -0,0 +1,55 @@
+/* Host stand-in for libopeninv params.h with the parameter list of this
+ * project, implemented by simparams.cpp */
+#ifndef SIM_PARAMS_H
+#define SIM_PARAMS_H
+
+#include <stdint.h>
+#include "my_fp.h"
+
+#define STRINGIFY(s) #s
+
+#include "param_prj.h"
+
+namespace Param
+{
+   #define PARAM_ENTRY(category, name, unit, min, max, def, id) name,
+   #define VALUE_ENTRY(name, unit, id) name,
+   typedef enum
+   {
+      PARAM_LIST
+      PARAM_LAST,
+      PARAM_INVALID
+   } PARAM_NUM;
+   #undef PARAM_ENTRY
+   #undef VALUE_ENTRY
+
+   enum PARAM_FLAG
+   {
+      FLAG_NONE = 0,
+      FLAG_HIDDEN = 1
+   };
+
+   typedef struct
+   {
+      char const *category;
+      char const *name;
+      char const *unit;
+      s32fp min;
+      s32fp max;
+      s32fp def;
+      uint32_t id;
+   } Attributes;
+
+   int Set(PARAM_NUM ParamNum, s32fp ParamVal);
+   s32fp Get(PARAM_NUM ParamNum);
+   int GetInt(PARAM_NUM ParamNum);
+   void SetInt(PARAM_NUM ParamNum, int ParamVal);
+   void SetFlt(PARAM_NUM ParamNum, s32fp ParamVal);
+   PARAM_NUM NumFromString(const char *name);
+   const Attributes *GetAttrib(PARAM_NUM ParamNum);
+   int IsParam(PARAM_NUM ParamNum);
+   void SetFlag(PARAM_NUM param, PARAM_FLAG flag);
+   PARAM_FLAG GetFlag(PARAM_NUM param);
+}
+
+#endif // SIM_PARAMS_H
@@ -0,0 +1,12 @@
+/* Host stand-in for libopeninv printf.h, implemented by simprintf.cpp.
+ * %f prints s32fp. printf output goes to the simulated terminal */
+#ifndef SIM_PRINTF_H
+#define SIM_PRINTF_H
+
+int sim_printf(const char* format, ...);
+int sim_sprintf(char* out, const char* format, ...);
+
+#define printf sim_printf
+#define sprintf sim_sprintf
+
+#endif // SIM_PRINTF_H
@@ -0,0 +1,14 @@
+/* Host stand-in for libopeninv stm32_can.h, implemented by simparams.cpp */
+#ifndef SIM_STM32_CAN_H
+#define SIM_STM32_CAN_H
+
+#include "params.h"
+
+class Can
+{
+   public:
+      static Can* GetInterface(int index);
+      bool FindMap(Param::PARAM_NUM param, int& canId, int& offset, int& length, s32fp& gain, bool& rx);
+};
+
+#endif // SIM_STM32_CAN_H
@@ -0,0 +1,17 @@
+/* Host stand-in for util/crc16.h */
+#ifndef SIM_UTIL_CRC16_H
+#define SIM_UTIL_CRC16_H
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+uint16_t _crc_xmodem_update(uint16_t crc, uint8_t data);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_UTIL_CRC16_H
@@ -0,0 +1,20 @@
+/* Host stand-in for util/delay.h. Delays advance the virtual time of the active cell module */
+#ifndef SIM_UTIL_DELAY_H
+#define SIM_UTIL_DELAY_H
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+void sim_cell_delay_us(uint32_t us);
+
+#define _delay_ms(ms) sim_cell_delay_us((uint32_t)((ms) * 1000))
+#define _delay_us(us) sim_cell_delay_us((uint32_t)(us))
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // SIM_UTIL_DELAY_H
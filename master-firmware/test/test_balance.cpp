@@ -0,0 +1,256 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Simulates a pack through daily charge and drive cycles and compares the time
+ * it takes to balance with threshold shunting and with BalancePlanner. The
+ * cells start with different SoC and capacity, one module sits in a hot spot
+ * and warms up with every shunt that is on */
+#include <stdio.h>
+#include <math.h>
+#include "bmscalculation.h"
+#include "balanceplanner.h"
+#include "ocvtable.h"
+
+#define NUM_MODULES  4
+#define NUM_CELLS    (NUM_MODULES * 4)
+#define CAPACITY     100     //Ah, nominal
+#define RESISTANCE   0.001   //Ohm
+#define STEP         2       //s, the planner period
+#define THRESH_STEPS 6       //threshold shunting runs every 12 s
+#define BLEED        0.1     //A per shunt
+#define CHARGE_CUR   20.0    //A
+#define CHARGE_STOP  4170    //mV
+#define DRIVE_CUR    -30.0   //A
+#define DRIVE_START  (8 * 3600)
+#define DRIVE_TIME   (2 * 3600)
+#define SHUNT_VTG    4100    //mV, the threshold policy has to start well below CHARGE_STOP
+#define TOLERANCE    300     //mAh
+#define MAX_TEMP     55      //°C
+#define HEATING      3.0     //°C per shunt that is on
+#define HEAT_TAU     600.0   //s
+#define BALANCED     500     //mAh spread of the charge to full
+#define MAX_DAYS     30
+
+enum Policy { Threshold, Predictive };
+
+static const double ambient[NUM_MODULES] = { 25, 25, 25, 40 };
+static uint16_t voltages[NUM_CELLS];
+static int8_t temperatures[NUM_MODULES];
+static double charge[NUM_CELLS]; //Ah
+static double capacity[NUM_CELLS];
+static double moduleTemp[NUM_MODULES];
+static uint8_t shunts[NUM_MODULES];
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; }
+
+static void InitCells()
+{
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      capacity[cell] = CAPACITY * (1 + ((cell * 7) % 5 - 2) * 0.01);
+      charge[cell] = capacity[cell] * (0.5 + ((cell * 5) % 8) * 0.01);
+   }
+
+   for (int module = 0; module < NUM_MODULES; module++)
+   {
+      moduleTemp[module] = ambient[module];
+      shunts[module] = 0;
+   }
+}
+
+static void SetVoltages(double current)
+{
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      int32_t slope;
+      int32_t soc = fmax(0, fmin(1, charge[cell] / capacity[cell])) * (1 << 30);
+      s32fp temperature = FP_FROMINT(temperatures[cell / 4]);
+      double ocv = OcvTable::GetVoltage(soc, temperature, slope) / 1000.0;
+
+      voltages[cell] = lround(ocv + current * RESISTANCE * 1000);
+   }
+}
+
+/** @return spread of the charge that fills each cell in mAh */
+static double Spread()
+{
+   double min = 1e9, max = -1e9;
+
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      double toFull = (capacity[cell] - charge[cell]) * 1000;
+      min = fmin(min, toFull);
+      max = fmax(max, toFull);
+   }
+   return max - min;
+}
+
+static bool AnyAbove(double current, int vtg)
+{
+   SetVoltages(current);
+
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+      if (voltages[cell] >= vtg) return true;
+   return false;
+}
+
+/** @return simulated seconds until balanced or -1 */
+static int Simulate(Policy policy, const char* name)
+{
+   bool charging = true;
+   double countedIn = 0, countedOut = 0; //As
+   int restTime = 0, balanceTime = -1, budgetViolations = 0;
+   int estimatedTime = -1;
+   double hottest = 0;
+
+   InitCells();
+   BmsCalculation::SetVoltageSource(voltages, NUM_CELLS, 4);
+   BmsCalculation::SetTemperatureSource(temperatures, NUM_MODULES);
+   BmsCalculation::SetCapacity(FP_FROMINT(CAPACITY));
+   BmsCalculation::SetCharge(0, 0);
+   BalancePlanner::Stop(NUM_MODULES);
+   BalancePlanner::Restart();
+
+   double initialSpread = Spread();
+
+   for (int t = 0; t < MAX_DAYS * 86400; t += STEP)
+   {
+      int timeOfDay = t % 86400;
+      double current = 0;
+
+      if (timeOfDay == 0)
+         charging = true;
+
+      if (charging && AnyAbove(CHARGE_CUR, CHARGE_STOP))
+         charging = false;
+
+      if (charging)
+         current = CHARGE_CUR;
+      else if (timeOfDay >= DRIVE_START && timeOfDay < DRIVE_START + DRIVE_TIME)
+         current = DRIVE_CUR;
+
+      for (int module = 0; module < NUM_MODULES; module++)
+         temperatures[module] = lround(moduleTemp[module]);
+
+      SetVoltages(current);
+
+      if (current != 0)
+      {
+         restTime = 0;
+         (current > 0 ? countedIn : countedOut) += fabs(current) * STEP;
+         BmsCalculation::SetCharge(FP_FROMFLT(countedIn), FP_FROMFLT(countedOut));
+      }
+      else
+      {
+         restTime += STEP;
+
+         //Same as the firmware after an hour without current
+         if (restTime > 3600 && (restTime % 60) == 0)
+         {
+            BmsCalculation::SetCharge(FP_FROMFLT(countedIn), FP_FROMFLT(countedOut));
+            BmsCalculation::EstimateCellSocs();
+            BmsCalculation::RestartCharge();
+            BalancePlanner::Restart();
+            countedIn = countedOut = 0;
+         }
+      }
+
+      if (policy == Threshold && (t / STEP) % THRESH_STEPS == 0)
+      {
+         for (int module = 0; module < NUM_MODULES; module++)
+         {
+            shunts[module] = 0;
+
+            for (int i = 0; i < 4; i++)
+               shunts[module] |= (voltages[module * 4 + i] > SHUNT_VTG) << i;
+         }
+      }
+      else if (policy == Predictive)
+      {
+         if (current < 0)
+            BalancePlanner::Stop(NUM_MODULES);
+         else
+            BalancePlanner::Plan(voltages, temperatures, NUM_MODULES, STEP * 1000);
+
+         for (int module = 0; module < NUM_MODULES; module++)
+         {
+            shunts[module] = BalancePlanner::GetShunts(module + 1);
+
+            if (__builtin_popcount(shunts[module]) > BalancePlanner::GetBudget(temperatures[module]))
+               budgetViolations++;
+         }
+
+         if (estimatedTime < 0 && BalancePlanner::GetTimeToBalance() > 0)
+            estimatedTime = BalancePlanner::GetTimeToBalance();
+      }
+
+      for (int cell = 0; cell < NUM_CELLS; cell++)
+      {
+         charge[cell] += current * STEP / 3600.0;
+
+         if (shunts[cell / 4] & (1 << (cell % 4)))
+            charge[cell] -= BLEED * STEP / 3600.0;
+      }
+
+      for (int module = 0; module < NUM_MODULES; module++)
+      {
+         double target = ambient[module] + HEATING * __builtin_popcount(shunts[module]);
+         moduleTemp[module] += (target - moduleTemp[module]) * STEP / HEAT_TAU;
+         hottest = fmax(hottest, moduleTemp[module]);
+      }
+
+      if (balanceTime < 0 && Spread() < BALANCED)
+         balanceTime = t;
+   }
+
+   printf("%-10s spread %5.0f -> %4.0f mAh  ", name, initialSpread, Spread());
+
+   if (balanceTime >= 0)
+      printf("balanced after %5.1f h", balanceTime / 3600.0);
+   else
+      printf("not balanced within %d days", MAX_DAYS);
+
+   if (policy == Predictive)
+      printf(", first estimate %5.1f h", estimatedTime / 3600.0);
+   printf(", hottest module %4.1f °C\r\n", hottest);
+
+   CHECK(budgetViolations == 0, "thermal budget");
+   CHECK(policy == Threshold || hottest < MAX_TEMP, "temperature limit");
+
+   return balanceTime;
+}
+
+int main()
+{
+   OcvTable::LoadPreset(OcvTable::Nmc);
+   BalancePlanner::SetBleedCurrent(BLEED * 1000);
+   BalancePlanner::SetTolerance(TOLERANCE);
+   BalancePlanner::SetThermalLimit(MAX_TEMP, 4);
+
+   int threshold = Simulate(Threshold, "threshold");
+   int predictive = Simulate(Predictive, "predictive");
+
+   CHECK(predictive >= 0, "predictive balances");
+   CHECK(threshold < 0 || predictive < threshold, "predictive is faster");
+   CHECK(Spread() < BALANCED, "predictive stays balanced");
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
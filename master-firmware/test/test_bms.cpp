@@ -0,0 +1,726 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Runs BmsComm and OneWire against a chain of virtual cell modules and reports
+ * bus timing for every chain length. Exit code is the number of failed checks. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "bmscomm.h"
+#include "bmscalculation.h"
+#include "cellstatistics.h"
+#include "onewire.h"
+#include "imagestore.h"
+#include "crc16.h"
+#include "simbus.h"
+#include "simcell.h"
+
+#define TASK_PERIOD_US  40000 //CellModuleCommunication() runs every 40 ms
+#define UPDATE_PERIOD_US 10000 //Ms10Task drives the update
+#define POLL_CYCLES     3     //the simulation is deterministic, more cycles only take longer
+
+uint8_t _binary_cmu_images_lz_start[12288];
+static uint16_t image[ATTINY_MAX_APPLICATION_PAGES * PAGE_WORDS];      //for the hardware of main.c
+static uint16_t otherImage[ATTINY_MAX_APPLICATION_PAGES * PAGE_WORDS]; //for otherHardware
+static const uint8_t otherHardware[2] = { 2, 'A' };
+static const struct version imageVersion = { { 2, 0, 17, 'R' }, { 1, 'A' } };
+
+struct Result
+{
+   uint64_t addrUs;
+   uint64_t versionUs;
+   uint64_t cycleUs;
+   uint64_t pollUs;
+   uint32_t bytesPerCycle;
+   uint64_t negotiationUs;
+   int baudrate;
+   uint64_t broadcastUs;
+   uint32_t broadcastBytes;
+   uint64_t updateUs;
+   uint32_t updateBytes;
+   int updateRounds;
+   uint64_t diffUs;
+   uint32_t diffBytes;
+   uint64_t mixedUs;
+   uint64_t legacyUs;
+};
+
+static int failures = 0;
+
+#define CHECK(cond, n, what) if (!(cond)) { printf("FAIL: %d modules: %s\r\n", n, what); failures++; return false; }
+
+/** Build the image store like tools/lzpack does */
+static void PackImages()
+{
+   const uint16_t* images[] = { image, otherImage };
+   uint8_t* entry = _binary_cmu_images_lz_start;
+   uint8_t* end = _binary_cmu_images_lz_start + sizeof(_binary_cmu_images_lz_start);
+
+   for (int i = 0; i < 2; i++)
+   {
+      ImageHeader* header = (ImageHeader*)entry;
+
+      header->magic = ImageStore::Magic;
+      header->version = imageVersion;
+      header->size = sizeof(image);
+      header->packedSize = LzImage::Compress((const uint8_t*)images[i], sizeof(image), entry + sizeof(ImageHeader), end - entry - sizeof(ImageHeader));
+      header->crc = Crc16::Calculate((const uint8_t*)images[i], sizeof(image));
+
+      if (i == 1)
+         memcpy(header->version.hwVersion, otherHardware, sizeof(otherHardware));
+
+      entry += sizeof(ImageHeader) + header->packedSize;
+   }
+
+   memset(entry, 0, end - entry);
+}
+
+/** @return image the store has for the hardware of a module */
+static const uint16_t* ImageFor(int mod)
+{
+   return memcmp(SimBus::GetCell(mod)->reportedVersion.hwVersion, otherHardware, sizeof(otherHardware)) == 0 ? otherImage : image;
+}
+
+static void Tick()
+{
+   SimBus::RunFor(TASK_PERIOD_US);
+}
+
+/** Same sequence as ResetAddress, SetAddress and WaitAddress states. A module
+ * that has left the updater while those behind it kept running doesn't forward
+ * the reset until it has an address, WaitAddress then starts over once */
+static bool AssignAddresses(int n, Result& r)
+{
+   bool done = false;
+
+   for (int attempt = 0; attempt < 2 && !done; attempt++)
+   {
+      BmsComm::ResetAddress();
+      Tick();
+
+      uint64_t start = SimBus::Now();
+      BmsComm::SetAddress();
+      done = SimBus::RunUntil([n]() { return BmsComm::GetNumberOfCellModules() == n; }, 30 * TASK_PERIOD_US);
+      r.addrUs = SimBus::Now() - start;
+   }
+
+   CHECK(done, n, "address assignment");
+
+   //as in WaitReady state
+   BmsCalculation::SetVoltageSource(BmsComm::GetVoltages(), n * BmsComm::voltagesPerModule, BmsComm::voltagesPerModule);
+   BmsCalculation::SetTemperatureSource(BmsComm::GetTemperatures(), n);
+   return true;
+}
+
+/** Same sequence as GetVersion state */
+static bool ReadVersions(int n, Result& r)
+{
+   uint64_t start = SimBus::Now();
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      BmsComm::StartVersionAcquisition(mod);
+      Tick();
+      CHECK(BmsComm::AcquireVersion(mod), n, "version reply");
+   }
+   r.versionUs = SimBus::Now() - start;
+
+   for (int mod = 0; mod < n; mod++)
+   {
+      CHECK(BmsComm::GetVersions()[mod].swVersion[3] == 'R', n, "version content");
+   }
+   return true;
+}
+
+/** Pack statistics are updated per reply, compare them with a full scan */
+static bool CheckPackStats(int n)
+{
+   const uint16_t* voltages = BmsComm::GetVoltages();
+   int numVoltages = n * BmsComm::voltagesPerModule;
+   int min = 5000, max = 0, sum = 0, tmpsum = 0;
+   int statMin, statMax, statAvg;
+   s32fp statSum;
+
+   for (int i = 0; i < numVoltages; i++)
+   {
+      min = std::min(min, (int)voltages[i]);
+      max = std::max(max, (int)voltages[i]);
+      sum += voltages[i];
+   }
+
+   for (int i = 0; i < n; i++)
+      tmpsum += BmsComm::GetTemperatures()[i];
+
+   BmsCalculation::AggregateVoltages(statMin, statMax, statAvg, statSum);
+
+   CHECK(statMin == min && statMax == max, n, "pack min/max");
+   CHECK(statAvg == sum / numVoltages && statSum == FP_FROMINT(sum) / 1000, n, "pack average/sum");
+   CHECK(voltages[BmsCalculation::GetMinCell()] == min, n, "weakest cell");
+   CHECK(voltages[BmsCalculation::GetMaxCell()] == max, n, "strongest cell");
+   CHECK(BmsCalculation::GetTemperatureAverage() == FP_FROMINT(tmpsum) / n, n, "temperature average");
+
+   return true;
+}
+
+static bool CheckValues(int n)
+{
+   for (int mod = 1; mod <= n; mod++)
+   {
+      SimCell* cell = SimBus::GetCell(mod);
+
+      for (int i = 0; i < BmsComm::voltagesPerModule; i++)
+      {
+         CHECK(BmsComm::GetVoltages()[(mod - 1) * BmsComm::voltagesPerModule + i] == cell->voltages[i], n, "voltage value");
+      }
+      CHECK(BmsComm::GetTemperatures()[mod - 1] == cell->temperature, n, "temperature value");
+   }
+
+   return CheckPackStats(n);
+}
+
+/** After PollCycles every cell has been read at its initial voltage -3, +4 and +1 */
+static bool CheckCellStatistics(int n)
+{
+   for (int cell = 0; cell < n * BmsComm::voltagesPerModule; cell++)
+   {
+      const CellStatistics::Stats& stats = CellStatistics::Get(cell);
+      int vtg = BmsComm::GetVoltages()[cell];
+      int jump = cell == (n - 1) * BmsComm::voltagesPerModule ? 1000 : 0;
+
+      CHECK(stats.min == vtg - jump - 4 && stats.max == (jump ? vtg : vtg + 3), n, "cell min/max");
+      CHECK(stats.mean >= stats.min * 1000 && stats.mean <= stats.max * 1000, n, "cell mean");
+      CHECK(stats.variance > 0, n, "cell variance");
+   }
+
+   //Cells that were briefly extreme give way, those with the most time keep their counters
+   for (int i = 0; i < 3; i++)
+      CellStatistics::CountExtremes(0, 1);
+   for (int cell = 2; cell < 2 + CellStatistics::MaxExtremeCells; cell++)
+      CellStatistics::CountExtremes(cell, cell);
+
+   CHECK(CellStatistics::GetSecondsMin(0) == 3 && CellStatistics::GetSecondsMax(1) == 3, n, "time at extreme");
+   CHECK(CellStatistics::GetSecondsMin(1) == 0 && CellStatistics::GetSecondsMax(0) == 0, n, "time at other extreme");
+
+   //The two that gave way are unknown rather than 0, a cell that never was extreme is 0
+   int unknown = 0;
+   for (int cell = 2; cell < 2 + CellStatistics::MaxExtremeCells; cell++)
+      unknown += CellStatistics::GetSecondsMin(cell) == -1 && CellStatistics::GetSecondsMax(cell) == -1;
+
+   CHECK(CellStatistics::GetExtremeOverflows() == 2 && unknown == 2, n, "table overflow");
+   CHECK(CellStatistics::GetSecondsMin(2 + CellStatistics::MaxExtremeCells) == 0, n, "never extreme");
+
+   return true;
+}
+
+/** Same sequence as Run state, one module per task tick. The first cycle gets
+ * full replies, after that only the module with a large change sends one */
+static bool PollCycles(int n, Result& r)
+{
+   uint64_t start = SimBus::Now();
+   uint32_t moduleBytes = 0;
+   bool ok = true;
+
+   SimBus::ClearStats();
+
+   for (int cycle = 0; cycle < POLL_CYCLES; cycle++)
+   {
+      for (int mod = 1; mod <= n; mod++)
+      {
+         SimCell* cell = SimBus::GetCell(mod);
+
+         for (int i = 0; i < NUM_INPUTS; i++)
+            cell->voltages[i] += (cycle & 1) ? 7 : -3;
+         cell->temperature--;
+      }
+
+      if (cycle == POLL_CYCLES - 1)
+      {
+         SimBus::GetCell(n)->voltages[0] += 1000;
+         moduleBytes = SimBus::GetStats().moduleBytes;
+      }
+
+      for (int mod = 1; mod <= n; mod++)
+      {
+         BmsComm::StartAcquisition(mod);
+         Tick();
+         ok &= BmsComm::Acquire(mod);
+         BmsComm::ProcessReceived();
+      }
+   }
+   r.cycleUs = (SimBus::Now() - start) / POLL_CYCLES;
+   r.bytesPerCycle = (SimBus::GetStats().masterBytes + SimBus::GetStats().moduleBytes) / POLL_CYCLES;
+   moduleBytes = SimBus::GetStats().moduleBytes - moduleBytes;
+
+   CHECK(ok, n, "data reply");
+   CHECK(moduleBytes == (n - 1) * sizeof(struct BatDeltas) + sizeof(struct BatValues), n, "compact replies");
+
+   //The master notices a module that has lost compact mode and asks for it again
+   SimBus::GetCell(1)->DropCompactReplies();
+
+   for (int cycle = 0; cycle < 3; cycle++)
+   {
+      moduleBytes = SimBus::GetStats().moduleBytes;
+
+      for (int mod = 1; mod <= n; mod++)
+      {
+         BmsComm::StartAcquisition(mod);
+         Tick();
+         ok &= BmsComm::Acquire(mod);
+         BmsComm::ProcessReceived();
+      }
+   }
+   moduleBytes = SimBus::GetStats().moduleBytes - moduleBytes;
+
+   CHECK(ok, n, "data reply after resync");
+   CHECK(moduleBytes == n * sizeof(struct BatDeltas), n, "compact replies resumed");
+
+   return CheckValues(n) && CheckCellStatistics(n);
+}
+
+/** Same sequence as BitRate state. In every other chain the module in the
+ * middle can't go beyond 25 kbit/s, so the whole chain has to settle there */
+static bool NegotiateBitRate(int n, Result& r)
+{
+   bool limited = (n % 2) == 1;
+   int expected = limited ? 25000 : CMU_BIT_CLOCK / BAUD_DIVIDER_MIN;
+   uint64_t start = SimBus::Now();
+   bool done = false;
+
+   if (limited)
+      SimBus::GetCell((n + 1) / 2)->maxBaudrate = 25000;
+
+   for (int tick = 0; !done && tick < 10 * (n + 10); tick++)
+   {
+      done = BmsComm::NegotiateBitRate(BmsComm::NumBitRates - 1);
+      Tick();
+   }
+   r.negotiationUs = SimBus::Now() - start;
+   r.baudrate = BmsComm::GetBitRate();
+
+   CHECK(done, n, "bit rate negotiation");
+   CHECK(r.baudrate == expected, n, "negotiated bit rate");
+   CHECK(SimBus::baudrate == expected, n, "master bit rate");
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      CHECK(SimBus::GetCell(mod)->GetBaudrate() == expected, n, "module bit rate");
+   }
+
+   return true;
+}
+
+/** Same sequence as Run state with acqmode=Sequential: the next module is
+ * polled from the idle line interrupt, the task only checks for stalls */
+static bool PipelinedCycles(int n, Result& r)
+{
+   bool allReplied = false;
+   uint32_t first = BmsComm::GetCompletedCycles(allReplied);
+   uint32_t cycles = first;
+   uint64_t start = SimBus::Now();
+
+   //Make sure we don't just see the values of the tick paced polls
+   for (int mod = 1; mod <= n; mod++)
+      SimBus::GetCell(mod)->temperature++;
+
+   BmsComm::StartPipelinedAcquisition();
+
+   for (int tick = 0; (cycles - first) < POLL_CYCLES && tick < POLL_CYCLES * n; tick++)
+   {
+      SimBus::RunUntil([&]() { return (BmsComm::GetCompletedCycles(allReplied) - first) >= POLL_CYCLES; }, TASK_PERIOD_US);
+      BmsComm::CheckPipeline();
+      BmsComm::ProcessReceived();
+      cycles = BmsComm::GetCompletedCycles(allReplied);
+      CHECK(allReplied, n, "pipelined data reply");
+   }
+   r.pollUs = (SimBus::Now() - start) / POLL_CYCLES;
+
+   CHECK(cycles - first >= POLL_CYCLES, n, "pipelined cycles");
+   CHECK(BmsComm::StopPipelinedAcquisition(), n, "pipeline running");
+   Tick(); //let the last reply pass like the Run state does
+   BmsComm::ProcessReceived();
+
+   return CheckValues(n);
+}
+
+/** Same sequence as Run state with acqmode=Broadcast, as fast as the bus allows */
+static bool BroadcastCycles(int n, Result& r)
+{
+   //Make sure we don't just see the values of the sequential polls
+   for (int mod = 1; mod <= n; mod++)
+   {
+      for (int i = 0; i < NUM_INPUTS; i++)
+         SimBus::GetCell(mod)->voltages[i] += 100;
+   }
+
+   uint64_t start = SimBus::Now();
+
+   SimBus::ClearStats();
+
+   for (int cycle = 0; cycle < POLL_CYCLES; cycle++)
+   {
+      BmsComm::StartBroadcastAcquisition();
+      bool received = SimBus::RunUntil([]() { return BmsComm::IsBroadcastComplete(); }, (n / 2 + 3) * TASK_PERIOD_US);
+      CHECK(received, n, "broadcast reply");
+      CHECK(BmsComm::AcquireAll() == n, n, "broadcast data reply");
+      BmsComm::ProcessReceived();
+   }
+   r.broadcastUs = (SimBus::Now() - start) / POLL_CYCLES;
+   r.broadcastBytes = (SimBus::GetStats().masterBytes + SimBus::GetStats().moduleBytes) / POLL_CYCLES;
+
+   //Noise that fills the whole ring buffer before the task gets to the replies
+   std::vector<uint8_t> noise(1024, 0x55);
+   uint32_t overruns = OneWire::GetOverruns();
+
+   BmsComm::StartBroadcastAcquisition();
+   CHECK(SimBus::RunUntil([]() { return BmsComm::IsBroadcastComplete(); }, (n / 2 + 3) * TASK_PERIOD_US), n, "broadcast reply");
+   SimBus::Transmit(n, SimBus::Now(), noise.data(), noise.size(), false, 11, SimBus::baudrate);
+   SimBus::RunFor(SimBus::FrameTime(noise.size() + 2, false, 11, SimBus::baudrate));
+   CHECK(OneWire::GetFrameLength(0) == 0 && OneWire::GetOverruns() > overruns, n, "overwritten replies dropped");
+   CHECK(BmsComm::AcquireAll() == 0, n, "no values from overwritten replies");
+
+   return CheckValues(n);
+}
+
+/** Same sequence as SWUpgrade state, checks that every module runs the image
+ * for its hardware afterwards
+ * @param current modules that already run their image, they must not be updated
+ * @param again modules that must wait for the next update */
+static bool RunUpdate(int n, bool differential, uint64_t current = 0, uint64_t again = 0, uint64_t noBoot = 0)
+{
+   uint64_t start = SimBus::Now();
+
+   BmsComm::StartUpdate(differential);
+
+   while (BmsComm::IsUpdating() && (SimBus::Now() - start) < 60000000)
+   {
+      SimBus::RunFor(UPDATE_PERIOD_US);
+      BmsComm::RunUpdate();
+   }
+   //the last frame is still on its way
+   Tick();
+
+   CHECK(!BmsComm::IsUpdating(), n, "update finished");
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      SimCell* cell = SimBus::GetCell(mod);
+      CHECK(!cell->IsUpdating(), n, "updater exit");
+
+      if (current & (1ULL << (mod - 1)))
+      {
+         CHECK(BmsComm::GetMissingPages(mod) == BmsComm::UpdateCurrent, n, "update skipped");
+         continue;
+      }
+
+      if (again & (1ULL << (mod - 1)))
+      {
+         CHECK(BmsComm::GetMissingPages(mod) == BmsComm::UpdateAgain, n, "update postponed");
+         continue;
+      }
+
+      if (noBoot & (1ULL << (mod - 1)))
+      {
+         CHECK(BmsComm::GetMissingPages(mod) == BmsComm::UpdateNoBoot, n, "update not booted");
+         continue;
+      }
+
+      CHECK(BmsComm::GetMissingPages(mod) == 0, n, "update result");
+
+      for (int i = 0; i < ATTINY_MAX_APPLICATION_PAGES * PAGE_WORDS; i++)
+      {
+         CHECK(cell->GetFlash()[i] == ImageFor(mod)[i], n, "flash content");
+      }
+   }
+
+   return true;
+}
+
+/** Full update from the power-on rate with lost pages and queries */
+static bool Update(int n, Result& r)
+{
+   uint64_t start;
+
+   //Run state goes back to the power-on rate first
+   while (BmsComm::ResetBitRate())
+      Tick();
+
+   CHECK(SimBus::baudrate == CMU_BIT_CLOCK / BAUD_DIVIDER_DEFAULT, n, "bit rate reset");
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      CHECK(SimBus::GetCell(mod)->GetBaudrate() == SimBus::baudrate, n, "module bit rate reset");
+   }
+
+   //Some pages and a query get lost on their way, they must be made up for
+   if (n >= 2)
+   {
+      SimBus::GetCell(2)->dropPages = (1ULL << 3) | (1ULL << 40);
+      SimBus::GetCell(n)->dropPages |= 1ULL << 17;
+   }
+   if (n >= 3)
+      SimBus::GetCell(n / 2 + 1)->dropQueries = 1;
+
+   start = SimBus::Now();
+   SimBus::ClearStats();
+
+   if (!RunUpdate(n, false))
+      return false;
+
+   r.updateUs = SimBus::Now() - start;
+   r.updateBytes = SimBus::GetStats().masterBytes + SimBus::GetStats().moduleBytes;
+   r.updateRounds = BmsComm::GetUpdateRounds() + 1;
+
+   CHECK(r.updateRounds <= (n >= 2 ? 2 : 1), n, "update rounds");
+   return true;
+}
+
+/** Change a few pages of the image, only those may be sent and programmed */
+static bool DiffUpdate(int n, Result& r)
+{
+   static const int changedPages[] = { 5, 30, 45 };
+   const int numChanged = sizeof(changedPages) / sizeof(changedPages[0]);
+   int writes[BmsComm::MaxModules];
+   uint64_t start;
+
+   for (int page: changedPages)
+      image[page * PAGE_WORDS + 7]++;
+
+   PackImages();
+
+   for (int mod = 1; mod <= n; mod++)
+      writes[mod - 1] = SimBus::GetCell(mod)->flashWrites;
+
+   start = SimBus::Now();
+   SimBus::ClearStats();
+
+   if (!RunUpdate(n, true))
+      return false;
+
+   r.diffUs = SimBus::Now() - start;
+   r.diffBytes = SimBus::GetStats().masterBytes + SimBus::GetStats().moduleBytes;
+
+   CHECK(BmsComm::GetUpdateRounds() == 0, n, "differential update rounds");
+   //Page crcs, changed pages, two queries, done three times, the boot command
+   //and the question for its updater to every module
+   CHECK(SimBus::GetStats().masterBytes < (COMPARE_FRAMES + numChanged + 6) * (sizeof(struct PageBuf) + 1) + n * (sizeof(struct cmd) + 1), n, "differential update pages sent");
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      CHECK(SimBus::GetCell(mod)->flashWrites - writes[mod - 1] == numChanged, n, "differential update pages written");
+   }
+
+   return true;
+}
+
+/** Every other module runs the legacy updater, the first one with software
+ * that predates updater versions. The legacy updaters report corrupted pages
+ * and only take pages in order */
+static bool LegacyUpdate(int n, Result& r)
+{
+   uint64_t start;
+
+   for (int mod = 1; mod <= n; mod += 2)
+      SimBus::GetCell(mod)->legacyUpdater = true;
+
+   SimBus::GetCell(1)->oldApplication = true;
+   SimBus::GetCell(1)->dropPages = 1ULL << 10;
+
+   if (n >= 2)
+      SimBus::GetCell(2)->dropPages = 1ULL << 20;
+
+   image[2 * PAGE_WORDS]++;
+   PackImages();
+
+   start = SimBus::Now();
+
+   if (!RunUpdate(n, false))
+      return false;
+
+   r.legacyUs = SimBus::Now() - start;
+   return true;
+}
+
+/** Every other module has other hardware and the first one already runs the
+ * image of the store. Each hardware gets its own image, the first module
+ * must be left alone */
+static bool MixedUpdate(int n, Result& r)
+{
+   int writes;
+   uint64_t start;
+
+   for (int mod = 2; mod <= n; mod += 2)
+      memcpy(SimBus::GetCell(mod)->reportedVersion.hwVersion, otherHardware, sizeof(otherHardware));
+
+   SimBus::GetCell(1)->reportedVersion = imageVersion;
+
+   if (!ReadVersions(n, r))
+      return false;
+
+   otherImage[PAGE_WORDS + 3]++;
+   PackImages();
+
+   writes = SimBus::GetCell(1)->flashWrites;
+   start = SimBus::Now();
+
+   if (!RunUpdate(n, true, 1))
+      return false;
+
+   r.mixedUs = SimBus::Now() - start;
+
+   CHECK(SimBus::GetCell(1)->flashWrites == writes, n, "current module not written");
+   return true;
+}
+
+/** Only one pass with legacy updaters runs per update, the modules with
+ * another image wait for the next one */
+static bool LegacyMixedUpdate(int n, Result& r)
+{
+   uint64_t otherModules = 0;
+
+   for (int mod = 2; mod <= n; mod += 2)
+   {
+      SimBus::GetCell(mod)->legacyUpdater = true;
+      otherModules |= 1ULL << (mod - 1);
+   }
+
+   image[3 * PAGE_WORDS]++;
+   otherImage[3 * PAGE_WORDS]++;
+   PackImages();
+
+   //Without modules for the first image the second one goes right away
+   if (!RunUpdate(n, false, 1, n >= 3 ? otherModules : 0))
+      return false;
+
+   //Now the others are the only ones left
+   for (int mod = 3; mod <= n; mod += 2)
+      SimBus::GetCell(mod)->reportedVersion = imageVersion;
+
+   return AssignAddresses(n, r) &&
+          ReadVersions(n, r) &&
+          RunUpdate(n, false, ~otherModules);
+}
+
+/** The first module runs software that only enters the updater by broadcast.
+ * Unless it is the only one it is left out, the last module goes with an
+ * addressed boot and the second one with an addressed boot of its legacy
+ * updater */
+static bool OldApplicationUpdate(int n, Result& r)
+{
+   int writes = SimBus::GetCell(1)->flashWrites;
+   uint64_t current = ~(1ULL | (1ULL << (n - 1)) | 2ULL);
+
+   for (int mod = 2; mod <= n; mod += 2)
+   {
+      SimBus::GetCell(mod)->reportedVersion = imageVersion;
+      memcpy(SimBus::GetCell(mod)->reportedVersion.hwVersion, otherHardware, sizeof(otherHardware));
+   }
+
+   SimBus::GetCell(1)->reportedVersion.swVersion[2]--;
+
+   if (n >= 2)
+   {
+      SimBus::GetCell(n)->legacyUpdater = false;
+      SimBus::GetCell(n)->reportedVersion.swVersion[2]--;
+   }
+   if (n >= 3)
+      SimBus::GetCell(2)->reportedVersion.swVersion[2]--;
+
+   image[4 * PAGE_WORDS]++;
+   otherImage[4 * PAGE_WORDS]++;
+   PackImages();
+
+   if (!ReadVersions(n, r) || !RunUpdate(n, false, current, 0, n >= 2 ? 1 : 0))
+      return false;
+
+   if (n >= 2)
+      CHECK(SimBus::GetCell(1)->flashWrites == writes, n, "module without boot not written");
+
+   return true;
+}
+
+static bool RunChain(int n, Result& r)
+{
+   SimBus::Reset(n);
+   OneWire::Init();
+   BmsComm::SetCompactReplies(true);
+   CellStatistics::Reset();
+   Tick();
+
+   return AssignAddresses(n, r) &&
+          ReadVersions(n, r) &&
+          PollCycles(n, r) &&
+          NegotiateBitRate(n, r) &&
+          PipelinedCycles(n, r) &&
+          BroadcastCycles(n, r) &&
+          Update(n, r) &&
+          AssignAddresses(n, r) && //modules must come back after the update
+          DiffUpdate(n, r) &&
+          AssignAddresses(n, r) &&
+          LegacyUpdate(n, r) &&
+          AssignAddresses(n, r) &&
+          MixedUpdate(n, r) &&
+          AssignAddresses(n, r) &&
+          LegacyMixedUpdate(n, r) &&
+          AssignAddresses(n, r) &&
+          OldApplicationUpdate(n, r) &&
+          AssignAddresses(n, r);
+}
+
+int main(int argc, char** argv)
+{
+   int first = 1, last = BmsComm::MaxModules - 1;
+
+   if (argc > 1)
+      first = last = atoi(argv[1]);
+   if (argc > 2)
+      last = atoi(argv[2]);
+
+   srand(1);
+   //A small set of instructions so the image compresses somewhat. The
+   //application ends below the updater, the rest of the image is padding
+   for (uint32_t i = 0; i < sizeof(image) / sizeof(uint16_t); i++)
+   {
+      bool padding = i >= SimCell::UpdaterPage * PAGE_WORDS;
+
+      image[i] = padding ? 0xffff : 0x9000 + rand() % 16;
+      otherImage[i] = padding ? 0xffff : 0x9000 + rand() % 16;
+   }
+
+   PackImages();
+
+   printf("Virtual chain at %d baud, %d ms task period, %d us module latency\r\n",
+          SimBus::baudrate, TASK_PERIOD_US / 1000, SimCell::commandLatencyUs);
+   printf("mods  addr[ms]  ver[ms]  cycle[ms]  cycles/s  negotiate[ms]  baud   pipecycle[ms]  pipecycles/s  bytes/cycle  bcast[ms]  bcasts/s  bytes/bcast  update[s]  updatebytes  rounds  diff[s]  diffbytes  mixed[s]  legacy[s]\r\n");
+
+   for (int n = first; n <= last; n++)
+   {
+      Result r = Result();
+      bool ok = RunChain(n, r);
+
+      printf("%4d  %8.1f  %7.1f  %9.1f  %8.2f  %13.1f  %5d  %13.1f  %12.2f  %11u  %9.1f  %8.2f  %11u  %9.2f  %11u  %6d  %7.2f  %9u  %8.2f  %9.2f%s\r\n",
+             n, r.addrUs / 1000.0, r.versionUs / 1000.0, r.cycleUs / 1000.0,
+             r.cycleUs > 0 ? 1e6 / r.cycleUs : 0.0, r.negotiationUs / 1000.0, r.baudrate, r.pollUs / 1000.0, r.pollUs > 0 ? 1e6 / r.pollUs : 0.0,
+             r.bytesPerCycle, r.broadcastUs / 1000.0, r.broadcastUs > 0 ? 1e6 / r.broadcastUs : 0.0,
+             r.broadcastBytes, r.updateUs / 1e6, r.updateBytes, r.updateRounds, r.diffUs / 1e6, r.diffBytes, r.mixedUs / 1e6, r.legacyUs / 1e6, ok ? "" : "  FAILED");
+   }
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,181 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Saves the battery state many times and checks that the newest record is
+ * restored after simulated resets, that erases are spread over all pages and
+ * that a power loss in the middle of programming or erasing never loses more
+ * than the record being written */
+#include <stdio.h>
+#include <libopencm3/stm32/flash.h>
+#include <libopencm3/stm32/crc.h>
+#include "hwdefs.h"
+#include "bmsstate.h"
+#include "simflash.h"
+
+#define NUM_SAVES        2000
+#define SLOTS_PER_PAGE   (FLASH_PAGE_SIZE / 24)
+
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; return; }
+
+static void Set(int n)
+{
+   BMSState::SetEstimatedSoC(FP_FROMINT(n % 100));
+   BMSState::SetChargein(n * 3);
+   BMSState::SetChargeout(n * 5);
+}
+
+static bool Is(int n)
+{
+   return BMSState::GetEstimatedSoC() == FP_FROMINT(n % 100) &&
+          BMSState::GetChargein() == n * 3 && BMSState::GetChargeout() == n * 5;
+}
+
+/** Reset and restore */
+static bool Reboot()
+{
+   Set(-1);
+   return BMSState::LoadFromFlash();
+}
+
+static void CheckPeriodicSaves()
+{
+   SimFlash::EraseAll();
+   CHECK(!Reboot(), "blank flash");
+
+   for (int n = 1; n <= NUM_SAVES; n++)
+   {
+      Set(n);
+      BMSState::SaveToFlash();
+
+      //Restart now and then, the journal continues behind the newest record
+      if ((n % 97) == 0)
+      {
+         CHECK(Reboot() && Is(n), "newest record after reset");
+      }
+   }
+
+   CHECK(Reboot() && Is(NUM_SAVES), "newest record");
+
+   int expected = NUM_SAVES / (SLOTS_PER_PAGE * BATSTT_PAGES);
+
+   for (int page = 0; page < BATSTT_PAGES; page++)
+   {
+      int erases = SimFlash::GetEraseCount(BATSTT_ADDRESS + page * FLASH_PAGE_SIZE);
+      printf("page %d: %d erases for %d saves\r\n", page, erases, NUM_SAVES);
+      CHECK(erases >= expected - 1 && erases <= expected + 1, "erases spread over pages");
+   }
+}
+
+static void CheckUnchanged()
+{
+   SimFlash::EraseAll();
+   Set(5);
+   BMSState::SaveToFlash();
+   SimFlash::PowerLossAfter(1); //Any write would be cut short
+   BMSState::SaveToFlash();
+   SimFlash::Restore();
+   CHECK(Reboot() && Is(5), "unchanged state not written");
+}
+
+/** Lose power during each flash operation of one save,
+ * including the erase at a page boundary */
+static void CheckPowerLoss()
+{
+   for (int start = SLOTS_PER_PAGE - 3; start < SLOTS_PER_PAGE + 2; start++)
+   {
+      for (int ops = 1; ops <= 8; ops++)
+      {
+         SimFlash::EraseAll();
+         Reboot();
+
+         for (int n = 1; n <= start; n++)
+         {
+            Set(n);
+            BMSState::SaveToFlash();
+         }
+
+         Set(1000);
+         SimFlash::PowerLossAfter(ops);
+         BMSState::SaveToFlash();
+         SimFlash::Restore();
+
+         CHECK(Reboot(), "record after power loss");
+         CHECK(Is(start) || Is(1000), "previous or new record after power loss");
+
+         //Saving continues after the damaged slot
+         Set(2000);
+         BMSState::SaveToFlash();
+         CHECK(Reboot() && Is(2000), "save after power loss");
+      }
+   }
+
+   //Erase of a full page cut short, the records in the other page remain
+   SimFlash::EraseAll();
+   Reboot();
+
+   //Both pages written once, the next save erases the second one
+   for (int n = 1; n <= 3 * SLOTS_PER_PAGE; n++)
+   {
+      Set(n);
+      BMSState::SaveToFlash();
+   }
+
+   Set(4000);
+   SimFlash::PowerLossAfter(1);
+   BMSState::SaveToFlash();
+   SimFlash::Restore();
+   CHECK(Reboot() && Is(3 * SLOTS_PER_PAGE), "interrupted erase");
+}
+
+/** The single record of the former firmware is restored once */
+static void CheckLegacy()
+{
+   uint32_t legacy[5] = { 1, (uint32_t)FP_FROMINT(42), 123, 456, 0 };
+
+   SimFlash::EraseAll();
+   crc_reset();
+   legacy[4] = crc_calculate_block(legacy, 1);
+
+   flash_unlock();
+   for (int i = 0; i < 5; i++)
+      flash_program_word(BATSTT_ADDRESS + FLASH_PAGE_SIZE + i * 4, legacy[i]);
+   flash_lock();
+
+   CHECK(Reboot() && BMSState::GetEstimatedSoC() == FP_FROMINT(42) && BMSState::GetChargein() == 123, "legacy record");
+
+   Set(7);
+   BMSState::SaveToFlash();
+   CHECK(Reboot() && Is(7), "journal after legacy record");
+}
+
+int main()
+{
+   if (!SimFlash::Map(BATSTT_ADDRESS, BATSTT_PAGES * FLASH_PAGE_SIZE))
+      return 1;
+
+   CheckPeriodicSaves();
+   CheckUnchanged();
+   CheckPowerLoss();
+   CheckLegacy();
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
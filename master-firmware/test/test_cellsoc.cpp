@@ -0,0 +1,167 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Estimates the SoC of cells with different SoC, capacity and temperature at
+ * two rests with a discharge in between and checks SoC, capacity and charge
+ * offsets against the simulated cells */
+#include <stdio.h>
+#include <math.h>
+#include "bmscalculation.h"
+#include "ocvtable.h"
+
+#define NUM_MODULES 3
+#define NUM_CELLS   (NUM_MODULES * 4)
+#define DISCHARGE   60 //Ah between the rests
+
+static uint16_t voltages[NUM_CELLS];
+static int8_t temperatures[NUM_MODULES] = { 5, 25, 40 };
+static double trueSoc[NUM_CELLS];
+static double trueCapacity[NUM_CELLS];
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; }
+
+/** NMC preset at 0°C and 20 mV higher at 40°C */
+static void EnterTable()
+{
+   const int temps[] = { 0, 40 };
+   int points[OcvTable::maxPoints][2];
+   int socs[OcvTable::maxPoints];
+   int numPoints;
+
+   OcvTable::LoadPreset(OcvTable::Nmc);
+   numPoints = OcvTable::GetNumPoints();
+
+   for (int p = 0; p < numPoints; p++)
+   {
+      socs[p] = OcvTable::GetPointSoc(p);
+      points[p][0] = OcvTable::GetPointVoltage(0, p);
+      points[p][1] = points[p][0] + 20;
+   }
+
+   OcvTable::SetTemperatures(temps, 2);
+
+   for (int p = 0; p < numPoints; p++)
+      OcvTable::AddRow(socs[p], points[p]);
+
+   OcvTable::ApplyStaged();
+}
+
+static void SetVoltages()
+{
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      int32_t slope;
+      int32_t soc = trueSoc[cell] / 100 * (1 << 30);
+      s32fp temperature = FP_FROMINT(temperatures[cell / 4]);
+
+      voltages[cell] = (OcvTable::GetVoltage(soc, temperature, slope) + 500) / 1000;
+   }
+}
+
+static double TrueOffset(int cell)
+{
+   double mean = 0;
+
+   for (int i = 0; i < NUM_CELLS; i++)
+      mean += trueSoc[i] * trueCapacity[i] * 10 / NUM_CELLS;
+
+   return trueSoc[cell] * trueCapacity[cell] * 10 - mean;
+}
+
+static void CheckCells(const char* what, bool capacityKnown)
+{
+   double maxSocError = 0, maxOffsetError = 0, maxCapacityError = 0;
+
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      CHECK(BmsCalculation::HasCellSoc(cell), what);
+
+      double soc = BmsCalculation::GetCellSoc(cell) / 32.0;
+      double capacity = BmsCalculation::GetCellCapacity(cell) / 32.0;
+
+      maxSocError = fmax(maxSocError, fabs(soc - trueSoc[cell]));
+
+      if (capacityKnown)
+      {
+         maxCapacityError = fmax(maxCapacityError, fabs(capacity - trueCapacity[cell]));
+         maxOffsetError = fmax(maxOffsetError, fabs(BmsCalculation::GetCellOffset(cell) - TrueOffset(cell)));
+      }
+   }
+
+   printf("%-12s soc %5.2f%%  capacity %5.2f Ah  offset %4.0f mAh  imbalance %d mAh\r\n", what,
+          maxSocError, maxCapacityError, maxOffsetError, BmsCalculation::GetImbalance());
+
+   CHECK(maxSocError < 0.3, what);
+   CHECK(maxCapacityError < 1, what);
+   CHECK(maxOffsetError < 300, what);
+}
+
+int main()
+{
+   EnterTable();
+
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+   {
+      trueSoc[cell] = 80 + cell * 0.5;
+      trueCapacity[cell] = 100;
+   }
+   trueCapacity[5] = 90;
+   trueCapacity[7] = 110;
+
+   BmsCalculation::SetVoltageSource(voltages, NUM_CELLS, 4);
+   BmsCalculation::SetTemperatureSource(temperatures, NUM_MODULES);
+   BmsCalculation::SetCapacity(FP_FROMINT(100));
+   BmsCalculation::SetCharge(0, 0);
+   CHECK(!BmsCalculation::HasCellSoc(0), "no estimate yet");
+
+   //First rest, capacities are nominal
+   SetVoltages();
+   BmsCalculation::EstimateCellSocs();
+   BmsCalculation::RestartCharge();
+   CheckCells("first rest", false);
+
+   //Counting moves all estimates
+   BmsCalculation::SetCharge(FP_FROMINT(360), FP_FROMINT(360 + DISCHARGE * 3600));
+
+   for (int cell = 0; cell < NUM_CELLS; cell++)
+      trueSoc[cell] -= DISCHARGE * 100 / trueCapacity[cell];
+
+   //Before the second rest only cells of nominal capacity are right
+   CHECK(fabs(BmsCalculation::GetCellSoc(0) / 32.0 - trueSoc[0]) < 0.3, "counting");
+   CHECK(fabs(BmsCalculation::GetCellSoc(5) / 32.0 - trueSoc[5]) > 5, "counting with wrong capacity");
+
+   //Second rest finds the capacities and the offsets
+   SetVoltages();
+   BmsCalculation::EstimateCellSocs();
+   BmsCalculation::RestartCharge();
+   CheckCells("second rest", true);
+
+   //Cells without plausible voltage are left out
+   voltages[3] = 0;
+   BmsCalculation::EstimateCellSocs();
+   CHECK(!BmsCalculation::HasCellSoc(3) && BmsCalculation::HasCellSoc(4), "implausible voltage");
+
+   //Renumbering forgets everything
+   BmsCalculation::SetVoltageSource(voltages, NUM_CELLS, 4);
+   CHECK(!BmsCalculation::HasCellSoc(4) && BmsCalculation::GetCellCapacity(5) == FP_FROMINT(100), "new chain");
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
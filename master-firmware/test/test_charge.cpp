@@ -0,0 +1,164 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Replays synthetic current profiles sampled every millisecond through the
+ * former accumulation of MeasureCurrent() and through ChargeIntegrator and
+ * compares both with the exact integral of the samples. Also checks the
+ * counter interface used for the ISA shunt */
+#include <stdio.h>
+#include <math.h>
+#include "my_fp.h"
+#include "chargeintegrator.h"
+
+#define HOURS       4
+#define NUM_SAMPLES (HOURS * 3600 * 1000)
+#define DEADBAND    FP_FROMFLT(0.8)
+
+static int failures = 0;
+static double previous; //The integrator continues from the last sample of the previous profile
+static bool started = false;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; }
+
+/** MeasureCurrent() before ChargeIntegrator */
+class LegacyIntegrator
+{
+   public:
+      void AddSample(s32fp current)
+      {
+         if (current < -DEADBAND)
+            amsOut += -current;
+         else if (current > DEADBAND)
+            amsIn += current;
+
+         samples++;
+
+         if (samples == 1000)
+         {
+            chargein += amsIn / 1000;
+            chargeout += amsOut / 1000;
+            amsIn = 0;
+            amsOut = 0;
+            samples = 0;
+         }
+      }
+
+      s32fp chargein = 0, chargeout = 0;
+
+   private:
+      int samples = 0;
+      u32fp amsIn = 0, amsOut = 0;
+};
+
+typedef double (*Profile)(double t);
+
+static double Constant(double) { return 12.34; }
+static double HighCurrent(double) { return -387.65; }
+static double Drive(double t) { return 80 * sin(2 * M_PI * t / 37) + 30 * sin(2 * M_PI * t / 5.3) - 4; }
+static double Pulses(double t) { return fmod(t, 1.7) < 1.1 ? -153.2 : 61.9; }
+static double Trickle(double t) { return 0.9 + 0.3 * sin(2 * M_PI * t / 60); }
+
+/** Integral of straight lines between the samples, in As */
+static void Exact(double first, double last, double& in, double& out)
+{
+   double dt = 0.001;
+
+   if (first >= 0 && last >= 0)
+   {
+      in += (first + last) / 2 * dt;
+   }
+   else if (first <= 0 && last <= 0)
+   {
+      out -= (first + last) / 2 * dt;
+   }
+   else
+   {
+      double zero = dt * fabs(first) / (fabs(first) + fabs(last));
+      double a = first * zero / 2, b = last * (dt - zero) / 2;
+      in += first > 0 ? a : b;
+      out -= first > 0 ? b : a;
+   }
+}
+
+static void Replay(const char* name, Profile profile)
+{
+   LegacyIntegrator legacy;
+   double exactIn = 0, exactOut = 0;
+
+   ChargeIntegrator::SetCharge(0, 0);
+
+   for (int i = 0; i < NUM_SAMPLES; i++)
+   {
+      s32fp current = lround(profile(i / 1000.0) * (1 << CST_DIGITS));
+
+      legacy.AddSample(current);
+
+      if (current >= -DEADBAND && current <= DEADBAND)
+         current = 0;
+
+      ChargeIntegrator::AddSample(current, 1);
+
+      double sample = current / (double)(1 << CST_DIGITS);
+      Exact(started ? previous : sample, sample, exactIn, exactOut);
+      previous = sample;
+      started = true;
+   }
+
+   double resolution = 1.0 / (1 << CST_DIGITS);
+   double legacyError = fabs(legacy.chargein * resolution - exactIn) + fabs(legacy.chargeout * resolution - exactOut);
+   double error = fabs(ChargeIntegrator::GetChargeIn() * resolution - exactIn) + fabs(ChargeIntegrator::GetChargeOut() * resolution - exactOut);
+
+   printf("%-12s %9.2f %9.2f %12.3f %12.3f\r\n", name, exactIn / 3600, exactOut / 3600, legacyError, error);
+
+   //Only the truncation of the final readout remains
+   CHECK(error <= 2 * resolution, name);
+}
+
+static void CheckCounters()
+{
+   ChargeIntegrator::SetCharge(FP_FROMINT(100), FP_FROMINT(50));
+   CHECK(ChargeIntegrator::GetChargeIn() == FP_FROMINT(100) && ChargeIntegrator::GetChargeOut() == FP_FROMINT(50), "set charge");
+
+   //The first reading is the reference, a meter reset restarts counting from 0
+   ChargeIntegrator::AddCounters(1000000, 2000000);
+   ChargeIntegrator::AddCounters(1000360, 2000720);
+   CHECK(ChargeIntegrator::GetChargeIn() == FP_FROMINT(460) && ChargeIntegrator::GetChargeOut() == FP_FROMINT(770), "counter delta");
+   ChargeIntegrator::AddCounters(10, 20);
+   CHECK(ChargeIntegrator::GetChargeIn() == FP_FROMINT(470) && ChargeIntegrator::GetChargeOut() == FP_FROMINT(790), "counter reset");
+
+   //Beyond what s32fp can hold the readout saturates
+   for (int i = 0; i < 20; i++)
+      ChargeIntegrator::AddCounters(10 + i * 4000000u, 20);
+   CHECK(ChargeIntegrator::GetChargeIn() == INT32_MAX && ChargeIntegrator::GetChargeOut() == FP_FROMINT(790), "saturation");
+}
+
+int main()
+{
+   printf("profile       in [Ah]  out [Ah]  legacy [As]     new [As]\r\n");
+
+   Replay("constant", Constant);
+   Replay("highcurrent", HighCurrent);
+   Replay("drive", Drive);
+   Replay("pulses", Pulses);
+   Replay("trickle", Trickle);
+   CheckCounters();
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,112 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Round trip of CobsFrame for payload sizes around the COBS block length,
+ * detection of corrupted frames and resynchronization in a stream */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "cobs.h"
+
+static int failures = 0;
+
+#define CHECK(cond, len, what) if (!(cond)) { printf("FAIL: %d bytes: %s\r\n", len, what); failures++; continue; }
+
+static std::vector<uint8_t> Encode(const uint8_t* payload, int len)
+{
+   std::vector<uint8_t> buf(CobsFrame::MaxSize(len));
+   CobsFrame frame(buf.data(), buf.size());
+
+   frame.Add(payload, len);
+   buf.resize(frame.Close());
+   return buf;
+}
+
+int main()
+{
+   uint8_t payload[1100], decoded[1200];
+   std::vector<uint8_t> stream;
+   int numFrames = 0;
+
+   srand(1);
+
+   for (int len = 0; len <= 1100; len++)
+   {
+      //Mix zero runs, long non-zero runs and random data
+      for (int i = 0; i < len; i++)
+      {
+         switch ((len / 7) % 3)
+         {
+         case 0: payload[i] = 0; break;
+         case 1: payload[i] = (i % 300) + 1 > 255 ? 0 : (i % 300) + 1; break;
+         default: payload[i] = rand(); break;
+         }
+      }
+
+      std::vector<uint8_t> frame = Encode(payload, len);
+
+      CHECK(frame.size() > 0 && (int)frame.size() <= CobsFrame::MaxSize(len), len, "encoded size");
+      CHECK(memchr(frame.data(), 0, frame.size() - 1) == 0 && frame.back() == 0, len, "zero only at the end");
+
+      int decodedLen = CobsFrame::Decode(frame.data(), frame.size() - 1, decoded);
+
+      CHECK(decodedLen == len && memcmp(payload, decoded, len) == 0, len, "round trip");
+
+      //A flipped bit must not pass the CRC
+      int pos = rand() % (frame.size() - 1);
+      frame[pos] ^= 1 << (rand() % 8);
+      CHECK(CobsFrame::Decode(frame.data(), frame.size() - 1, decoded) < 0, len, "corruption detected");
+
+      //Too small buffer
+      std::vector<uint8_t> small(frame.size() - 1);
+      CobsFrame smallFrame(small.data(), small.size());
+      smallFrame.Add(payload, len);
+      CHECK(smallFrame.Close() == 0, len, "overflow detected");
+
+      if (len % 50 == 0)
+      {
+         frame = Encode(payload, len);
+         stream.insert(stream.end(), frame.begin(), frame.end());
+         numFrames++;
+      }
+   }
+
+   //The receiver starts in the middle of the first frame and must find all others
+   int start = 3, found = 0;
+
+   for (size_t i = start; i < stream.size(); i++)
+   {
+      if (stream[i] == 0)
+      {
+         if (CobsFrame::Decode(&stream[start], i - start, decoded) >= 0)
+            found++;
+         start = i + 1;
+      }
+   }
+
+   if (found != numFrames - 1)
+   {
+      printf("FAIL: resynchronization, found %d of %d frames\r\n", found, numFrames - 1);
+      failures++;
+   }
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
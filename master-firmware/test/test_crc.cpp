@@ -0,0 +1,99 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Compares the table driven CRC16 against the former bit serial loop of
+ * BmsComm for the message sizes used on the bus */
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include "crc16.h"
+#include "bms_shared.h"
+
+#define REPETITIONS 20000
+
+static volatile uint32_t sink;
+
+/** The bit serial implementation formerly in BmsComm::Crc16XModem */
+static int RefCrc16XModem(const uint8_t *addr, int num)
+{
+   int i, crc = 0;
+
+   for (; num > 0; num--)
+   {
+      crc = crc ^ (*addr++ << 8);
+      for (i = 0; i < 8; i++)
+      {
+         crc = crc << 1;
+         if (crc & 0x10000)
+            crc = (crc ^ 0x1021) & 0xFFFF;
+      }
+   }
+   return crc;
+}
+
+template<typename F>
+static double NsPerMessage(F f)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   for (int rep = 0; rep < REPETITIONS; rep++)
+      sink += f();
+
+   std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+   return elapsed.count() / REPETITIONS;
+}
+
+int main()
+{
+   static const int sizes[] =
+   {
+      sizeof(struct versionComm) - 2, sizeof(struct BatValues) - 2, sizeof(struct PageBuf) - 2, 256, 1024
+   };
+   uint8_t data[1024];
+   int failures = 0;
+
+   srand(1);
+   for (uint32_t i = 0; i < sizeof(data); i++)
+      data[i] = rand();
+
+   for (int len = 0; len <= (int)sizeof(data); len++)
+   {
+      uint16_t ref = RefCrc16XModem(data, len);
+      int split = len > 0 ? rand() % len : 0;
+      uint16_t crc = Crc16::Update(Crc16::Init(), data, split);
+      crc = Crc16::Final(Crc16::Update(crc, data + split, len - split));
+
+      if (Crc16::Calculate(data, len) != ref || crc != ref)
+      {
+         printf("FAIL: %d bytes: %04x/%04x, expected %04x\r\n", len, Crc16::Calculate(data, len), crc, ref);
+         failures++;
+      }
+   }
+
+   printf("bytes     table[ns]   loop[ns]\r\n");
+
+   for (int len: sizes)
+   {
+      printf("%5d  %10.1f %10.1f\r\n", len,
+             NsPerMessage([&]() { return Crc16::Calculate(data, len); }),
+             NsPerMessage([&]() { return RefCrc16XModem(data, len); }));
+   }
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
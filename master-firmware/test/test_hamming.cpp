@@ -0,0 +1,83 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Compares the table driven Hamming coder against the bit loop implementation
+ * for every possible input and reports the time per word of both */
+#include <stdio.h>
+#include <chrono>
+#include "hamming.h"
+
+extern "C"
+{
+   uint16_t ref_hamming_encode(uint16_t d);
+   int8_t ref_hamming_decode(uint16_t c, uint16_t* d);
+}
+
+#define REPETITIONS 50
+
+static volatile uint32_t sink;
+
+template<typename F>
+static double NsPerWord(F f)
+{
+   std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+   for (int rep = 0; rep < REPETITIONS; rep++)
+   {
+      for (uint32_t w = 0; w < 0x10000; w++)
+         sink += f(w);
+   }
+
+   std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+   return elapsed.count() / (REPETITIONS * 0x10000);
+}
+
+int main()
+{
+   int failures = 0;
+
+   for (uint32_t w = 0; w < 0x10000; w++)
+   {
+      uint16_t d, refd;
+
+      if (hamming_encode(w) != ref_hamming_encode(w))
+      {
+         printf("FAIL: encode(%04x)=%04x, expected %04x\r\n", w, hamming_encode(w), ref_hamming_encode(w));
+         failures++;
+      }
+
+      int8_t res = hamming_decode(w, &d);
+      int8_t refres = ref_hamming_decode(w, &refd);
+
+      if (res != refres || d != refd)
+      {
+         printf("FAIL: decode(%04x)=%d/%04x, expected %d/%04x\r\n", w, res, d, refres, refd);
+         failures++;
+      }
+   }
+
+   printf("encode: table %.2f ns/word, loop %.2f ns/word\r\n",
+          NsPerWord([](uint16_t w) { return hamming_encode(w); }),
+          NsPerWord([](uint16_t w) { return ref_hamming_encode(w); }));
+   printf("decode: table %.2f ns/word, loop %.2f ns/word\r\n",
+          NsPerWord([](uint16_t w) { uint16_t d; return hamming_decode(w, &d) + d; }),
+          NsPerWord([](uint16_t w) { uint16_t d; return ref_hamming_decode(w, &d) + d; }));
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
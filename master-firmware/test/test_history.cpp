@@ -0,0 +1,333 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Feeds three hours of synthetic cell voltages into CellHistory, dumps every
+ * tier and compares the decoded records with minimum and maximum calculated
+ * from the raw values. Also covers time ranges, cells without value, spread
+ * beyond 8 bits and records overwritten while being dumped */
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "bmscomm.h"
+#include "termdma.h"
+#include "cobs.h"
+#include "cellhistory.h"
+
+#define CYCLES_PER_SECOND 4
+#define NUM_CYCLES        (3 * 3600 * CYCLES_PER_SECOND + 123)
+
+/********* Stand-ins for the acquisition and the terminal *********/
+
+static uint16_t cellVoltages[BmsComm::MaxModules * BmsComm::voltagesPerModule];
+static int chainLength;
+static std::string output;
+
+const uint16_t* BmsComm::GetVoltages() { return cellVoltages; }
+int BmsComm::GetNumberOfCellModules() { return chainLength; }
+bool TermDma::IsBusy() { return false; }
+bool TermDma::Send(const uint8_t* data, int len) { output.append((const char*)data, len); return true; }
+
+struct Record
+{
+   uint32_t time;
+   int shift;
+   std::vector<int> lo, hi; //-1 for no value
+};
+
+struct Reference
+{
+   std::vector<int> lo, hi;
+};
+
+static int failures = 0;
+
+#define CHECK(cond, n, what) if (!(cond)) { printf("FAIL: %d modules: %s\r\n", n, what); failures++; return; }
+
+static uint16_t Voltage(int cell, int cycle)
+{
+   uint32_t time = cycle / CYCLES_PER_SECOND;
+
+   //No value for a while
+   if (cell == 2 && time >= 10700)
+      return 0xffff;
+   //Drop beyond the 8 bit range
+   if (cell == 1 && time >= 4000 && time < 4100)
+      return 2990 + (cycle % 7);
+
+   return 3200 + (cell % 32) * 3 + (cycle * 7 + cell * 13) % 50;
+}
+
+static void Accumulate(Reference& ref, int numCells, int cycle)
+{
+   if (ref.lo.empty())
+   {
+      ref.lo.assign(numCells, 0xffff);
+      ref.hi.assign(numCells, 0);
+   }
+
+   for (int i = 0; i < numCells; i++)
+   {
+      uint16_t vtg = Voltage(i, cycle);
+
+      if (vtg > 50 && vtg < 5000)
+      {
+         ref.lo[i] = std::min(ref.lo[i], (int)vtg);
+         ref.hi[i] = std::max(ref.hi[i], (int)vtg);
+      }
+   }
+}
+
+/** Run a dump to completion and reassemble the records from their slices
+ * @return number of records announced by the end frame, -1 if there is none */
+static int Dump(int tier, uint32_t from, uint32_t to, std::vector<Record>& records, bool& corrupt)
+{
+   uint8_t data[1024];
+   size_t start = 0;
+   int announced = -1;
+
+   output.clear();
+   records.clear();
+   corrupt = false;
+
+   if (!CellHistory::StartDump(tier, from, to)) return -1;
+
+   while (CellHistory::IsDumping())
+      CellHistory::Run();
+
+   for (size_t end = output.find('\0'); end != std::string::npos; start = end + 1, end = output.find('\0', start))
+   {
+      if (end == start) continue;
+
+      int len = CobsFrame::Decode((const uint8_t*)output.data() + start, end - start, data);
+
+      if (len < 0)
+      {
+         corrupt = true;
+      }
+      else if (data[0] == HISTORY_END && len == sizeof(HistoryEndHeader))
+      {
+         HistoryEndHeader endHeader;
+         memcpy(&endHeader, data, sizeof(endHeader));
+         announced = endHeader.records;
+      }
+      else if (data[0] == HISTORY_DATA)
+      {
+         HistoryFrameHeader header;
+         int bytesPerCell = tier == CellHistory::Cycle ? 1 : 2;
+         memcpy(&header, data, sizeof(header));
+
+         if (len != (int)sizeof(header) + header.numModules * header.voltagesPerModule * bytesPerCell || header.tier != tier)
+         {
+            corrupt = true;
+            continue;
+         }
+
+         if (header.firstModule == 0)
+         {
+            records.push_back(Record());
+            records.back().time = header.time;
+            records.back().shift = header.shift;
+         }
+
+         Record& rec = records.back();
+         const uint8_t* p = data + sizeof(header);
+
+         for (int i = 0; i < header.numModules * header.voltagesPerModule; i++, p += bytesPerCell)
+         {
+            uint8_t lo = p[0], hi = p[bytesPerCell - 1];
+            rec.lo.push_back(lo == HISTORY_INVALID ? -1 : header.base + (lo << header.shift));
+            rec.hi.push_back(hi == HISTORY_INVALID ? -1 : header.base + (hi << header.shift));
+         }
+      }
+   }
+
+   return announced;
+}
+
+/** Decoded minimums may be up to one step lower and maximums one step higher than the truth */
+static bool Matches(const Record& rec, const Reference& ref, bool single)
+{
+   int step = 1 << rec.shift;
+
+   if (rec.lo.size() != ref.lo.size()) return false;
+
+   for (size_t i = 0; i < ref.lo.size(); i++)
+   {
+      bool valid = ref.lo[i] <= ref.hi[i];
+
+      if (!valid)
+      {
+         if (rec.lo[i] != -1 || rec.hi[i] != -1) return false;
+         continue;
+      }
+
+      if (rec.lo[i] > ref.lo[i] || rec.lo[i] + step <= ref.lo[i]) return false;
+
+      if (single)
+      {
+         if (rec.hi[i] != rec.lo[i]) return false;
+      }
+      else if (rec.hi[i] < ref.hi[i] || rec.hi[i] - step >= ref.hi[i])
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+static void CheckTier(int n, int tier, const std::map<uint32_t, Reference>& refs, int expected)
+{
+   std::vector<Record> records;
+   bool corrupt;
+   int announced = Dump(tier, 0, 0xffffffff, records, corrupt);
+   uint32_t first, last;
+
+   CHECK(!corrupt && announced == (int)records.size(), n, "dump frames");
+   CHECK((int)records.size() == expected && CellHistory::GetRange(tier, first, last) == expected, n, "record count");
+   CHECK(records.front().time == first && records.back().time == last, n, "range");
+
+   for (const Record& rec: records)
+   {
+      std::map<uint32_t, Reference>::const_iterator ref = refs.find(rec.time);
+      CHECK(ref != refs.end() && Matches(rec, ref->second, false), n, "minimum and maximum");
+   }
+
+   //A range in the middle
+   uint32_t from = records[records.size() / 3].time, to = records[records.size() * 2 / 3].time;
+   int inRange = 0;
+
+   for (const Record& rec: records)
+      inRange += rec.time >= from && rec.time <= to;
+
+   announced = Dump(tier, from, to, records, corrupt);
+   CHECK(announced == inRange && (int)records.size() == inRange && records.front().time == from, n, "time range");
+}
+
+static void CheckChain(int n, std::vector<int>& depth)
+{
+   int numCells = n * BmsComm::voltagesPerModule;
+   std::map<uint32_t, Reference> minutes, hours;
+   std::vector<std::vector<uint16_t> > cycles;
+   std::vector<Record> records;
+   bool corrupt;
+
+   chainLength = n;
+   bool sawShift = false;
+
+   for (int cycle = 0; cycle < NUM_CYCLES; cycle++)
+   {
+      uint32_t time = cycle / CYCLES_PER_SECOND;
+
+      for (int i = 0; i < numCells; i++)
+         cellVoltages[i] = Voltage(i, cycle);
+
+      CellHistory::AddCycle(time);
+      Accumulate(minutes[time - time % 60], numCells, cycle);
+      Accumulate(hours[time - time % 3600], numCells, cycle);
+
+      if (cycle >= NUM_CYCLES - 100)
+         cycles.push_back(std::vector<uint16_t>(cellVoltages, cellVoltages + numCells));
+
+      //Records with a spread beyond 8 bits are sent with reduced resolution
+      if (time == 4050 && cycle % CYCLES_PER_SECOND == 0)
+      {
+         Dump(CellHistory::Cycle, time, time, records, corrupt);
+         sawShift = !records.empty() && records.back().shift > 0;
+      }
+   }
+   CHECK(sawShift, n, "reduced resolution");
+
+   //Only closed intervals are stored
+   minutes.erase(minutes.rbegin()->first);
+   hours.erase(hours.rbegin()->first);
+
+   //The open minute and hour take a slot each
+   int cycleSlots = (HISTORY_RAM / 5) / (7 + numCells);
+   int minuteSlots = (HISTORY_RAM * 2 / 5) / (7 + 2 * numCells) - 1;
+   int hourSlots = (HISTORY_RAM * 2 / 5) / (7 + 2 * numCells) - 1;
+
+   depth.clear();
+   depth.push_back(cycleSlots);
+   depth.push_back(std::min(minuteSlots, (int)minutes.size()));
+   depth.push_back(std::min(hourSlots, (int)hours.size()));
+
+   //The newest cycles
+   int announced = Dump(CellHistory::Cycle, 0, 0xffffffff, records, corrupt);
+   CHECK(!corrupt && announced == cycleSlots && (int)records.size() == cycleSlots, n, "cycle count");
+
+   for (int i = 0; i < cycleSlots; i++)
+   {
+      const std::vector<uint16_t>& raw = cycles[cycles.size() - cycleSlots + i];
+      Reference ref;
+
+      for (uint16_t vtg: raw)
+      {
+         bool valid = vtg > 50 && vtg < 5000;
+         ref.lo.push_back(valid ? vtg : 0xffff);
+         ref.hi.push_back(valid ? vtg : 0);
+      }
+      CHECK(Matches(records[i], ref, true), n, "cycle values");
+   }
+
+   CheckTier(n, CellHistory::Minute, minutes, depth[1]);
+   CheckTier(n, CellHistory::Hour, hours, depth[2]);
+
+   //Keep recording while a dump is running, it must still end cleanly
+   CellHistory::StartDump(CellHistory::Cycle, 0, 0xffffffff);
+   output.clear();
+   CellHistory::Run();
+
+   for (int i = 0; i < 2 * cycleSlots; i++)
+      CellHistory::AddCycle(NUM_CYCLES / CYCLES_PER_SECOND);
+
+   while (CellHistory::IsDumping())
+      CellHistory::Run();
+
+   CHECK(output.find(HISTORY_END) != std::string::npos, n, "dump with overwritten records");
+
+   //A different chain starts a new history
+   chainLength = n == 1 ? 2 : n - 1;
+   CellHistory::AddCycle(NUM_CYCLES / CYCLES_PER_SECOND + 1);
+   uint32_t first, last;
+   CHECK(CellHistory::GetRange(CellHistory::Cycle, first, last) == 1 &&
+         CellHistory::GetRange(CellHistory::Minute, first, last) == 0 &&
+         CellHistory::GetRange(CellHistory::Hour, first, last) == 0, n, "cleared on chain change");
+}
+
+int main()
+{
+   static const int chainLengths[] = { 1, 4, 16, 63 };
+
+   printf("mods  cycles  minutes  hours\r\n");
+
+   for (int n: chainLengths)
+   {
+      std::vector<int> depth(3);
+
+      chainLength = 0;
+      CellHistory::AddCycle(0);
+      CheckChain(n, depth);
+      printf("%4d  %6d  %7d  %5d\r\n", n, depth[0], depth[1], depth[2]);
+   }
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Compares the chunked JSON generator with the former blocking implementation
+ * of the json command for several chain lengths and chunk sizes and checks
+ * that delta dumps contain exactly the changed entries for every client */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <libopencm3/stm32/desig.h>
+#include "params.h"
+#include "stm32_can.h"
+#include "bmscomm.h"
+#include "cellstatistics.h"
+#include "onewire.h"
+#include "jsonstream.h"
+#include "imagestore.h"
+#include "simbus.h"
+#include "simcell.h"
+
+uint8_t _binary_cmu_images_lz_start[sizeof(ImageHeader)]; //no images
+
+#define TASK_PERIOD_US  40000
+
+//The reference goes through the target printf to the simulated terminal
+int sim_printf(const char* format, ...);
+
+/** PrintParamsJson of terminal_prj.cpp before JsonStream */
+static void LegacyPrintParamsJson()
+{
+   const Param::Attributes *pAtr;
+   int numSlaves = BmsComm::GetNumberOfCellModules();
+   const uint16_t* voltages = BmsComm::GetVoltages();
+   const int8_t* temperatures = BmsComm::GetTemperatures();
+   const struct version* versions = BmsComm::GetVersions();
+
+   sim_printf("{");
+   for (uint32_t idx = 0; idx < Param::PARAM_LAST; idx++)
+   {
+      int canId, canOffset, canLength;
+      bool isRx;
+      s32fp canGain;
+      pAtr = Param::GetAttrib((Param::PARAM_NUM)idx);
+
+      if ((Param::GetFlag((Param::PARAM_NUM)idx) & Param::FLAG_HIDDEN) == 0)
+      {
+         sim_printf("\r\n   \"%s\": {\"unit\":\"%s\",\"value\":%f,", pAtr->name, pAtr->unit, Param::Get((Param::PARAM_NUM)idx));
+
+         if (Can::GetInterface(0)->FindMap((Param::PARAM_NUM)idx, canId, canOffset, canLength, canGain, isRx))
+         {
+            sim_printf("\"canid\":%d,\"canoffset\":%d,\"canlength\":%d,\"cangain\":%d,\"isrx\":%s,",
+                       canId, canOffset, canLength, canGain, isRx ? "true" : "false");
+         }
+
+         if (Param::IsParam((Param::PARAM_NUM)idx))
+         {
+            sim_printf("\"isparam\":true,\"minimum\":%f,\"maximum\":%f,\"default\":%f,\"category\":\"%s\"},", pAtr->min, pAtr->max, pAtr->def, pAtr->category);
+         }
+         else
+         {
+            sim_printf("\"isparam\":false},");
+         }
+      }
+   }
+   sim_printf("\r\n   \"serial\": {\"unit\":\"\",\"value\":\"%X:%X:%X\",\"isparam\":false}", DESIG_UNIQUE_ID2, DESIG_UNIQUE_ID1, DESIG_UNIQUE_ID0);
+
+   for (int slave = 0; slave < numSlaves; slave++)
+   {
+      const uint8_t* ver = versions[slave].swVersion;
+      for (int channel = 0; channel < BmsComm::voltagesPerModule; channel++)
+      {
+         uint16_t vtg = voltages[4 * slave + channel];
+         const CellStatistics::Stats& stats = CellStatistics::Get(4 * slave + channel);
+         if (vtg < 5000)
+            sim_printf(",\r\n   \"u.%02d.%d\": {\"unit\":\"mV\",\"value\":%d,\"mean\":%f,\"variance\":%f,\"min\":%d,\"max\":%d,\"tmin\":%d,\"tmax\":%d,\"isparam\":false}",
+                       slave + 1, channel + 1, vtg, CellStatistics::GetMean(4 * slave + channel), CellStatistics::GetVariance(4 * slave + channel),
+                       stats.min, stats.max, CellStatistics::GetSecondsMin(4 * slave + channel), CellStatistics::GetSecondsMax(4 * slave + channel));
+      }
+      sim_printf(",\r\n   \"t.%02d\": {\"unit\":\"°C\",\"value\":%d,\"isparam\":false}", slave + 1, temperatures[slave]);
+      sim_printf(",\r\n   \"swver.%02d\": {\"unit\":\"\",\"value\":\"%d.%d.%d.%c\",\"isparam\":false}", slave + 1, ver[0], ver[1], ver[2], ver[3]);
+   }
+
+   sim_printf("\r\n}\r\n");
+}
+
+/** Address, read versions and poll the values of a chain of n modules */
+static bool SetupChain(int n)
+{
+   SimBus::Reset(n);
+   OneWire::Init();
+   CellStatistics::Reset();
+   SimBus::RunFor(TASK_PERIOD_US);
+
+   BmsComm::ResetAddress();
+   SimBus::RunFor(TASK_PERIOD_US);
+   BmsComm::SetAddress();
+
+   if (!SimBus::RunUntil([n]() { return BmsComm::GetNumberOfCellModules() == n; }, 30 * TASK_PERIOD_US))
+      return false;
+
+   for (int mod = 1; mod <= n; mod++)
+   {
+      BmsComm::StartVersionAcquisition(mod);
+      SimBus::RunFor(TASK_PERIOD_US);
+      BmsComm::AcquireVersion(mod);
+
+      for (int cycle = 0; cycle < 2; cycle++)
+      {
+         BmsComm::StartAcquisition(mod);
+         SimBus::RunFor(TASK_PERIOD_US);
+         BmsComm::Acquire(mod);
+         BmsComm::ProcessReceived();
+      }
+   }
+   return true;
+}
+
+static std::string Chunked(int chunkSize)
+{
+   std::string out;
+   char buf[4096];
+   int len;
+
+   JsonStream::Start();
+
+   while ((len = JsonStream::NextChunk(buf, chunkSize)) > 0)
+      out.append(buf, len);
+
+   return out;
+}
+
+static std::string Delta(uint16_t since, uint16_t& sequence)
+{
+   std::string out;
+   char buf[128];
+   int len;
+
+   JsonStream::StartDelta(since);
+
+   while ((len = JsonStream::NextChunk(buf, sizeof(buf))) > 0)
+      out.append(buf, len);
+
+   const char* seq = "\"seq\": {\"unit\":\"\",\"value\":";
+   size_t pos = out.find(seq);
+   sequence = pos != std::string::npos ? atoi(out.c_str() + pos + strlen(seq)) : 0;
+
+   return out;
+}
+
+static int Count(const std::string& s, const char* what)
+{
+   int count = 0;
+
+   for (size_t pos = s.find(what); pos != std::string::npos; pos = s.find(what, pos + 1))
+      count++;
+
+   return count;
+}
+
+#define CHECK(cond, n, what) if (!(cond)) { printf("FAIL: %d modules: %s\r\n", n, what); return false; }
+
+/** A delta after a full dump only has the module and parameter we changed */
+static bool CheckDelta(int n, int& deltaBytes)
+{
+   uint16_t first, second, third, fourth, fifth;
+   char cell[16];
+   char buf[16];
+
+   std::string all = Delta(0, first);
+   CHECK(Count(all, "\"serial\"") == 1 && Count(all, "\"u.") == 4 * n && Count(all, "\"swver.") == n, n, "delta 0 is complete");
+
+   std::string none = Delta(first, second);
+   CHECK(second != first && Count(none, "\"u.") == 0 && Count(none, "\"t.") == 0 && Count(none, "\"swver.") == 0, n, "unchanged cells omitted");
+   CHECK(Count(none, "\"isparam\"") == 1, n, "unchanged parameters omitted");
+
+   SimBus::GetCell(n)->voltages[1] += 5;
+   Param::SetInt(Param::soc, 50 + n);
+   BmsComm::StartAcquisition(n);
+   SimBus::RunFor(TASK_PERIOD_US);
+   BmsComm::Acquire(n);
+   BmsComm::ProcessReceived();
+
+   //An aborted dump doesn't take the changes from the next one
+   JsonStream::StartDelta(second);
+   JsonStream::NextChunk(buf, sizeof(buf));
+
+   std::string changed = Delta(second, third);
+   snprintf(cell, sizeof(cell), "\"u.%02d.2\"", n);
+   CHECK(Count(changed, "\"u.") == 4 && Count(changed, cell) == 1 && Count(changed, "\"swver.") == 1, n, "changed module sent");
+   CHECK(Count(changed, "\"soc\"") == 1 && Count(changed, "\"isparam\"") == 8, n, "changed parameter sent");
+   CHECK(Count(changed, ",,") == 0 && Count(changed, "{,") == 0, n, "delta syntax");
+
+   //Another client that saw an older dump gets the changes since then
+   std::string older = Delta(first, fourth);
+   CHECK(fourth != third && Count(older, "\"serial\"") == 0 && Count(older, "\"u.") == 4 && Count(older, "\"soc\"") == 1, n, "older sequence gets its changes");
+
+   //Numbers that were never given out, e.g. from before a reset, get everything
+   std::string unknown = Delta(fourth + 100, fifth);
+   CHECK(Count(unknown, "\"serial\"") == 1 && Count(unknown, "\"u.") == 4 * n, n, "unknown sequence gets everything");
+
+   deltaBytes = changed.size();
+   return true;
+}
+
+int main()
+{
+   static const int chainLengths[] = { 1, 4, 63 };
+   static const int chunkSizes[] = { 1, 7, 128, 4096 };
+   int failures = 0;
+
+   //Some values and a hidden parameter, udc and soc are CAN mapped
+   Param::SetFlt(Param::udc, FP_FROMINT(400) + 5);
+   Param::SetInt(Param::soc, 87);
+   Param::SetFlt(Param::tmpavg, -FP_FROMINT(3) / 2);
+   Param::SetFlag(Param::testcmd, Param::FLAG_HIDDEN);
+
+   printf("mods  bytes  delta\r\n");
+
+   for (int n: chainLengths)
+   {
+      if (!SetupChain(n))
+      {
+         printf("FAIL: %d modules: setup\r\n", n);
+         failures++;
+         continue;
+      }
+
+      SimBus::ClearTerminalOutput();
+      LegacyPrintParamsJson();
+      std::string reference = SimBus::GetTerminalOutput();
+
+      for (int size: chunkSizes)
+      {
+         if (Chunked(size) != reference)
+         {
+            printf("FAIL: %d modules: chunks of %d bytes differ\r\n", n, size);
+            failures++;
+         }
+      }
+
+      //Main loop path through the terminal DMA channel
+      SimBus::ClearTerminalOutput();
+      JsonStream::Start();
+
+      for (int i = 0; i < 100000 && JsonStream::IsActive(); i++)
+         JsonStream::Run();
+
+      if (SimBus::GetTerminalOutput() != reference)
+      {
+         printf("FAIL: %d modules: output of Run() differs\r\n", n);
+         failures++;
+      }
+
+      int deltaBytes = 0;
+      if (!CheckDelta(n, deltaBytes))
+         failures++;
+
+      printf("%4d  %5d  %5d\r\n", n, (int)reference.size(), deltaBytes);
+   }
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
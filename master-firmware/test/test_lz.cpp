@@ -0,0 +1,154 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Round trip of LzImage for erased, random and code like images of any size,
+ * page wise reading in random order and truncated compressed data */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include "lzimage.h"
+#include "bms_shared.h"
+
+#define PAGE_BYTES  (PAGE_WORDS * 2)
+#define IMAGE_BYTES (ATTINY_MAX_APPLICATION_PAGES * PAGE_BYTES)
+
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; return 0; }
+
+/** Something like AVR code: vector table, recurring instruction sequences with
+ * different registers and addresses, constant tables and erased flash at the end */
+static std::vector<uint8_t> CodeImage(int len)
+{
+   static const uint16_t snippets[][6] =
+   {
+      { 0x93cf, 0x93df, 0xb7cd, 0xb7de, 0x9721, 0x0000 },
+      { 0xe080, 0xe090, 0x940e, 0x0000, 0x9601, 0x3080 },
+      { 0x9100, 0x0000, 0x2311, 0xf409, 0x9508, 0x0000 },
+      { 0x91df, 0x91cf, 0x9508, 0x0000, 0x0000, 0x0000 },
+   };
+   std::vector<uint8_t> image(len, 0xff);
+   int pos = 0, code = len * 3 / 4;
+
+   for (int vector = 0; vector < 17 && pos + 1 < code; vector++, pos += 2)
+   {
+      uint16_t rjmp = 0xc000 | (0x20 + vector * 3);
+      image[pos] = rjmp & 0xff;
+      image[pos + 1] = rjmp >> 8;
+   }
+
+   while (pos + 1 < code)
+   {
+      if (rand() % 8 == 0)
+      {
+         image[pos++] = rand(); //table entry
+         continue;
+      }
+
+      const uint16_t* snippet = snippets[rand() % 4];
+
+      for (int i = 0; i < 6 && pos + 1 < code; i++, pos += 2)
+      {
+         uint16_t word = snippet[i] == 0 ? rand() & 0xfff : snippet[i] ^ (rand() % 4 << 4);
+         image[pos] = word & 0xff;
+         image[pos + 1] = word >> 8;
+      }
+   }
+
+   return image;
+}
+
+/** @return compressed size, 0 on failure */
+static int RoundTrip(const std::vector<uint8_t>& data)
+{
+   int len = data.size();
+   std::vector<uint8_t> packed(LzImage::MaxSize(len));
+   std::vector<uint8_t> out(len + 1);
+   int packedLen = LzImage::Compress(data.data(), len, packed.data(), packed.size());
+
+   CHECK(packedLen > 0 && packedLen <= LzImage::MaxSize(len), "compressed size");
+   CHECK(LzImage::Compress(data.data(), len, packed.data(), packed.size() - 1) < 0, "too small buffer detected");
+
+   LzImage image(packed.data());
+   image.Rewind();
+
+   CHECK(image.GetSize() == len && image.GetPackedSize() == packedLen, "header");
+   CHECK(image.Read(out.data(), len + 1) == len && memcmp(out.data(), data.data(), len) == 0, "round trip");
+
+   //Pages in random order, as a retransmit would read them
+   int numPages = (len + PAGE_BYTES - 1) / PAGE_BYTES;
+
+   for (int i = 0; i < numPages * 2; i++)
+   {
+      int page = rand() % numPages;
+      int expected = len - page * PAGE_BYTES < PAGE_BYTES ? len - page * PAGE_BYTES : PAGE_BYTES;
+
+      CHECK(image.Seek(page * PAGE_BYTES), "seek");
+      CHECK(image.Read(out.data(), PAGE_BYTES) == expected &&
+            memcmp(out.data(), &data[page * PAGE_BYTES], expected) == 0, "random page");
+   }
+
+   CHECK(!image.Seek(len + 1), "seek beyond the end");
+
+   //Cut off compressed data must end the output early, not read beyond it
+   if (packedLen > LzImage::HeaderSize + 1)
+   {
+      int cut = LzImage::HeaderSize + rand() % (packedLen - LzImage::HeaderSize - 1);
+      std::vector<uint8_t> truncated(packed.begin(), packed.begin() + cut);
+      truncated[2] = (cut - LzImage::HeaderSize) & 0xff;
+      truncated[3] = (cut - LzImage::HeaderSize) >> 8;
+
+      LzImage broken(truncated.data());
+      broken.Rewind();
+      CHECK(broken.Read(out.data(), len) < len, "truncated data detected");
+   }
+
+   return packedLen;
+}
+
+int main()
+{
+   srand(1);
+
+   for (int len = 0; len <= IMAGE_BYTES; len += len < 300 ? 1 : 37)
+   {
+      std::vector<uint8_t> data(len);
+
+      for (int i = 0; i < len; i++)
+         data[i] = rand();
+
+      RoundTrip(data);
+      RoundTrip(std::vector<uint8_t>(len, 0xff));
+      RoundTrip(CodeImage(len));
+   }
+
+   std::vector<uint8_t> random(IMAGE_BYTES);
+
+   for (int i = 0; i < IMAGE_BYTES; i++)
+      random[i] = rand();
+
+   printf("image       bytes  compressed\r\n");
+   printf("erased      %5d  %10d\r\n", IMAGE_BYTES, RoundTrip(std::vector<uint8_t>(IMAGE_BYTES, 0xff)));
+   printf("code        %5d  %10d\r\n", IMAGE_BYTES, RoundTrip(CodeImage(IMAGE_BYTES)));
+   printf("random      %5d  %10d\r\n", IMAGE_BYTES, RoundTrip(random));
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
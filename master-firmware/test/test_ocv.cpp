@@ -0,0 +1,234 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Checks the open circuit voltage table: the LFP preset against the former
+ * linear scan, bilinear interpolation against a floating point reference,
+ * validation of entered rows, staging and storage in simulated flash */
+#include <stdio.h>
+#include <math.h>
+#include "hwdefs.h"
+#include "ocvtable.h"
+#include "simflash.h"
+
+static const uint16_t lfpVtgToSoc[] = { 2700, 3223, 3257, 3283, 3292, 3295, 3302, 3323, 3331, 3334, 3357 };
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; return; }
+
+/** BmsCalculation::EstimateSocFromVoltage() before the table */
+static int LegacyEstimate(uint16_t vtg)
+{
+   int soc = 100;
+   for (uint32_t i = 0; i < sizeof(lfpVtgToSoc) / sizeof(lfpVtgToSoc[0]); i++)
+   {
+      if (vtg <= lfpVtgToSoc[i])
+      {
+         if (i == 0)
+         {
+            soc = 0;
+            break;
+         }
+         soc = (i - 1) * 10;
+         soc += (10 * (vtg - lfpVtgToSoc[i - 1])) / (lfpVtgToSoc[i] - lfpVtgToSoc[i - 1]);
+         break;
+      }
+   }
+   return soc;
+}
+
+static void CheckLfpPreset()
+{
+   OcvTable::LoadPreset(OcvTable::Lfp);
+
+   for (int vtg = 2500; vtg < 3500; vtg++)
+   {
+      CHECK(FP_TOINT(OcvTable::GetSoc(vtg, FP_FROMINT(25))) == LegacyEstimate(vtg), "lfp matches former table");
+   }
+
+   //The temperature doesn't matter with one column
+   CHECK(OcvTable::GetSoc(3300, FP_FROMFLT(-20)) == OcvTable::GetSoc(3300, FP_FROMINT(60)), "one column");
+}
+
+/** Voltage then SoC returns the SoC */
+static void CheckInverse(OcvTable::Preset preset)
+{
+   OcvTable::LoadPreset(preset);
+
+   for (int permille = 0; permille <= 1000; permille++)
+   {
+      int32_t slope, slopeAbove;
+      int32_t soc = ((int64_t)permille << 30) / 1000;
+      int32_t uv = OcvTable::GetVoltage(soc, FP_FROMINT(25), slope);
+      int32_t above = OcvTable::GetVoltage(soc + (1 << 20), FP_FROMINT(25), slopeAbove);
+      double expected = permille / 10.0;
+      double back = OcvTable::GetSoc(uv / 1000, FP_FROMINT(25)) / 32.0;
+
+      CHECK(slope > 0 && above >= uv, "ascending");
+      //Truncating to mV loses up to 1 mV
+      CHECK(back <= expected + 0.04 && back >= expected - 1000.0 * 100 / slope - 0.04, "inverse");
+   }
+}
+
+static const int temperatures[] = { -10, 0, 25, 45 };
+static const int socs[] = { 0, 5, 10, 30, 50, 70, 90, 100 };
+
+static int Voltage(int column, int point)
+{
+   return 3000 + socs[point] * 10 + temperatures[column] * 2 + (point * column) % 3;
+}
+
+static void EnterTable()
+{
+   OcvTable::SetTemperatures(temperatures, 4);
+
+   for (int p = 0; p < 8; p++)
+   {
+      int voltages[4];
+
+      for (int i = 0; i < 4; i++)
+         voltages[i] = Voltage(i, p);
+
+      OcvTable::AddRow(socs[p], voltages);
+   }
+
+   OcvTable::ApplyStaged();
+}
+
+/** Bilinear interpolation in double */
+static double Reference(int vtg, double temperature)
+{
+   int column = 0;
+   double w = 0;
+
+   if (temperature >= temperatures[3])
+   {
+      column = 3;
+   }
+   else if (temperature > temperatures[0])
+   {
+      while (temperature >= temperatures[column + 1]) column++;
+      w = (temperature - temperatures[column]) / (temperatures[column + 1] - temperatures[column]);
+   }
+
+   double v[8];
+   for (int p = 0; p < 8; p++)
+      v[p] = Voltage(column, p) + (w > 0 ? (Voltage(column + 1, p) - Voltage(column, p)) * w : 0);
+
+   if (vtg <= v[0]) return socs[0];
+   if (vtg >= v[7]) return socs[7];
+
+   int p = 0;
+   while (vtg >= v[p + 1]) p++;
+
+   return socs[p] + (socs[p + 1] - socs[p]) * (vtg - v[p]) / (v[p + 1] - v[p]);
+}
+
+static void CheckBilinear()
+{
+   EnterTable();
+   CHECK(OcvTable::IsComplete() && OcvTable::GetNumPoints() == 8, "table entered");
+
+   for (int t = -20 * 32; t <= 55 * 32; t += 7)
+   {
+      for (int vtg = 2950; vtg < 4150; vtg += 3)
+      {
+         double soc = OcvTable::GetSoc(vtg, t) / 32.0;
+         double ref = Reference(vtg, t / 32.0);
+
+         CHECK(fabs(soc - ref) < 0.07, "bilinear");
+      }
+   }
+}
+
+static void CheckValidation()
+{
+   const int descending[] = { 25, 0 };
+   const int voltages[] = { 3000, 3100 };
+   const int lower[] = { 2990, 3200 };
+   const int full[] = { 3200, 3300 };
+
+   OcvTable::LoadPreset(OcvTable::Nmc);
+   s32fp active = OcvTable::GetSoc(3700, FP_FROMINT(25));
+
+   CHECK(!OcvTable::SetTemperatures(descending, 2), "descending temperatures");
+   CHECK(OcvTable::SetTemperatures(temperatures + 1, 2), "two columns");
+   CHECK(!OcvTable::ApplyStaged(), "no rows");
+
+   //Entering doesn't touch the active table
+   CHECK(OcvTable::GetNumPoints() == 13 && OcvTable::GetSoc(3700, FP_FROMINT(25)) == active, "active while staging");
+
+   CHECK(OcvTable::AddRow(0, voltages), "first row");
+   CHECK(!OcvTable::ApplyStaged() && OcvTable::GetStagedPoints() == 1, "one row");
+   CHECK(!OcvTable::AddRow(0, lower), "same soc");
+   CHECK(!OcvTable::AddRow(50, lower), "voltage not ascending");
+   CHECK(!OcvTable::AddRow(101, voltages), "soc above 100");
+   CHECK(OcvTable::AddRow(100, full), "second row");
+   CHECK(OcvTable::GetSoc(3700, FP_FROMINT(25)) == active, "still staged");
+   CHECK(OcvTable::ApplyStaged() && OcvTable::GetStagedTemperatures() == 0, "two rows");
+   CHECK(OcvTable::IsComplete() && OcvTable::GetNumPoints() == 2, "applied");
+   CHECK(OcvTable::GetSoc(3200, FP_FROMINT(25)) == FP_FROMINT(50), "two row lookup");
+   CHECK(OcvTable::GetSoc(3150, FP_FROMINT(10)) == FP_FROMINT(55), "two row interpolation");
+}
+
+static void CheckFlash()
+{
+   SimFlash::EraseAll();
+   CHECK(!OcvTable::LoadFromFlash(), "blank flash");
+
+   EnterTable();
+   s32fp soc = OcvTable::GetSoc(3400, FP_FROMINT(10));
+   CHECK(OcvTable::SaveToFlash(), "save");
+
+   OcvTable::LoadPreset(OcvTable::Nmc);
+   CHECK(OcvTable::LoadFromFlash() && OcvTable::GetSoc(3400, FP_FROMINT(10)) == soc, "load");
+
+   OcvTable::LoadFromFlash();
+   OcvTable::SetTemperatures(temperatures, 1);
+   CHECK(!OcvTable::SaveToFlash(), "incomplete isn't saved");
+   CHECK(OcvTable::GetSoc(3400, FP_FROMINT(10)) == soc, "incomplete isn't applied");
+
+   //Saving takes over a staged table
+   const int voltages[] = { 3000, 3100 };
+   OcvTable::AddRow(0, voltages);
+   OcvTable::AddRow(100, voltages + 1);
+   CHECK(OcvTable::SaveToFlash() && OcvTable::GetNumPoints() == 2, "save staged");
+   OcvTable::LoadPreset(OcvTable::Lfp);
+   CHECK(OcvTable::LoadFromFlash() && OcvTable::GetNumTemperatures() == 1 && OcvTable::GetNumPoints() == 2, "load staged");
+
+   //A flipped bit makes the CRC fail
+   *(volatile uint32_t*)(uintptr_t)(OCVTBL_ADDRESS + 40) ^= 0x100;
+   CHECK(!OcvTable::LoadFromFlash(), "corrupt");
+}
+
+int main()
+{
+   //Host pages are 4K, the table page is the upper half of one
+   if (!SimFlash::Map(OCVTBL_ADDRESS - FLASH_PAGE_SIZE, 2 * FLASH_PAGE_SIZE))
+      return 1;
+
+   CheckLfpPreset();
+   CheckInverse(OcvTable::Lfp);
+   CheckInverse(OcvTable::Nmc);
+   CheckBilinear();
+   CheckValidation();
+   CheckFlash();
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,111 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Runs tasks with known execution times through TaskProfiler and checks
+ * min/avg/max, deadline misses, wrap around of the cycle counter and reset */
+#include <stdio.h>
+#include "taskprofiler.h"
+
+#define CYCLES_PER_US 72
+
+uint32_t sim_cycle_counter = 0;
+
+static int failures = 0;
+static uint32_t fastCycles; //execution time of the next run of FastTask
+static uint32_t slowCycles;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; }
+
+static void FastTask()
+{
+   sim_cycle_counter += fastCycles;
+}
+
+static void SlowTask()
+{
+   sim_cycle_counter += slowCycles;
+}
+
+static void RunFast(uint32_t us)
+{
+   fastCycles = us * CYCLES_PER_US;
+   TaskProfiler::Run<FastTask, 0>();
+   sim_cycle_counter += 1000; //time between tasks doesn't count
+}
+
+static void RunSlow(uint32_t us)
+{
+   slowCycles = us * CYCLES_PER_US;
+   TaskProfiler::Run<SlowTask, 1>();
+}
+
+int main()
+{
+   TaskProfiler::Init(CYCLES_PER_US);
+   TaskProfiler::SetTask(0, "FastTask", 1);
+   TaskProfiler::SetTask(1, "SlowTask", 40);
+
+   CHECK(TaskProfiler::GetNumTasks() == 2, "number of tasks");
+   CHECK(TaskProfiler::GetMin(0) == 0 && TaskProfiler::GetAvg(0) == 0 && TaskProfiler::GetMax(0) == 0, "no runs yet");
+
+   RunFast(100);
+   RunFast(300);
+   RunFast(200);
+
+   CHECK(TaskProfiler::GetMin(0) == 100, "min");
+   CHECK(TaskProfiler::GetAvg(0) == 200, "avg");
+   CHECK(TaskProfiler::GetMax(0) == 300, "max");
+   CHECK(TaskProfiler::GetRuns(0) == 3, "runs");
+   CHECK(TaskProfiler::GetMisses(0) == 0, "no misses");
+
+   //Exactly the period is still in time
+   RunFast(1000);
+   RunFast(1001);
+   RunFast(5000);
+
+   CHECK(TaskProfiler::GetMisses(0) == 2, "misses");
+   CHECK(TaskProfiler::GetMax(0) == 5000, "max after misses");
+
+   //The counter wraps after a minute at 72 MHz
+   sim_cycle_counter = UINT32_MAX - 100;
+   RunSlow(30000);
+   RunSlow(50000);
+
+   CHECK(TaskProfiler::GetMin(1) == 30000, "min across wrap around");
+   CHECK(TaskProfiler::GetMax(1) == 50000, "max across wrap around");
+   CHECK(TaskProfiler::GetMisses(1) == 1, "slow task misses");
+   CHECK(TaskProfiler::GetMisses(0) == 2, "tasks are independent");
+
+   //Every task clears its figures on its next run
+   TaskProfiler::Reset();
+   RunFast(10);
+
+   CHECK(TaskProfiler::GetRuns(0) == 1 && TaskProfiler::GetMin(0) == 10 && TaskProfiler::GetMax(0) == 10, "reset on next run");
+   CHECK(TaskProfiler::GetMisses(0) == 0, "misses reset");
+   CHECK(TaskProfiler::GetRuns(1) == 2, "other task not yet reset");
+
+   RunSlow(20);
+   RunFast(30);
+
+   CHECK(TaskProfiler::GetRuns(1) == 1 && TaskProfiler::GetMax(1) == 20 && TaskProfiler::GetMisses(1) == 0, "other task reset");
+   CHECK(TaskProfiler::GetRuns(0) == 2 && TaskProfiler::GetAvg(0) == 20, "reset only once");
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,220 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Replays a simulated drive cycle through SocEstimator. A 1-RC cell with
+ * different parameters than the filter's model and less than nominal capacity
+ * provides the true SoC and the cell voltage, the current sensor has offset
+ * and noise. Prints the error of the filter and of plain charge counting and
+ * the cost of a filter step */
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "my_fp.h"
+#include "ocvtable.h"
+#include "socestimator.h"
+
+#define CAPACITY        100   //Ah, nominal
+#define TRUE_CAPACITY   92.0
+#define TRUE_R0         0.0012
+#define TRUE_R1         0.0008
+#define TRUE_TAU        45.0
+#define SENSOR_OFFSET   0.4   //A
+#define SENSOR_NOISE    0.5   //A rms
+#define VOLTAGE_NOISE   1.0   //mV rms
+#define ACQ_PERIOD      200   //ms between cell voltage readings
+
+static const uint16_t lfpVtgToSoc[] = { 2700, 3223, 3257, 3283, 3292, 3295, 3302, 3323, 3331, 3334, 3357 };
+static int failures = 0;
+
+#define CHECK(cond, what) if (!(cond)) { printf("FAIL: %s\r\n", what); failures++; }
+
+/** Inputs of one filter step, recorded for the benchmark */
+struct StepInput
+{
+   int32_t currentSum;
+   int voltage;
+};
+
+static std::vector<StepInput> recorded;
+
+/** Deterministic gaussian noise */
+static double Noise(double rms)
+{
+   static uint32_t state = 12345;
+   double u1, u2;
+
+   state = state * 1664525 + 1013904223;
+   u1 = (state + 1.0) / 4294967297.0;
+   state = state * 1664525 + 1013904223;
+   u2 = state / 4294967296.0;
+
+   return rms * sqrt(-2 * log(u1)) * cos(2 * M_PI * u2);
+}
+
+static double Ocv(double soc)
+{
+   double pos = fmax(0, fmin(soc, 1)) * 10;
+   int i = fmin(pos, 9);
+
+   return lfpVtgToSoc[i] + (lfpVtgToSoc[i + 1] - lfpVtgToSoc[i]) * (pos - i);
+}
+
+/** City driving, 120 s per repetition, positive is charging */
+static double CityCurrent(double t)
+{
+   static const struct { double duration, current; } phases[] =
+   {
+      { 8, -180 }, { 40, -45 }, { 6, 70 }, { 20, 0 }, { 10, -150 }, { 30, -60 }, { 6, 40 }
+   };
+   double pos = fmod(t, 120);
+
+   for (auto& phase: phases)
+   {
+      if (pos < phase.duration) return phase.current;
+      pos -= phase.duration;
+   }
+   return 0;
+}
+
+/** 1.5 h city driving, 30 min rest, 1.5 h charging */
+static double DriveCycle(double t)
+{
+   if (t < 5400) return CityCurrent(t);
+   if (t < 7200) return 0;
+   return 40;
+}
+
+static void Replay(const char* name, double startSoc, double initialEstimate, bool record)
+{
+   const int duration = 3 * 3600 * 1000 + 1800 * 1000;
+   double trueSoc = startSoc, v1 = 0, counted = initialEstimate;
+   double maxError = 0, maxCountError = 0, error = 0, countError = 0;
+   int32_t sum = 0;
+
+   SocEstimator::SetModel(FP_FROMINT(CAPACITY), FP_FROMINT(1), FP_FROMINT(1), FP_FROMINT(60));
+   SocEstimator::Reset(FP_FROMFLT(initialEstimate * 100));
+
+   for (int ms = 0; ms < duration; ms++)
+   {
+      double current = DriveCycle(ms / 1000.0);
+      s32fp measured = lround((current + SENSOR_OFFSET + Noise(SENSOR_NOISE)) * (1 << CST_DIGITS));
+
+      trueSoc += current * 0.001 / 3600 / TRUE_CAPACITY;
+      v1 = v1 * exp(-0.001 / TRUE_TAU) + (1 - exp(-0.001 / TRUE_TAU)) * TRUE_R1 * current;
+      counted += measured / (double)(1 << CST_DIGITS) * 0.001 / 3600 / CAPACITY;
+
+      if ((ms % ACQ_PERIOD) == 0)
+      {
+         int voltage = lround(Ocv(trueSoc) + (v1 + TRUE_R0 * current) * 1000 + Noise(VOLTAGE_NOISE));
+         SocEstimator::SetVoltage(voltage);
+
+         if (record && (ms % SocEstimator::stepMs) == 0)
+            recorded.push_back({ 0, voltage });
+      }
+
+      SocEstimator::AddSample(measured);
+      sum += measured;
+
+      if (((ms + 1) % SocEstimator::stepMs) == 0)
+      {
+         if (record)
+            recorded.push_back({ sum, 0 });
+         sum = 0;
+
+         error = fabs(SocEstimator::GetSoc() / (double)(1 << CST_DIGITS) - trueSoc * 100);
+         countError = fabs(counted - trueSoc) * 100;
+
+         //Allow the filter 10 minutes to converge
+         if (ms > 600000)
+         {
+            maxError = fmax(maxError, error);
+            maxCountError = fmax(maxCountError, countError);
+         }
+      }
+   }
+
+   printf("%-10s %8.1f %8.2f %8.2f %8.2f %8.2f %8.1f\r\n", name, trueSoc * 100, maxCountError, countError, maxError, error,
+          SocEstimator::GetCapacity() / (double)(1 << CST_DIGITS));
+
+   //In the flat part of the LFP curve the filter can't do much better than counting,
+   //towards empty it learns the capacity and corrects the offset
+   CHECK(error < 3 && error < countError, name);
+   CHECK(maxError < maxCountError, name);
+}
+
+static uint64_t Cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+   return __rdtsc();
+#else
+   return 0;
+#endif
+}
+
+/** Time filter steps with the inputs recorded from the drive cycle */
+static void Benchmark()
+{
+   const int repetitions = 10;
+   struct timespec start, end;
+   int updates = 0;
+
+   SocEstimator::Reset(FP_FROMINT(95));
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   uint64_t startCycles = Cycles();
+
+   for (int r = 0; r < repetitions; r++)
+   {
+      for (const StepInput& input: recorded)
+      {
+         if (input.voltage > 0)
+         {
+            SocEstimator::SetVoltage(input.voltage);
+         }
+         else
+         {
+            SocEstimator::Step(input.currentSum);
+            updates++;
+         }
+      }
+   }
+
+   uint64_t cycles = Cycles() - startCycles;
+   clock_gettime(CLOCK_MONOTONIC, &end);
+   double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+
+   printf("%d updates, %.0f ns and %.0f host cycles per update\r\n", updates, ns / updates, (double)cycles / updates);
+}
+
+int main()
+{
+   OcvTable::LoadPreset(OcvTable::Lfp);
+
+   printf("start      true SoC  max cnt  end cnt  max ekf  end ekf  cap [Ah]\r\n");
+   Replay("correct", 0.95, 0.95, true);
+   Replay("low", 0.95, 0.60, false);
+   Replay("high", 0.85, 1.00, false);
+   Benchmark();
+
+   printf("%d failures\r\n", failures);
+
+   return failures;
+}
@@ -0,0 +1,206 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host side decoder for the cell voltage history sent by "history n [from [to]]"
+ * on the terminal. Prints one CSV line per record, with one column per cell
+ * for the cycle tier and a minimum and maximum column per cell otherwise.
+ * Cells without value are left empty.
+ *
+ * Usage: history-decode [device or file], stdin if omitted */
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <vector>
+#include "cobs.h"
+#include "cellhistory.h"
+
+static std::vector<int> values;
+static HistoryFrameHeader record;
+static int expectedModule = 0;
+static int numModules = 0;
+static int printedCells = -1;
+static uint32_t badFrames = 0;
+
+static void OpenSerial(int fd)
+{
+   struct termios tio;
+
+   if (tcgetattr(fd, &tio) != 0) return; //not a tty
+
+   cfmakeraw(&tio);
+   cfsetispeed(&tio, B115200);
+   cfsetospeed(&tio, B115200);
+   tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void PrintRecord()
+{
+   bool minMax = record.tier != 0;
+   int numCells = values.size() / (minMax ? 2 : 1);
+
+   if (numCells != printedCells)
+   {
+      printf("time");
+
+      for (int cell = 0; cell < numCells; cell++)
+      {
+         int mod = cell / record.voltagesPerModule + 1, chan = cell % record.voltagesPerModule + 1;
+
+         if (minMax)
+            printf(",u.%02d.%d.min,u.%02d.%d.max", mod, chan, mod, chan);
+         else
+            printf(",u.%02d.%d", mod, chan);
+      }
+      printf("\n");
+      printedCells = numCells;
+   }
+
+   printf("%u", record.time);
+
+   for (int value: values)
+   {
+      if (value >= 0)
+         printf(",%d", value);
+      else
+         printf(",");
+   }
+
+   printf("\n");
+   fflush(stdout);
+}
+
+/** Print the record collected so far unless slices are missing */
+static void FlushRecord()
+{
+   if (expectedModule > 0 && expectedModule >= numModules)
+      PrintRecord();
+   expectedModule = 0;
+}
+
+static void ParseData(const uint8_t* data, int len)
+{
+   HistoryFrameHeader header;
+
+   memcpy(&header, data, sizeof(header));
+
+   int bytesPerCell = header.tier == 0 ? 1 : 2;
+   int numBytes = header.numModules * header.voltagesPerModule * bytesPerCell;
+
+   if (len != (int)sizeof(header) + numBytes)
+   {
+      badFrames++;
+      return;
+   }
+
+   //Slices of a record arrive in module order, a gap means it was overwritten
+   if (header.firstModule == 0)
+   {
+      values.clear();
+      record = header;
+   }
+   else if (header.firstModule != expectedModule || header.time != record.time)
+   {
+      expectedModule = 0;
+      return;
+   }
+
+   for (int i = 0; i < numBytes; i++)
+   {
+      uint8_t offset = data[sizeof(header) + i];
+      values.push_back(offset == HISTORY_INVALID ? -1 : header.base + (offset << header.shift));
+   }
+
+   expectedModule = header.firstModule + header.numModules;
+
+   if (expectedModule > numModules)
+      numModules = expectedModule;
+}
+
+static bool ProcessFrame(const uint8_t* frame, int len)
+{
+   std::vector<uint8_t> data(len);
+   int dataLen = CobsFrame::Decode(frame, len, data.data());
+
+   //Terminal echo and other text ends up here as well
+   if (dataLen < (int)sizeof(HistoryEndHeader))
+   {
+      if (len > 0) badFrames++;
+      return false;
+   }
+
+   if (data[0] == HISTORY_END)
+   {
+      FlushRecord();
+      return true;
+   }
+
+   if (data[0] == HISTORY_DATA && dataLen >= (int)sizeof(HistoryFrameHeader))
+   {
+      //A new record starts, print the previous one
+      if (data[offsetof(HistoryFrameHeader, firstModule)] == 0)
+         FlushRecord();
+      ParseData(data.data(), dataLen);
+   }
+
+   return false;
+}
+
+int main(int argc, char** argv)
+{
+   int fd = 0;
+   std::vector<uint8_t> frame;
+   uint8_t buf[256];
+   bool done = false;
+   int n;
+
+   if (argc > 1)
+   {
+      fd = open(argv[1], O_RDONLY | O_NOCTTY);
+
+      if (fd < 0)
+      {
+         perror(argv[1]);
+         return 1;
+      }
+   }
+
+   OpenSerial(fd);
+
+   while (!done && (n = read(fd, buf, sizeof(buf))) > 0)
+   {
+      for (int i = 0; i < n && !done; i++)
+      {
+         if (buf[i] == 0)
+         {
+            done = ProcessFrame(frame.data(), frame.size());
+            frame.clear();
+         }
+         else
+         {
+            frame.push_back(buf[i]);
+         }
+      }
+   }
+
+   fprintf(stderr, "%u corrupt frames\n", badFrames);
+
+   return 0;
+}
@@ -0,0 +1,158 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Builds the store of cell module firmware images for linking into the
+ * master firmware. Every image is compressed and preceded by an ImageHeader
+ * with the software version it contains and the hardware version it is built
+ * for. Images are padded to whole pages with erased flash and must fit into
+ * the application section of the cell module.
+ *
+ * Usage: lzpack output.lz input.bin sw hw [input.bin sw hw ...]
+ * e.g.   lzpack cmu-images.lz bms-tiny.elf.bin 2.0.16.R 1.A
+ * Version fields are numbers or single characters as in the VERSION macro */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <vector>
+#include "lzimage.h"
+#include "imagestore.h"
+#include "crc16.h"
+#include "bms_shared.h"
+
+#define PAGE_BYTES (PAGE_WORDS * 2)
+
+/** Parse a version like 2.0.16.R into fields */
+static bool ParseVersion(const char* str, uint8_t* fields, int numFields)
+{
+   for (int i = 0; i < numFields; i++)
+   {
+      char* end = (char*)str;
+
+      if (isdigit((unsigned char)*str))
+      {
+         long value = strtol(str, &end, 10);
+
+         if (value > 255) return false;
+         fields[i] = value;
+      }
+      else if (*str != 0 && *str != '.')
+      {
+         fields[i] = *str;
+         end++;
+      }
+
+      if (end == str || *end != (i < numFields - 1 ? '.' : 0)) return false;
+      str = end + 1;
+   }
+
+   return true;
+}
+
+static bool ReadImage(const char* name, std::vector<uint8_t>& image)
+{
+   FILE* in = fopen(name, "rb");
+   int c;
+
+   if (!in)
+   {
+      perror(name);
+      return false;
+   }
+
+   while ((c = fgetc(in)) != EOF)
+      image.push_back(c);
+
+   fclose(in);
+
+   if (image.size() > ATTINY_MAX_APPLICATION_PAGES * PAGE_BYTES)
+   {
+      fprintf(stderr, "%s: %u bytes don't fit into %d pages\n", name, (unsigned)image.size(), ATTINY_MAX_APPLICATION_PAGES);
+      return false;
+   }
+
+   image.resize((image.size() + PAGE_BYTES - 1) / PAGE_BYTES * PAGE_BYTES, 0xff);
+   return true;
+}
+
+int main(int argc, char** argv)
+{
+   int numImages = (argc - 2) / 3;
+
+   if (argc < 5 || (argc - 2) % 3 != 0 || numImages > ImageStore::MaxImages)
+   {
+      fprintf(stderr, "Usage: %s output.lz input.bin sw hw [input.bin sw hw ...]\n", argv[0]);
+      fprintf(stderr, "e.g. %s cmu-images.lz bms-tiny.elf.bin 2.0.16.R 1.A, at most %d images\n", argv[0], ImageStore::MaxImages);
+      return 1;
+   }
+
+   std::vector<uint8_t> store;
+
+   for (int i = 0; i < numImages; i++)
+   {
+      const char* name = argv[2 + 3 * i];
+      std::vector<uint8_t> image;
+      ImageHeader header;
+
+      header.magic = ImageStore::Magic;
+
+      if (!ParseVersion(argv[3 + 3 * i], header.version.swVersion, sizeof(header.version.swVersion)) ||
+          !ParseVersion(argv[4 + 3 * i], header.version.hwVersion, sizeof(header.version.hwVersion)))
+      {
+         fprintf(stderr, "%s: invalid version %s %s\n", name, argv[3 + 3 * i], argv[4 + 3 * i]);
+         return 1;
+      }
+
+      if (!ReadImage(name, image))
+         return 1;
+
+      std::vector<uint8_t> packed(LzImage::MaxSize(image.size()));
+      int len = LzImage::Compress(image.data(), image.size(), packed.data(), packed.size());
+
+      if (len < 0)
+      {
+         fprintf(stderr, "%s: compression failed\n", name);
+         return 1;
+      }
+
+      header.size = image.size();
+      header.packedSize = len;
+      header.crc = Crc16::Calculate(image.data(), image.size());
+
+      store.insert(store.end(), (uint8_t*)&header, (uint8_t*)&header + sizeof(header));
+      store.insert(store.end(), packed.begin(), packed.begin() + len);
+      printf("%s: %s for hardware %s, %u bytes compressed to %d\n", name, argv[3 + 3 * i], argv[4 + 3 * i], (unsigned)image.size(), len);
+   }
+
+   //Anything but the magic ends the store
+   store.push_back(0);
+   store.push_back(0);
+
+   FILE* out = fopen(argv[1], "wb");
+
+   if (!out || fwrite(store.data(), 1, store.size(), out) != store.size())
+   {
+      perror(argv[1]);
+      return 1;
+   }
+
+   fclose(out);
+   printf("%s: %d images, %u bytes\n", argv[1], numImages, (unsigned)store.size());
+
+   return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * This file is part of the tumanako_vc project.
+ *
+ * Copyright (C) 2018 Johannes Huebner <dev@johanneshuebner.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+/* Host side decoder for the binary stream started with "binstream" on the
+ * terminal. Reads frames from a serial port or a file and prints one CSV line
+ * per data frame, preceded by a header line whenever the layout changes.
+ *
+ * Usage: telemetry-decode [device or file], stdin if omitted */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <string>
+#include <vector>
+#include "cobs.h"
+#include "telemetry.h"
+
+struct Layout
+{
+   TelemetryHeader header;
+   std::vector<std::string> names;
+};
+
+static Layout layout;
+static bool haveLayout = false;
+static uint32_t badFrames = 0, lostFrames = 0;
+
+static void OpenSerial(int fd)
+{
+   struct termios tio;
+
+   if (tcgetattr(fd, &tio) != 0) return; //not a tty
+
+   cfmakeraw(&tio);
+   cfsetispeed(&tio, B115200);
+   cfsetospeed(&tio, B115200);
+   tcsetattr(fd, TCSANOW, &tio);
+}
+
+static void PrintHeader()
+{
+   printf("seq");
+
+   for (const std::string& name: layout.names)
+      printf(",%s", name.c_str());
+
+   for (int mod = 0; mod < layout.header.numModules; mod++)
+      for (int cell = 0; cell < layout.header.voltagesPerModule; cell++)
+         printf(",u.%02d.%d", mod + 1, cell + 1);
+
+   for (int mod = 0; mod < layout.header.numModules; mod++)
+      printf(",t.%02d", mod + 1);
+
+   printf("\n");
+}
+
+static void ParseLayout(const uint8_t* data, int len)
+{
+   Layout newLayout;
+   const char* name = (const char*)data + sizeof(TelemetryHeader);
+   const char* end = (const char*)data + len;
+
+   memcpy(&newLayout.header, data, sizeof(TelemetryHeader));
+
+   while (name < end && (int)newLayout.names.size() < newLayout.header.numParams)
+   {
+      newLayout.names.push_back(std::string(name, strnlen(name, end - name)));
+      name += newLayout.names.back().size() + 1;
+   }
+
+   bool changed = !haveLayout || newLayout.names != layout.names ||
+                  newLayout.header.numModules != layout.header.numModules ||
+                  newLayout.header.voltagesPerModule != layout.header.voltagesPerModule;
+
+   layout = newLayout;
+   haveLayout = true;
+
+   if (changed)
+      PrintHeader();
+}
+
+static void ParseData(const uint8_t* data, int len)
+{
+   static uint16_t expectedSequence;
+   TelemetryHeader header;
+
+   memcpy(&header, data, sizeof(header));
+
+   int numCells = header.numModules * header.voltagesPerModule;
+   int expectedLen = sizeof(header) + header.numParams * 4 + numCells * 2 + header.numModules;
+
+   if (!haveLayout || header.numParams != layout.header.numParams ||
+       header.numModules != layout.header.numModules || len != expectedLen)
+      return; //wait for the next layout frame
+
+   lostFrames += (uint16_t)(header.sequence - expectedSequence);
+   expectedSequence = header.sequence + 1;
+
+   const uint8_t* p = data + sizeof(header);
+   printf("%u", header.sequence);
+
+   for (int i = 0; i < header.numParams; i++, p += 4)
+   {
+      int32_t value;
+      memcpy(&value, p, sizeof(value));
+      printf(",%.3f", value / (double)(1 << TELEMETRY_FRAC_BITS));
+   }
+
+   for (int i = 0; i < numCells; i++, p += 2)
+      printf(",%d", p[0] | (p[1] << 8));
+
+   for (int i = 0; i < header.numModules; i++, p++)
+      printf(",%d", (int8_t)*p);
+
+   printf("\n");
+   fflush(stdout);
+}
+
+static void ProcessFrame(const uint8_t* frame, int len)
+{
+   std::vector<uint8_t> data(len);
+   int dataLen = CobsFrame::Decode(frame, len, data.data());
+
+   //Terminal echo and other text ends up here as well
+   if (dataLen < (int)sizeof(TelemetryHeader))
+   {
+      if (len > 0) badFrames++;
+      return;
+   }
+
+   if (data[0] == TELEMETRY_LAYOUT)
+      ParseLayout(data.data(), dataLen);
+   else if (data[0] == TELEMETRY_DATA)
+      ParseData(data.data(), dataLen);
+}
+
+int main(int argc, char** argv)
+{
+   int fd = 0;
+   std::vector<uint8_t> frame;
+   uint8_t buf[256];
+   int n;
+
+   if (argc > 1)
+   {
+      fd = open(argv[1], O_RDONLY | O_NOCTTY);
+
+      if (fd < 0)
+      {
+         perror(argv[1]);
+         return 1;
+      }
+   }
+
+   OpenSerial(fd);
+
+   while ((n = read(fd, buf, sizeof(buf))) > 0)
+   {
+      for (int i = 0; i < n; i++)
+      {
+         if (buf[i] == 0)
+         {
+            ProcessFrame(frame.data(), frame.size());
+            frame.clear();
+         }
+         else
+         {
+            frame.push_back(buf[i]);
+         }
+      }
+   }
+
+   fprintf(stderr, "%u corrupt frames, %u frames lost\n", badFrames, lostFrames);
+
+   return 0;
+}